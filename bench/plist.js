@@ -0,0 +1,113 @@
+/**
+ * Benchmarks the native plist codec against popular JavaScript plist packages. The packages are
+ * not dependencies of node-ios-device, install whichever ones you want to compare against:
+ *
+ *   npm install --no-save plist bplist-parser bplist-creator
+ *   node bench/plist.js
+ */
+
+const iosDevice = require('..');
+
+function tryRequire(name) {
+	try {
+		return require(name);
+	} catch (e) {
+		console.log(`Skipping ${name} (not installed)`);
+		return null;
+	}
+}
+
+const plist = tryRequire('plist');
+const bplistParser = tryRequire('bplist-parser');
+const bplistCreator = tryRequire('bplist-creator');
+
+/**
+ * Builds a plist that looks like an installation proxy Browse response: an array of app info
+ * dictionaries with a mix of strings, numbers, booleans, and nested collections.
+ */
+function createSample(numApps) {
+	const apps = [];
+	for (let i = 0; i < numApps; i++) {
+		apps.push({
+			CFBundleIdentifier: `com.example.app${i}`,
+			CFBundleDisplayName: `Example App ${i}`,
+			CFBundleShortVersionString: '1.2.3',
+			CFBundleVersion: String(100 + i),
+			ApplicationType: i % 3 ? 'User' : 'System',
+			Path: `/private/var/containers/Bundle/Application/${i}/Example.app`,
+			SequenceNumber: i,
+			StaticDiskUsage: 1024 * 1024 * (i + 1),
+			IsDemotedApp: false,
+			UIDeviceFamily: [ 1, 2 ],
+			Entitlements: {
+				'application-identifier': `ABCDE12345.com.example.app${i}`,
+				'get-task-allow': true,
+				'keychain-access-groups': [ `ABCDE12345.com.example.app${i}` ]
+			}
+		});
+	}
+	return { Status: 'Complete', CurrentList: apps };
+}
+
+/**
+ * Runs `fn` repeatedly for roughly `ms` milliseconds and returns the number of operations per
+ * second.
+ */
+function bench(fn, ms = 1000) {
+	for (let i = 0; i < 10; i++) {
+		fn();
+	}
+
+	let ops = 0;
+	let elapsed;
+	const start = process.hrtime();
+	do {
+		fn();
+		ops++;
+		const [ sec, nsec ] = process.hrtime(start);
+		elapsed = sec * 1e3 + nsec / 1e6;
+	} while (elapsed < ms);
+
+	return ops / (elapsed / 1e3);
+}
+
+function report(name, results) {
+	const fastest = Math.max(...Object.values(results));
+	console.log(`\n${name}`);
+	for (const [ label, ops ] of Object.entries(results)) {
+		console.log(`  ${label.padEnd(28)} ${ops.toFixed(1).padStart(10)} ops/sec ${(ops / fastest * 100).toFixed(0).padStart(4)}%`);
+	}
+}
+
+for (const numApps of [ 10, 500 ]) {
+	const sample = createSample(numApps);
+	const binary = iosDevice.plist.encode(sample);
+	const xml = iosDevice.plist.encode(sample, { format: 'xml' });
+	const xmlString = xml.toString();
+
+	console.log(`\n=== ${numApps} apps (binary ${binary.length} bytes, xml ${xml.length} bytes) ===`);
+
+	let results = { 'node-ios-device': bench(() => iosDevice.plist.parse(binary)) };
+	if (bplistParser) {
+		results['bplist-parser'] = bench(() => bplistParser.parseBuffer(binary));
+	}
+	report('Parse binary', results);
+
+	results = { 'node-ios-device': bench(() => iosDevice.plist.parse(xml)) };
+	if (plist) {
+		results.plist = bench(() => plist.parse(xmlString));
+	}
+	report('Parse XML', results);
+
+	results = { 'node-ios-device': bench(() => iosDevice.plist.encode(sample)) };
+	if (bplistCreator) {
+		results['bplist-creator'] = bench(() => bplistCreator(sample));
+	}
+	report('Encode binary', results);
+
+	results = { 'node-ios-device': bench(() => iosDevice.plist.encode(sample, { format: 'xml' })) };
+	if (plist) {
+		results.plist = bench(() => plist.build(sample));
+	}
+	report('Encode XML', results);
+}
@@ -0,0 +1,131 @@
+/**
+ * Benchmarks splitting relayed data into lines and creating the line strings, comparing the
+ * native ASCII fast path and UTF-8 repair against the previous byte at a time path that left the
+ * decoding to V8. Syslog relay data is also compared against unescaping the vis(3) escapes in
+ * JavaScript.
+ *
+ *   node bench/relay.js
+ */
+
+// `relayLines()` is only in the test addon
+const binding = require(`${__dirname}/../build/Release/test/node_ios_device_test.node`);
+
+/**
+ * Builds a chunk of syslog output. `utf8Every` lines contain multibyte characters and
+ * `invalidEvery` lines contain bytes that aren't valid UTF-8.
+ */
+function createSample(numLines, utf8Every, invalidEvery) {
+	const lines = [];
+	for (let i = 0; i < numLines; i++) {
+		let line = `Jan 12 10:23:${String(i % 60).padStart(2, '0')} iPhone SpringBoard(FrontBoard)[58] <Notice>: [com.example.app${i % 7}] Scene update completed with status ${i}`;
+		if (utf8Every && i % utf8Every === 0) {
+			line += ' — café 😀';
+		}
+		lines.push(Buffer.from(line));
+		if (invalidEvery && i % invalidEvery === 0) {
+			lines.push(Buffer.from([ 0x20, 0xC3, 0x28, 0xFF ]));
+		}
+		lines.push(Buffer.from('\n'));
+	}
+	return Buffer.concat(lines);
+}
+
+/**
+ * Encodes a chunk the way the syslog relay does, escaping control characters and non-ASCII bytes
+ * in vis(3) style.
+ */
+function visEncode(buf) {
+	let str = '';
+	for (const c of buf) {
+		if (c === 0x5C) {
+			str += '\\\\';
+		} else if (c === 0x0A || (c >= 0x20 && c < 0x7F)) {
+			str += String.fromCharCode(c);
+		} else {
+			const low = c & 0x7F;
+			str += c & 0x80 ? '\\M-' : '\\';
+			if (low < 0x20 || low === 0x7F) {
+				str += `^${low === 0x7F ? '?' : String.fromCharCode(low + 0x40)}`;
+			} else {
+				str += String.fromCharCode(low);
+			}
+		}
+	}
+	return Buffer.from(str, 'latin1');
+}
+
+/**
+ * Unescapes a syslog line with regular expressions, the way it had to be done before the syslog
+ * relay decoded escapes natively.
+ */
+function visDecode(line) {
+	const bytes = line
+		.replace(/\\M-\^(.)/g, (m, c) => String.fromCharCode(0x80 | (c === '?' ? 0x7F : c.charCodeAt(0) - 0x40)))
+		.replace(/\\M-(.)/g, (m, c) => String.fromCharCode(0x80 | c.charCodeAt(0)))
+		.replace(/\\\^(.)/g, (m, c) => String.fromCharCode(c === '?' ? 0x7F : c.charCodeAt(0) - 0x40))
+		.replace(/\\\\/g, '\\');
+	return Buffer.from(bytes, 'latin1').toString();
+}
+
+/**
+ * Runs `fn` repeatedly for roughly `ms` milliseconds and returns the number of operations per
+ * second.
+ */
+function bench(fn, ms = 1000) {
+	for (let i = 0; i < 10; i++) {
+		fn();
+	}
+
+	let ops = 0;
+	let elapsed;
+	const start = process.hrtime();
+	do {
+		fn();
+		ops++;
+		const [ sec, nsec ] = process.hrtime(start);
+		elapsed = sec * 1e3 + nsec / 1e6;
+	} while (elapsed < ms);
+
+	return ops / (elapsed / 1e3);
+}
+
+function report(name, bytes, results) {
+	const fastest = Math.max(...Object.values(results));
+	console.log(`\n${name}`);
+	for (const [ label, ops ] of Object.entries(results)) {
+		const mbps = ops * bytes / 1e6;
+		console.log(`  ${label.padEnd(12)} ${ops.toFixed(1).padStart(10)} ops/sec ${mbps.toFixed(1).padStart(8)} MB/s ${(ops / fastest * 100).toFixed(0).padStart(4)}%`);
+	}
+}
+
+const samples = {
+	'ASCII': createSample(2000, 0, 0),
+	'UTF-8 every 10th line': createSample(2000, 10, 0),
+	'Invalid every 100th line': createSample(2000, 0, 100)
+};
+
+const syslog = visEncode(samples['UTF-8 every 10th line']);
+
+for (const [ name, sample ] of Object.entries(samples)) {
+	const native = binding.relayLines(sample, false);
+	const legacy = binding.relayLines(sample, true);
+	if (native.length !== legacy.length) {
+		throw new Error(`${name}: expected ${legacy.length} lines, got ${native.length}`);
+	}
+
+	report(`${name} (${sample.length} bytes, ${native.length} lines)`, sample.length, {
+		native: bench(() => binding.relayLines(sample, false)),
+		legacy: bench(() => binding.relayLines(sample, true))
+	});
+}
+
+const native = binding.relayLines(syslog, false, true);
+const legacy = binding.relayLines(syslog, true).map(visDecode);
+if (native.join('\n') !== legacy.join('\n')) {
+	throw new Error('Syslog lines decoded natively differ from the lines decoded in JavaScript');
+}
+
+report(`Syslog with vis(3) escapes (${syslog.length} bytes, ${native.length} lines)`, syslog.length, {
+	native: bench(() => binding.relayLines(syslog, false, true)),
+	legacy: bench(() => binding.relayLines(syslog, true).map(visDecode))
+});
@@ -1,45 +1,117 @@
 {
+	'variables': {
+		# the OpenSSL to build the native lockdown client against, e.g. `/usr/local/opt/openssl@1.1`;
+		# when empty, the addon uses the OpenSSL that Node.js exports
+		'openssl_root%': '',
+		'node_shared_openssl%': 'false'
+	},
 	'conditions': [
 		['OS=="mac"', {
+			'target_defaults': {
+				'defines': [
+					"NODE_IOS_DEVICE_VERSION=\"<!(node -e \"console.log(require(\'./package.json\').version)\")\"",
+					"NODE_IOS_DEVICE_URL=\"<!(node -e \"console.log(require(\'./package.json\').homepage)\")\""
+				],
+				'sources': [
+					'src/afc.cpp',
+					'src/afc.h',
+					'src/afc-tree.cpp',
+					'src/afc-tree.h',
+					'src/apps.cpp',
+					'src/apps.h',
+					'src/cancel-token.h',
+					'src/container-sync.cpp',
+					'src/container-sync.h',
+					'src/crash-reports.cpp',
+					'src/crash-reports.h',
+					'src/deadline.cpp',
+					'src/deadline.h',
+					'src/device.cpp',
+					'src/device.h',
+					'src/device-interface.cpp',
+					'src/device-interface.h',
+					'src/deviceman.cpp',
+					'src/deviceman.h',
+					'src/diagnostics.cpp',
+					'src/diagnostics.h',
+					'src/file-relay.cpp',
+					'src/file-relay.h',
+					'src/fingerprint.cpp',
+					'src/fingerprint.h',
+					'src/hash.h',
+					'src/image-mounter.cpp',
+					'src/image-mounter.h',
+					'src/install-progress.cpp',
+					'src/install-progress.h',
+					'src/install-queue.cpp',
+					'src/install-queue.h',
+					'src/install-record.cpp',
+					'src/install-record.h',
+					'src/lockdown.cpp',
+					'src/lockdown.h',
+					'src/mobiledevice.h',
+					'src/node-ios-device.cpp',
+					'src/node-ios-device.h',
+					'src/pairing-cache.cpp',
+					'src/pairing-cache.h',
+					'src/plist.cpp',
+					'src/plist.h',
+					'src/qos.cpp',
+					'src/qos.h',
+					'src/relay.cpp',
+					'src/relay.h',
+					'src/screenshot.cpp',
+					'src/screenshot.h',
+					'src/service.cpp',
+					'src/service.h',
+					'src/syslog-limiter.cpp',
+					'src/syslog-limiter.h',
+					'src/usb-scheduler.cpp',
+					'src/usb-scheduler.h',
+					'src/utf8.cpp',
+					'src/utf8.h',
+					'src/vis.cpp',
+					'src/vis.h'
+				],
+				'libraries': [
+					'/System/Library/Frameworks/CoreFoundation.framework',
+					'MobileDevice.framework'
+				],
+				'mac_framework_dirs': [
+					'<(module_root_dir)/build'
+				],
+				'include_dirs': [
+					'<!(node -e "require(\'napi-macros\')")'
+				],
+				'cflags': [
+					'-Wl,-whole-archive -Wl,--no-whole-archive'
+				],
+				'cflags!': [
+					'-fno-exceptions'
+				],
+				'cflags_cc!': [
+					'-fno-exceptions'
+				],
+				'xcode_settings': {
+					'OTHER_CPLUSPLUSFLAGS' : [ '-std=c++17', '-stdlib=libc++' ],
+					'OTHER_LDFLAGS': [ '-stdlib=libc++' ],
+					'MACOSX_DEPLOYMENT_TARGET': '10.11',
+					'GCC_ENABLE_CPP_EXCEPTIONS': 'YES'
+				},
+				'conditions': [
+					['openssl_root!=""', {
+						'include_dirs': [ '<(openssl_root)/include' ],
+						'libraries': [ '-L<(openssl_root)/lib', '-lssl', '-lcrypto' ]
+					}],
+					['openssl_root=="" and node_shared_openssl=="true"', {
+						# Node.js links a system OpenSSL instead of exporting its own
+						'libraries': [ '-lssl', '-lcrypto' ]
+					}]
+				]
+			},
 			'targets': [
 				{
 					'target_name': 'node_ios_device',
-					'defines': [
-						"NODE_IOS_DEVICE_VERSION=\"<!(node -e \"console.log(require(\'./package.json\').version)\")\"",
-						"NODE_IOS_DEVICE_URL=\"<!(node -e \"console.log(require(\'./package.json\').homepage)\")\""
-					],
-					'sources': [
-						'src/device.cpp',
-						'src/device.h',
-						'src/device-interface.cpp',
-						'src/device-interface.h',
-						'src/deviceman.cpp',
-						'src/deviceman.h',
-						'src/mobiledevice.h',
-						'src/node-ios-device.cpp',
-						'src/node-ios-device.h',
-						'src/relay.cpp',
-						'src/relay.h'
-					],
-					'libraries': [
-						'/System/Library/Frameworks/CoreFoundation.framework',
-						'MobileDevice.framework'
-					],
-					'mac_framework_dirs': [
-						'<(module_root_dir)/build'
-					],
-					'include_dirs': [
-						'<!(node -e "require(\'napi-macros\')")'
-					],
-					'cflags': [
-						'-Wl,-whole-archive -Wl,--no-whole-archive'
-					],
-					'cflags!': [
-						'-fno-exceptions'
-					],
-					'cflags_cc!': [
-						'-fno-exceptions'
-					],
 					'actions': [
 						{
 							'action_name': 'copy_mobiledevice',
@@ -47,13 +119,15 @@
 							'outputs': [ '<(module_root_dir)/build/MobileDevice.framework' ],
 							'action': [ 'cp', '-R', '<@(_inputs)', '<@(_outputs)' ]
 						}
-					],
-					'xcode_settings': {
-						'OTHER_CPLUSPLUSFLAGS' : [ '-std=c++17', '-stdlib=libc++' ],
-						'OTHER_LDFLAGS': [ '-stdlib=libc++' ],
-						'MACOSX_DEPLOYMENT_TARGET': '10.11',
-						'GCC_ENABLE_CPP_EXCEPTIONS': 'YES'
-					}
+					]
+				},
+				{
+					# the same addon plus the hooks the tests and benchmarks drive directly, built into
+					# build/Release/test so that it's never mistaken for the production addon
+					'target_name': 'node_ios_device_test',
+					'dependencies': [ 'node_ios_device' ],
+					'defines': [ 'NODE_IOS_DEVICE_TEST' ],
+					'product_dir': '<(PRODUCT_DIR)/test'
 				}
 			]
 		}, {
@@ -0,0 +1,298 @@
+#include "afc-tree.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <numeric>
+#include <thread>
+
+namespace node_ios_device {
+
+/**
+ * The packed snapshot starts with the magic, version, entry count, and path table length, followed
+ * by the sizes, modified times, path offsets, directory flags, and the path table. The 64-bit
+ * arrays come first so that they stay aligned.
+ */
+#define AFC_SNAPSHOT_MAGIC   0x534e4641 // "AFNS"
+#define AFC_SNAPSHOT_VERSION 1
+#define AFC_SNAPSHOT_HEADER_SIZE 16
+
+/**
+ * Adds an entry and returns its index, which stays valid until the snapshot is sorted.
+ */
+size_t AfcSnapshot::add(const std::string& path, const AfcFileInfo& info) {
+	offsets.push_back((uint32_t)names.size());
+	names.append(path);
+	names.push_back('\0');
+	sizes.push_back(info.size);
+	mtimes.push_back(info.mtime);
+	dirs.push_back(info.isDir ? AFC_ENTRY_DIR : AFC_ENTRY_FILE);
+	return offsets.size() - 1;
+}
+
+/**
+ * Returns the paths of the directories that couldn't be listed.
+ */
+std::set<std::string> AfcSnapshot::unreadable() const {
+	std::set<std::string> rval;
+	for (size_t i = 0; i < count(); ++i) {
+		if (dirs[i] == AFC_ENTRY_UNREADABLE_DIR) {
+			rval.insert(path(i));
+		}
+	}
+	return rval;
+}
+
+/**
+ * Sorts the entries by path. The path table itself isn't rewritten, only the offsets into it.
+ */
+void AfcSnapshot::sort() {
+	std::vector<size_t> order(count());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+		return ::strcmp(path(a), path(b)) < 0;
+	});
+
+	AfcSnapshot sorted;
+	sorted.names = names;
+	sorted.offsets.reserve(order.size());
+	sorted.sizes.reserve(order.size());
+	sorted.mtimes.reserve(order.size());
+	sorted.dirs.reserve(order.size());
+	for (size_t i : order) {
+		sorted.offsets.push_back(offsets[i]);
+		sorted.sizes.push_back(sizes[i]);
+		sorted.mtimes.push_back(mtimes[i]);
+		sorted.dirs.push_back(dirs[i]);
+	}
+	*this = std::move(sorted);
+}
+
+static void packUint32(std::vector<uint8_t>& out, size_t& pos, uint32_t value) {
+	::memcpy(out.data() + pos, &value, sizeof(value));
+	pos += sizeof(value);
+}
+
+static uint32_t unpackUint32(const uint8_t* data) {
+	uint32_t value;
+	::memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+/**
+ * Serializes the snapshot into a single buffer in host byte order.
+ */
+std::vector<uint8_t> AfcSnapshot::pack() const {
+	size_t n = count();
+	std::vector<uint8_t> out(AFC_SNAPSHOT_HEADER_SIZE + n * (8 + 8 + 4 + 1) + names.size());
+	size_t pos = 0;
+
+	packUint32(out, pos, AFC_SNAPSHOT_MAGIC);
+	packUint32(out, pos, AFC_SNAPSHOT_VERSION);
+	packUint32(out, pos, (uint32_t)n);
+	packUint32(out, pos, (uint32_t)names.size());
+
+	::memcpy(out.data() + pos, sizes.data(), n * 8);
+	pos += n * 8;
+	::memcpy(out.data() + pos, mtimes.data(), n * 8);
+	pos += n * 8;
+	::memcpy(out.data() + pos, offsets.data(), n * 4);
+	pos += n * 4;
+	::memcpy(out.data() + pos, dirs.data(), n);
+	pos += n;
+	::memcpy(out.data() + pos, names.data(), names.size());
+
+	return out;
+}
+
+/**
+ * Reads a snapshot created by `pack()`.
+ */
+AfcSnapshot AfcSnapshot::unpack(const uint8_t* data, size_t len) {
+	if (len < AFC_SNAPSHOT_HEADER_SIZE || unpackUint32(data) != AFC_SNAPSHOT_MAGIC) {
+		throw std::runtime_error("Invalid AFC snapshot");
+	}
+	if (unpackUint32(data + 4) != AFC_SNAPSHOT_VERSION) {
+		throw std::runtime_error("Unsupported AFC snapshot version");
+	}
+
+	size_t n = unpackUint32(data + 8);
+	size_t namesLen = unpackUint32(data + 12);
+	if (len != AFC_SNAPSHOT_HEADER_SIZE + n * (8 + 8 + 4 + 1) + namesLen || (n && (!namesLen || data[len - 1] != '\0'))) {
+		throw std::runtime_error("Invalid AFC snapshot");
+	}
+
+	AfcSnapshot snapshot;
+	const uint8_t* p = data + AFC_SNAPSHOT_HEADER_SIZE;
+	snapshot.sizes.resize(n);
+	::memcpy(snapshot.sizes.data(), p, n * 8);
+	p += n * 8;
+	snapshot.mtimes.resize(n);
+	::memcpy(snapshot.mtimes.data(), p, n * 8);
+	p += n * 8;
+	snapshot.offsets.resize(n);
+	::memcpy(snapshot.offsets.data(), p, n * 4);
+	p += n * 4;
+	snapshot.dirs.assign(p, p + n);
+	p += n;
+	snapshot.names.assign((const char*)p, namesLen);
+
+	for (uint32_t offset : snapshot.offsets) {
+		if (offset >= namesLen) {
+			throw std::runtime_error("Invalid AFC snapshot");
+		}
+	}
+
+	return snapshot;
+}
+
+/**
+ * Returns true if the path is inside one of the directories.
+ */
+static bool isInside(const std::set<std::string>& dirs, const char* path) {
+	if (dirs.empty()) {
+		return false;
+	}
+	for (const char* slash = ::strchr(path, '/'); slash; slash = ::strchr(slash + 1, '/')) {
+		if (dirs.count(std::string(path, slash - path))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Compares two snapshots with a single pass over both sorted path lists. An entry has changed if
+ * its size, modified time, or type differs. Nothing is known about the contents of a directory that
+ * couldn't be read in either snapshot, so paths inside it aren't reported as added or removed.
+ */
+AfcSnapshotDiff diffAfcSnapshots(const AfcSnapshot& from, const AfcSnapshot& to) {
+	AfcSnapshotDiff diff;
+	std::set<std::string> fromUnreadable = from.unreadable();
+	std::set<std::string> toUnreadable = to.unreadable();
+	size_t i = 0;
+	size_t j = 0;
+
+	while (i < from.count() || j < to.count()) {
+		int cmp = i == from.count() ? 1 : j == to.count() ? -1 : ::strcmp(from.path(i), to.path(j));
+		if (cmp < 0) {
+			if (!isInside(toUnreadable, from.path(i))) {
+				diff.removed.push_back(from.path(i));
+			}
+			++i;
+		} else if (cmp > 0) {
+			if (!isInside(fromUnreadable, to.path(j))) {
+				diff.added.push_back(to.path(j));
+			}
+			++j;
+		} else {
+			if (from.sizes[i] != to.sizes[j] || from.mtimes[i] != to.mtimes[j] || from.dirs[i] != to.dirs[j]) {
+				diff.changed.push_back(to.path(j));
+			}
+			++i;
+			++j;
+		}
+	}
+
+	return diff;
+}
+
+/**
+ * Walks a directory tree on the device. Every connection works through a shared queue of
+ * directories, listing a directory and requesting the info of each of its entries, so the walk
+ * has as many requests in flight as there are connections. Subdirectories that can't be read are
+ * kept in the snapshot as `AFC_ENTRY_UNREADABLE_DIR`.
+ */
+AfcSnapshot walkAfcTree(const std::vector<AfcConnection*>& connections, const std::string& root) {
+	std::string base = root;
+	while (base.length() > 1 && base.back() == '/') {
+		base.pop_back();
+	}
+	if (base.empty() || base[0] != '/') {
+		base = "/" + base;
+	}
+
+	AfcSnapshot snapshot;
+	// each directory to list and the index of its entry, the root has none
+	std::deque<std::pair<std::string, size_t>> queue;
+	std::mutex lock;
+	std::condition_variable cv;
+	size_t busy = 0;
+	std::string error;
+
+	// list the root up front so that a bad root is an error instead of an empty snapshot
+	AfcFileInfo rootInfo;
+	if (!connections[0]->stat(base, rootInfo) || !rootInfo.isDir) {
+		throw std::runtime_error("Directory \"" + base + "\" not found on device");
+	}
+	queue.emplace_back("", SIZE_MAX);
+
+	auto worker = [&](AfcConnection* afc) {
+		while (1) {
+			std::string dir;
+			size_t index;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				cv.wait(guard, [&] { return !queue.empty() || busy == 0 || !error.empty(); });
+				if (queue.empty() || !error.empty()) {
+					return;
+				}
+				dir = queue.front().first;
+				index = queue.front().second;
+				queue.pop_front();
+				++busy;
+			}
+
+			std::string remoteDir = dir.empty() ? base : (base == "/" ? "/" : base + "/") + dir;
+			std::vector<std::pair<std::string, AfcFileInfo>> entries;
+			try {
+				for (auto const& name : afc->readDir(remoteDir)) {
+					std::string path = dir.empty() ? name : dir + "/" + name;
+					AfcFileInfo info;
+					if (afc->stat((base == "/" ? "/" : base + "/") + path, info)) {
+						entries.emplace_back(path, info);
+					}
+				}
+			} catch (std::exception& e) {
+				std::lock_guard<std::mutex> guard(lock);
+				if (dir.empty()) {
+					error = e.what();
+				} else {
+					LOG_DEBUG_1("walkAfcTree", "Recording unreadable directory: %s", e.what())
+					snapshot.dirs[index] = AFC_ENTRY_UNREADABLE_DIR;
+					entries.clear();
+				}
+			}
+
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				for (auto const& entry : entries) {
+					size_t i = snapshot.add(entry.first, entry.second);
+					if (entry.second.isDir) {
+						queue.emplace_back(entry.first, i);
+					}
+				}
+				--busy;
+			}
+			cv.notify_all();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < connections.size(); ++i) {
+		threads.emplace_back(worker, connections[i]);
+	}
+	worker(connections[0]);
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	if (!error.empty()) {
+		throw std::runtime_error(error);
+	}
+
+	snapshot.sort();
+	return snapshot;
+}
+
+}
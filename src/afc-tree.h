@@ -0,0 +1,60 @@
+#ifndef __AFC_TREE_H__
+#define __AFC_TREE_H__
+
+#include "node-ios-device.h"
+#include "afc.h"
+#include <set>
+#include <string>
+#include <vector>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * The type of a snapshot entry. A directory that couldn't be listed is kept as unreadable so its
+ * missing contents aren't mistaken for removed files.
+ */
+#define AFC_ENTRY_FILE           0
+#define AFC_ENTRY_DIR            1
+#define AFC_ENTRY_UNREADABLE_DIR 2
+
+/**
+ * A listing of a directory tree on the device sorted by path. Paths are relative to the root of
+ * the walk and are stored back to back in a single path table, with the sizes, modified times,
+ * and `AFC_ENTRY_*` types in parallel arrays.
+ */
+class AfcSnapshot {
+public:
+	size_t add(const std::string& path, const AfcFileInfo& info);
+	size_t count() const { return offsets.size(); }
+	const char* path(size_t i) const { return names.data() + offsets[i]; }
+	void sort();
+
+	std::vector<uint8_t> pack() const;
+	static AfcSnapshot unpack(const uint8_t* data, size_t len);
+
+	std::string           names;
+	std::vector<uint32_t> offsets;
+	std::vector<uint64_t> sizes;
+	std::vector<uint64_t> mtimes;
+	std::vector<uint8_t>  dirs;
+
+	std::set<std::string> unreadable() const;
+};
+
+/**
+ * The differences between two snapshots of the same tree.
+ */
+struct AfcSnapshotDiff {
+	std::vector<std::string> added;
+	std::vector<std::string> removed;
+	std::vector<std::string> changed;
+};
+
+AfcSnapshotDiff diffAfcSnapshots(const AfcSnapshot& from, const AfcSnapshot& to);
+AfcSnapshot walkAfcTree(const std::vector<AfcConnection*>& connections, const std::string& root);
+
+}
+
+#endif
@@ -0,0 +1,428 @@
+#include "afc.h"
+#include "service.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+namespace node_ios_device {
+
+/**
+ * The size of each read/write request. AFC packets are capped by the device, so larger chunks
+ * don't help and just waste memory.
+ */
+#define AFC_CHUNK_SIZE (1024 * 1024)
+
+/**
+ * Opens the AFC connection on top of the service socket.
+ */
+AfcConnection::AfcConnection(service_conn_t connection, std::shared_ptr<QosShaper> qos) :
+	connection(connection),
+	conn(NULL),
+	qos(qos) {
+
+	afc_error_t rval = ::AFCConnectionOpen(connection, 0, &conn);
+	if (rval != MDERR_OK) {
+		::close(connection);
+		std::stringstream error;
+		error << "Failed to open AFC connection (0x" << std::hex << rval << ")";
+		throw std::runtime_error(error.str());
+	}
+}
+
+/**
+ * Closes the AFC connection and the underlying service socket.
+ */
+AfcConnection::~AfcConnection() {
+	if (conn) {
+		::AFCConnectionClose(conn);
+		conn = NULL;
+	}
+	::close(connection);
+}
+
+/**
+ * Shuts down the service socket so that the thread using the connection fails at its next read or
+ * write. The socket is left open until the connection is destroyed, so its descriptor can't be
+ * reused while that thread still has it.
+ */
+void AfcConnection::abort() {
+	::shutdown(connection, SHUT_RDWR);
+}
+
+/**
+ * Copies a file from the device to the local filesystem. The file is written to a temp file next
+ * to the destination and renamed once complete so that an interrupted transfer never leaves a
+ * truncated file behind. If `mtime` is specified (in nanoseconds), it is applied to the local file.
+ */
+void AfcConnection::download(const std::string& remotePath, const std::string& localPath, uint64_t mtime) {
+	afc_file_ref ref;
+	afc_error_t rval = ::AFCFileRefOpen(conn, remotePath.c_str(), 1, &ref);
+	if (rval != MDERR_OK) {
+		std::stringstream error;
+		error << "Failed to open \"" << remotePath << "\" on device (0x" << std::hex << rval << ")";
+		throw std::runtime_error(error.str());
+	}
+
+	size_t slash = localPath.find_last_of('/');
+	if (slash != std::string::npos) {
+		makeLocalDirs(localPath.substr(0, slash));
+	}
+
+	std::string tmpPath = localPath + ".partial";
+	int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		::AFCFileRefClose(conn, ref);
+		std::stringstream error;
+		error << "Failed to open \"" << tmpPath << "\" for writing (" << ::strerror(errno) << ")";
+		throw std::runtime_error(error.str());
+	}
+
+	std::vector<char> buffer(AFC_CHUNK_SIZE);
+	std::string failure;
+
+	while (1) {
+		uint32_t len = AFC_CHUNK_SIZE;
+		rval = ::AFCFileRefRead(conn, ref, buffer.data(), &len);
+		if (rval != MDERR_OK) {
+			std::stringstream error;
+			error << "Failed to read \"" << remotePath << "\" from device (0x" << std::hex << rval << ")";
+			failure = error.str();
+			break;
+		}
+		if (len == 0) {
+			break;
+		}
+
+		// the chunk has already been received, so its cost holds back the next read
+		if (qos) {
+			qos->acquire(QosBulk, len);
+		}
+
+		const char* p = buffer.data();
+		while (len > 0) {
+			ssize_t n = ::write(fd, p, len);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				failure = "Failed to write \"" + tmpPath + "\" (" + ::strerror(errno) + ")";
+				break;
+			}
+			p += n;
+			len -= (uint32_t)n;
+		}
+		if (!failure.empty()) {
+			break;
+		}
+	}
+
+	::AFCFileRefClose(conn, ref);
+	::close(fd);
+
+	if (failure.empty() && mtime) {
+		struct timeval times[2];
+		times[0].tv_sec = times[1].tv_sec = (time_t)(mtime / 1000000000ULL);
+		times[0].tv_usec = times[1].tv_usec = (suseconds_t)((mtime % 1000000000ULL) / 1000);
+		::utimes(tmpPath.c_str(), times);
+	}
+
+	if (failure.empty() && ::rename(tmpPath.c_str(), localPath.c_str()) != 0) {
+		failure = "Failed to rename \"" + tmpPath + "\" (" + ::strerror(errno) + ")";
+	}
+
+	if (!failure.empty()) {
+		::unlink(tmpPath.c_str());
+		throw std::runtime_error(failure);
+	}
+}
+
+/**
+ * Creates a directory on the device along with any missing parent directories.
+ */
+void AfcConnection::makeDir(const std::string& path) {
+	afc_error_t rval = ::AFCDirectoryCreate(conn, path.c_str());
+	if (rval != MDERR_OK) {
+		std::stringstream error;
+		error << "Failed to create directory \"" << path << "\" on device (0x" << std::hex << rval << ")";
+		throw std::runtime_error(error.str());
+	}
+}
+
+/**
+ * Returns the names of the entries in a directory on the device, excluding `.` and `..`.
+ */
+std::vector<std::string> AfcConnection::readDir(const std::string& path) {
+	afc_directory dir;
+	afc_error_t rval = ::AFCDirectoryOpen(conn, path.c_str(), &dir);
+	if (rval != MDERR_OK) {
+		std::stringstream error;
+		error << "Failed to open directory \"" << path << "\" on device (0x" << std::hex << rval << ")";
+		throw std::runtime_error(error.str());
+	}
+
+	std::vector<std::string> entries;
+	char* dirent = NULL;
+
+	while (::AFCDirectoryRead(conn, dir, &dirent) == MDERR_OK && dirent) {
+		if (::strcmp(dirent, ".") != 0 && ::strcmp(dirent, "..") != 0) {
+			entries.push_back(dirent);
+		}
+	}
+
+	::AFCDirectoryClose(conn, dir);
+	return entries;
+}
+
+/**
+ * Deletes a file or empty directory on the device.
+ */
+void AfcConnection::remove(const std::string& path) {
+	afc_error_t rval = ::AFCRemovePath(conn, path.c_str());
+	if (rval != MDERR_OK) {
+		std::stringstream error;
+		error << "Failed to remove \"" << path << "\" from device (0x" << std::hex << rval << ")";
+		throw std::runtime_error(error.str());
+	}
+}
+
+/**
+ * Removes a file or a directory and everything in it from the device. A path that doesn't exist is
+ * ignored.
+ */
+void AfcConnection::removeTree(const std::string& path) {
+	AfcFileInfo info;
+	if (!stat(path, info)) {
+		return;
+	}
+	if (info.isDir) {
+		for (auto const& name : readDir(path)) {
+			removeTree(path + "/" + name);
+		}
+	}
+	remove(path);
+}
+
+/**
+ * Retrieves the size, modified time, and type of a path on the device. Returns false if the path
+ * does not exist.
+ */
+bool AfcConnection::stat(const std::string& path, AfcFileInfo& info) {
+	afc_dictionary dict;
+	if (::AFCFileInfoOpen(conn, path.c_str(), &dict) != MDERR_OK || !dict) {
+		return false;
+	}
+
+	char* key = NULL;
+	char* val = NULL;
+
+	while (::AFCKeyValueRead(dict, &key, &val) == MDERR_OK && key && val) {
+		if (::strcmp(key, "st_size") == 0) {
+			info.size = ::strtoull(val, NULL, 10);
+		} else if (::strcmp(key, "st_mtime") == 0) {
+			info.mtime = ::strtoull(val, NULL, 10);
+		} else if (::strcmp(key, "st_ifmt") == 0) {
+			info.isDir = ::strcmp(val, "S_IFDIR") == 0;
+		}
+	}
+
+	::AFCKeyValueClose(dict);
+	return true;
+}
+
+/**
+ * Copies a local file to the device. Like `download()`, the file is written to a temp file next to
+ * the destination and renamed once complete. `onWrite` is called with the size of each chunk once
+ * it's written. Once `cancel` is tripped, the upload stops before the next chunk and throws
+ * `OperationCancelled`.
+ */
+void AfcConnection::upload(const std::string& localPath, const std::string& remotePath, std::function<void(size_t)> onWrite, const CancelToken* cancel) {
+	int fd = ::open(localPath.c_str(), O_RDONLY);
+	if (fd < 0) {
+		std::stringstream error;
+		error << "Failed to open \"" << localPath << "\" for reading (" << ::strerror(errno) << ")";
+		throw std::runtime_error(error.str());
+	}
+
+	std::string tmpPath = remotePath + ".partial";
+	afc_file_ref ref;
+	afc_error_t rval = ::AFCFileRefOpen(conn, tmpPath.c_str(), 3, &ref);
+	if (rval != MDERR_OK) {
+		::close(fd);
+		std::stringstream error;
+		error << "Failed to open \"" << tmpPath << "\" on device (0x" << std::hex << rval << ")";
+		throw std::runtime_error(error.str());
+	}
+	::AFCFileRefSetFileSize(conn, ref, 0);
+
+	std::vector<char> buffer(AFC_CHUNK_SIZE);
+	std::string failure;
+	bool cancelled = false;
+
+	while (1) {
+		ssize_t len = ::read(fd, buffer.data(), AFC_CHUNK_SIZE);
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len < 0) {
+			failure = "Failed to read \"" + localPath + "\" (" + ::strerror(errno) + ")";
+			break;
+		}
+		if (len == 0) {
+			break;
+		}
+
+		if ((qos && !qos->acquire(QosBulk, (size_t)len, cancel)) || (cancel && cancel->isCancelled())) {
+			cancelled = true;
+			break;
+		}
+		rval = ::AFCFileRefWrite(conn, ref, buffer.data(), (uint32_t)len);
+		if (rval != MDERR_OK) {
+			std::stringstream error;
+			error << "Failed to write \"" << remotePath << "\" to device (0x" << std::hex << rval << ")";
+			failure = error.str();
+			break;
+		}
+		if (onWrite) {
+			onWrite((size_t)len);
+		}
+	}
+
+	::AFCFileRefClose(conn, ref);
+	::close(fd);
+
+	if (failure.empty() && !cancelled) {
+		rval = ::AFCRenamePath(conn, tmpPath.c_str(), remotePath.c_str());
+		if (rval != MDERR_OK) {
+			std::stringstream error;
+			error << "Failed to rename \"" << tmpPath << "\" on device (0x" << std::hex << rval << ")";
+			failure = error.str();
+		}
+	}
+
+	if (cancelled) {
+		::AFCRemovePath(conn, tmpPath.c_str());
+		throw OperationCancelled();
+	}
+	if (!failure.empty()) {
+		::AFCRemovePath(conn, tmpPath.c_str());
+		throw std::runtime_error(failure);
+	}
+}
+
+/**
+ * Copies a local directory and everything in it to the device, creating `remotePath` if needed.
+ * A plain file is copied with `upload()`. `onWrite` and `cancel` are passed on to each file's
+ * upload. Symlinks are refused since installd won't install an app that contains them.
+ */
+void AfcConnection::uploadTree(const std::string& localPath, const std::string& remotePath, std::function<void(size_t)> onWrite, const CancelToken* cancel) {
+	struct stat st;
+	if (::lstat(localPath.c_str(), &st) != 0) {
+		throw std::runtime_error("Failed to stat \"" + localPath + "\" (" + ::strerror(errno) + ")");
+	}
+	if (S_ISLNK(st.st_mode)) {
+		throw std::runtime_error("Failed to copy \"" + localPath + "\" to device: symlinks are not supported");
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		upload(localPath, remotePath, onWrite, cancel);
+		return;
+	}
+
+	makeDir(remotePath);
+
+	DIR* dir = ::opendir(localPath.c_str());
+	if (!dir) {
+		throw std::runtime_error("Failed to read directory \"" + localPath + "\" (" + ::strerror(errno) + ")");
+	}
+	std::vector<std::string> names;
+	struct dirent* ent;
+	while ((ent = ::readdir(dir)) != NULL) {
+		if (::strcmp(ent->d_name, ".") != 0 && ::strcmp(ent->d_name, "..") != 0) {
+			names.push_back(ent->d_name);
+		}
+	}
+	::closedir(dir);
+
+	for (auto const& name : names) {
+		uploadTree(localPath + "/" + name, remotePath + "/" + name, onWrite, cancel);
+	}
+}
+
+/**
+ * Asks house_arrest for the app's data container and returns an AFC connection rooted at it.
+ */
+std::unique_ptr<AfcConnection> vendContainer(std::shared_ptr<DeviceInterface> iface, const std::string& bundleId) {
+	service_conn_t connection;
+	iface->startService(AMSVC_HOUSE_ARREST, &connection);
+
+	CFStringRef identifier = createCFString(bundleId);
+	const void* keys[] = { CFSTR("Command"), CFSTR("Identifier") };
+	const void* values[] = { CFSTR("VendContainer"), identifier };
+	CFDictionaryRef request = ::CFDictionaryCreate(kCFAllocatorDefault, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	::CFRelease(identifier);
+
+	std::vector<uint8_t> buffer;
+	CFPropertyListRef msg = NULL;
+	try {
+		sendPlist(connection, request, kCFPropertyListXMLFormat_v1_0);
+		msg = recvPlist(connection, buffer);
+	} catch (std::exception& e) {
+		::CFRelease(request);
+		::close(connection);
+		throw;
+	}
+	::CFRelease(request);
+
+	std::string error;
+	if (!msg) {
+		error = "house_arrest closed the connection";
+	} else if (::CFGetTypeID(msg) != ::CFDictionaryGetTypeID()) {
+		error = "Unexpected response from house_arrest";
+	} else {
+		CFStringRef err = (CFStringRef)::CFDictionaryGetValue((CFDictionaryRef)msg, CFSTR("Error"));
+		if (err && ::CFGetTypeID(err) == ::CFStringGetTypeID()) {
+			error = cfStringToStdString(err);
+		}
+	}
+	if (msg) {
+		::CFRelease(msg);
+	}
+
+	if (!error.empty()) {
+		::close(connection);
+		throw std::runtime_error("Failed to access container for \"" + bundleId + "\": " + error);
+	}
+
+	return std::make_unique<AfcConnection>(connection, iface->qos);
+}
+
+/**
+ * Creates a local directory and any missing parent directories.
+ */
+void makeLocalDirs(const std::string& path) {
+	if (path.empty()) {
+		return;
+	}
+
+	struct stat st;
+	if (::stat(path.c_str(), &st) == 0) {
+		if (!S_ISDIR(st.st_mode)) {
+			throw std::runtime_error("Path \"" + path + "\" exists and is not a directory");
+		}
+		return;
+	}
+
+	size_t slash = path.find_last_of('/');
+	if (slash != std::string::npos && slash > 0) {
+		makeLocalDirs(path.substr(0, slash));
+	}
+
+	if (::mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+		throw std::runtime_error("Failed to create directory \"" + path + "\" (" + ::strerror(errno) + ")");
+	}
+}
+
+}
@@ -0,0 +1,64 @@
+#ifndef __AFC_H__
+#define __AFC_H__
+
+#include "node-ios-device.h"
+#include "cancel-token.h"
+#include "device-interface.h"
+#include "mobiledevice.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * The subset of `AFCFileInfoOpen()` info that we care about. `mtime` is in nanoseconds since the
+ * epoch, which is how AFC reports it.
+ */
+struct AfcFileInfo {
+	AfcFileInfo() : size(0), mtime(0), isDir(false) {}
+	uint64_t size;
+	uint64_t mtime;
+	bool     isDir;
+};
+
+/**
+ * A connection to an AFC based service such as `com.apple.afc`, `com.apple.crashreportcopymobile`,
+ * or a vended house_arrest container. The connection owns the service socket and closes it when
+ * destroyed.
+ *
+ * AFC connections are not thread safe. To transfer files in parallel, open one connection per
+ * thread. File transfers are shaped as bulk traffic when the connection has the link's shaper.
+ * `abort()` is the exception, it may be called from any thread to fail whatever is blocked on the
+ * connection.
+ */
+class AfcConnection {
+public:
+	AfcConnection(service_conn_t connection, std::shared_ptr<QosShaper> qos = nullptr);
+	~AfcConnection();
+
+	void abort();
+	void download(const std::string& remotePath, const std::string& localPath, uint64_t mtime = 0);
+	void makeDir(const std::string& path);
+	std::vector<std::string> readDir(const std::string& path);
+	void remove(const std::string& path);
+	void removeTree(const std::string& path);
+	bool stat(const std::string& path, AfcFileInfo& info);
+	void upload(const std::string& localPath, const std::string& remotePath, std::function<void(size_t)> onWrite = nullptr, const CancelToken* cancel = NULL);
+	void uploadTree(const std::string& localPath, const std::string& remotePath, std::function<void(size_t)> onWrite = nullptr, const CancelToken* cancel = NULL);
+
+private:
+	service_conn_t connection;
+	afc_connection conn;
+	std::shared_ptr<QosShaper> qos;
+};
+
+void makeLocalDirs(const std::string& path);
+std::unique_ptr<AfcConnection> vendContainer(std::shared_ptr<DeviceInterface> iface, const std::string& bundleId);
+
+}
+
+#endif
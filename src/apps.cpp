@@ -0,0 +1,530 @@
+#include "apps.h"
+#include "service.h"
+#include <sstream>
+
+namespace node_ios_device {
+
+/**
+ * The notifications posted when an app is installed, updated, or uninstalled.
+ */
+static const char* appNotifications[] = {
+	"com.apple.mobile.application_installed",
+	"com.apple.mobile.application_uninstalled"
+};
+
+/**
+ * How the notification proxy socket's callback reaches the app inventory. The socket holds a
+ * reference for as long as it exists and for the duration of each callback, so this can outlive
+ * the inventory. `unwatch()` detaches the inventory with the lock held, so once it returns, no
+ * callback is using the inventory and none will.
+ */
+struct AppInventoryWatch {
+	AppInventoryWatch(AppInventory* inventory) : inventory(inventory), refs(1) {}
+	std::mutex            lock;
+	AppInventory*         inventory;
+	std::atomic<uint32_t> refs;
+};
+
+static const void* retainWatch(const void* info) {
+	++static_cast<AppInventoryWatch*>((void*)info)->refs;
+	return info;
+}
+
+static void releaseWatch(const void* info) {
+	AppInventoryWatch* watch = static_cast<AppInventoryWatch*>((void*)info);
+	if (--watch->refs == 0) {
+		delete watch;
+	}
+}
+
+/**
+ * Initializes an empty app inventory for the device.
+ */
+AppInventory::AppInventory(std::string& udid, std::weak_ptr<CFRunLoopRef> runloop) :
+	udid(udid),
+	runloop(runloop),
+	allAttributes(false),
+	complete(false),
+	cacheGeneration(0),
+	pagingThread(std::thread::id()),
+	generation(0),
+	watching(false),
+	connection(0),
+	socket(NULL),
+	source(NULL),
+	watchState(NULL) {}
+
+/**
+ * Stops observing notifications and releases the cached apps.
+ */
+AppInventory::~AppInventory() {
+	unwatch();
+	clear();
+}
+
+/**
+ * Dispatches activity from the notification proxy socket to the app inventory, unless the
+ * inventory stopped watching. The notifications themselves don't matter, only the two app
+ * notifications are observed.
+ */
+static void appInventorySocketCallback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void* data, void* info) {
+	if (type == kCFSocketDataCallBack) {
+		AppInventoryWatch* watch = static_cast<AppInventoryWatch*>(info);
+		std::lock_guard<std::mutex> guard(watch->lock);
+		if (watch->inventory) {
+			watch->inventory->onNotification(::CFDataGetLength((CFDataRef)data) == 0);
+		}
+	}
+}
+
+/**
+ * Creates the installation proxy client options for the specified return attributes.
+ */
+static CFMutableDictionaryRef createClientOptions(CFArrayRef returnAttributes) {
+	CFMutableDictionaryRef options = ::CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	::CFDictionarySetValue(options, CFSTR("ApplicationType"), CFSTR("Any"));
+	if (returnAttributes) {
+		::CFDictionarySetValue(options, CFSTR("ReturnAttributes"), returnAttributes);
+	}
+	return options;
+}
+
+/**
+ * Lists every app on the device and merges each page into the cache as it arrives. When a page
+ * handler is given, each page is also passed to it filtered down to `attrs`. Must be called with
+ * the lock held.
+ */
+void AppInventory::browse(CFArrayRef returnAttributes, std::shared_ptr<DeviceInterface> iface, const std::vector<std::string>& attrs, AppPageHandler onPage) {
+	service_conn_t conn;
+	iface->startService(AMSVC_INSTALLATION_PROXY, &conn);
+
+	LOG_DEBUG_1("AppInventory::browse", "Browsing apps on %s", udid.c_str())
+	CFMutableDictionaryRef options = createClientOptions(returnAttributes);
+
+	try {
+		installationProxyRequest(conn, CFSTR("Browse"), options, [this, &attrs, &onPage](CFDictionaryRef page) {
+			CFArrayRef list = (CFArrayRef)::CFDictionaryGetValue(page, CFSTR("CurrentList"));
+			if (!list || ::CFGetTypeID(list) != ::CFArrayGetTypeID()) {
+				return;
+			}
+
+			CFMutableArrayRef filtered = onPage ? ::CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks) : NULL;
+
+			for (CFIndex i = 0, n = ::CFArrayGetCount(list); i < n; ++i) {
+				CFDictionaryRef app = (CFDictionaryRef)::CFArrayGetValueAtIndex(list, i);
+				if (::CFGetTypeID(app) != ::CFDictionaryGetTypeID()) {
+					continue;
+				}
+
+				CFStringRef bundleId = (CFStringRef)::CFDictionaryGetValue(app, CFSTR("CFBundleIdentifier"));
+				if (!bundleId || ::CFGetTypeID(bundleId) != ::CFStringGetTypeID()) {
+					continue;
+				}
+
+				CFDictionaryRef& slot = apps[cfStringToStdString(bundleId)];
+				if (slot) {
+					::CFRelease(slot);
+				}
+				slot = (CFDictionaryRef)::CFRetain(app);
+
+				if (filtered) {
+					CFDictionaryRef result = filter(app, attrs);
+					::CFArrayAppendValue(filtered, result);
+					::CFRelease(result);
+				}
+			}
+
+			if (filtered) {
+				try {
+					if (::CFArrayGetCount(filtered) > 0) {
+						emitPage(filtered, onPage);
+					}
+				} catch (std::exception& e) {
+					::CFRelease(filtered);
+					throw;
+				}
+				::CFRelease(filtered);
+			}
+		});
+	} catch (std::exception& e) {
+		::CFRelease(options);
+		::close(conn);
+		throw;
+	}
+
+	::CFRelease(options);
+	::close(conn);
+	complete = true;
+	notInstalled.clear();
+	LOG_DEBUG_2("AppInventory::browse", "Found %ld apps on %s", (long)apps.size(), udid.c_str())
+}
+
+/**
+ * Releases the cached apps and forgets which attributes they hold. Must be called with the lock
+ * held.
+ */
+void AppInventory::clear() {
+	for (auto& it : apps) {
+		::CFRelease(it.second);
+	}
+	apps.clear();
+	notInstalled.clear();
+	attributes.clear();
+	allAttributes = false;
+	complete = false;
+}
+
+/**
+ * Creates the list of attributes to request from the device or returns NULL if every attribute is
+ * wanted. The bundle id is always requested since the apps are keyed by it. Must be called with the
+ * lock held.
+ */
+CFArrayRef AppInventory::createReturnAttributes() {
+	if (allAttributes) {
+		return NULL;
+	}
+
+	CFMutableArrayRef rval = ::CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+	if (!attributes.count("CFBundleIdentifier")) {
+		::CFArrayAppendValue(rval, CFSTR("CFBundleIdentifier"));
+	}
+	for (auto const& attr : attributes) {
+		CFStringRef str = createCFString(attr);
+		::CFArrayAppendValue(rval, str);
+		::CFRelease(str);
+	}
+	return rval;
+}
+
+/**
+ * Returns a copy of the app containing only the specified attributes, or the app itself if no
+ * attributes were specified. The caller must release the returned dictionary.
+ */
+CFDictionaryRef AppInventory::filter(CFDictionaryRef app, const std::vector<std::string>& attrs) {
+	if (attrs.empty()) {
+		return (CFDictionaryRef)::CFRetain(app);
+	}
+
+	CFMutableDictionaryRef rval = ::CFDictionaryCreateMutable(kCFAllocatorDefault, attrs.size(), &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	for (auto const& attr : attrs) {
+		CFStringRef key = createCFString(attr);
+		const void* value = ::CFDictionaryGetValue(app, key);
+		if (value) {
+			::CFDictionarySetValue(rval, key, value);
+		}
+		::CFRelease(key);
+	}
+	return rval;
+}
+
+/**
+ * Drops the cache. This is called after an install since the install notification is delivered
+ * asynchronously.
+ */
+void AppInventory::invalidate() {
+	++generation;
+}
+
+/**
+ * Looks up specific apps and caches them. Bundle ids that aren't in the result are remembered as
+ * not installed. Must be called with the lock held.
+ */
+void AppInventory::lookup(const std::vector<std::string>& bundleIds, CFArrayRef returnAttributes, std::shared_ptr<DeviceInterface> iface) {
+	service_conn_t conn;
+	iface->startService(AMSVC_INSTALLATION_PROXY, &conn);
+
+	LOG_DEBUG_2("AppInventory::lookup", "Looking up %ld apps on %s", (long)bundleIds.size(), udid.c_str())
+	CFMutableDictionaryRef options = createClientOptions(returnAttributes);
+	CFMutableArrayRef ids = ::CFArrayCreateMutable(kCFAllocatorDefault, bundleIds.size(), &kCFTypeArrayCallBacks);
+	for (auto const& id : bundleIds) {
+		CFStringRef str = createCFString(id);
+		::CFArrayAppendValue(ids, str);
+		::CFRelease(str);
+	}
+	::CFDictionarySetValue(options, CFSTR("BundleIDs"), ids);
+	::CFRelease(ids);
+
+	try {
+		installationProxyRequest(conn, CFSTR("Lookup"), options, [this](CFDictionaryRef page) {
+			CFDictionaryRef result = (CFDictionaryRef)::CFDictionaryGetValue(page, CFSTR("LookupResult"));
+			if (!result || ::CFGetTypeID(result) != ::CFDictionaryGetTypeID()) {
+				return;
+			}
+
+			CFIndex count = ::CFDictionaryGetCount(result);
+			std::vector<const void*> keys(count), values(count);
+			::CFDictionaryGetKeysAndValues(result, keys.data(), values.data());
+
+			for (CFIndex i = 0; i < count; ++i) {
+				if (::CFGetTypeID(keys[i]) != ::CFStringGetTypeID() || ::CFGetTypeID(values[i]) != ::CFDictionaryGetTypeID()) {
+					continue;
+				}
+
+				CFDictionaryRef& slot = apps[cfStringToStdString((CFStringRef)keys[i])];
+				if (slot) {
+					::CFRelease(slot);
+				}
+				slot = (CFDictionaryRef)::CFRetain(values[i]);
+			}
+		});
+	} catch (std::exception& e) {
+		::CFRelease(options);
+		::close(conn);
+		throw;
+	}
+
+	::CFRelease(options);
+	::close(conn);
+
+	for (auto const& id : bundleIds) {
+		if (!apps.count(id)) {
+			notInstalled.insert(id);
+		}
+	}
+}
+
+/**
+ * Called from the runloop thread when an app notification is received or the notification proxy
+ * connection closes.
+ */
+void AppInventory::onNotification(bool closed) {
+	if (closed) {
+		LOG_DEBUG_1("AppInventory::onNotification", "Notification proxy connection closed for %s", udid.c_str())
+		watching = false;
+	} else {
+		LOG_DEBUG_1("AppInventory::onNotification", "Apps changed on %s", udid.c_str())
+	}
+	++generation;
+}
+
+/**
+ * Returns the installed apps with the specified attributes. If no bundle ids are specified, every
+ * app is returned. Bundle ids that aren't installed are omitted. The caller must release the
+ * returned array.
+ *
+ * When a page handler is given, the apps are passed to it instead and NULL is returned. A listing
+ * of every app that has to be fetched reaches the handler a page at a time as the device sends
+ * them.
+ */
+CFArrayRef AppInventory::query(const std::vector<std::string>& attrs, const std::vector<std::string>& bundleIds, std::shared_ptr<DeviceInterface> iface, AppPageHandler onPage) {
+	if (pagingThread == std::this_thread::get_id()) {
+		// the lock is held by the page handler's caller, so querying again would deadlock
+		throw std::runtime_error("Can't query apps from a page handler of the same device");
+	}
+
+	// concurrent queries would race to set up the notification connection, so it's set up with the
+	// lock held
+	std::lock_guard<std::mutex> guard(lock);
+	bool cacheable = watch(iface);
+	uint64_t gen = generation;
+
+	if (gen != cacheGeneration) {
+		LOG_DEBUG_1("AppInventory::query", "App cache is stale for %s", udid.c_str())
+		clear();
+		cacheGeneration = gen;
+	}
+
+	bool covered = allAttributes;
+	if (!covered && !attrs.empty()) {
+		covered = true;
+		for (auto const& attr : attrs) {
+			if (!attributes.count(attr)) {
+				covered = false;
+				break;
+			}
+		}
+	}
+
+	if (!covered) {
+		// the cached apps are missing attributes, so widen the attributes and start over
+		std::set<std::string> wanted = attributes;
+		bool all = attrs.empty();
+		clear();
+		attributes = wanted;
+		attributes.insert(attrs.begin(), attrs.end());
+		allAttributes = all;
+	}
+
+	CFArrayRef returnAttributes = createReturnAttributes();
+	bool paged = false;
+
+	try {
+		if (bundleIds.empty()) {
+			if (!complete) {
+				browse(returnAttributes, iface, attrs, onPage);
+				paged = onPage != nullptr;
+			}
+		} else if (!complete) {
+			std::vector<std::string> missing;
+			for (auto const& id : bundleIds) {
+				if (!apps.count(id) && !notInstalled.count(id)) {
+					missing.push_back(id);
+				}
+			}
+			if (!missing.empty()) {
+				lookup(missing, returnAttributes, iface);
+			}
+		}
+	} catch (std::exception& e) {
+		if (returnAttributes) {
+			::CFRelease(returnAttributes);
+		}
+		clear();
+		throw;
+	}
+
+	if (returnAttributes) {
+		::CFRelease(returnAttributes);
+	}
+
+	CFMutableArrayRef rval = ::CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+
+	auto append = [&](CFDictionaryRef app) {
+		CFDictionaryRef filtered = filter(app, attrs);
+		::CFArrayAppendValue(rval, filtered);
+		::CFRelease(filtered);
+	};
+
+	if (bundleIds.empty()) {
+		for (auto const& it : apps) {
+			append(it.second);
+		}
+	} else {
+		std::set<std::string> seen;
+		for (auto const& id : bundleIds) {
+			auto it = apps.find(id);
+			if (it != apps.end() && seen.insert(id).second) {
+				append(it->second);
+			}
+		}
+	}
+
+	// the apps may have changed while they were being fetched, in which case the result is
+	// returned, but not kept
+	if (!cacheable || generation != gen) {
+		clear();
+	}
+
+	if (onPage) {
+		// the browse already passed every page
+		try {
+			if (!paged) {
+				emitPage(rval, onPage);
+			}
+		} catch (std::exception& e) {
+			::CFRelease(rval);
+			throw;
+		}
+		::CFRelease(rval);
+		return NULL;
+	}
+
+	return rval;
+}
+
+/**
+ * Passes a page to the page handler and remembers which thread it's running on so that the
+ * handler can't query the inventory again. Must be called with the lock held.
+ */
+void AppInventory::emitPage(CFArrayRef page, const AppPageHandler& onPage) {
+	pagingThread = std::this_thread::get_id();
+	try {
+		onPage(page);
+	} catch (std::exception& e) {
+		pagingThread = std::thread::id();
+		throw;
+	}
+	pagingThread = std::thread::id();
+}
+
+/**
+ * Starts observing the app notifications if not already observing them. Returns false if the
+ * notifications can't be observed. Must be called with the lock held.
+ */
+bool AppInventory::watch(std::shared_ptr<DeviceInterface> iface) {
+	if (watching) {
+		return true;
+	}
+
+	unwatch();
+
+	try {
+		iface->startService(AMSVC_NOTIFICATION_PROXY, &connection);
+	} catch (std::exception& e) {
+		LOG_DEBUG_2("AppInventory::watch", "Unable to observe app notifications for %s: %s", udid.c_str(), e.what())
+		return false;
+	}
+
+	std::vector<uint8_t> batch;
+	const void* keys[] = { CFSTR("Command"), CFSTR("Name") };
+	for (auto const& name : appNotifications) {
+		CFStringRef cfname = createCFString(name);
+		const void* values[] = { CFSTR("ObserveNotification"), cfname };
+		CFDictionaryRef msg = ::CFDictionaryCreate(kCFAllocatorDefault, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+		::CFRelease(cfname);
+		appendPlist(batch, msg, kCFPropertyListXMLFormat_v1_0);
+		::CFRelease(msg);
+	}
+
+	if (!writeFully(connection, batch.data(), batch.size())) {
+		LOG_DEBUG_1("AppInventory::watch", "Failed to register app notifications for %s", udid.c_str())
+		::close(connection);
+		return false;
+	}
+
+	watchState = new AppInventoryWatch(this);
+	CFSocketContext socketCtx = { 0, watchState, &retainWatch, &releaseWatch, NULL };
+	socket = ::CFSocketCreateWithNative(kCFAllocatorDefault, (CFSocketNativeHandle)connection, kCFSocketDataCallBack, &appInventorySocketCallback, &socketCtx);
+	if (!socket) {
+		::close(connection);
+		unwatch();
+		return false;
+	}
+
+	source = ::CFSocketCreateRunLoopSource(kCFAllocatorDefault, socket, 0);
+	auto rl = runloop.lock();
+	if (!source || !rl) {
+		unwatch();
+		return false;
+	}
+	::CFRunLoopAddSource(*rl, source, kCFRunLoopCommonModes);
+
+	// anything cached before now may already be out of date
+	++generation;
+	watching = true;
+	return true;
+}
+
+/**
+ * Stops observing the app notifications. The socket's callback runs on the run loop thread, so the
+ * inventory is detached from it first, which waits for a callback that's underway. Invalidating
+ * the socket closes the connection. Must be called with the lock held, or from the destructor.
+ */
+void AppInventory::unwatch() {
+	watching = false;
+
+	if (watchState) {
+		{
+			std::lock_guard<std::mutex> guard(watchState->lock);
+			watchState->inventory = NULL;
+		}
+		releaseWatch(watchState);
+		watchState = NULL;
+	}
+
+	if (source) {
+		if (auto rl = runloop.lock()) {
+			::CFRunLoopRemoveSource(*rl, source, kCFRunLoopCommonModes);
+		}
+		::CFRelease(source);
+		source = NULL;
+	}
+
+	if (socket) {
+		::CFSocketInvalidate(socket);
+		::CFRelease(socket);
+		socket = NULL;
+	}
+}
+
+}
@@ -0,0 +1,87 @@
+#ifndef __APPS_H__
+#define __APPS_H__
+
+#include "node-ios-device.h"
+#include "device-interface.h"
+#include "mobiledevice.h"
+#include <CoreFoundation/CoreFoundation.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+struct AppInventoryWatch;
+
+/**
+ * Receives a page of apps. The page is only valid for the duration of the call.
+ */
+typedef std::function<void(CFArrayRef page)> AppPageHandler;
+
+/**
+ * Caches the apps installed on a device as reported by the installation proxy.
+ *
+ * Only the attributes that have been asked for are requested from the device. The cached apps hold
+ * the union of every attribute asked for so far and each result is filtered down to the attributes
+ * of its query. A full listing is fetched with `Browse` and merged into the cache a page at a time
+ * as the pages arrive. Queries for specific bundle ids use `Lookup` for the ones that aren't cached
+ * yet, and bundle ids that aren't installed are remembered too.
+ *
+ * The cache is kept current by observing the app install and uninstall notifications on a private
+ * notification proxy connection. Any notification, or the connection closing, drops the cache.
+ * When the notifications can't be observed, nothing is cached.
+ *
+ * Results can be passed to a page handler instead of being returned. A full listing that isn't
+ * cached yet is passed a page at a time as the pages arrive, anything else as a single page. The
+ * handler is called with the lock held, so it must not query the same inventory.
+ */
+class AppInventory {
+public:
+	AppInventory(std::string& udid, std::weak_ptr<CFRunLoopRef> runloop);
+	~AppInventory();
+
+	CFArrayRef query(const std::vector<std::string>& attributes, const std::vector<std::string>& bundleIds, std::shared_ptr<DeviceInterface> iface, AppPageHandler onPage = nullptr);
+	void invalidate();
+	void onNotification(bool closed);
+
+private:
+	void browse(CFArrayRef returnAttributes, std::shared_ptr<DeviceInterface> iface, const std::vector<std::string>& attrs, AppPageHandler onPage);
+	void clear();
+	CFArrayRef createReturnAttributes();
+	void emitPage(CFArrayRef page, const AppPageHandler& onPage);
+	CFDictionaryRef filter(CFDictionaryRef app, const std::vector<std::string>& attributes);
+	void lookup(const std::vector<std::string>& bundleIds, CFArrayRef returnAttributes, std::shared_ptr<DeviceInterface> iface);
+	bool watch(std::shared_ptr<DeviceInterface> iface);
+	void unwatch();
+
+	std::string udid;
+	std::weak_ptr<CFRunLoopRef> runloop;
+
+	std::mutex lock;
+	std::map<std::string, CFDictionaryRef> apps;
+	std::set<std::string> notInstalled;
+	std::set<std::string> attributes;
+	bool allAttributes;
+	bool complete;
+	uint64_t cacheGeneration;
+	std::atomic<std::thread::id> pagingThread;
+
+	std::atomic<uint64_t> generation;
+	std::atomic<bool> watching;
+	service_conn_t connection;
+	CFSocketRef socket;
+	CFRunLoopSourceRef source;
+	AppInventoryWatch* watchState;
+};
+
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef __CANCEL_TOKEN_H__
+#define __CANCEL_TOKEN_H__
+
+#include "node-ios-device.h"
+#include <atomic>
+#include <stdexcept>
+
+namespace node_ios_device {
+
+/**
+ * Thrown by `CancelToken::check()` once the operation has been cancelled.
+ */
+class OperationCancelled : public std::runtime_error {
+public:
+	OperationCancelled() : std::runtime_error("Operation cancelled") {}
+};
+
+/**
+ * A flag shared between an operation running on a worker thread and the thread that may cancel
+ * it. Long operations call `check()` between steps, so a step that is already underway runs to
+ * completion.
+ */
+class CancelToken {
+public:
+	CancelToken() : cancelled(false) {}
+
+	void cancel() { cancelled = true; }
+	bool isCancelled() const { return cancelled; }
+	void check() const {
+		if (cancelled) {
+			throw OperationCancelled();
+		}
+	}
+
+private:
+	std::atomic<bool> cancelled;
+};
+
+}
+
+#endif
@@ -0,0 +1,222 @@
+#include "container-sync.h"
+#include "service.h"
+#include <atomic>
+#include <dirent.h>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+
+namespace node_ios_device {
+
+/**
+ * Returns the modification time of a stat'd file in nanoseconds.
+ */
+static uint64_t mtimeOf(const struct stat& st) {
+#ifdef __APPLE__
+	return (uint64_t)st.st_mtimespec.tv_sec * 1000000000ULL + (uint64_t)st.st_mtimespec.tv_nsec;
+#else
+	return (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec;
+#endif
+}
+
+/**
+ * Returns true for the temp files that uploads and downloads write to before renaming them.
+ */
+static bool isPartial(const std::string& name) {
+	return name.length() > 8 && name.compare(name.length() - 8, 8, ".partial") == 0;
+}
+
+ContainerSync::ContainerSync(std::string& udid, std::shared_ptr<DeviceInterface> iface) :
+	udid(udid),
+	iface(iface) {}
+
+/**
+ * Brings the local directory and the app's container in sync in the specified direction. Files
+ * that only exist on the receiving side are left alone.
+ *
+ * When pulling, a file is copied unless the local file has the same size and modified time, which
+ * is applied to every downloaded file. AFC can't set the modified time of a file on the device, so
+ * when pushing a file is copied unless the file on the device has the same size and is newer.
+ */
+ContainerSyncResult ContainerSync::sync(const std::string& bundleId, const std::string& localDir, ContainerSyncDirection direction, uint32_t concurrency) {
+	ContainerSyncResult result;
+
+	if (direction == Pull) {
+		makeLocalDirs(localDir);
+	} else {
+		struct stat st;
+		if (::stat(localDir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+			throw std::runtime_error("Directory not found: " + localDir);
+		}
+	}
+
+	iface->connect();
+
+	try {
+		// open every connection up front since the device interface must only be used from the
+		// calling thread, they're shared by the walk and the transfers
+		std::vector<std::unique_ptr<AfcConnection>> connections;
+		std::vector<AfcConnection*> walkers;
+		while (connections.size() < std::max<uint32_t>(concurrency, 1)) {
+			connections.push_back(vendContainer(iface, bundleId));
+			walkers.push_back(connections.back().get());
+		}
+
+		std::map<std::string, AfcFileInfo> remote;
+		std::map<std::string, AfcFileInfo> local;
+		AfcSnapshot snapshot = walkAfcTree(walkers, "/");
+		for (size_t i = 0; i < snapshot.count(); ++i) {
+			AfcFileInfo& info = remote[snapshot.path(i)];
+			info.size = snapshot.sizes[i];
+			info.mtime = snapshot.mtimes[i];
+			info.isDir = snapshot.dirs[i] != 0;
+		}
+		walkLocal(localDir, "", local);
+
+		std::map<std::string, AfcFileInfo>& src = direction == Pull ? remote : local;
+		std::map<std::string, AfcFileInfo>& dest = direction == Pull ? local : remote;
+		std::vector<std::string> pending;
+
+		for (auto const& it : src) {
+			if (it.second.isDir) {
+				continue;
+			}
+			auto existing = dest.find(it.first);
+			bool same = existing != dest.end() && !existing->second.isDir && existing->second.size == it.second.size;
+			if (same && direction == Pull) {
+				// local timestamps only keep microseconds
+				same = existing->second.mtime / 1000 == it.second.mtime / 1000;
+			} else if (same) {
+				same = existing->second.mtime >= it.second.mtime;
+			}
+			if (same) {
+				++result.skipped;
+			} else {
+				pending.push_back(it.first);
+			}
+		}
+
+		LOG_DEBUG_4("ContainerSync::sync", "Found %ld files in %s on %s, %ld to copy", src.size(), bundleId.c_str(), udid.c_str(), pending.size())
+
+		// create the missing directories on the device before the uploads start
+		if (direction == Push) {
+			std::set<std::string> dirs;
+			for (auto const& path : pending) {
+				size_t slash = path.find_last_of('/');
+				if (slash != std::string::npos) {
+					dirs.insert(path.substr(0, slash));
+				}
+			}
+			for (auto const& dir : dirs) {
+				auto it = remote.find(dir);
+				if (it == remote.end() || !it->second.isDir) {
+					connections[0]->makeDir("/" + dir);
+				}
+			}
+		}
+
+		size_t workers = std::min<size_t>(connections.size(), pending.size());
+
+		std::vector<uint8_t> copied(pending.size(), 0);
+		std::atomic<size_t> next(0);
+		std::mutex errorLock;
+		std::string firstError;
+		size_t numErrors = 0;
+
+		auto worker = [&](AfcConnection* afc) {
+			size_t n;
+			while ((n = next++) < pending.size()) {
+				const std::string& path = pending[n];
+				try {
+					if (direction == Pull) {
+						afc->download("/" + path, localDir + "/" + path, remote.at(path).mtime);
+					} else {
+						afc->upload(localDir + "/" + path, "/" + path);
+					}
+					copied[n] = 1;
+				} catch (std::exception& e) {
+					std::lock_guard<std::mutex> lock(errorLock);
+					if (numErrors++ == 0) {
+						firstError = e.what();
+					}
+				}
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < workers; ++i) {
+			threads.emplace_back(worker, connections[i].get());
+		}
+		if (workers > 0) {
+			worker(connections[0].get());
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+
+		for (size_t i = 0; i < pending.size(); ++i) {
+			if (copied[i]) {
+				result.copied.push_back(pending[i]);
+			}
+		}
+
+		if (numErrors) {
+			std::stringstream error;
+			error << "Failed to copy " << numErrors << " file" << (numErrors == 1 ? "" : "s") << ": " << firstError;
+			throw std::runtime_error(error.str());
+		}
+	} catch (std::exception& e) {
+		iface->disconnect();
+		throw;
+	}
+
+	iface->disconnect();
+	return result;
+}
+
+/**
+ * Recursively lists the files and directories in a local directory. Symlinks are skipped.
+ */
+void ContainerSync::walkLocal(const std::string& localDir, const std::string& dir, std::map<std::string, AfcFileInfo>& files) {
+	std::string absDir = dir.empty() ? localDir : localDir + "/" + dir;
+	DIR* d = ::opendir(absDir.c_str());
+	if (!d) {
+		return;
+	}
+
+	std::vector<std::string> subdirs;
+	struct dirent* ent;
+	while ((ent = ::readdir(d)) != NULL) {
+		std::string name = ent->d_name;
+		if (name == "." || name == ".." || isPartial(name)) {
+			continue;
+		}
+
+		std::string path = dir.empty() ? name : dir + "/" + name;
+		struct stat st;
+		if (::lstat((localDir + "/" + path).c_str(), &st) != 0) {
+			continue;
+		}
+
+		AfcFileInfo info;
+		if (S_ISDIR(st.st_mode)) {
+			info.isDir = true;
+			subdirs.push_back(path);
+		} else if (S_ISREG(st.st_mode)) {
+			info.size = (uint64_t)st.st_size;
+			info.mtime = mtimeOf(st);
+		} else {
+			continue;
+		}
+		files[path] = info;
+	}
+	::closedir(d);
+
+	for (auto const& subdir : subdirs) {
+		walkLocal(localDir, subdir, files);
+	}
+}
+
+}
@@ -0,0 +1,48 @@
+#ifndef __CONTAINER_SYNC_H__
+#define __CONTAINER_SYNC_H__
+
+#include "node-ios-device.h"
+#include "afc.h"
+#include "afc-tree.h"
+#include "device-interface.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+enum ContainerSyncDirection { Pull, Push };
+
+/**
+ * The outcome of a container sync. Paths are relative to the container.
+ */
+struct ContainerSyncResult {
+	ContainerSyncResult() : skipped(0) {}
+	std::vector<std::string> copied;
+	size_t                   skipped;
+};
+
+/**
+ * Copies the files that differ between an app's data container and a local directory. The
+ * container is vended by the house_arrest service and both trees are walked up front so that only
+ * files whose size or modified time differ are transferred, spread across several AFC connections.
+ */
+class ContainerSync {
+public:
+	ContainerSync(std::string& udid, std::shared_ptr<DeviceInterface> iface);
+
+	ContainerSyncResult sync(const std::string& bundleId, const std::string& localDir, ContainerSyncDirection direction, uint32_t concurrency);
+
+private:
+	void walkLocal(const std::string& localDir, const std::string& dir, std::map<std::string, AfcFileInfo>& files);
+
+	std::string udid;
+	std::shared_ptr<DeviceInterface> iface;
+};
+
+}
+
+#endif
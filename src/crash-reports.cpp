@@ -0,0 +1,209 @@
+#include "crash-reports.h"
+#include "service.h"
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <sys/socket.h>
+#include <thread>
+
+namespace node_ios_device {
+
+#define CRASH_MANIFEST_HEADER "# node-ios-device crash report manifest v1"
+
+/**
+ * Initializes the crash report sync for the specified device interface.
+ */
+CrashReportSync::CrashReportSync(std::string& udid, std::shared_ptr<DeviceInterface> iface) :
+	udid(udid),
+	iface(iface) {}
+
+/**
+ * Asks the crash report mover to move any pending crash reports into the directory served by the
+ * crash report copy service. The mover replies with "ping" once it's done. A mover that never
+ * replies is given up on after `CRASH_REPORT_MOVER_TIMEOUT` seconds.
+ */
+void CrashReportSync::flush() {
+	service_conn_t connection;
+	iface->startService(AMSVC_CRASH_REPORT_MOVER, &connection);
+
+	struct timeval timeout = { CRASH_REPORT_MOVER_TIMEOUT, 0 };
+	::setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	char ping[4];
+	bool success = readFully(connection, ping, sizeof(ping));
+	::close(connection);
+
+	if (!success || ::strncmp(ping, "ping", 4) != 0) {
+		LOG_DEBUG_1("CrashReportSync::flush", "Crash report mover did not respond for %s", udid.c_str())
+	}
+}
+
+/**
+ * Loads the manifest of previously synced crash reports. A missing or unreadable manifest is
+ * treated as empty so that everything is copied.
+ */
+std::map<std::string, CrashReportEntry> CrashReportSync::loadManifest(const std::string& manifestPath) {
+	std::map<std::string, CrashReportEntry> manifest;
+	std::ifstream in(manifestPath);
+	std::string line;
+
+	if (!std::getline(in, line) || line != CRASH_MANIFEST_HEADER) {
+		return manifest;
+	}
+
+	while (std::getline(in, line)) {
+		size_t a = line.find('\t');
+		size_t b = a == std::string::npos ? a : line.find('\t', a + 1);
+		if (b == std::string::npos) {
+			continue;
+		}
+
+		CrashReportEntry entry(
+			line.substr(b + 1),
+			::strtoull(line.substr(0, a).c_str(), NULL, 10),
+			::strtoull(line.substr(a + 1, b - a - 1).c_str(), NULL, 10)
+		);
+		manifest[entry.path] = entry;
+	}
+
+	return manifest;
+}
+
+/**
+ * Writes the manifest to a temp file and moves it into place.
+ */
+void CrashReportSync::saveManifest(const std::string& manifestPath, const std::vector<CrashReportEntry>& entries) {
+	std::string tmpPath = manifestPath + ".partial";
+
+	{
+		std::ofstream out(tmpPath, std::ios::trunc);
+		out << CRASH_MANIFEST_HEADER << '\n';
+		for (auto const& entry : entries) {
+			out << entry.size << '\t' << entry.mtime << '\t' << entry.path << '\n';
+		}
+		if (!out) {
+			throw std::runtime_error("Failed to write crash report manifest \"" + tmpPath + "\"");
+		}
+	}
+
+	if (::rename(tmpPath.c_str(), manifestPath.c_str()) != 0) {
+		::unlink(tmpPath.c_str());
+		throw std::runtime_error("Failed to write crash report manifest \"" + manifestPath + "\"");
+	}
+}
+
+/**
+ * Syncs the crash reports into `destDir`. The device's crash report tree is listed, compared against
+ * the manifest, and only new or changed files are copied using up to `concurrency` AFC
+ * connections in parallel. When `removeFromDevice` is set, copied crash reports are deleted from
+ * the device.
+ */
+CrashReportSyncResult CrashReportSync::sync(const std::string& destDir, bool removeFromDevice, uint32_t concurrency) {
+	CrashReportSyncResult result;
+
+	makeLocalDirs(destDir);
+	std::string manifestPath = destDir + "/.crash-manifest-" + udid;
+	std::map<std::string, CrashReportEntry> manifest = loadManifest(manifestPath);
+
+	flush();
+
+	// open every connection up front since the device interface must only be used from the
+	// calling thread, they're shared by the walk and the copies
+	std::vector<std::unique_ptr<AfcConnection>> connections;
+	std::vector<AfcConnection*> walkers;
+	service_conn_t connection;
+	while (connections.size() < std::max<uint32_t>(concurrency, 1)) {
+		iface->startService(AMSVC_CRASH_REPORT_COPY_MOBILE, &connection);
+		connections.push_back(std::make_unique<AfcConnection>(connection, iface->qos));
+		walkers.push_back(connections.back().get());
+	}
+
+	std::vector<CrashReportEntry> entries;
+	AfcSnapshot snapshot = walkAfcTree(walkers, "/");
+	for (size_t i = 0; i < snapshot.count(); ++i) {
+		if (!snapshot.dirs[i]) {
+			entries.push_back(CrashReportEntry(snapshot.path(i), snapshot.sizes[i], snapshot.mtimes[i]));
+		}
+	}
+
+	std::vector<size_t> pending;
+	std::vector<uint8_t> upToDate(entries.size(), 0);
+	for (size_t i = 0; i < entries.size(); ++i) {
+		auto it = manifest.find(entries[i].path);
+		if (it != manifest.end() && it->second.size == entries[i].size && it->second.mtime == entries[i].mtime) {
+			upToDate[i] = 1;
+			++result.skipped;
+		} else {
+			pending.push_back(i);
+		}
+	}
+
+	LOG_DEBUG_3("CrashReportSync::sync", "Found %zu crash reports on %s, %zu to copy", entries.size(), udid.c_str(), pending.size())
+
+	size_t workers = std::min<size_t>(connections.size(), pending.size());
+
+	std::vector<uint8_t> copied(entries.size(), 0);
+	std::vector<uint8_t> removed(entries.size(), 0);
+	std::atomic<size_t> next(0);
+	std::mutex errorLock;
+	std::string firstError;
+	size_t numErrors = 0;
+
+	auto worker = [&](AfcConnection* afc) {
+		size_t n;
+		while ((n = next++) < pending.size()) {
+			const CrashReportEntry& entry = entries[pending[n]];
+			try {
+				afc->download("/" + entry.path, destDir + "/" + entry.path, entry.mtime);
+				copied[pending[n]] = 1;
+				if (removeFromDevice) {
+					afc->remove("/" + entry.path);
+					removed[pending[n]] = 1;
+				}
+			} catch (std::exception& e) {
+				std::lock_guard<std::mutex> lock(errorLock);
+				if (numErrors++ == 0) {
+					firstError = e.what();
+				}
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < workers; ++i) {
+		threads.emplace_back(worker, connections[i].get());
+	}
+	if (workers > 0) {
+		worker(connections[0].get());
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	// the new manifest contains everything that is still on the device and has been synced,
+	// failed copies are left out so they are retried next time
+	std::vector<CrashReportEntry> synced;
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (copied[i]) {
+			result.copied.push_back(entries[i].path);
+		}
+		if (removed[i]) {
+			result.removed.push_back(entries[i].path);
+		} else if (copied[i] || upToDate[i]) {
+			synced.push_back(entries[i]);
+		}
+	}
+	saveManifest(manifestPath, synced);
+
+	if (numErrors) {
+		std::stringstream error;
+		error << "Failed to copy " << numErrors << " crash report" << (numErrors == 1 ? "" : "s") << ": " << firstError;
+		throw std::runtime_error(error.str());
+	}
+
+	return result;
+}
+
+}
@@ -0,0 +1,64 @@
+#ifndef __CRASH_REPORTS_H__
+#define __CRASH_REPORTS_H__
+
+#include "node-ios-device.h"
+#include "afc.h"
+#include "afc-tree.h"
+#include "device-interface.h"
+#include <map>
+#include <string>
+#include <vector>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * How long to wait for the crash report mover to reply before syncing whatever has been moved.
+ */
+#define CRASH_REPORT_MOVER_TIMEOUT 10
+
+/**
+ * A crash report on the device or in the manifest of previously synced crash reports.
+ */
+struct CrashReportEntry {
+	CrashReportEntry() : size(0), mtime(0) {}
+	CrashReportEntry(std::string path, uint64_t size, uint64_t mtime) : path(path), size(size), mtime(mtime) {}
+	std::string path;
+	uint64_t    size;
+	uint64_t    mtime;
+};
+
+/**
+ * The outcome of a crash report sync.
+ */
+struct CrashReportSyncResult {
+	CrashReportSyncResult() : skipped(0) {}
+	std::vector<std::string> copied;
+	std::vector<std::string> removed;
+	size_t                   skipped;
+};
+
+/**
+ * Incrementally copies crash reports from the device into a local directory. A manifest of what has
+ * already been copied is kept in the destination directory for each device so that only new or
+ * changed crash reports are transferred.
+ */
+class CrashReportSync {
+public:
+	CrashReportSync(std::string& udid, std::shared_ptr<DeviceInterface> iface);
+
+	CrashReportSyncResult sync(const std::string& destDir, bool removeFromDevice, uint32_t concurrency);
+
+private:
+	void flush();
+	std::map<std::string, CrashReportEntry> loadManifest(const std::string& manifestPath);
+	void saveManifest(const std::string& manifestPath, const std::vector<CrashReportEntry>& entries);
+
+	std::string udid;
+	std::shared_ptr<DeviceInterface> iface;
+};
+
+}
+
+#endif
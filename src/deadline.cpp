@@ -0,0 +1,141 @@
+#include "deadline.h"
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace node_ios_device {
+
+static std::mutex timeoutsLock;
+static DeviceTimeouts timeouts;
+
+DeviceTimeouts DeviceTimeouts::get() {
+	std::lock_guard<std::mutex> guard(timeoutsLock);
+	return timeouts;
+}
+
+void DeviceTimeouts::set(const DeviceTimeouts& value) {
+	std::lock_guard<std::mutex> guard(timeoutsLock);
+	timeouts = value;
+}
+
+/**
+ * The state shared between a caller and the worker running its operation. Either may go away
+ * first, so it's reference counted.
+ */
+struct DeadlineState {
+	DeadlineState() : done(false), abandoned(false) {}
+	std::mutex              lock;
+	std::condition_variable cond;
+	bool                    done;
+	bool                    abandoned;
+	std::exception_ptr      error;
+};
+
+/**
+ * Runs `work` on a worker thread and waits until it returns, `timeout` elapses, or `cancel` is
+ * tripped. Exceptions thrown by `work` are rethrown on the calling thread.
+ *
+ * MobileDevice calls can't be interrupted, so on timeout or cancel the worker is abandoned instead.
+ * `abort` is called on the calling thread to tear down whatever the worker is blocked on, usually by
+ * force disconnecting the session. Then `DeadlineExceeded` or `OperationCancelled` is thrown. If the
+ * abandoned worker's `work` succeeds later, it calls `abandoned` to release whatever it created.
+ * Everything `work` touches must be owned by the functions, since the caller's frame may be gone by
+ * then.
+ *
+ * When `stop` is given, a cancel first calls it on the calling thread to ask `work` to return on its
+ * own, such as at the next progress callback. `work` then has `DEADLINE_STOP_GRACE` to return
+ * before it's abandoned. If it returns in time, its result is reported as usual.
+ *
+ * Every call with a timeout or cancel token starts its own detached thread rather than reusing a
+ * worker, so a thread that's stuck in MobileDevice can't hold up operations on other devices. An
+ * abandoned thread lives until its call returns, which may be never. Without a timeout or cancel
+ * token, `work` simply runs on the calling thread.
+ */
+void runWithDeadline(const std::string& what, std::chrono::milliseconds timeout, const CancelToken* cancel, std::function<void()> work, std::function<void()> abort, std::function<void()> abandoned, std::function<void()> stop) {
+	if (timeout.count() <= 0 && !cancel) {
+		work();
+		return;
+	}
+
+	auto state = std::make_shared<DeadlineState>();
+
+	std::thread([state, work, abandoned]() {
+		std::exception_ptr error;
+		try {
+			work();
+		} catch (...) {
+			error = std::current_exception();
+		}
+
+		bool late;
+		{
+			std::lock_guard<std::mutex> guard(state->lock);
+			state->done = true;
+			state->error = error;
+			late = state->abandoned;
+		}
+		state->cond.notify_all();
+
+		if (late && !error && abandoned) {
+			LOG_DEBUG("runWithDeadline", "Abandoned operation completed, releasing its result")
+			abandoned();
+		}
+	}).detach();
+
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	bool cancelled = false;
+	std::chrono::steady_clock::time_point stopDeadline;
+	{
+		std::unique_lock<std::mutex> guard(state->lock);
+		while (!state->done) {
+			auto now = std::chrono::steady_clock::now();
+			if (!cancelled && cancel && cancel->isCancelled()) {
+				cancelled = true;
+				if (!stop) {
+					break;
+				}
+				guard.unlock();
+				stop();
+				guard.lock();
+				stopDeadline = now + DEADLINE_STOP_GRACE;
+				continue;
+			}
+
+			if (cancelled && now >= stopDeadline) {
+				break;
+			}
+			if (timeout.count() > 0 && now >= deadline) {
+				break;
+			}
+
+			auto wake = cancelled ? stopDeadline : cancel ? now + DEADLINE_CANCEL_POLL_INTERVAL : deadline;
+			if (timeout.count() > 0 && wake > deadline) {
+				wake = deadline;
+			}
+			state->cond.wait_until(guard, wake);
+		}
+
+		if (state->done) {
+			if (state->error) {
+				std::rethrow_exception(state->error);
+			}
+			return;
+		}
+
+		state->abandoned = true;
+	}
+
+	LOG_DEBUG_2("runWithDeadline", "%s %s, aborting", what.c_str(), cancelled ? "was cancelled" : "timed out")
+	if (abort) {
+		abort();
+	}
+
+	if (cancelled) {
+		throw OperationCancelled();
+	}
+	throw DeadlineExceeded(what + " timed out after " + std::to_string(timeout.count()) + "ms");
+}
+
+}
@@ -0,0 +1,94 @@
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__
+
+#include "node-ios-device.h"
+#include "cancel-token.h"
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * The default time in milliseconds each kind of device operation may take. Installs are limited
+ * per phase, so the transfer and the install each get the full time.
+ */
+#define DEVICE_CONNECT_TIMEOUT       30000
+#define DEVICE_START_SERVICE_TIMEOUT 30000
+#define DEVICE_INSTALL_TIMEOUT       600000
+
+/**
+ * How often a caller waiting on a cancellable operation checks its cancel token.
+ */
+#define DEADLINE_CANCEL_POLL_INTERVAL std::chrono::milliseconds(50)
+
+/**
+ * How long a cancelled operation that was asked to stop gets to return on its own before it's
+ * abandoned.
+ */
+#define DEADLINE_STOP_GRACE std::chrono::seconds(5)
+
+/**
+ * The error code reported for an operation that ran past its deadline.
+ */
+#define DEADLINE_ERROR_CODE "ETIMEDOUT"
+
+/**
+ * Thrown by `runWithDeadline()` when the operation ran past its deadline.
+ */
+class DeadlineExceeded : public std::runtime_error {
+public:
+	DeadlineExceeded(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+/**
+ * The error code reported for an operation refused because an abandoned operation is still running
+ * on the device.
+ */
+#define DEVICE_BUSY_ERROR_CODE "EBUSY"
+
+/**
+ * Thrown when a device can't be used until an abandoned operation on it returns.
+ */
+class DeviceBusy : public std::runtime_error {
+public:
+	DeviceBusy(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+/**
+ * Returns the error code for an exception, which is `DEADLINE_ERROR_CODE` for a timeout,
+ * `DEVICE_BUSY_ERROR_CODE` for a device that is still busy with an abandoned operation, and `code`
+ * for everything else.
+ */
+inline const char* errorCode(const std::exception& e, const char* code) {
+	if (dynamic_cast<const DeadlineExceeded*>(&e)) {
+		return DEADLINE_ERROR_CODE;
+	}
+	return dynamic_cast<const DeviceBusy*>(&e) ? DEVICE_BUSY_ERROR_CODE : code;
+}
+
+/**
+ * How long device operations may take. A timeout of zero disables the deadline. The timeouts are
+ * shared by every device.
+ */
+struct DeviceTimeouts {
+	DeviceTimeouts() :
+		connect(DEVICE_CONNECT_TIMEOUT),
+		startService(DEVICE_START_SERVICE_TIMEOUT),
+		install(DEVICE_INSTALL_TIMEOUT) {}
+	std::chrono::milliseconds connect;
+	std::chrono::milliseconds startService;
+	std::chrono::milliseconds install;
+
+	static DeviceTimeouts get();
+	static void set(const DeviceTimeouts& timeouts);
+};
+
+void runWithDeadline(const std::string& what, std::chrono::milliseconds timeout, const CancelToken* cancel, std::function<void()> work, std::function<void()> abort, std::function<void()> abandoned = nullptr, std::function<void()> stop = nullptr);
+
+}
+
+#endif
@@ -1,5 +1,12 @@
 #include "device-interface.h"
+#include "deadline.h"
+#include "pairing-cache.h"
+#include "service.h"
+#include "usb-scheduler.h"
+#include <algorithm>
 #include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
 
 namespace node_ios_device {
 
@@ -7,83 +14,165 @@ namespace node_ios_device {
  * Initialzies the device interface.
  */
 DeviceInterface::DeviceInterface(std::string& udid, am_device& dev) :
-	dev(dev), udid(udid), numConnections(0) {}
+	dev(dev), qos(std::make_shared<QosShaper>()), usbHub(0), usbInitialCap(USB_SCHEDULER_INITIAL_CAP), udid(udid), numConnections(0), sessionOpen(false), abandonedCalls(0), retired(false) {
+
+	// transfers are only scheduled per hub for USB, Wi-Fi has no hub and is left unlimited
+	if (::AMDeviceGetInterfaceType(dev) == 1) {
+		usbHub = UsbScheduler::hubOf(::AMDeviceUSBLocationID(dev));
+		if (::AMDeviceGetInterfaceSpeed(dev) > USB_HIGH_SPEED) {
+			usbInitialCap *= 2;
+		}
+	}
+}
 
 /**
- * Cleanup the device interface, namely disconnects and stops the active session.
+ * Cleanup the device interface, namely disconnects and stops the active session. A retired
+ * interface has handed the device and its pairing over to its replacement, so it leaves both alone.
  */
 DeviceInterface::~DeviceInterface() {
-	disconnect(true);
+	if (!retired) {
+		disconnect(true);
+		PairingCache::shared().invalidate(udid);
+	}
 }
 
 /**
  * Connects to the device, pairs with it, and starts a session. We use a
- * connected counter so that we don't connect more than once.
+ * connected counter so that we don't connect more than once. The session is
+ * shared by every caller, including other threads, until the last one
+ * disconnects.
+ *
+ * The handshake runs on a detached worker thread with the connect deadline since a device waiting
+ * on the trust prompt or with a wedged lockdown never answers. If it times out, the half open
+ * session is torn down and `DeadlineExceeded` is thrown. Callers that share an open session don't
+ * start a thread.
+ *
+ * Throws `DeviceBusy` without connecting while an abandoned operation is still running on the
+ * device or once the interface has been retired. If an abandoned operation closed the session out
+ * from under other callers, it's reopened.
  */
 void DeviceInterface::connect() {
-		if (numConnections > 0) {
-		LOG_DEBUG("DeviceInterface::connect", "Already connected")
-		return;
+	std::lock_guard<std::recursive_mutex> guard(connectLock);
+
+	if (isBusy()) {
+		throw DeviceBusy("Device " + udid + " is busy until an operation that was abandoned returns");
+	}
+	if (retired) {
+		throw DeviceBusy("Device " + udid + " was reconnected after an operation was abandoned");
 	}
 
 	// connection ref counter
-	if (numConnections < 0) {
-		numConnections = 0;
-	}
 	++numConnections;
+	if (sessionOpen) {
+		LOG_DEBUG("DeviceInterface::connect", "Already connected")
+		return;
+	}
+
+	std::shared_ptr<DeviceInterface> self = shared_from_this();
 
 	try {
-		// connect to the device
-		LOG_DEBUG_1("DeviceInterface::connect", "Connecting to device: %s", udid.c_str())
-		mach_error_t rval = ::AMDeviceConnect(dev);
-		if (rval == MDERR_SYSCALL) {
-			throw std::runtime_error("Failed to connect to device: setsockopt() failed");
-		} else if (rval == MDERR_QUERY_FAILED) {
-			throw std::runtime_error("Failed to connect to device: the daemon query failed");
-		} else if (rval == MDERR_INVALID_ARGUMENT) {
-			throw std::runtime_error("Failed to connect to device: invalid argument, USBMuxConnectByPort returned 0xffffffff");
-		} else if (rval != MDERR_OK) {
-			std::stringstream error;
-			error << "Failed to connect to device (0x" << std::hex << rval << ")";
-			throw std::runtime_error(error.str());
+		run(
+			"Connecting to device " + udid,
+			DeviceTimeouts::get().connect,
+			NULL,
+			[self]() { self->openSession(); },
+			[self]() {
+				// the handshake finished after we gave up, so close the session nobody is tracking;
+				// nobody could have connected since the interface is busy until this returns, and
+				// run() skips this once the interface has been retired
+				::AMDeviceStopSession(self->dev);
+				::AMDeviceDisconnect(self->dev);
+			}
+		);
+	} catch (std::exception& e) {
+		--numConnections;
+		if (!isBusy()) {
+			// an abandoned handshake was already torn down by run() and cleans up after itself
+			::AMDeviceStopSession(dev);
+			::AMDeviceDisconnect(dev);
 		}
+		throw;
+	}
 
-		// if we're not paired, go ahead and pair now
-		LOG_DEBUG_1("DeviceInterface::connect", "Pairing device: %s", udid.c_str())
-		if (::AMDeviceIsPaired(dev) != 1 && ::AMDevicePair(dev) != 1) {
-			throw std::runtime_error("Failed to pair device");
-		}
+	sessionOpen = true;
+}
 
-		// double check the pairing
-		LOG_DEBUG("DeviceInterface::connect", "Validating device pairing");
-		rval = ::AMDeviceValidatePairing(dev);
-		if (rval == MDERR_INVALID_ARGUMENT) {
-			throw std::runtime_error("Device is not paired: the device is null");
-		} else if (rval == MDERR_DICT_NOT_LOADED) {
-			throw std::runtime_error("Device is not paired: load_dict() failed");
-		} else if (rval != MDERR_OK) {
-			std::stringstream error;
-			error << "Device is not paired (0x" << std::hex << rval << ")";
-			throw std::runtime_error(error.str());
-		}
+/**
+ * Stops the session and disconnects from the device without touching the connection count. Must
+ * be called with the connect lock held.
+ */
+void DeviceInterface::closeSession() {
+	LOG_DEBUG_1("DeviceInterface::disconnect", "Stopping session: %s", udid.c_str())
+	::AMDeviceStopSession(dev);
+	LOG_DEBUG_1("DeviceInterface::disconnect", "Disconnecting from device: %s", udid.c_str())
+	::AMDeviceDisconnect(dev);
+	sessionOpen = false;
+}
+
+/**
+ * Performs the connect handshake. Once the pairing has been validated, later connects skip
+ * straight to starting the session until the pairing record changes or starting the session fails.
+ */
+void DeviceInterface::openSession() {
+	// connect to the device
+	LOG_DEBUG_1("DeviceInterface::connect", "Connecting to device: %s", udid.c_str())
+	mach_error_t rval = ::AMDeviceConnect(dev);
+	if (rval == MDERR_SYSCALL) {
+		throw std::runtime_error("Failed to connect to device: setsockopt() failed");
+	} else if (rval == MDERR_QUERY_FAILED) {
+		throw std::runtime_error("Failed to connect to device: the daemon query failed");
+	} else if (rval == MDERR_INVALID_ARGUMENT) {
+		throw std::runtime_error("Failed to connect to device: invalid argument, USBMuxConnectByPort returned 0xffffffff");
+	} else if (rval != MDERR_OK) {
+		std::stringstream error;
+		error << "Failed to connect to device (0x" << std::hex << rval << ")";
+		throw std::runtime_error(error.str());
+	}
 
-		// start the session
-		LOG_DEBUG_1("DeviceInterface::connect", "Starting session: %s", udid.c_str())
-		rval = ::AMDeviceStartSession(dev);
-		if (rval == MDERR_INVALID_ARGUMENT) {
-			throw std::runtime_error("Failed to start session: the lockdown connection has not been established");
-		} else if (rval == MDERR_DICT_NOT_LOADED) {
-			throw std::runtime_error("Failed to start session: load_dict() failed");
-		} else if (rval != MDERR_OK) {
-			std::stringstream error;
-			error << "Failed to start session (0x" << std::hex << rval << ")";
-			throw std::runtime_error(error.str());
+	// the pairing was validated before and the record hasn't changed, so try the session first
+	// and only fall back to the full pairing check if it fails
+	if (PairingCache::shared().isTrusted(udid)) {
+		LOG_DEBUG_1("DeviceInterface::connect", "Starting session with cached pairing: %s", udid.c_str())
+		if (::AMDeviceStartSession(dev) == MDERR_OK) {
+			return;
 		}
-	} catch (std::runtime_error& e) {
-		disconnect(dev);
-		throw e;
+		LOG_DEBUG_1("DeviceInterface::connect", "Cached pairing failed, validating pairing: %s", udid.c_str())
+		PairingCache::shared().invalidate(udid);
+	}
+
+	// if we're not paired, go ahead and pair now
+	LOG_DEBUG_1("DeviceInterface::connect", "Pairing device: %s", udid.c_str())
+	if (::AMDeviceIsPaired(dev) != 1 && ::AMDevicePair(dev) != 1) {
+		throw std::runtime_error("Failed to pair device");
 	}
 
+	// double check the pairing
+	LOG_DEBUG("DeviceInterface::connect", "Validating device pairing");
+	rval = ::AMDeviceValidatePairing(dev);
+	if (rval == MDERR_INVALID_ARGUMENT) {
+		throw std::runtime_error("Device is not paired: the device is null");
+	} else if (rval == MDERR_DICT_NOT_LOADED) {
+		throw std::runtime_error("Device is not paired: load_dict() failed");
+	} else if (rval != MDERR_OK) {
+		std::stringstream error;
+		error << "Device is not paired (0x" << std::hex << rval << ")";
+		throw std::runtime_error(error.str());
+	}
+
+	// start the session
+	LOG_DEBUG_1("DeviceInterface::connect", "Starting session: %s", udid.c_str())
+	rval = ::AMDeviceStartSession(dev);
+	if (rval == MDERR_INVALID_ARGUMENT) {
+		throw std::runtime_error("Failed to start session: the lockdown connection has not been established");
+	} else if (rval == MDERR_DICT_NOT_LOADED) {
+		throw std::runtime_error("Failed to start session: load_dict() failed");
+	} else if (rval != MDERR_OK) {
+		std::stringstream error;
+		error << "Failed to start session (0x" << std::hex << rval << ")";
+		throw std::runtime_error(error.str());
+	}
+
+	PairingCache::shared().setTrusted(udid);
 }
 
 /**
@@ -92,12 +181,12 @@ void DeviceInterface::connect() {
  * destructor.
  */
 void DeviceInterface::disconnect(const bool force) {
+	std::lock_guard<std::recursive_mutex> guard(connectLock);
 	if (dev && numConnections > 0) {
 		if (force || numConnections == 1) {
-			LOG_DEBUG_1("DeviceInterface::disconnect", "Stopping session: %s", udid.c_str())
-			::AMDeviceStopSession(dev);
-			LOG_DEBUG_1("DeviceInterface::disconnect", "Disconnecting from device: %s", udid.c_str())
-			::AMDeviceDisconnect(dev);
+			if (sessionOpen) {
+				closeSession();
+			}
 			numConnections = 0;
 		} else {
 			--numConnections;
@@ -105,6 +194,125 @@ void DeviceInterface::disconnect(const bool force) {
 	}
 }
 
+/**
+ * Returns how long the interface has been busy with abandoned operations, or zero if it isn't.
+ */
+std::chrono::milliseconds DeviceInterface::busyFor() {
+	std::lock_guard<std::recursive_mutex> guard(connectLock);
+	if (!isBusy()) {
+		return std::chrono::milliseconds(0);
+	}
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - busySince);
+}
+
+/**
+ * Hands the device over to a replacement interface after an abandoned operation on it didn't
+ * return. The session was already closed by the abort, so the connection count is dropped, which
+ * makes disconnects from callers that still hold this interface no-ops. Once the abandoned call
+ * returns, it no longer cleans up after itself since the device belongs to the replacement.
+ */
+void DeviceInterface::retire() {
+	std::lock_guard<std::recursive_mutex> guard(connectLock);
+	LOG_DEBUG_1("DeviceInterface::retire", "Retiring busy interface of device %s", udid.c_str())
+	retired = true;
+	sessionOpen = false;
+	numConnections = 0;
+}
+
+/**
+ * Whether an operation on the device has started, whether it has been abandoned, and whether it
+ * has returned. Whichever of the caller and the worker gets to it first decides.
+ */
+struct DeviceCall {
+	DeviceCall() : started(false), finished(false), abandoned(false) {}
+	std::mutex lock;
+	bool       started;
+	bool       finished;
+	bool       abandoned;
+};
+
+/**
+ * Runs a MobileDevice call on the device with `runWithDeadline()`, which runs it on a detached
+ * thread when there's a deadline or cancel token. If the call is abandoned, the session is closed to
+ * unblock it and the interface stays busy until the call returns, so that nothing else uses the
+ * interface in the meantime. `abandoned` is called if the abandoned call succeeds, before the
+ * interface is usable again, unless the interface has been retired. `stop` asks a cancelled call to
+ * return on its own first, see `runWithDeadline()`.
+ *
+ * A call that is abandoned before its worker gets to it is skipped, and since it never touched the
+ * device, the session is left alone.
+ */
+void DeviceInterface::run(const std::string& what, std::chrono::milliseconds timeout, const CancelToken* cancel, std::function<void()> work, std::function<void()> abandoned, std::function<void()> stop) {
+	std::shared_ptr<DeviceInterface> self = shared_from_this();
+	auto call = std::make_shared<DeviceCall>();
+
+	runWithDeadline(
+		what,
+		timeout,
+		cancel,
+		[self, call, work, abandoned]() {
+			{
+				std::lock_guard<std::mutex> guard(call->lock);
+				if (call->abandoned) {
+					LOG_DEBUG_1("DeviceInterface::run", "Skipping operation on device %s that was abandoned before it started", self->udid.c_str())
+					return;
+				}
+				call->started = true;
+			}
+
+			std::exception_ptr error;
+			try {
+				work();
+			} catch (...) {
+				error = std::current_exception();
+			}
+
+			bool late;
+			{
+				std::lock_guard<std::mutex> guard(call->lock);
+				call->finished = true;
+				late = call->abandoned;
+			}
+
+			if (late) {
+				// waits for the abort to finish closing the session before cleaning up and making
+				// the device usable again
+				std::lock_guard<std::recursive_mutex> guard(self->connectLock);
+				if (!error && abandoned && !self->retired) {
+					abandoned();
+				}
+				LOG_DEBUG_1("DeviceInterface::run", "Abandoned operation returned, device %s is usable again", self->udid.c_str())
+				--self->abandonedCalls;
+			}
+
+			if (error) {
+				std::rethrow_exception(error);
+			}
+		},
+		[self, call]() {
+			std::lock_guard<std::recursive_mutex> guard(self->connectLock);
+			{
+				std::lock_guard<std::mutex> callGuard(call->lock);
+				if (call->finished) {
+					// it returned just as we gave up, so there's nothing to unblock
+					return;
+				}
+				call->abandoned = true;
+				if (!call->started) {
+					// the worker hasn't touched the device yet and skips the call
+					return;
+				}
+				if (self->abandonedCalls++ == 0) {
+					self->busySince = std::chrono::steady_clock::now();
+				}
+			}
+			self->closeSession();
+		},
+		nullptr,
+		stop
+	);
+}
+
 /**
  * Retrieves a boolean property from the device and converts it to a bool.
  */
@@ -122,54 +330,137 @@ std::string DeviceInterface::getString(CFStringRef key) {
 }
 
 /**
- * Connects to the device and installs an app using the specified local directory.
+ * Waits until no other install is running on the device and takes the lock. Throws
+ * `DeadlineExceeded` if it's still held after `timeout` and `OperationCancelled` once `cancel` is
+ * tripped. A timeout of zero waits forever.
  */
-void DeviceInterface::install(std::string& appPath) {
-	CFStringRef appPathStr = ::CFStringCreateWithCString(NULL, appPath.c_str(), kCFStringEncodingUTF8);
-	CFURLRef relativeUrl = ::CFURLCreateWithFileSystemPath(NULL, appPathStr, kCFURLPOSIXPathStyle, false);
-	CFURLRef localUrl = ::CFURLCopyAbsoluteURL(relativeUrl);
-	::CFRelease(appPathStr);
-	::CFRelease(relativeUrl);
-
-	CFStringRef keys[] = { CFSTR("PackageType") };
-	CFStringRef values[] = { CFSTR("Developer") };
-	CFDictionaryRef options = CFDictionaryCreate(NULL, (const void **)&keys, (const void **)&values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+void InstallLock::acquire(const std::string& what, std::chrono::milliseconds timeout, const CancelToken* cancel) {
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	std::unique_lock<std::mutex> guard(lock);
+	while (held) {
+		if (cancel && cancel->isCancelled()) {
+			throw OperationCancelled();
+		}
 
-	connect();
+		auto now = std::chrono::steady_clock::now();
+		if (timeout.count() > 0 && now >= deadline) {
+			throw DeadlineExceeded(what + " timed out after " + std::to_string(timeout.count()) + "ms waiting for another install");
+		}
 
-	LOG_DEBUG_1("DeviceInterface::install", "Transferring app to device: %s", udid.c_str())
-	mach_error_t rval = ::AMDeviceSecureTransferPath(0, dev, localUrl, options, NULL, 0);
-	if (rval != MDERR_OK) {
-		::CFRelease(options);
-		::CFRelease(localUrl);
-		disconnect();
-		if (rval == -402653177) {
-			throw std::runtime_error("Failed to copy app to device: can't install app that contains symlinks");
+		if (cancel || timeout.count() > 0) {
+			auto wake = cancel ? now + DEADLINE_CANCEL_POLL_INTERVAL : deadline;
+			if (timeout.count() > 0 && wake > deadline) {
+				wake = deadline;
+			}
+			cond.wait_until(guard, wake);
+		} else {
+			cond.wait(guard);
 		}
-		std::stringstream error;
-		error << "Failed to transfer app to device (0x" << std::hex << rval << ")";
-		throw std::runtime_error(error.str());
 	}
+	held = true;
+}
 
-	// install package on device
-	LOG_DEBUG_1("DeviceInterface::install", "Installing app on device: %s", udid.c_str());
-	rval = ::AMDeviceSecureInstallApplication(0, dev, localUrl, options, NULL, 0);
-	::CFRelease(options);
-	::CFRelease(localUrl);
+/**
+ * Releases the lock and wakes the next install waiting for it.
+ */
+void InstallLock::release() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		held = false;
+	}
+	cond.notify_one();
+}
 
-	disconnect();
+/**
+ * The installation proxy connection of an install and the install lock it holds. The worker may
+ * outlive the caller, so both are released when the last reference goes away, which is once the
+ * installation proxy has answered or the aborted connection fails.
+ */
+struct StagedInstall {
+	StagedInstall(std::shared_ptr<DeviceInterface> iface, service_conn_t connection) : iface(iface), connection(connection) {}
 
-	if (rval == -402620395) {
-		throw std::runtime_error("Failed to install app on device: most likely a provisioning profile issue");
-	} else if (rval != MDERR_OK) {
-		std::stringstream error;
-		error << "Failed to install app on device (0x" << std::hex << rval << ")";
-		throw std::runtime_error(error.str());
+	~StagedInstall() {
+		::close(connection);
+		iface->installLock.release();
+	}
+
+	std::shared_ptr<DeviceInterface> iface;
+	service_conn_t                   connection;
+};
+
+/**
+ * Installs an app that has been copied to `stagedPath` on the device, relative to the AFC root, by
+ * sending the installation proxy an "Install" command on its own service connection. Nothing else
+ * is sent over the session, so apps can be staged over AFC while this runs. When a progress
+ * reporter is given, it receives the "install" phase.
+ *
+ * Only one install runs on an interface at a time, such as when installs from the install queue
+ * and `installAll()` target the same device. The install lock is taken before the service is
+ * started, so the wait counts against the install deadline and can be cancelled. On timeout or
+ * cancel, the connection is shut down, which fails the worker's read right away, so the lock is
+ * released without leaving the interface busy.
+ */
+void DeviceInterface::installStaged(const std::string& stagedPath, std::shared_ptr<InstallProgress> progress, const CancelToken* cancel) {
+	std::string what = "Installing app on device " + udid;
+	auto timeout = DeviceTimeouts::get().install;
+	auto start = std::chrono::steady_clock::now();
+	installLock.acquire(what, timeout, cancel);
+
+	service_conn_t connection;
+	try {
+		startService(AMSVC_INSTALLATION_PROXY, &connection);
+	} catch (std::exception& e) {
+		installLock.release();
+		throw;
+	}
+	auto install = std::make_shared<StagedInstall>(shared_from_this(), connection);
+
+	if (timeout.count() > 0) {
+		auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+		timeout = std::max(timeout - waited, std::chrono::milliseconds(1));
+	}
+
+	LOG_DEBUG_2("DeviceInterface::installStaged", "Installing %s on device: %s", stagedPath.c_str(), udid.c_str())
+	if (progress) {
+		progress->begin("install");
+	}
+
+	runWithDeadline(
+		what,
+		timeout,
+		cancel,
+		[install, stagedPath, progress]() {
+			CFStringRef keys[] = { CFSTR("PackageType") };
+			CFStringRef values[] = { CFSTR("Developer") };
+			CFDictionaryRef options = ::CFDictionaryCreate(NULL, (const void **)&keys, (const void **)&values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+			CFStringRef packagePath = createCFString(stagedPath);
+
+			try {
+				installationProxyRequest(install->connection, CFSTR("Install"), options, [progress](CFDictionaryRef status) {
+					if (progress) {
+						progress->update(status);
+					}
+				}, packagePath);
+			} catch (std::exception& e) {
+				::CFRelease(packagePath);
+				::CFRelease(options);
+				throw std::runtime_error(std::string("Failed to install app on device: ") + e.what());
+			}
+
+			::CFRelease(packagePath);
+			::CFRelease(options);
+		},
+		[install]() { ::shutdown(install->connection, SHUT_RDWR); }
+	);
+
+	if (progress) {
+		progress->complete();
 	}
 }
 
 /**
- * Starts a service.
+ * Starts a service. Starting it is limited by the start service deadline, and if it times out the
+ * session is closed since lockdown is most likely wedged.
  *
  * Note that if the call to AMDeviceStartService() fails, it's probably because MobileDevice thinks
  * we're connected and paired, but we're not.
@@ -178,10 +469,41 @@ void DeviceInterface::startService(const char* serviceName, service_conn_t* conn
 	connect();
 
 	LOG_DEBUG_2("DeviceInterface::startService", "Starting \'%s\' service: %s", serviceName, udid.c_str());
-	mach_error_t rval = ::AMDeviceStartService(dev, ::CFStringCreateWithCStringNoCopy(NULL, serviceName, kCFStringEncodingUTF8, NULL), connection, NULL);
+	std::shared_ptr<DeviceInterface> self = shared_from_this();
+	std::string name = serviceName;
+	auto result = std::make_shared<std::pair<mach_error_t, service_conn_t>>(MDERR_OK, 0);
+
+	try {
+		run(
+			"Starting \"" + name + "\" service on device " + udid,
+			DeviceTimeouts::get().startService,
+			NULL,
+			[self, name, result]() {
+				CFStringRef str = ::CFStringCreateWithCString(NULL, name.c_str(), kCFStringEncodingUTF8);
+				result->first = ::AMDeviceStartService(self->dev, str, &result->second, NULL);
+				::CFRelease(str);
+			},
+			[result]() {
+				if (result->first == MDERR_OK) {
+					::close(result->second);
+				}
+			}
+		);
+	} catch (std::exception& e) {
+		disconnect();
+		PairingCache::shared().invalidate(udid);
+		throw;
+	}
 
 	disconnect();
 
+	mach_error_t rval = result->first;
+	*connection = result->second;
+
+	if (rval != MDERR_OK) {
+		PairingCache::shared().invalidate(udid);
+	}
+
 	std::stringstream error;
 	if (rval == MDERR_SYSCALL) {
 		error << "Failed to start \"" << serviceName << "\" service due to system call error (0x" << std::hex << rval << ")";
@@ -2,8 +2,17 @@
 #define __DEVICE_INTERFACE_H__
 
 #include "node-ios-device.h"
+#include "cancel-token.h"
+#include "install-progress.h"
 #include "mobiledevice.h"
+#include "qos.h"
 #include <CoreFoundation/CoreFoundation.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 
 namespace node_ios_device {
@@ -12,28 +21,81 @@ LOG_DEBUG_EXTERN_VARS
 
 enum InterfaceType { USB, WiFi };
 
+/**
+ * Serializes the installs on a device. Unlike a mutex, it can be released by a thread other than
+ * the one that acquired it, since an install acquires it before starting its worker and the worker,
+ * which may outlive the caller, releases it once the installation proxy is done with it.
+ */
+class InstallLock {
+public:
+	InstallLock() : held(false) {}
+
+	void acquire(const std::string& what, std::chrono::milliseconds timeout, const CancelToken* cancel);
+	void release();
+
+private:
+	std::mutex              lock;
+	std::condition_variable cond;
+	bool                    held;
+};
+
 /**
  * Represents a specific interface to a device. There are only 2 supported interfaces: USB and
  * Wi-Fi. Whenever something needs to queried or run on the device, it must run through this
  * interface.
+ *
+ * Connecting, starting services, and installing run with the deadlines in `DeviceTimeouts`.
+ * Interfaces must be created with `std::make_shared()` since abandoned operations hold on to them.
+ *
+ * Every operation with a deadline runs on its own detached thread, including each `connect()`
+ * that opens a session. When an operation is abandoned, the session is closed to unblock it, but
+ * callers that share the session keep their connection count. Until the abandoned MobileDevice call
+ * returns, the interface is poisoned and connecting fails right away with `DeviceBusy`. After that,
+ * the next connect opens a new session for everyone still connected. Installs are the exception,
+ * they only use their own installation proxy connection, so an abandoned install shuts that down
+ * and leaves the session alone.
+ *
+ * Since the call may never return, `Device` retires an interface that has been busy for longer than
+ * the longest timeout and replaces it with a new one on the same `am_device`. Until then, the
+ * abandoned call may still be using the device, so the device stays busy. A retired interface
+ * leaves the device alone and refuses to connect, even after the abandoned call returns.
  */
-class DeviceInterface {
+class DeviceInterface : public std::enable_shared_from_this<DeviceInterface> {
 public:
 	DeviceInterface(std::string& udid, am_device& dev);
 	~DeviceInterface();
 
 	void connect();
 	void disconnect(const bool force = false);
+	bool isBusy() const { return abandonedCalls > 0; }
+	std::chrono::milliseconds busyFor();
+	void retire();
+	void run(const std::string& what, std::chrono::milliseconds timeout, const CancelToken* cancel, std::function<void()> work, std::function<void()> abandoned = nullptr, std::function<void()> stop = nullptr);
 	bool getBoolean(CFStringRef key);
 	std::string getString(CFStringRef key);
-	void install(std::string& appPath);
+	void installStaged(const std::string& stagedPath, std::shared_ptr<InstallProgress> progress = nullptr, const CancelToken* cancel = NULL);
 	void startService(const char* serviceName, service_conn_t* connection);
 
 	am_device   dev;
+	std::shared_ptr<QosShaper> qos;
+	uint32_t    usbHub;
+	uint32_t    usbInitialCap;
+
+	// held while an install is running on `dev` so installs from different callers don't overlap,
+	// staging the next app over AFC doesn't need it
+	InstallLock installLock;
 
 private:
+	void closeSession();
+	void openSession();
+
 	std::string udid;
 	uint32_t    numConnections;
+	bool        sessionOpen;
+	std::atomic<uint32_t> abandonedCalls;
+	std::chrono::steady_clock::time_point busySince;
+	std::atomic<bool> retired;
+	std::recursive_mutex connectLock;
 };
 
 }
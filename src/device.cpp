@@ -1,5 +1,14 @@
 #include "device.h"
+#include "afc.h"
+#include "deadline.h"
+#include "fingerprint.h"
+#include "service.h"
+#include "usb-scheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <future>
 #include <sstream>
+#include <unistd.h>
 
 namespace node_ios_device {
 
@@ -12,7 +21,12 @@ namespace node_ios_device {
  */
 Device::Device(napi_env env, std::string& udid, am_device& dev, std::weak_ptr<CFRunLoopRef> runloop) :
 	portRelay(env, runloop),
+	notificationRelay(env, runloop),
 	syslogRelay(env, runloop),
+	screenshotRelay(env, runloop),
+	webInspectorRelay(env, runloop),
+	appInventory(udid, runloop),
+	diagnosticsCache(udid),
 	env(env),
 	udid(udid) {
 
@@ -52,15 +66,132 @@ Device::Device(napi_env env, std::string& udid, am_device& dev, std::weak_ptr<CF
 	iface->disconnect();
 }
 
+/**
+ * Converts an optional JavaScript array of strings into a list of std strings.
+ */
+static std::vector<std::string> napiToStrings(napi_env env, napi_value value, const char* error) {
+	std::vector<std::string> rval;
+	napi_valuetype type;
+	bool isArray = false;
+
+	if (!value || ::napi_typeof(env, value, &type) != napi_ok || type == napi_undefined || type == napi_null) {
+		return rval;
+	}
+
+	if (::napi_is_array(env, value, &isArray) != napi_ok || !isArray) {
+		throw std::runtime_error(error);
+	}
+
+	uint32_t count = 0;
+	::napi_get_array_length(env, value, &count);
+	for (uint32_t i = 0; i < count; ++i) {
+		napi_value str;
+		::napi_get_element(env, value, i, &str);
+		if (::napi_typeof(env, str, &type) != napi_ok || type != napi_string) {
+			throw std::runtime_error(error);
+		}
+		rval.push_back(napi_string_to_std_string(env, str));
+	}
+
+	return rval;
+}
+
+/**
+ * Walks a directory tree of an AFC service, or of an app's container when a bundle id is given,
+ * using `concurrency` connections.
+ */
+AfcSnapshot Device::afcSnapshot(const std::string& service, const std::string& bundleId, const std::string& root, uint32_t concurrency) {
+	std::shared_ptr<DeviceInterface> iface = getInterface();
+	if (!iface) {
+		std::stringstream error;
+		error << "No interfaces found for device " << udid;
+		throw std::runtime_error(error.str());
+	}
+
+	std::vector<std::unique_ptr<AfcConnection>> connections;
+	std::vector<AfcConnection*> walkers;
+
+	iface->connect();
+
+	try {
+		while (connections.size() < std::max<uint32_t>(concurrency, 1)) {
+			if (bundleId.empty()) {
+				service_conn_t connection;
+				iface->startService(service.c_str(), &connection);
+				connections.push_back(std::make_unique<AfcConnection>(connection, iface->qos));
+			} else {
+				connections.push_back(vendContainer(iface, bundleId));
+			}
+			walkers.push_back(connections.back().get());
+		}
+	} catch (std::exception& e) {
+		iface->disconnect();
+		throw;
+	}
+
+	iface->disconnect();
+	return walkAfcTree(walkers, root);
+}
+
+/**
+ * Returns the installed apps with the specified attributes from the app inventory. When `onPage`
+ * is a function, the apps are passed to it a page at a time instead and undefined is returned. If
+ * it throws, its exception is left pending.
+ */
+napi_value Device::apps(napi_value attributes, napi_value bundleIds, napi_value onPage) {
+	std::shared_ptr<DeviceInterface> iface = getInterface();
+	if (!iface) {
+		std::stringstream error;
+		error << "No interfaces found for device " << udid;
+		throw std::runtime_error(error.str());
+	}
+
+	std::vector<std::string> attrs = napiToStrings(env, attributes, "Expected attributes to be an array of strings");
+	std::vector<std::string> ids = napiToStrings(env, bundleIds, "Expected bundle ids to be an array of strings");
+
+	napi_value rval;
+	napi_valuetype type;
+	NAPI_THROW_RETURN("Device::apps", "ERR_NAPI_TYPEOF", ::napi_typeof(env, onPage, &type), NULL)
+
+	if (type == napi_function) {
+		napi_env env = this->env;
+		appInventory.query(attrs, ids, iface, [env, onPage](CFArrayRef page) {
+			napi_handle_scope scope;
+			napi_value global, argv[1], result;
+			if (::napi_open_handle_scope(env, &scope) != napi_ok) {
+				throw std::runtime_error("Failed to open handle scope for apps page");
+			}
+			argv[0] = cfToJS(env, page);
+			napi_status status = argv[0] ? ::napi_get_global(env, &global) : napi_pending_exception;
+			if (status == napi_ok) {
+				status = ::napi_call_function(env, global, onPage, 1, argv, &result);
+			}
+			::napi_close_handle_scope(env, scope);
+			if (status != napi_ok) {
+				throw std::runtime_error("Failed to pass apps page to callback");
+			}
+		});
+		NAPI_THROW_RETURN("Device::apps", "ERR_NAPI_GET_UNDEFINED", ::napi_get_undefined(env, &rval), NULL)
+		return rval;
+	}
+
+	CFArrayRef list = appInventory.query(attrs, ids, iface);
+	rval = cfToJS(env, list);
+	::CFRelease(list);
+	return rval;
+}
+
 /**
  * Adds or removes a device interface.
  */
 DeviceInterface* Device::config(am_device& dev, bool isAdd) {
+	std::lock_guard<std::mutex> guard(interfaceLock);
 	uint32_t type = ::AMDeviceGetInterfaceType(dev);
 	if (type == 1) {
 		if (isAdd && !usb) {
 			LOG_DEBUG_1("Device::config", "Device %s connected via USB", udid.c_str())
 			usb = std::make_shared<DeviceInterface>(udid, dev);
+			usb->qos->configure(qosConfig);
 			return usb.get();
 		} else if (!isAdd && usb) {
 			LOG_DEBUG_1("Device::config", "Device %s disconnected via USB", udid.c_str())
@@ -70,6 +201,7 @@ DeviceInterface* Device::config(am_device& dev, bool isAdd) {
 		if (isAdd && !wifi) {
 			LOG_DEBUG_1("Device::config", "Device %s connected via Wi-Fi", udid.c_str())
 			wifi = std::make_shared<DeviceInterface>(udid, dev);
+			wifi->qos->configure(qosConfig);
 			return wifi.get();
 		} else if (!isAdd && wifi) {
 			LOG_DEBUG_1("Device::config", "Device %s disconnected via Wi-Fi", udid.c_str())
@@ -83,38 +215,479 @@ DeviceInterface* Device::config(am_device& dev, bool isAdd) {
 }
 
 /**
- * Starts or stops port forwarding.
+ * Sets the rates that each of the device's links are shaped to. Links that connect later are shaped
+ * to the same rates.
+ */
+void Device::configureQos(const QosConfig& config) {
+	qosConfig = config;
+	if (usb) {
+		usb->qos->configure(config);
+	}
+	if (wifi) {
+		wifi->qos->configure(config);
+	}
+}
+
+/**
+ * Sets the per process rate limits of the syslog relay.
+ */
+void Device::configureSyslogLimits(const SyslogLimitConfig& config) {
+	syslogRelay.configureLimits(config);
+}
+
+/**
+ * Returns the requested diagnostic values, fetching the ones that aren't cached in a single
+ * session. The caller must release the returned dictionary.
  */
-void Device::forward(uint8_t action, napi_value nport, napi_value listener) {
-	if (action == RELAY_START && !usb) {
+CFDictionaryRef Device::diagnostics(const std::vector<std::string>& keys, const std::vector<uint64_t>& ttls) {
+	std::shared_ptr<DeviceInterface> iface = getInterface();
+	if (!iface) {
+		std::stringstream error;
+		error << "No interfaces found for device " << udid;
+		throw std::runtime_error(error.str());
+	}
+
+	return diagnosticsCache.query(keys, ttls, iface);
+}
+
+/**
+ * Requests diagnostic sources from the file relay service and extracts them into the sink.
+ */
+FileRelayResult Device::fileRelay(const std::vector<std::string>& sources, FileRelaySink& sink) {
+	std::shared_ptr<DeviceInterface> iface = getInterface();
+	if (!iface) {
+		std::stringstream error;
+		error << "No interfaces found for device " << udid;
+		throw std::runtime_error(error.str());
+	}
+
+	FileRelay relay(udid, iface);
+	return relay.run(sources, sink);
+}
+
+/**
+ * Starts or stops port forwarding. Pull listeners only receive data as they pull it.
+ */
+void Device::forward(uint8_t action, napi_value nport, napi_value listener, QosClass cls, RelayFlow flow) {
+	std::shared_ptr<DeviceInterface> iface = getInterface(true);
+	if (action == RELAY_START && !iface) {
 		throw std::runtime_error("Port forward requires a USB connected iOS device");
 	}
-	portRelay.config(action, nport, listener, usb);
+	portRelay.config(action, nport, listener, iface, cls, flow);
 }
 
 /**
- * Installs the specified app on the device.
+ * Lets a port forwarding pull listener receive up to `credit` more lines or bytes.
  */
-void Device::install(std::string& appPath) {
-	if (usb) {
-		usb->install(appPath);
-	} else if (wifi) {
-		wifi->install(appPath);
-	} else {
+void Device::pullForward(napi_value nport, napi_value listener, uint32_t credit) {
+	portRelay.pull(nport, listener, credit);
+}
+
+/**
+ * Returns how long an interface stays busy with an abandoned operation before it's retired. It's
+ * the longest timeout, since an abandoned call that hasn't returned by then is most likely stuck.
+ * When every timeout is disabled, operations are only abandoned when cancelled, so the default
+ * install timeout is used.
+ */
+static std::chrono::milliseconds retireGrace() {
+	DeviceTimeouts timeouts = DeviceTimeouts::get();
+	auto grace = std::max(timeouts.install, std::max(timeouts.connect, timeouts.startService));
+	return grace.count() > 0 ? grace : std::chrono::milliseconds(DEVICE_INSTALL_TIMEOUT);
+}
+
+/**
+ * Returns the interface to run an operation on, preferring USB, or `nullptr` if the device has no
+ * suitable interface.
+ *
+ * An interface that is busy with an abandoned operation is returned as is, so operations fail with
+ * `DeviceBusy` while the abandoned call may still be using the device. Once it has been busy for
+ * longer than the longest timeout, it's retired and replaced with a new one on the same device, so
+ * later operations don't fail for as long as the abandoned call is stuck.
+ */
+std::shared_ptr<DeviceInterface> Device::getInterface(bool usbOnly) {
+	std::lock_guard<std::mutex> guard(interfaceLock);
+	std::shared_ptr<DeviceInterface>& iface = usb || usbOnly ? usb : wifi;
+	if (iface && iface->isBusy() && iface->busyFor() >= retireGrace()) {
+		LOG_DEBUG_1("Device::getInterface", "Reconnecting device %s after an abandoned operation", udid.c_str())
+		iface->retire();
+		auto fresh = std::make_shared<DeviceInterface>(udid, iface->dev);
+		fresh->qos->configure(qosConfig);
+		iface = fresh;
+	}
+	return iface;
+}
+
+/**
+ * Installs the specified app on the device and returns true if the install was skipped because the
+ * app is unchanged. See `installAll()`.
+ */
+bool Device::install(const std::string& appPath, bool skipIfUnchanged, const std::string& recordDir) {
+	std::vector<AppInstallResult> results = installAll({ appPath }, skipIfUnchanged, recordDir);
+	if (!results[0].error.empty()) {
+		if (results[0].code == DEADLINE_ERROR_CODE) {
+			throw DeadlineExceeded(results[0].error);
+		}
+		throw std::runtime_error(results[0].error);
+	}
+	return results[0].skipped;
+}
+
+/**
+ * The prefix of the directories apps are copied to before they're installed, relative to the AFC
+ * root. Each app gets its own directory, named after the process, batch, and app, so batches from
+ * other processes or running concurrently never share one.
+ */
+#define INSTALL_STAGING_PREFIX "PublicStaging/node-ios-device-"
+
+static std::atomic<uint64_t> stagingBatch(0);
+
+/**
+ * An app on its way to the staging directory. The AFC connection belongs to the upload until it
+ * finishes, after which it's used to remove `dir` once the app has been installed from `path`.
+ */
+struct StagedApp {
+	std::shared_ptr<AfcConnection>   afc;
+	std::shared_ptr<InstallProgress> reporter;
+	std::string                      dir;
+	std::string                      path;
+	std::future<void>                upload;
+};
+
+/**
+ * Returns the name of the app bundle, ignoring trailing slashes.
+ */
+static std::string bundleName(const std::string& appPath) {
+	std::string path = appPath.substr(0, appPath.find_last_not_of('/') + 1);
+	return path.substr(path.find_last_of('/') + 1);
+}
+
+/**
+ * Copies an app to its staging directory over the app's AFC connection while holding a USB slot.
+ * The copy runs on a worker with the install deadline since a wedged AFC write never returns. On
+ * cancel, the copy stops before its next chunk. If it doesn't get there in time, or the deadline
+ * passes, the connection is shut down, which fails the worker. A failed copy removes what it left
+ * behind.
+ */
+static void stageApp(std::shared_ptr<DeviceInterface> iface, std::shared_ptr<AfcConnection> afc, const std::string& what, const std::string& appPath, const std::string& dir, const std::string& path, uint64_t size, std::shared_ptr<InstallProgress> reporter, const CancelToken* cancel) {
+	UsbSlot slot(iface->usbHub, iface->usbInitialCap, cancel);
+	auto stopped = std::make_shared<CancelToken>();
+	if (reporter) {
+		reporter->begin("transfer");
+	}
+
+	runWithDeadline(
+		what,
+		DeviceTimeouts::get().install,
+		cancel,
+		[afc, appPath, dir, path, reporter, stopped]() {
+			std::function<void(size_t)> onWrite;
+			if (reporter) {
+				onWrite = [reporter](size_t bytes) { reporter->transferred(bytes); };
+			}
+			try {
+				afc->uploadTree(appPath, path, onWrite, stopped.get());
+			} catch (std::exception& e) {
+				try {
+					afc->removeTree(dir);
+				} catch (std::exception& err) {
+					LOG_DEBUG_2("Device::installAll", "Failed to remove staged copy %s: %s", dir.c_str(), err.what())
+				}
+				throw;
+			}
+		},
+		[afc]() { afc->abort(); },
+		nullptr,
+		[stopped]() { stopped->cancel(); }
+	);
+
+	slot.finish(size);
+	if (reporter) {
+		reporter->complete();
+	}
+}
+
+/**
+ * Installs several apps on the device over a single session. Each app is copied to its own staging
+ * directory over a separate AFC connection, then installed from there by the installation proxy on
+ * another connection. The next app is copied on a separate thread while the current app installs,
+ * so the install lock is only held while installing and the link stays busy during installs.
+ *
+ * An app that fails to transfer or install doesn't stop the others. The error is reported in the
+ * app's result. Staged copies are removed once their app has been installed or has failed. The app
+ * inventory is dropped afterwards, even if an install failed, since the install notifications
+ * arrive asynchronously.
+ *
+ * When `skipIfUnchanged` is set, each app is fingerprinted and compared with the install record
+ * for the device in `recordDir`. If the record matches and the device still has the recorded
+ * `CFBundleVersion` installed, the app is skipped.
+ *
+ * When a `cancel` token is given, it's checked before each transfer and each install. A transfer
+ * that is underway stops before its next chunk and an install that is underway stops being waited
+ * on. Apps that haven't been installed when it's cancelled fail with "Operation cancelled".
+ *
+ * Each transfer and install is limited by the install deadline. An app that runs past it fails
+ * with the `DEADLINE_ERROR_CODE` code in its result.
+ *
+ * When `progress` options are given, each app reports the progress of its transfer and install.
+ * Since they overlap, events for the next app's transfer are interleaved with the current app's
+ * install.
+ */
+std::vector<AppInstallResult> Device::installAll(const std::vector<std::string>& appPaths, bool skipIfUnchanged, const std::string& recordDir, const CancelToken* cancel, const InstallProgressOptions* progress) {
+	std::shared_ptr<DeviceInterface> iface = getInterface();
+	if (!iface) {
+		std::stringstream error;
+		error << "No interfaces found for device " << udid;
+		throw std::runtime_error(error.str());
+	}
+
+	std::vector<AppInstallResult> results(appPaths.size());
+	std::vector<AppBundleInfo> bundles(appPaths.size());
+	std::vector<InstallRecordEntry> fingerprints(appPaths.size());
+	std::unique_ptr<InstallRecord> record;
+	std::vector<size_t> pending;
+
+	if (skipIfUnchanged) {
+		record = std::make_unique<InstallRecord>(recordDir, udid);
+	}
+
+	for (size_t i = 0; i < appPaths.size(); ++i) {
+		results[i].appPath = appPaths[i];
+		if (!skipIfUnchanged) {
+			pending.push_back(i);
+			continue;
+		}
+
+		try {
+			if (isUnchanged(iface, appPaths[i], *record, bundles[i], fingerprints[i])) {
+				results[i].skipped = true;
+			} else {
+				// forget the previous install up front so a failed install is never mistaken for a
+				// match
+				record->remove(bundles[i].bundleId);
+				pending.push_back(i);
+			}
+		} catch (std::exception& e) {
+			results[i].error = e.what();
+			results[i].code = errorCode(e, "ERR_INSTALL");
+		}
+	}
+
+	if (pending.empty()) {
+		return results;
+	}
+
+	// hold the session for the whole batch so each service doesn't reconnect
+	iface->connect();
+
+	uint64_t batch = ++stagingBatch;
+	std::vector<StagedApp> staged(pending.size());
+	std::string what = "Transferring app to device " + udid;
+
+	// the AFC service is started on this thread, so only the copy itself runs alongside the
+	// install and lockdown is never used by both at once
+	auto beginStaging = [&](size_t n) {
+		StagedApp& app = staged[n];
+		const std::string& appPath = results[pending[n]].appPath;
+
+		try {
+			if (cancel) {
+				cancel->check();
+			}
+			uint64_t size = dirSize(appPath);
+			if (progress) {
+				app.reporter = std::make_shared<InstallProgress>(appPath, size, *progress);
+			}
+
+			service_conn_t connection;
+			iface->startService(AMSVC_AFC, &connection);
+			app.afc = std::make_shared<AfcConnection>(connection, iface->qos);
+
+			std::stringstream dir;
+			dir << INSTALL_STAGING_PREFIX << ::getpid() << "-" << batch << "-" << n;
+			app.dir = dir.str();
+			app.path = app.dir + "/" + bundleName(appPath);
+			app.upload = std::async(std::launch::async, stageApp, iface, app.afc, what, appPath, app.dir, app.path, size, app.reporter, cancel);
+		} catch (std::exception& e) {
+			std::promise<void> failed;
+			failed.set_exception(std::current_exception());
+			app.upload = failed.get_future();
+		}
+	};
+
+	beginStaging(0);
+
+	for (size_t n = 0; n < pending.size(); ++n) {
+		AppInstallResult& result = results[pending[n]];
+		StagedApp& app = staged[n];
+
+		bool uploaded = false;
+		try {
+			app.upload.get();
+			uploaded = true;
+		} catch (std::exception& e) {
+			result.error = e.what();
+			result.code = errorCode(e, "ERR_INSTALL");
+		}
+
+		// copy the next app while this one installs
+		if (n + 1 < pending.size()) {
+			beginStaging(n + 1);
+		}
+
+		if (!uploaded) {
+			// a failed copy cleaned up after itself and an abandoned one may still have the connection
+			app.afc.reset();
+			continue;
+		}
+
+		try {
+			if (cancel) {
+				cancel->check();
+			}
+			iface->installStaged(app.path, app.reporter, cancel);
+		} catch (std::exception& e) {
+			result.error = e.what();
+			result.code = errorCode(e, "ERR_INSTALL");
+		}
+
+		try {
+			app.afc->removeTree(app.dir);
+		} catch (std::exception& e) {
+			LOG_DEBUG_2("Device::installAll", "Failed to remove staged copy %s: %s", app.dir.c_str(), e.what())
+		}
+		app.afc.reset();
+
+		// the app is installed at this point, so failing to record it only means the next batch
+		// installs it again
+		if (record && result.error.empty()) {
+			try {
+				record->put(bundles[pending[n]].bundleId, fingerprints[pending[n]]);
+			} catch (std::exception& e) {
+				LOG_DEBUG_2("Device::installAll", "Failed to record the install of %s: %s", result.appPath.c_str(), e.what())
+			}
+		}
+	}
+
+	iface->disconnect();
+	appInventory.invalidate();
+
+	return results;
+}
+
+/**
+ * Fingerprints the app and checks it against the install record. Returns true if the record
+ * matches and the device still has the recorded `CFBundleVersion` installed.
+ */
+bool Device::isUnchanged(std::shared_ptr<DeviceInterface> iface, const std::string& appPath, InstallRecord& record, AppBundleInfo& bundle, InstallRecordEntry& current) {
+	bundle = AppBundleInfo::load(appPath);
+	current.fingerprint = fingerprintDir(appPath);
+	current.bundleVersion = bundle.bundleVersion;
+
+	InstallRecordEntry previous;
+	if (!record.get(bundle.bundleId, previous) || previous.fingerprint != current.fingerprint || previous.bundleVersion != current.bundleVersion) {
+		return false;
+	}
+
+	CFArrayRef list = appInventory.query({ "CFBundleVersion" }, { bundle.bundleId }, iface);
+	bool installed = false;
+	if (::CFArrayGetCount(list) == 1) {
+		CFDictionaryRef app = (CFDictionaryRef)::CFArrayGetValueAtIndex(list, 0);
+		CFStringRef version = (CFStringRef)::CFDictionaryGetValue(app, CFSTR("CFBundleVersion"));
+		installed = version && ::CFGetTypeID(version) == ::CFStringGetTypeID() && cfStringToStdString(version) == current.bundleVersion;
+	}
+	::CFRelease(list);
+
+	if (installed) {
+		LOG_DEBUG_2("Device::isUnchanged", "%s is unchanged on %s, skipping install", bundle.bundleId.c_str(), udid.c_str())
+	}
+	return installed;
+}
+
+/**
+ * Mounts the developer disk image if one isn't already mounted.
+ */
+DeveloperImageMountResult Device::mountDeveloperImage(const std::string& imagePath, const std::string& sigPath) {
+	std::shared_ptr<DeviceInterface> iface = getInterface();
+	if (!iface) {
+		std::stringstream error;
+		error << "No interfaces found for device " << udid;
+		throw std::runtime_error(error.str());
+	}
+
+	ImageMounter mounter(udid, iface);
+	return mounter.mount(imagePath, sigPath);
+}
+
+/**
+ * Starts or stops observing device notifications.
+ */
+void Device::observe(uint8_t action, napi_value listener, napi_value names) {
+	std::shared_ptr<DeviceInterface> iface = getInterface();
+	if (action == RELAY_START && !iface) {
+		std::stringstream error;
+		error << "No interfaces found for device " << udid;
+		throw std::runtime_error(error.str());
+	}
+	notificationRelay.config(action, listener, names, iface);
+}
+
+/**
+ * Starts or stops the screenshot stream.
+ */
+void Device::screenshots(uint8_t action, napi_value listener, napi_value fps, napi_value dedup) {
+	std::shared_ptr<DeviceInterface> iface = getInterface(true);
+	if (action == RELAY_START && !iface) {
+		throw std::runtime_error("screenshots requires a USB connected iOS device");
+	}
+	screenshotRelay.config(action, listener, fps, dedup, iface);
+}
+
+/**
+ * Copies the files that differ between an app's data container and a local directory.
+ */
+ContainerSyncResult Device::syncContainer(const std::string& bundleId, const std::string& localDir, ContainerSyncDirection direction, uint32_t concurrency) {
+	std::shared_ptr<DeviceInterface> iface = getInterface();
+	if (!iface) {
+		std::stringstream error;
+		error << "No interfaces found for device " << udid;
+		throw std::runtime_error(error.str());
+	}
+
+	ContainerSync container(udid, iface);
+	return container.sync(bundleId, localDir, direction, concurrency);
+}
+
+/**
+ * Copies new crash reports from the device into the specified directory.
+ */
+CrashReportSyncResult Device::syncCrashReports(std::string& destDir, bool removeFromDevice, uint32_t concurrency) {
+	std::shared_ptr<DeviceInterface> iface = getInterface();
+	if (!iface) {
 		std::stringstream error;
 		error << "No interfaces found for device " << udid;
 		throw std::runtime_error(error.str());
 	}
+
+	CrashReportSync crashReports(udid, iface);
+	return crashReports.sync(destDir, removeFromDevice, concurrency);
 }
 
 /**
- * Starts or stops syslog relaying.
+ * Lets a syslog pull listener receive up to `credit` more lines or bytes.
  */
-void Device::syslog(uint8_t action, napi_value listener) {
-	if (action == RELAY_START && !usb) {
+void Device::pullSyslog(napi_value listener, uint32_t credit) {
+	syslogRelay.pull(listener, credit);
+}
+
+/**
+ * Starts or stops syslog relaying. Pull listeners only receive data as they pull it.
+ */
+void Device::syslog(uint8_t action, napi_value listener, RelayFlow flow) {
+	std::shared_ptr<DeviceInterface> iface = getInterface(true);
+	if (action == RELAY_START && !iface) {
 		throw std::runtime_error("syslog requires a USB connected iOS device");
 	}
-	syslogRelay.config(action, listener, usb);
+	syslogRelay.config(action, listener, iface, flow);
 }
 
 /**
@@ -164,4 +737,33 @@ napi_value Device::toJS() {
 	return obj;
 }
 
+/**
+ * Starts or stops relaying Web Inspector messages. Devices running iOS 10 and older require large
+ * outgoing messages to be split into partial messages.
+ */
+void Device::webinspector(uint8_t action, napi_value listener) {
+	std::shared_ptr<DeviceInterface> iface = getInterface();
+	if (action == RELAY_START && !iface) {
+		std::stringstream error;
+		error << "No interfaces found for device " << udid;
+		throw std::runtime_error(error.str());
+	}
+
+	bool splitMessages = false;
+	for (auto const& it : props) {
+		if (::strcmp(it.first, "productVersion") == 0 && it.second->type == String) {
+			splitMessages = ::atoi(it.second->sval.c_str()) < 11;
+		}
+	}
+
+	webInspectorRelay.config(action, listener, iface, splitMessages);
+}
+
+/**
+ * Sends a message to the Web Inspector.
+ */
+void Device::webinspectorSend(napi_value message) {
+	webInspectorRelay.send(message);
+}
+
 }
@@ -2,13 +2,24 @@
 #define __DEVICE_H__
 
 #include "node-ios-device.h"
+#include "afc-tree.h"
+#include "apps.h"
+#include "cancel-token.h"
+#include "container-sync.h"
+#include "crash-reports.h"
+#include "diagnostics.h"
 #include "device-interface.h"
+#include "file-relay.h"
+#include "image-mounter.h"
+#include "install-record.h"
 #include "mobiledevice.h"
 #include "relay.h"
+#include "screenshot.h"
 #include <CoreFoundation/CoreFoundation.h>
 #include <list>
 #include <map>
 #include <string>
+#include <vector>
 
 namespace node_ios_device {
 
@@ -32,6 +43,17 @@ public:
 	std::string sval;
 };
 
+/**
+ * The outcome of installing one app with `installAll()`.
+ */
+struct AppInstallResult {
+	AppInstallResult() : skipped(false) {}
+	std::string appPath;
+	bool        skipped;
+	std::string error;
+	std::string code;
+};
+
 /**
  * Contains info for a connected device as well as the interfaces (USB/Wi-Fi) and the relays.
  * Any device-specific queries or execution needs to be run at the interface level.
@@ -40,19 +62,45 @@ class Device {
 public:
 	Device(napi_env env, std::string& udid, am_device& dev, std::weak_ptr<CFRunLoopRef> runloop);
 
+	AfcSnapshot afcSnapshot(const std::string& service, const std::string& bundleId, const std::string& root, uint32_t concurrency);
+	napi_value apps(napi_value attributes, napi_value bundleIds, napi_value onPage);
 	DeviceInterface* config(am_device& dev, bool isAdd);
-	void forward(uint8_t action, napi_value nport, napi_value listener);
-	void install(std::string& appPath);
+	void configureQos(const QosConfig& config);
+	void configureSyslogLimits(const SyslogLimitConfig& config);
+	CFDictionaryRef diagnostics(const std::vector<std::string>& keys, const std::vector<uint64_t>& ttls);
+	FileRelayResult fileRelay(const std::vector<std::string>& sources, FileRelaySink& sink);
+	void forward(uint8_t action, napi_value nport, napi_value listener, QosClass cls, RelayFlow flow = RelayPush);
+	bool install(const std::string& appPath, bool skipIfUnchanged, const std::string& recordDir);
+	std::vector<AppInstallResult> installAll(const std::vector<std::string>& appPaths, bool skipIfUnchanged, const std::string& recordDir, const CancelToken* cancel = NULL, const InstallProgressOptions* progress = NULL);
+	DeveloperImageMountResult mountDeveloperImage(const std::string& imagePath, const std::string& sigPath);
+	void observe(uint8_t action, napi_value listener, napi_value names);
+	void pullForward(napi_value nport, napi_value listener, uint32_t credit);
+	void pullSyslog(napi_value listener, uint32_t credit);
 	inline bool isDisconnected() const { return !usb && !wifi; }
-	void syslog(uint8_t action, napi_value listener);
+	void screenshots(uint8_t action, napi_value listener, napi_value fps, napi_value dedup);
+	ContainerSyncResult syncContainer(const std::string& bundleId, const std::string& localDir, ContainerSyncDirection direction, uint32_t concurrency);
+	CrashReportSyncResult syncCrashReports(std::string& destDir, bool removeFromDevice, uint32_t concurrency);
+	void syslog(uint8_t action, napi_value listener, RelayFlow flow = RelayPush);
 	napi_value toJS();
+	void webinspector(uint8_t action, napi_value listener);
+	void webinspectorSend(napi_value message);
 
 	std::shared_ptr<DeviceInterface> usb;
 	std::shared_ptr<DeviceInterface> wifi;
 
 private:
+	std::shared_ptr<DeviceInterface> getInterface(bool usbOnly = false);
+	bool isUnchanged(std::shared_ptr<DeviceInterface> iface, const std::string& appPath, InstallRecord& record, AppBundleInfo& bundle, InstallRecordEntry& current);
+
 	PortRelay   portRelay;
+	NotificationRelay notificationRelay;
 	SyslogRelay syslogRelay;
+	ScreenshotRelay screenshotRelay;
+	WebInspectorRelay webInspectorRelay;
+	AppInventory appInventory;
+	DiagnosticsCache diagnosticsCache;
+	QosConfig   qosConfig;
+	std::mutex  interfaceLock;
 	napi_env    env;
 	std::string udid;
 	std::map<const char*, std::unique_ptr<DeviceProp>> props;
@@ -1,4 +1,5 @@
 #include "deviceman.h"
+#include <atomic>
 
 namespace node_ios_device {
 
@@ -144,6 +145,54 @@ void DeviceMan::dispatch() {
 	}
 }
 
+/**
+ * Queries the diagnostic values of every connected device, with up to `concurrency` devices being
+ * queried at a time. A device that fails doesn't stop the others. The caller must release the
+ * values of each result.
+ */
+std::vector<DeviceDiagnosticsResult> DeviceMan::diagnosticsAll(const std::vector<std::string>& keys, const std::vector<uint64_t>& ttls, uint32_t concurrency) {
+	std::vector<std::shared_ptr<Device>> targets;
+	std::vector<DeviceDiagnosticsResult> results;
+
+	{
+		std::lock_guard<std::mutex> lock(deviceMutex);
+		for (auto const& it : devices) {
+			targets.push_back(it.second);
+			results.emplace_back();
+			results.back().udid = it.first;
+		}
+	}
+
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		size_t n;
+		while ((n = next++) < targets.size()) {
+			try {
+				results[n].values = targets[n]->diagnostics(keys, ttls);
+			} catch (std::exception& e) {
+				LOG_DEBUG_2("DeviceMan::diagnosticsAll", "Failed to query %s: %s", results[n].udid.c_str(), e.what())
+				results[n].error = e.what();
+			}
+		}
+	};
+
+	size_t workers = std::min<size_t>(std::max<uint32_t>(concurrency, 1), targets.size());
+	LOG_DEBUG_2("DeviceMan::diagnosticsAll", "Querying %ld devices with %ld workers", targets.size(), workers)
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < workers; ++i) {
+		threads.emplace_back(worker);
+	}
+	if (workers > 0) {
+		worker();
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	return results;
+}
+
 /**
  * Attempts to find a connected device by udid or throws an error if not found.
  */
@@ -8,6 +8,7 @@
 #include <list>
 #include <map>
 #include <thread>
+#include <vector>
 
 namespace node_ios_device {
 
@@ -26,6 +27,7 @@ public:
 	static std::shared_ptr<DeviceMan> create(napi_env env);
 
 	void config(napi_value listener, WatchAction action);
+	std::vector<DeviceDiagnosticsResult> diagnosticsAll(const std::vector<std::string>& keys, const std::vector<uint64_t>& ttls, uint32_t concurrency);
 	std::shared_ptr<Device> getDevice(std::string& udid);
 	void init();
 	napi_value list();
@@ -0,0 +1,220 @@
+#include "diagnostics.h"
+#include "service.h"
+#include <chrono>
+
+namespace node_ios_device {
+
+/**
+ * Returns the current time in milliseconds on a clock that never goes backwards.
+ */
+static uint64_t nowMs() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Returns true if the response's status is the expected status.
+ */
+static bool hasStatus(CFDictionaryRef msg, CFStringRef status) {
+	CFStringRef value = (CFStringRef)::CFDictionaryGetValue(msg, CFSTR("Status"));
+	return value && ::CFGetTypeID(value) == ::CFStringGetTypeID() && ::CFStringCompare(value, status, 0) == kCFCompareEqualTo;
+}
+
+/**
+ * Asks the diagnostics relay for the properties of an IORegistry entry class. Returns NULL if the
+ * device doesn't have the entry class. The caller must release the returned value.
+ */
+static CFTypeRef queryIORegistry(service_conn_t connection, const std::string& entryClass, std::vector<uint8_t>& buffer) {
+	CFStringRef entryClassStr = createCFString(entryClass);
+	const void* keys[] = { CFSTR("Request"), CFSTR("EntryClass") };
+	const void* values[] = { CFSTR("IORegistry"), entryClassStr };
+	CFDictionaryRef request = ::CFDictionaryCreate(kCFAllocatorDefault, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	::CFRelease(entryClassStr);
+	sendPlist(connection, request, kCFPropertyListXMLFormat_v1_0);
+	::CFRelease(request);
+
+	CFPropertyListRef msg = recvPlist(connection, buffer);
+	if (!msg) {
+		throw std::runtime_error("Diagnostics relay closed the connection");
+	}
+
+	CFTypeRef rval = NULL;
+	if (::CFGetTypeID(msg) == ::CFDictionaryGetTypeID() && hasStatus((CFDictionaryRef)msg, CFSTR("Success"))) {
+		CFDictionaryRef diagnostics = (CFDictionaryRef)::CFDictionaryGetValue((CFDictionaryRef)msg, CFSTR("Diagnostics"));
+		if (diagnostics && ::CFGetTypeID(diagnostics) == ::CFDictionaryGetTypeID()) {
+			rval = ::CFDictionaryGetValue(diagnostics, CFSTR("IORegistry"));
+			if (rval) {
+				::CFRetain(rval);
+			}
+		}
+	} else {
+		LOG_DEBUG_1("queryIORegistry", "Diagnostics relay has no IORegistry entry class %s", entryClass.c_str())
+	}
+
+	::CFRelease(msg);
+	return rval;
+}
+
+DiagnosticsCache::DiagnosticsCache(std::string& udid) : udid(udid) {}
+
+DiagnosticsCache::~DiagnosticsCache() {
+	invalidate();
+}
+
+/**
+ * Releases every cached value.
+ */
+void DiagnosticsCache::invalidate() {
+	std::lock_guard<std::mutex> guard(lock);
+	for (auto const& it : values) {
+		if (it.second.value) {
+			::CFRelease(it.second.value);
+		}
+	}
+	values.clear();
+}
+
+/**
+ * Returns a dictionary of the requested keys that have a value. Cached values that haven't expired
+ * are used as is and the rest are fetched from the device together. A TTL of zero always fetches
+ * the key and doesn't cache it. A key the device has no value for isn't cached either, since
+ * `AMDeviceCopyValue()` also returns NULL when the read failed. The caller must release the
+ * returned dictionary.
+ */
+CFDictionaryRef DiagnosticsCache::query(const std::vector<std::string>& keys, const std::vector<uint64_t>& ttls, std::shared_ptr<DeviceInterface> iface) {
+	std::lock_guard<std::mutex> guard(lock);
+	CFMutableDictionaryRef rval = ::CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	uint64_t now = nowMs();
+
+	std::vector<std::string> missing;
+	std::vector<uint64_t> missingTtls;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		auto it = values.find(keys[i]);
+		if (it != values.end() && it->second.expires > now) {
+			if (it->second.value) {
+				CFStringRef key = createCFString(keys[i]);
+				::CFDictionarySetValue(rval, key, it->second.value);
+				::CFRelease(key);
+			}
+		} else {
+			missing.push_back(keys[i]);
+			missingTtls.push_back(i < ttls.size() ? ttls[i] : 0);
+		}
+	}
+
+	if (missing.empty()) {
+		LOG_DEBUG_2("DiagnosticsCache::query", "All %zu keys cached for %s", keys.size(), udid.c_str())
+		return rval;
+	}
+
+	LOG_DEBUG_3("DiagnosticsCache::query", "Fetching %zu of %zu keys from %s", missing.size(), keys.size(), udid.c_str())
+
+	std::vector<CFTypeRef> fetched;
+	try {
+		fetch(missing, fetched, iface);
+	} catch (std::exception& e) {
+		for (auto value : fetched) {
+			if (value) {
+				::CFRelease(value);
+			}
+		}
+		::CFRelease(rval);
+		throw;
+	}
+
+	now = nowMs();
+	for (size_t i = 0; i < missing.size(); ++i) {
+		if (fetched[i]) {
+			CFStringRef key = createCFString(missing[i]);
+			::CFDictionarySetValue(rval, key, fetched[i]);
+			::CFRelease(key);
+		}
+
+		auto it = values.find(missing[i]);
+		if (it != values.end()) {
+			if (it->second.value) {
+				::CFRelease(it->second.value);
+			}
+			values.erase(it);
+		}
+
+		if (missingTtls[i] > 0 && fetched[i]) {
+			// the cache takes over the reference
+			CachedValue& cached = values[missing[i]];
+			cached.value = fetched[i];
+			cached.expires = now + missingTtls[i];
+		} else if (fetched[i]) {
+			::CFRelease(fetched[i]);
+		}
+	}
+
+	return rval;
+}
+
+/**
+ * Fetches the keys from the device in a single session. A value is NULL if the device doesn't
+ * have it. The caller must release the values.
+ */
+void DiagnosticsCache::fetch(const std::vector<std::string>& keys, std::vector<CFTypeRef>& values, std::shared_ptr<DeviceInterface> iface) {
+	std::vector<uint8_t> buffer;
+	service_conn_t relay = 0;
+	bool relayStarted = false;
+	size_t prefixLen = ::strlen(DIAGNOSTICS_IOREGISTRY_PREFIX);
+
+	iface->connect();
+
+	try {
+		for (auto const& key : keys) {
+			if (key.compare(0, prefixLen, DIAGNOSTICS_IOREGISTRY_PREFIX) == 0) {
+				if (!relayStarted) {
+					iface->startService(AMSVC_DIAGNOSTICS_RELAY, &relay);
+					relayStarted = true;
+				}
+				values.push_back(queryIORegistry(relay, key.substr(prefixLen), buffer));
+				continue;
+			}
+
+			// "domain:key" reads a value in a domain, "domain:" reads the whole domain
+			CFStringRef domain = NULL;
+			CFStringRef name = NULL;
+			size_t colon = key.find(':');
+			if (colon == std::string::npos) {
+				name = createCFString(key);
+			} else {
+				domain = createCFString(key.substr(0, colon));
+				if (colon + 1 < key.length()) {
+					name = createCFString(key.substr(colon + 1));
+				}
+			}
+
+			values.push_back((CFTypeRef)::AMDeviceCopyValue(iface->dev, domain, name));
+
+			if (domain) {
+				::CFRelease(domain);
+			}
+			if (name) {
+				::CFRelease(name);
+			}
+		}
+
+		if (relayStarted) {
+			const void* reqKeys[] = { CFSTR("Request") };
+			const void* reqValues[] = { CFSTR("Goodbye") };
+			CFDictionaryRef request = ::CFDictionaryCreate(kCFAllocatorDefault, reqKeys, reqValues, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+			sendPlist(relay, request, kCFPropertyListXMLFormat_v1_0);
+			::CFRelease(request);
+		}
+	} catch (std::exception& e) {
+		if (relayStarted) {
+			::close(relay);
+		}
+		iface->disconnect();
+		throw;
+	}
+
+	if (relayStarted) {
+		::close(relay);
+	}
+	iface->disconnect();
+}
+
+}
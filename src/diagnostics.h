@@ -0,0 +1,68 @@
+#ifndef __DIAGNOSTICS_H__
+#define __DIAGNOSTICS_H__
+
+#include "node-ios-device.h"
+#include "device-interface.h"
+#include "mobiledevice.h"
+#include <CoreFoundation/CoreFoundation.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * The prefix of keys that query an IORegistry entry class through the diagnostics relay instead of
+ * a lockdown domain, for example `IORegistry:IOPMPowerSource` for the battery and thermal state.
+ */
+#define DIAGNOSTICS_IOREGISTRY_PREFIX "IORegistry:"
+
+/**
+ * The diagnostic values of one device from `diagnosticsAll()`. The values are NULL if the query
+ * failed.
+ */
+struct DeviceDiagnosticsResult {
+	DeviceDiagnosticsResult() : values(NULL) {}
+	std::string     udid;
+	CFDictionaryRef values;
+	std::string     error;
+};
+
+/**
+ * Caches diagnostic values for a device, each for its own time-to-live.
+ *
+ * A key is a lockdown value such as `DeviceName`, a value in a lockdown domain such as
+ * `com.apple.disk_usage:TotalDiskCapacity`, a whole lockdown domain such as
+ * `com.apple.mobile.battery:`, or an IORegistry entry class. Every key that isn't cached or has
+ * expired is fetched in a single session, and the diagnostics relay is only started when an
+ * IORegistry key needs to be fetched.
+ */
+class DiagnosticsCache {
+public:
+	DiagnosticsCache(std::string& udid);
+	~DiagnosticsCache();
+
+	CFDictionaryRef query(const std::vector<std::string>& keys, const std::vector<uint64_t>& ttls, std::shared_ptr<DeviceInterface> iface);
+	void invalidate();
+
+private:
+	struct CachedValue {
+		CachedValue() : value(NULL), expires(0) {}
+		CFTypeRef value;
+		uint64_t  expires;
+	};
+
+	void fetch(const std::vector<std::string>& keys, std::vector<CFTypeRef>& values, std::shared_ptr<DeviceInterface> iface);
+
+	std::string udid;
+	std::mutex lock;
+	std::map<std::string, CachedValue> values;
+};
+
+}
+
+#endif
@@ -0,0 +1,461 @@
+#include "file-relay.h"
+#include "afc.h"
+#include "service.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+namespace node_ios_device {
+
+/**
+ * The size of the socket reads and of the inflate output buffer.
+ */
+#define FILE_RELAY_CHUNK_SIZE (256 * 1024)
+
+/**
+ * Cpio header sizes and the longest entry name we accept.
+ */
+#define CPIO_ODC_HEADER_SIZE  76
+#define CPIO_NEWC_HEADER_SIZE 110
+#define CPIO_MAX_NAME_SIZE    4096
+
+DirectorySink::DirectorySink(const std::string& destDir) :
+	destDir(destDir),
+	mtime(0),
+	fd(-1) {
+
+	makeLocalDirs(destDir);
+}
+
+/**
+ * Removes the partially written file if the archive ended mid-entry.
+ */
+DirectorySink::~DirectorySink() {
+	if (fd >= 0) {
+		::close(fd);
+		::unlink((path + ".partial").c_str());
+	}
+}
+
+/**
+ * Converts an entry name into a relative path with no `.` or `..` segments. Returns an empty
+ * string if the name refers to the root or tries to escape it.
+ */
+std::string DirectorySink::sanitize(const std::string& name) {
+	std::string rval;
+	size_t start = 0;
+
+	while (start <= name.length()) {
+		size_t slash = name.find('/', start);
+		if (slash == std::string::npos) {
+			slash = name.length();
+		}
+
+		std::string segment = name.substr(start, slash - start);
+		if (segment == "..") {
+			return "";
+		}
+		if (!segment.empty() && segment != ".") {
+			if (!rval.empty()) {
+				rval += '/';
+			}
+			rval += segment;
+		}
+
+		start = slash + 1;
+	}
+
+	return rval;
+}
+
+void DirectorySink::begin(const CpioEntry& entry) {
+	std::string rel = sanitize(entry.name);
+	if (rel.empty()) {
+		return;
+	}
+
+	path = destDir + "/" + rel;
+	mtime = entry.mtime;
+
+	if (S_ISDIR(entry.mode)) {
+		makeLocalDirs(path);
+		return;
+	}
+
+	if (!S_ISREG(entry.mode)) {
+		LOG_DEBUG_1("DirectorySink::begin", "Skipping non-regular file %s", entry.name.c_str())
+		return;
+	}
+
+	size_t slash = path.find_last_of('/');
+	makeLocalDirs(path.substr(0, slash));
+
+	std::string tmpPath = path + ".partial";
+	fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to open \"" + tmpPath + "\" for writing (" + ::strerror(errno) + ")");
+	}
+}
+
+void DirectorySink::data(const uint8_t* data, size_t len) {
+	if (fd < 0) {
+		return;
+	}
+
+	while (len > 0) {
+		ssize_t n = ::write(fd, data, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			throw std::runtime_error("Failed to write \"" + path + ".partial\" (" + ::strerror(errno) + ")");
+		}
+		data += n;
+		len -= (size_t)n;
+	}
+}
+
+/**
+ * Moves the completed file into place and applies the entry's modified time.
+ */
+void DirectorySink::end() {
+	if (fd < 0) {
+		return;
+	}
+
+	::close(fd);
+	fd = -1;
+
+	std::string tmpPath = path + ".partial";
+	if (mtime) {
+		struct timeval times[2];
+		times[0].tv_sec = times[1].tv_sec = (time_t)mtime;
+		times[0].tv_usec = times[1].tv_usec = 0;
+		::utimes(tmpPath.c_str(), times);
+	}
+
+	if (::rename(tmpPath.c_str(), path.c_str()) != 0) {
+		::unlink(tmpPath.c_str());
+		throw std::runtime_error("Failed to write \"" + path + "\" (" + ::strerror(errno) + ")");
+	}
+}
+
+CpioDecoder::CpioDecoder(FileRelaySink& sink) :
+	numEntries(0),
+	numBytes(0),
+	sink(sink),
+	state(Header),
+	headerLen(CPIO_ODC_HEADER_SIZE),
+	newc(false),
+	nameLen(0),
+	skip(0),
+	afterSkip(Header),
+	remaining(0) {}
+
+/**
+ * Parses a fixed width octal or hex header field.
+ */
+static uint64_t parseField(const uint8_t* p, size_t len, int base) {
+	uint64_t rval = 0;
+	for (size_t i = 0; i < len; ++i) {
+		int digit;
+		if (p[i] >= '0' && p[i] <= '9') {
+			digit = p[i] - '0';
+		} else if (base == 16 && p[i] >= 'a' && p[i] <= 'f') {
+			digit = p[i] - 'a' + 10;
+		} else if (base == 16 && p[i] >= 'A' && p[i] <= 'F') {
+			digit = p[i] - 'A' + 10;
+		} else {
+			digit = base;
+		}
+		if (digit >= base) {
+			throw std::runtime_error("Invalid cpio header");
+		}
+		rval = rval * base + (uint64_t)digit;
+	}
+	return rval;
+}
+
+/**
+ * Decodes the fields we care about from a complete header.
+ */
+void CpioDecoder::parseHeader() {
+	const uint8_t* h = header.data();
+	entry = CpioEntry();
+
+	if (newc) {
+		entry.mode  = (uint32_t)parseField(h + 14, 8, 16);
+		entry.mtime = parseField(h + 46, 8, 16);
+		entry.size  = parseField(h + 54, 8, 16);
+		nameLen     = (size_t)parseField(h + 94, 8, 16);
+	} else {
+		entry.mode  = (uint32_t)parseField(h + 18, 6, 8);
+		entry.mtime = parseField(h + 48, 11, 8);
+		nameLen     = (size_t)parseField(h + 59, 6, 8);
+		entry.size  = parseField(h + 65, 11, 8);
+	}
+
+	if (nameLen == 0 || nameLen > CPIO_MAX_NAME_SIZE) {
+		throw std::runtime_error("Invalid cpio entry name length");
+	}
+}
+
+/**
+ * Called once the name has been read. The trailer entry marks the end of the archive.
+ */
+void CpioDecoder::startEntry() {
+	// the name length includes the terminating null
+	entry.name.assign((const char*)header.data() + headerLen, nameLen - 1);
+	header.clear();
+
+	if (entry.name == "TRAILER!!!") {
+		state = Done;
+		return;
+	}
+
+	++numEntries;
+	sink.begin(entry);
+	remaining = entry.size;
+
+	// newc pads the header plus name and the data to a multiple of 4 bytes
+	size_t pad = newc ? (4 - (headerLen + nameLen) % 4) % 4 : 0;
+	if (remaining == 0) {
+		sink.end();
+		state = pad ? Skip : Header;
+		afterSkip = Header;
+	} else {
+		state = pad ? Skip : Data;
+		afterSkip = Data;
+	}
+	skip = pad;
+}
+
+/**
+ * Decodes as much of the archive as possible. Entry data is passed straight through to the sink
+ * without being copied.
+ */
+void CpioDecoder::feed(const uint8_t* data, size_t len) {
+	const uint8_t* end = data + len;
+
+	while (data < end && state != Done) {
+		switch (state) {
+			case Header: {
+				size_t need = (header.size() < 6 ? 6 : headerLen) - header.size();
+				size_t n = std::min<size_t>(need, end - data);
+				header.insert(header.end(), data, data + n);
+				data += n;
+
+				if (header.size() == 6) {
+					if (::memcmp(header.data(), "070707", 6) == 0) {
+						newc = false;
+						headerLen = CPIO_ODC_HEADER_SIZE;
+					} else if (::memcmp(header.data(), "070701", 6) == 0 || ::memcmp(header.data(), "070702", 6) == 0) {
+						newc = true;
+						headerLen = CPIO_NEWC_HEADER_SIZE;
+					} else {
+						throw std::runtime_error("Invalid cpio header");
+					}
+				} else if (header.size() == headerLen) {
+					parseHeader();
+					state = Name;
+				}
+				break;
+			}
+
+			case Name: {
+				size_t n = std::min<size_t>(headerLen + nameLen - header.size(), end - data);
+				header.insert(header.end(), data, data + n);
+				data += n;
+				if (header.size() == headerLen + nameLen) {
+					startEntry();
+				}
+				break;
+			}
+
+			case Skip: {
+				size_t n = std::min<size_t>(skip, end - data);
+				data += n;
+				skip -= n;
+				if (skip == 0) {
+					state = afterSkip;
+				}
+				break;
+			}
+
+			case Data: {
+				size_t n = (size_t)std::min<uint64_t>(remaining, end - data);
+				sink.data(data, n);
+				data += n;
+				remaining -= n;
+				numBytes += n;
+
+				if (remaining == 0) {
+					sink.end();
+					skip = newc ? (4 - entry.size % 4) % 4 : 0;
+					state = skip ? Skip : Header;
+					afterSkip = Header;
+				}
+				break;
+			}
+
+			case Done:
+				break;
+		}
+	}
+}
+
+/**
+ * Initializes zlib to expect a gzip header.
+ */
+GzipCpioExtractor::GzipCpioExtractor(FileRelaySink& sink) :
+	decoder(sink),
+	streamEnded(false),
+	out(FILE_RELAY_CHUNK_SIZE) {
+
+	::memset(&stream, 0, sizeof(stream));
+	if (::inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+		throw std::runtime_error("Failed to initialize zlib");
+	}
+}
+
+GzipCpioExtractor::~GzipCpioExtractor() {
+	::inflateEnd(&stream);
+}
+
+/**
+ * Inflates the compressed data and feeds it to the cpio decoder. Anything after the end of the
+ * archive is ignored.
+ */
+void GzipCpioExtractor::write(const uint8_t* data, size_t len) {
+	stream.next_in = const_cast<Bytef*>(data);
+	stream.avail_in = (uInt)len;
+
+	while (stream.avail_in > 0 && !decoder.isDone()) {
+		if (streamEnded) {
+			// another gzip member follows
+			::inflateReset(&stream);
+			streamEnded = false;
+		}
+
+		stream.next_out = out.data();
+		stream.avail_out = (uInt)out.size();
+
+		int rval = ::inflate(&stream, Z_NO_FLUSH);
+		if (rval == Z_STREAM_END) {
+			streamEnded = true;
+		} else if (rval != Z_OK && rval != Z_BUF_ERROR) {
+			std::stringstream error;
+			error << "Failed to inflate file relay archive (" << (stream.msg ? stream.msg : "zlib error " + std::to_string(rval)) << ")";
+			throw std::runtime_error(error.str());
+		}
+
+		decoder.feed(out.data(), out.size() - stream.avail_out);
+
+		if (rval == Z_BUF_ERROR && stream.avail_out > 0) {
+			break;
+		}
+	}
+}
+
+/**
+ * Throws if the archive was cut short.
+ */
+void GzipCpioExtractor::finish() {
+	if (!decoder.isDone()) {
+		throw std::runtime_error("File relay archive ended unexpectedly");
+	}
+}
+
+FileRelay::FileRelay(std::string& udid, std::shared_ptr<DeviceInterface> iface) :
+	udid(udid),
+	iface(iface) {}
+
+/**
+ * Requests the sources and extracts the archive into the sink as it's received. Memory use is
+ * bounded by the chunk size no matter how large the archive is.
+ */
+FileRelayResult FileRelay::run(const std::vector<std::string>& sources, FileRelaySink& sink) {
+	service_conn_t connection;
+	iface->startService(AMSVC_FILE_RELAY, &connection);
+
+	FileRelayResult result;
+
+	try {
+		CFMutableArrayRef list = ::CFArrayCreateMutable(kCFAllocatorDefault, sources.size(), &kCFTypeArrayCallBacks);
+		for (auto const& source : sources) {
+			CFStringRef str = createCFString(source);
+			::CFArrayAppendValue(list, str);
+			::CFRelease(str);
+		}
+		const void* keys[] = { CFSTR("Sources") };
+		const void* values[] = { list };
+		CFDictionaryRef request = ::CFDictionaryCreate(kCFAllocatorDefault, keys, values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+		::CFRelease(list);
+
+		try {
+			sendPlist(connection, request, kCFPropertyListXMLFormat_v1_0);
+		} catch (std::exception& e) {
+			::CFRelease(request);
+			throw;
+		}
+		::CFRelease(request);
+
+		std::vector<uint8_t> buffer;
+		CFPropertyListRef msg = recvPlist(connection, buffer);
+		if (!msg) {
+			throw std::runtime_error("File relay closed the connection");
+		}
+
+		std::string status, error;
+		if (::CFGetTypeID(msg) == ::CFDictionaryGetTypeID()) {
+			CFStringRef value = (CFStringRef)::CFDictionaryGetValue((CFDictionaryRef)msg, CFSTR("Status"));
+			if (value && ::CFGetTypeID(value) == ::CFStringGetTypeID()) {
+				status = cfStringToStdString(value);
+			}
+			value = (CFStringRef)::CFDictionaryGetValue((CFDictionaryRef)msg, CFSTR("Error"));
+			if (value && ::CFGetTypeID(value) == ::CFStringGetTypeID()) {
+				error = cfStringToStdString(value);
+			}
+		}
+		::CFRelease(msg);
+
+		if (!error.empty()) {
+			throw std::runtime_error("File relay error: " + error);
+		}
+		if (status != "Acknowledged") {
+			throw std::runtime_error("File relay did not acknowledge the request");
+		}
+
+		LOG_DEBUG_1("FileRelay::run", "Receiving file relay archive from %s", udid.c_str())
+		GzipCpioExtractor extractor(sink);
+		buffer.resize(FILE_RELAY_CHUNK_SIZE);
+
+		while (!extractor.decoder.isDone()) {
+			ssize_t n = ::recv((int)connection, buffer.data(), buffer.size(), 0);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				break;
+			}
+			iface->qos->acquire(QosBulk, (size_t)n);
+			extractor.write(buffer.data(), (size_t)n);
+		}
+
+		extractor.finish();
+		result.entries = extractor.decoder.numEntries;
+		result.bytes = extractor.decoder.numBytes;
+	} catch (std::exception& e) {
+		::close(connection);
+		throw;
+	}
+
+	::close(connection);
+	LOG_DEBUG_3("FileRelay::run", "Extracted %llu entries (%llu bytes) from %s", (unsigned long long)result.entries, (unsigned long long)result.bytes, udid.c_str())
+	return result;
+}
+
+}
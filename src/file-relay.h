@@ -0,0 +1,137 @@
+#ifndef __FILE_RELAY_H__
+#define __FILE_RELAY_H__
+
+#include "node-ios-device.h"
+#include "device-interface.h"
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * A file, directory, or symlink in a cpio archive. The mode includes the file type bits.
+ */
+struct CpioEntry {
+	CpioEntry() : mode(0), size(0), mtime(0) {}
+	std::string name;
+	uint32_t    mode;
+	uint64_t    size;
+	uint64_t    mtime;
+};
+
+/**
+ * Receives the entries of an archive as they are decoded. `data()` is called zero or more times
+ * between `begin()` and `end()` with the entry's contents in order.
+ */
+class FileRelaySink {
+public:
+	virtual ~FileRelaySink() {}
+	virtual void begin(const CpioEntry& entry) = 0;
+	virtual void data(const uint8_t* data, size_t len) = 0;
+	virtual void end() = 0;
+};
+
+/**
+ * Writes the entries of an archive into a directory. Entry names are sanitized so that nothing is
+ * written outside of the directory, and symlinks are skipped.
+ */
+class DirectorySink : public FileRelaySink {
+public:
+	DirectorySink(const std::string& destDir);
+	~DirectorySink();
+
+	void begin(const CpioEntry& entry);
+	void data(const uint8_t* data, size_t len);
+	void end();
+
+	static std::string sanitize(const std::string& name);
+
+private:
+	std::string destDir;
+	std::string path;
+	uint64_t    mtime;
+	int         fd;
+};
+
+/**
+ * An incremental decoder for "odc" (`070707`) and "newc" (`070701`/`070702`) cpio archives. Data
+ * can be fed in chunks of any size. Only the current header and name are buffered, so memory use
+ * doesn't depend on the size of the archive or its entries.
+ */
+class CpioDecoder {
+public:
+	CpioDecoder(FileRelaySink& sink);
+
+	void feed(const uint8_t* data, size_t len);
+	bool isDone() const { return state == Done; }
+
+	uint64_t numEntries;
+	uint64_t numBytes;
+
+private:
+	enum State { Header, Name, Skip, Data, Done };
+
+	void parseHeader();
+	void startEntry();
+
+	FileRelaySink&       sink;
+	State                state;
+	std::vector<uint8_t> header;
+	size_t               headerLen;
+	bool                 newc;
+	size_t               nameLen;
+	size_t               skip;
+	State                afterSkip;
+	uint64_t             remaining;
+	CpioEntry            entry;
+};
+
+/**
+ * Inflates a gzip stream and decodes the cpio archive inside it as the compressed data arrives.
+ */
+class GzipCpioExtractor {
+public:
+	GzipCpioExtractor(FileRelaySink& sink);
+	~GzipCpioExtractor();
+
+	void write(const uint8_t* data, size_t len);
+	void finish();
+
+	CpioDecoder decoder;
+
+private:
+	z_stream             stream;
+	bool                 streamEnded;
+	std::vector<uint8_t> out;
+};
+
+/**
+ * The outcome of a file relay.
+ */
+struct FileRelayResult {
+	FileRelayResult() : entries(0), bytes(0) {}
+	uint64_t entries;
+	uint64_t bytes;
+};
+
+/**
+ * Requests diagnostic sources such as "CrashReporter" or "Network" from the file relay service
+ * and extracts the archive it sends back into a sink while it's being received.
+ */
+class FileRelay {
+public:
+	FileRelay(std::string& udid, std::shared_ptr<DeviceInterface> iface);
+
+	FileRelayResult run(const std::vector<std::string>& sources, FileRelaySink& sink);
+
+private:
+	std::string udid;
+	std::shared_ptr<DeviceInterface> iface;
+};
+
+}
+
+#endif
@@ -0,0 +1,191 @@
+#include "fingerprint.h"
+#include "hash.h"
+#include <algorithm>
+#include <atomic>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace node_ios_device {
+
+/**
+ * The most threads used to hash files. Beyond this the disk is the bottleneck.
+ */
+#define FINGERPRINT_MAX_THREADS 8
+
+/**
+ * A file, symlink, or directory in the tree being fingerprinted.
+ */
+struct FingerprintEntry {
+	std::string path;
+	uint8_t     type;
+	uint64_t    size;
+	uint64_t    hash;
+};
+
+/**
+ * Closes a directory stream when it goes out of scope.
+ */
+struct DirCloser {
+	DirCloser(DIR* d) : d(d) {}
+	~DirCloser() { ::closedir(d); }
+	DIR* d;
+};
+
+/**
+ * Recursively collects the files, symlinks, and directories under `dir`. Paths are relative to the
+ * root.
+ */
+static void collect(const std::string& root, const std::string& dir, std::vector<FingerprintEntry>& entries) {
+	std::string fullDir = dir.empty() ? root : root + "/" + dir;
+	DIR* d = ::opendir(fullDir.c_str());
+	if (!d) {
+		throw std::runtime_error("Failed to read directory \"" + fullDir + "\" (" + ::strerror(errno) + ")");
+	}
+	DirCloser closer(d);
+
+	struct dirent* ent;
+	while ((ent = ::readdir(d)) != NULL) {
+		if (::strcmp(ent->d_name, ".") == 0 || ::strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+
+		std::string path = dir.empty() ? ent->d_name : dir + "/" + ent->d_name;
+		struct stat st;
+		if (::lstat((root + "/" + path).c_str(), &st) != 0) {
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			entries.push_back({ path, (uint8_t)'d', 0, 0 });
+			collect(root, path, entries);
+		} else if (S_ISREG(st.st_mode)) {
+			entries.push_back({ path, (uint8_t)((st.st_mode & S_IXUSR) ? 'x' : 'f'), (uint64_t)st.st_size, 0 });
+		} else if (S_ISLNK(st.st_mode)) {
+			entries.push_back({ path, (uint8_t)'l', (uint64_t)st.st_size, 0 });
+		}
+	}
+}
+
+/**
+ * Hashes a file's contents by mapping it into memory, or a symlink's target. Directories have no
+ * contents and only contribute their path.
+ */
+static uint64_t hashEntry(const std::string& fullPath, const FingerprintEntry& entry) {
+	if (entry.type == 'd') {
+		return 0;
+	}
+
+	if (entry.type == 'l') {
+		char target[PATH_MAX];
+		ssize_t len = ::readlink(fullPath.c_str(), target, sizeof(target));
+		if (len < 0) {
+			throw std::runtime_error("Failed to read symlink \"" + fullPath + "\" (" + ::strerror(errno) + ")");
+		}
+		return Hash64::compute(target, (size_t)len);
+	}
+
+	if (entry.size == 0) {
+		return Hash64::compute(NULL, 0);
+	}
+
+	int fd = ::open(fullPath.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to open \"" + fullPath + "\" (" + ::strerror(errno) + ")");
+	}
+
+	void* data = ::mmap(NULL, (size_t)entry.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED) {
+		throw std::runtime_error("Failed to map \"" + fullPath + "\" (" + ::strerror(errno) + ")");
+	}
+
+	::madvise(data, (size_t)entry.size, MADV_SEQUENTIAL);
+	uint64_t rval = Hash64::compute(data, (size_t)entry.size);
+	::munmap(data, (size_t)entry.size);
+	return rval;
+}
+
+uint64_t dirSize(const std::string& path) {
+	std::vector<FingerprintEntry> entries;
+	collect(path, "", entries);
+	uint64_t size = 0;
+	for (auto const& entry : entries) {
+		size += entry.size;
+	}
+	return size;
+}
+
+std::string fingerprintDir(const std::string& path, uint32_t concurrency) {
+	std::vector<FingerprintEntry> entries;
+	collect(path, "", entries);
+	std::sort(entries.begin(), entries.end(), [](const FingerprintEntry& a, const FingerprintEntry& b) {
+		return a.path < b.path;
+	});
+
+	if (concurrency == 0) {
+		concurrency = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+	}
+	size_t workers = std::min<size_t>(std::min<uint32_t>(concurrency, FINGERPRINT_MAX_THREADS), entries.size());
+
+	std::atomic<size_t> next(0);
+	std::mutex errorLock;
+	std::string firstError;
+
+	auto worker = [&]() {
+		size_t n;
+		while ((n = next++) < entries.size()) {
+			try {
+				entries[n].hash = hashEntry(path + "/" + entries[n].path, entries[n]);
+			} catch (std::exception& e) {
+				std::lock_guard<std::mutex> lock(errorLock);
+				if (firstError.empty()) {
+					firstError = e.what();
+				}
+				next = entries.size();
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < workers; ++i) {
+		threads.emplace_back(worker);
+	}
+	if (workers > 0) {
+		worker();
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	if (!firstError.empty()) {
+		throw std::runtime_error(firstError);
+	}
+
+	// the hashes of each file are combined in path order so the result doesn't depend on which
+	// thread finished first
+	std::vector<uint8_t> manifest;
+	for (auto const& entry : entries) {
+		manifest.insert(manifest.end(), entry.path.begin(), entry.path.end());
+		manifest.push_back('\0');
+		manifest.push_back(entry.type);
+		const uint8_t* size = reinterpret_cast<const uint8_t*>(&entry.size);
+		manifest.insert(manifest.end(), size, size + sizeof(entry.size));
+		const uint8_t* hash = reinterpret_cast<const uint8_t*>(&entry.hash);
+		manifest.insert(manifest.end(), hash, hash + sizeof(entry.hash));
+	}
+
+	char hex[17];
+	::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)Hash64::compute(manifest.data(), manifest.size()));
+	LOG_DEBUG_3("fingerprintDir", "Fingerprinted %ld entries in %s: %s", (long)entries.size(), path.c_str(), hex)
+	return hex;
+}
+
+}
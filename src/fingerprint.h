@@ -0,0 +1,30 @@
+#ifndef __FINGERPRINT_H__
+#define __FINGERPRINT_H__
+
+#include "node-ios-device.h"
+#include <string>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * Computes a fingerprint of a directory tree's contents such as an `.app` bundle. Every file is
+ * memory mapped and hashed with `Hash64` using up to `concurrency` threads, then the relative path,
+ * type, executable bit, size, and hash of each file and symlink, and the relative path of each
+ * directory, are hashed in path order. Any change to the tree, including adding or removing an empty
+ * directory, yields a different fingerprint, but timestamps are ignored so a rebuild that produces
+ * identical output keeps the same fingerprint.
+ *
+ * Returns the fingerprint as 16 lowercase hex characters.
+ */
+std::string fingerprintDir(const std::string& path, uint32_t concurrency = 0);
+
+/**
+ * Returns the total size of the files and symlinks in a directory tree.
+ */
+uint64_t dirSize(const std::string& path);
+
+}
+
+#endif
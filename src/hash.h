@@ -0,0 +1,95 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace node_ios_device {
+
+/**
+ * A 64-bit non-cryptographic hash (XXH64) used to cheaply compare large blobs such as screenshot
+ * frames. It runs at memory bandwidth, so hashing a frame costs far less than transferring it.
+ */
+class Hash64 {
+public:
+	static uint64_t compute(const void* input, size_t len, uint64_t seed = 0) {
+		const uint8_t* p = static_cast<const uint8_t*>(input);
+		const uint8_t* end = p + len;
+		uint64_t h;
+
+		if (len >= 32) {
+			const uint8_t* limit = end - 32;
+			uint64_t v1 = seed + P1 + P2;
+			uint64_t v2 = seed + P2;
+			uint64_t v3 = seed;
+			uint64_t v4 = seed - P1;
+
+			do {
+				v1 = round(v1, read64(p));      p += 8;
+				v2 = round(v2, read64(p));      p += 8;
+				v3 = round(v3, read64(p));      p += 8;
+				v4 = round(v4, read64(p));      p += 8;
+			} while (p <= limit);
+
+			h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+			h = merge(h, v1);
+			h = merge(h, v2);
+			h = merge(h, v3);
+			h = merge(h, v4);
+		} else {
+			h = seed + P5;
+		}
+
+		h += static_cast<uint64_t>(len);
+
+		for (; p + 8 <= end; p += 8) {
+			h ^= round(0, read64(p));
+			h = rotl(h, 27) * P1 + P4;
+		}
+
+		if (p + 4 <= end) {
+			h ^= static_cast<uint64_t>(read32(p)) * P1;
+			h = rotl(h, 23) * P2 + P3;
+			p += 4;
+		}
+
+		for (; p < end; ++p) {
+			h ^= (*p) * P5;
+			h = rotl(h, 11) * P1;
+		}
+
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
+	}
+
+private:
+	static constexpr uint64_t P1 = 11400714785074694791ULL;
+	static constexpr uint64_t P2 = 14029467366897019727ULL;
+	static constexpr uint64_t P3 = 1609587929392839161ULL;
+	static constexpr uint64_t P4 = 9650029242287828579ULL;
+	static constexpr uint64_t P5 = 2870177450012600261ULL;
+
+	static inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+	static inline uint64_t read64(const uint8_t* p) { uint64_t v; ::memcpy(&v, p, 8); return v; }
+	static inline uint32_t read32(const uint8_t* p) { uint32_t v; ::memcpy(&v, p, 4); return v; }
+
+	static inline uint64_t round(uint64_t acc, uint64_t input) {
+		acc += input * P2;
+		acc = rotl(acc, 31);
+		return acc * P1;
+	}
+
+	static inline uint64_t merge(uint64_t acc, uint64_t val) {
+		acc ^= round(0, val);
+		return acc * P1 + P4;
+	}
+};
+
+}
+
+#endif
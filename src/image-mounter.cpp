@@ -0,0 +1,323 @@
+#include "image-mounter.h"
+#include "service.h"
+#include "usb-scheduler.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+namespace node_ios_device {
+
+/**
+ * Where the uploaded image is staged on the device before it's mounted.
+ */
+#define IMAGE_STAGING_PATH "/private/var/mobile/Media/PublicStaging/staging.dimage"
+
+/**
+ * The size of each write while uploading the image. The next chunk is paged in while the current
+ * chunk is being sent.
+ */
+#define IMAGE_UPLOAD_CHUNK_SIZE (1024 * 1024)
+
+/**
+ * Returns the modification time of a stat'd file in nanoseconds.
+ */
+static uint64_t mtimeOf(const struct stat& st) {
+#ifdef __APPLE__
+	return (uint64_t)st.st_mtimespec.tv_sec * 1000000000ULL + (uint64_t)st.st_mtimespec.tv_nsec;
+#else
+	return (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec;
+#endif
+}
+
+/**
+ * Maps the entire file into memory.
+ */
+MappedFile::MappedFile(const std::string& path) : data(NULL), size(0), mtime(0) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to open \"" + path + "\" (" + ::strerror(errno) + ")");
+	}
+
+	struct stat st;
+	if (::fstat(fd, &st) != 0) {
+		::close(fd);
+		throw std::runtime_error("Failed to stat \"" + path + "\" (" + ::strerror(errno) + ")");
+	}
+	size = (size_t)st.st_size;
+	mtime = mtimeOf(st);
+
+	if (size == 0) {
+		::close(fd);
+		throw std::runtime_error("File \"" + path + "\" is empty");
+	}
+
+	void* ptr = ::mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (ptr == MAP_FAILED) {
+		throw std::runtime_error("Failed to map \"" + path + "\" (" + ::strerror(errno) + ")");
+	}
+	data = static_cast<const uint8_t*>(ptr);
+}
+
+MappedFile::~MappedFile() {
+	if (data) {
+		::munmap((void*)data, size);
+	}
+}
+
+DiskImageCache& DiskImageCache::shared() {
+	static DiskImageCache cache;
+	return cache;
+}
+
+/**
+ * Returns the mapped file, mapping it the first time it's requested or after it changed on disk.
+ */
+std::shared_ptr<MappedFile> DiskImageCache::get(const std::string& path) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	struct stat st;
+	if (::stat(path.c_str(), &st) != 0) {
+		files.erase(path);
+		throw std::runtime_error("File not found: " + path);
+	}
+
+	auto it = files.find(path);
+	if (it != files.end() && it->second->size == (size_t)st.st_size && it->second->mtime == mtimeOf(st)) {
+		return it->second;
+	}
+
+	LOG_DEBUG_1("DiskImageCache::get", "Mapping %s", path.c_str())
+	auto file = std::make_shared<MappedFile>(path);
+	files[path] = file;
+	return file;
+}
+
+/**
+ * Sends a request to the image mounter and returns the response. Throws if the response is an
+ * error. The caller must release the response.
+ */
+static CFDictionaryRef imageMounterRequest(service_conn_t connection, CFDictionaryRef request, std::vector<uint8_t>& buffer) {
+	sendPlist(connection, request, kCFPropertyListXMLFormat_v1_0);
+
+	CFPropertyListRef msg = recvPlist(connection, buffer);
+	if (!msg) {
+		throw std::runtime_error("Image mounter closed the connection");
+	}
+	if (::CFGetTypeID(msg) != ::CFDictionaryGetTypeID()) {
+		::CFRelease(msg);
+		throw std::runtime_error("Unexpected response from image mounter");
+	}
+
+	CFStringRef error = (CFStringRef)::CFDictionaryGetValue((CFDictionaryRef)msg, CFSTR("Error"));
+	if (error && ::CFGetTypeID(error) == ::CFStringGetTypeID()) {
+		std::stringstream ss;
+		ss << "Image mounter error: " << cfStringToStdString(error);
+		CFStringRef detail = (CFStringRef)::CFDictionaryGetValue((CFDictionaryRef)msg, CFSTR("DetailedError"));
+		if (detail && ::CFGetTypeID(detail) == ::CFStringGetTypeID()) {
+			ss << " (" << cfStringToStdString(detail) << ")";
+		}
+		::CFRelease(msg);
+		throw std::runtime_error(ss.str());
+	}
+
+	return (CFDictionaryRef)msg;
+}
+
+/**
+ * Returns true if the response's status is the expected status.
+ */
+static bool hasStatus(CFDictionaryRef msg, CFStringRef status) {
+	CFStringRef value = (CFStringRef)::CFDictionaryGetValue(msg, CFSTR("Status"));
+	return value && ::CFGetTypeID(value) == ::CFStringGetTypeID() && ::CFStringCompare(value, status, 0) == kCFCompareEqualTo;
+}
+
+/**
+ * Asks the device whether a developer image is mounted and, when the device reports the mounted
+ * signatures, whether it's the image with the specified signature.
+ */
+static void lookupImage(service_conn_t connection, CFDataRef sigData, std::vector<uint8_t>& buffer, DeveloperImageMountResult& result) {
+	const void* keys[] = { CFSTR("Command"), CFSTR("ImageType") };
+	const void* values[] = { CFSTR("LookupImage"), CFSTR("Developer") };
+	CFDictionaryRef request = ::CFDictionaryCreate(kCFAllocatorDefault, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	CFDictionaryRef response;
+	try {
+		response = imageMounterRequest(connection, request, buffer);
+	} catch (std::exception& e) {
+		::CFRelease(request);
+		throw;
+	}
+	::CFRelease(request);
+
+	// iOS 10 and newer return the signatures of the mounted images, older versions only say whether
+	// an image is present
+	CFArrayRef sigs = (CFArrayRef)::CFDictionaryGetValue(response, CFSTR("ImageSignature"));
+	CFBooleanRef present = (CFBooleanRef)::CFDictionaryGetValue(response, CFSTR("ImagePresent"));
+	if (sigs && ::CFGetTypeID(sigs) == ::CFArrayGetTypeID()) {
+		result.alreadyMounted = ::CFArrayGetCount(sigs) > 0;
+		result.differentImage = result.alreadyMounted && !::CFArrayContainsValue(sigs, ::CFRangeMake(0, ::CFArrayGetCount(sigs)), sigData);
+	} else if (present) {
+		result.alreadyMounted = present == kCFBooleanTrue;
+	}
+	::CFRelease(response);
+}
+
+/**
+ * Writes the image to the connection. The pages of the next chunk are requested before the current
+ * chunk is sent so that reading the image from disk overlaps with sending it.
+ */
+static void uploadImage(service_conn_t connection, const MappedFile& image, QosShaper& qos) {
+	size_t offset = 0;
+	::madvise((void*)image.data, std::min<size_t>(image.size, IMAGE_UPLOAD_CHUNK_SIZE), MADV_WILLNEED);
+
+	while (offset < image.size) {
+		size_t len = std::min<size_t>(image.size - offset, IMAGE_UPLOAD_CHUNK_SIZE);
+		size_t next = offset + len;
+		if (next < image.size) {
+			// madvise() wants a page aligned address, chunks are a multiple of the page size
+			::madvise((void*)(image.data + next), std::min<size_t>(image.size - next, IMAGE_UPLOAD_CHUNK_SIZE), MADV_WILLNEED);
+		}
+
+		qos.acquire(QosBulk, len);
+		if (!writeFully(connection, image.data + offset, len)) {
+			throw std::runtime_error("Connection closed while uploading developer disk image");
+		}
+		offset = next;
+	}
+}
+
+ImageMounter::ImageMounter(std::string& udid, std::shared_ptr<DeviceInterface> iface) :
+	udid(udid),
+	iface(iface) {}
+
+/**
+ * Mounts the developer disk image unless one is already mounted. The image is only uploaded if
+ * it needs to be mounted.
+ */
+DeveloperImageMountResult ImageMounter::mount(const std::string& imagePath, const std::string& sigPath) {
+	DeveloperImageMountResult result;
+	std::shared_ptr<MappedFile> sig = DiskImageCache::shared().get(sigPath);
+
+	service_conn_t connection;
+	iface->startService(AMSVC_MOBILE_IMAGE_MOUNTER, &connection);
+
+	std::vector<uint8_t> buffer;
+	CFDataRef sigData = ::CFDataCreate(kCFAllocatorDefault, sig->data, (CFIndex)sig->size);
+	CFDictionaryRef request = NULL;
+	CFDictionaryRef response = NULL;
+
+	try {
+		// ask the device if a developer image is already mounted
+		lookupImage(connection, sigData, buffer, result);
+
+		if (result.differentImage) {
+			LOG_DEBUG_1("ImageMounter::mount", "A different developer disk image is mounted on %s", udid.c_str())
+		} else if (result.alreadyMounted) {
+			LOG_DEBUG_1("ImageMounter::mount", "Developer disk image is already mounted on %s", udid.c_str())
+		} else {
+			std::shared_ptr<MappedFile> image = DiskImageCache::shared().get(imagePath);
+
+			// upload the image
+			{
+				long long imageSize = (long long)image->size;
+				CFNumberRef size = ::CFNumberCreate(kCFAllocatorDefault, kCFNumberLongLongType, &imageSize);
+				const void* keys[] = { CFSTR("Command"), CFSTR("ImageType"), CFSTR("ImageSize"), CFSTR("ImageSignature") };
+				const void* values[] = { CFSTR("ReceiveBytes"), CFSTR("Developer"), size, sigData };
+				request = ::CFDictionaryCreate(kCFAllocatorDefault, keys, values, 4, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+				::CFRelease(size);
+				response = imageMounterRequest(connection, request, buffer);
+				::CFRelease(request);
+				request = NULL;
+
+				if (!hasStatus(response, CFSTR("ReceiveBytesAck"))) {
+					throw std::runtime_error("Image mounter did not accept the developer disk image");
+				}
+				::CFRelease(response);
+				response = NULL;
+
+				LOG_DEBUG_2("ImageMounter::mount", "Uploading %ld byte developer disk image to %s", (long)image->size, udid.c_str())
+				{
+					UsbSlot slot(iface->usbHub, iface->usbInitialCap);
+					uploadImage(connection, *image, *iface->qos);
+					slot.finish(image->size);
+				}
+				result.uploaded = true;
+
+				CFPropertyListRef msg = recvPlist(connection, buffer);
+				if (!msg) {
+					throw std::runtime_error("Image mounter closed the connection");
+				}
+				response = (CFDictionaryRef)msg;
+				if (::CFGetTypeID(msg) != ::CFDictionaryGetTypeID() || !hasStatus(response, CFSTR("Complete"))) {
+					throw std::runtime_error("Failed to upload developer disk image");
+				}
+				::CFRelease(response);
+				response = NULL;
+			}
+
+			// mount the image
+			{
+				const void* keys[] = { CFSTR("Command"), CFSTR("ImageType"), CFSTR("ImagePath"), CFSTR("ImageSignature") };
+				const void* values[] = { CFSTR("MountImage"), CFSTR("Developer"), CFSTR(IMAGE_STAGING_PATH), sigData };
+				request = ::CFDictionaryCreate(kCFAllocatorDefault, keys, values, 4, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+				try {
+					response = imageMounterRequest(connection, request, buffer);
+				} catch (std::runtime_error& e) {
+					// another tool may have mounted an image since we checked, so ask the device
+					// again instead of guessing from the error text
+					LOG_DEBUG_1("ImageMounter::mount", "%s, checking whether an image was mounted", e.what())
+					DeveloperImageMountResult current;
+					try {
+						lookupImage(connection, sigData, buffer, current);
+					} catch (std::exception&) {
+						throw e;
+					}
+					if (!current.alreadyMounted) {
+						throw;
+					}
+					result.alreadyMounted = true;
+					result.differentImage = current.differentImage;
+				}
+				::CFRelease(request);
+				request = NULL;
+
+				if (response) {
+					::CFRelease(response);
+					response = NULL;
+				}
+			}
+
+			LOG_DEBUG_1("ImageMounter::mount", "Mounted developer disk image on %s", udid.c_str())
+		}
+
+		// let the service know we're done
+		{
+			const void* keys[] = { CFSTR("Command") };
+			const void* values[] = { CFSTR("Hangup") };
+			request = ::CFDictionaryCreate(kCFAllocatorDefault, keys, values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+			sendPlist(connection, request, kCFPropertyListXMLFormat_v1_0);
+			::CFRelease(request);
+			request = NULL;
+		}
+	} catch (std::exception& e) {
+		if (request) {
+			::CFRelease(request);
+		}
+		if (response) {
+			::CFRelease(response);
+		}
+		::CFRelease(sigData);
+		::close(connection);
+		throw;
+	}
+
+	::CFRelease(sigData);
+	::close(connection);
+	return result;
+}
+
+}
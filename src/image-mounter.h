@@ -0,0 +1,75 @@
+#ifndef __IMAGE_MOUNTER_H__
+#define __IMAGE_MOUNTER_H__
+
+#include "node-ios-device.h"
+#include "device-interface.h"
+#include "mobiledevice.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * A read-only memory mapped file.
+ */
+class MappedFile {
+public:
+	MappedFile(const std::string& path);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const uint8_t* data;
+	size_t         size;
+	uint64_t       mtime;
+};
+
+/**
+ * Developer disk images and their signatures mapped into memory and shared by every device. A
+ * cached file is remapped if its size or modification time changes.
+ */
+class DiskImageCache {
+public:
+	static DiskImageCache& shared();
+
+	std::shared_ptr<MappedFile> get(const std::string& path);
+
+private:
+	std::mutex lock;
+	std::map<std::string, std::shared_ptr<MappedFile>> files;
+};
+
+/**
+ * The outcome of mounting the developer disk image. `differentImage` is set when the mounted image's
+ * signature doesn't match the requested one, which only iOS 10 and newer report.
+ */
+struct DeveloperImageMountResult {
+	DeveloperImageMountResult() : alreadyMounted(false), differentImage(false), uploaded(false) {}
+	bool alreadyMounted;
+	bool differentImage;
+	bool uploaded;
+};
+
+/**
+ * Mounts the developer disk image using the mobile image mounter service. The device is asked
+ * whether a developer image is already mounted before anything is uploaded.
+ */
+class ImageMounter {
+public:
+	ImageMounter(std::string& udid, std::shared_ptr<DeviceInterface> iface);
+
+	DeveloperImageMountResult mount(const std::string& imagePath, const std::string& sigPath);
+
+private:
+	std::string udid;
+	std::shared_ptr<DeviceInterface> iface;
+};
+
+}
+
+#endif
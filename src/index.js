@@ -3,7 +3,9 @@ const { EventEmitter } = require('events');
 const fs = require('fs');
 const logger = require('snooplogg').default('node-ios-device');
 const nss = {};
+const os = require('os');
 const path = require('path');
+const { createRelayStream, relayFlows } = require('./relay-stream');
 
 /**
  * The `node-ios-device` API and debug log emitter.
@@ -23,37 +25,415 @@ binding.init((ns, msg) => {
 	}
 });
 
+/**
+ * The AFC services that can be walked by `afc.snapshot()`.
+ */
+const afcServices = {
+	crashreports: 'com.apple.crashreportcopymobile',
+	media: 'com.apple.afc'
+};
+
+api.afc = {
+	/**
+	 * Walks a directory tree on the device using several AFC connections in parallel and returns a
+	 * packed snapshot of every file and directory with its size and modified time.
+	 *
+	 * @param {String} udid - The device udid.
+	 * @param {Object} [opts] - Various options.
+	 * @param {String} [opts.bundleId] - Walks the data container of the app with this bundle id
+	 * instead of an AFC service.
+	 * @param {Number} [opts.concurrency=4] - The number of AFC connections to walk the tree with.
+	 * @param {String} [opts.root='/'] - The directory to walk. Paths in the snapshot are relative
+	 * to it.
+	 * @param {String} [opts.service='media'] - The AFC service to walk, either `media` or
+	 * `crashreports`.
+	 * @returns {Buffer}
+	 */
+	snapshot(udid, opts = {}) {
+		if (!udid || typeof udid !== 'string') {
+			throw new TypeError('Expected udid to be a non-empty string');
+		}
+
+		if (!opts || typeof opts !== 'object') {
+			throw new TypeError('Expected options to be an object');
+		}
+
+		if (opts.bundleId !== undefined && (!opts.bundleId || typeof opts.bundleId !== 'string')) {
+			throw new TypeError('Expected bundle id to be a non-empty string');
+		}
+
+		const service = opts.service || 'media';
+		if (!Object.prototype.hasOwnProperty.call(afcServices, service)) {
+			throw new TypeError(`Expected service to be one of: ${Object.keys(afcServices).join(', ')}`);
+		}
+
+		if (opts.root !== undefined && (!opts.root || typeof opts.root !== 'string')) {
+			throw new TypeError('Expected root to be a non-empty string');
+		}
+
+		if (opts.concurrency !== undefined && (!Number.isInteger(opts.concurrency) || opts.concurrency < 1)) {
+			throw new TypeError('Expected concurrency to be a positive integer');
+		}
+
+		return binding.afcSnapshot(udid, afcServices[service], opts.bundleId || '', opts.root || '/', opts.concurrency || 4);
+	},
+
+	/**
+	 * Compares two snapshots of the same tree.
+	 *
+	 * @param {Buffer} from - The older snapshot.
+	 * @param {Buffer} to - The newer snapshot.
+	 * @returns {Object} An object with the `added`, `removed`, and `changed` paths.
+	 */
+	diff(from, to) {
+		if (!Buffer.isBuffer(from) || !Buffer.isBuffer(to)) {
+			throw new TypeError('Expected snapshots to be Buffers');
+		}
+		return binding.afcSnapshotDiff(from, to);
+	},
+
+	/**
+	 * Expands a snapshot into an array of entries sorted by path.
+	 *
+	 * @param {Buffer} snapshot - The snapshot.
+	 * @returns {Array<Object>} The `path`, `isDirectory`, `unreadable`, `size`, and `mtimeMs` of each
+	 * entry.
+	 */
+	entries(snapshot) {
+		if (!Buffer.isBuffer(snapshot)) {
+			throw new TypeError('Expected snapshot to be a Buffer');
+		}
+		return binding.afcSnapshotEntries(snapshot);
+	}
+};
+
+/**
+ * Retrieves the apps installed on the specified device. Results are cached per device until an app
+ * is installed or uninstalled.
+ *
+ * @param {String} udid - The device udid.
+ * @param {Object} [opts] - Various options.
+ * @param {Array<String>} [opts.attributes] - The app attributes to return. Defaults to all
+ * attributes.
+ * @param {Array<String>} [opts.bundleIds] - The bundle ids of the apps to return. Defaults to all
+ * apps.
+ * @param {Function} [opts.onPage] - Called with each page of apps as the device sends it instead
+ * of returning them all at once.
+ * @returns {Array<Object>|undefined} The app info for each installed app, or `undefined` when
+ * `onPage` is set.
+ */
+api.apps = function apps(udid, opts = {}) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	if (!opts || typeof opts !== 'object') {
+		throw new TypeError('Expected options to be an object');
+	}
+
+	for (const name of [ 'attributes', 'bundleIds' ]) {
+		const value = opts[name];
+		if (value !== undefined && (!Array.isArray(value) || value.some(s => !s || typeof s !== 'string'))) {
+			throw new TypeError(`Expected ${name} to be an array of strings`);
+		}
+	}
+
+	if (opts.onPage !== undefined && typeof opts.onPage !== 'function') {
+		throw new TypeError('Expected onPage to be a function');
+	}
+
+	return binding.apps(udid, opts.attributes || [], opts.bundleIds || [], opts.onPage);
+};
+
+/**
+ * Retrieves diagnostic values such as the battery level, free disk space, and thermal state from
+ * the specified device. Every key that isn't cached is fetched in a single session.
+ *
+ * A key is a lockdown value (e.g. `DeviceName`), a value in a lockdown domain (e.g.
+ * `com.apple.disk_usage:TotalDiskCapacity`), a whole lockdown domain (e.g.
+ * `com.apple.mobile.battery:`), or an IORegistry entry class (e.g. `IORegistry:IOPMPowerSource`).
+ *
+ * @param {String} udid - The device udid.
+ * @param {Array<String>} keys - The keys to retrieve.
+ * @param {Object} [opts] - Various options.
+ * @param {Number|Object} [opts.ttl=0] - How long in milliseconds to cache values, or an object
+ * mapping keys to how long to cache them with an optional `default`.
+ * @returns {Object} An object with the value of each key, or `null` if the device doesn't have it.
+ */
+api.diagnostics = function diagnostics(udid, keys, opts = {}) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	keys = validateDiagnosticsKeys(keys);
+	return binding.diagnostics(udid, keys, resolveTtls(keys, opts.ttl));
+};
+
+/**
+ * Retrieves diagnostic values from every connected device in parallel. See `diagnostics()`.
+ *
+ * @param {Array<String>} keys - The keys to retrieve.
+ * @param {Object} [opts] - Various options.
+ * @param {Number} [opts.concurrency=4] - The number of devices to query at a time.
+ * @param {Number|Object} [opts.ttl=0] - How long in milliseconds to cache values, or an object
+ * mapping keys to how long to cache them with an optional `default`.
+ * @returns {Array<Object>} The result for each device with the `udid`, and the `values` or the
+ * `error` if the device couldn't be queried.
+ */
+api.diagnosticsAll = function diagnosticsAll(keys, opts = {}) {
+	keys = validateDiagnosticsKeys(keys);
+
+	const concurrency = opts.concurrency === undefined ? 4 : opts.concurrency;
+	if (typeof concurrency !== 'number' || !Number.isInteger(concurrency) || concurrency < 1) {
+		throw new TypeError('Expected concurrency to be a positive integer');
+	}
+
+	return binding.diagnosticsAll(keys, resolveTtls(keys, opts.ttl), concurrency);
+};
+
+/**
+ * Makes sure the diagnostic keys are a non-empty array of strings and removes duplicates.
+ *
+ * @param {Array<String>} keys - The keys to retrieve.
+ * @returns {Array<String>}
+ */
+function validateDiagnosticsKeys(keys) {
+	if (!Array.isArray(keys) || !keys.length || keys.some(key => !key || typeof key !== 'string')) {
+		throw new TypeError('Expected keys to be a non-empty array of strings');
+	}
+	return Array.from(new Set(keys));
+}
+
+/**
+ * Resolves the TTL in milliseconds of each diagnostic key.
+ *
+ * @param {Array<String>} keys - The keys to retrieve.
+ * @param {Number|Object} [ttl] - The TTL for every key, or an object mapping keys to TTLs with an
+ * optional `default`.
+ * @returns {Array<Number>}
+ */
+function resolveTtls(keys, ttl) {
+	if (ttl === undefined || ttl === null) {
+		return keys.map(() => 0);
+	}
+	if (typeof ttl === 'number') {
+		return keys.map(() => Math.max(ttl, 0));
+	}
+	if (typeof ttl !== 'object') {
+		throw new TypeError('Expected ttl to be a number or an object');
+	}
+	return keys.map(key => {
+		const value = Object.prototype.hasOwnProperty.call(ttl, key) ? ttl[key] : ttl.default;
+		return typeof value === 'number' ? Math.max(value, 0) : 0;
+	});
+}
+
+/**
+ * Retrieves diagnostic sources such as `CrashReporter`, `Network`, or `SystemConfiguration` using
+ * the file relay service. The archive is decompressed and unpacked as it's received, so memory use
+ * doesn't depend on the size of the archive.
+ *
+ * @param {String} udid - The device udid.
+ * @param {Array<String>} sources - The names of the sources to retrieve.
+ * @param {String|Function} dest - The directory to write the files to, or a function that is
+ * called with the entry and each chunk of its contents. The chunk is `null` once the entry has
+ * been fully read.
+ * @returns {Object} An object with the number of `entries` and `bytes` extracted.
+ */
+api.fileRelay = function fileRelay(udid, sources, dest) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	if (!Array.isArray(sources) || !sources.length || sources.some(source => !source || typeof source !== 'string')) {
+		throw new TypeError('Expected sources to be a non-empty array of strings');
+	}
+
+	if (typeof dest === 'string' && dest) {
+		dest = path.resolve(dest);
+	} else if (typeof dest !== 'function') {
+		throw new TypeError('Expected destination to be a directory or a function');
+	}
+
+	return binding.fileRelay(udid, sources, dest);
+};
+
+/**
+ * Validates the stream options of a relay.
+ *
+ * @param {Object} opts - The stream options.
+ */
+function validateStreamOptions(opts) {
+	if (!opts || typeof opts !== 'object') {
+		throw new TypeError('Expected options to be an object');
+	}
+
+	if (opts.highWaterMark !== undefined && (!Number.isInteger(opts.highWaterMark) || opts.highWaterMark < 1)) {
+		throw new TypeError('Expected highWaterMark to be a positive integer');
+	}
+}
+
+/**
+ * Validates the udid and forward options and returns the traffic class.
+ *
+ * @param {String} udid - The device udid.
+ * @param {Object} opts - The forward options.
+ * @returns {Number}
+ */
+function resolveQosClass(udid, opts) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	if (!opts || typeof opts !== 'object') {
+		throw new TypeError('Expected options to be an object');
+	}
+
+	const qosClass = qosClasses.indexOf(opts.qos || 'interactive');
+	if (qosClass === -1) {
+		throw new TypeError('Expected qos to be "interactive", "streaming", or "bulk"');
+	}
+
+	return qosClass;
+}
+
 /**
  * Relays syslog messages.
  *
  * @param {String} udid - The device udid to install the app to.
  * @param {Number} port - The port number to connect to and forward messages from.
+ * @param {Object} [opts] - Various options.
+ * @param {Boolean} [opts.batch=false] - When `true`, a `batch` event is emitted with all lines that
+ * have arrived along with their sequence numbers and receive times instead of a `data` event per
+ * line.
+ * @param {String} [opts.qos='interactive'] - The traffic class the relayed data counts against,
+ * either `'interactive'`, `'streaming'`, or `'bulk'`.
  * @returns {Promise<EventEmitter>} Resolves a handle to wire up listeners and stop watching.
  * @emits {data} Emits a buffer containing syslog messages.
+ * @emits {batch} Emits an array of lines and an object of `Float64Array`s with each line's `seq`,
+ * `monotonic`, and `time`.
  * @emits {end} Emits when the device has been disconnected.
  */
-api.forward = function forward(udid, port) {
-	if (!udid || typeof udid !== 'string') {
-		throw new TypeError('Expected udid to be a non-empty string');
-	}
-
+api.forward = function forward(udid, port, opts = {}) {
+	const qosClass = resolveQosClass(udid, opts);
 	const handle = new EventEmitter();
 	const emit = handle.emit.bind(handle);
 	port = ~~port;
 
 	handle.stop = () => binding.stopForward(udid, port, emit);
-	binding.startForward(udid, port, emit);
+	binding.startForward(udid, port, emit, qosClass, opts.batch ? relayFlows.batch : relayFlows.push);
 
 	return handle;
 };
 
+/**
+ * Relays messages from a port on the device as a `Readable` stream. Lines are only read from the
+ * device as fast as the stream is consumed.
+ *
+ * @param {String} udid - The device udid.
+ * @param {Number} port - The port number to connect to and forward messages from.
+ * @param {Object} [opts] - Various options.
+ * @param {Number} [opts.highWaterMark] - The number of lines, or bytes when `objectMode` is
+ * `false`, to buffer before the stream stops pulling.
+ * @param {Boolean} [opts.objectMode=true] - When `true`, each chunk is a line. When `false`, the
+ * stream is a byte stream with each line terminated by a newline. Empty lines are dropped and every
+ * line break becomes a single newline.
+ * @param {String} [opts.qos='interactive'] - The traffic class the relayed data counts against,
+ * either `'interactive'`, `'streaming'`, or `'bulk'`.
+ * @returns {Readable}
+ */
+api.forwardStream = function forwardStream(udid, port, opts = {}) {
+	const qosClass = resolveQosClass(udid, opts);
+	validateStreamOptions(opts);
+	port = ~~port;
+
+	return createRelayStream(
+		opts,
+		(listener, flow) => binding.startForward(udid, port, listener, qosClass, flow),
+		(listener, size) => binding.pullForward(udid, port, listener, size),
+		listener => binding.stopForward(udid, port, listener)
+	);
+};
+
 /**
  * Installs an iOS app on the specified device.
  *
  * @param {String} udid - The device udid to install the app to.
  * @param {String} appPath - The path to iOS .app directory to install.
+ * @param {Object} [opts] - Various options.
+ * @param {Boolean} [opts.skipIfUnchanged=false] - When `true`, the install is skipped if the
+ * identical build was previously installed and is still installed.
+ * @param {String} [opts.recordDir] - The directory to store the per-device install records in.
+ * Defaults to `~/.node-ios-device/installs`.
+ * @returns {Object} An object with a `skipped` flag.
+ */
+api.install = function install(udid, appPath, opts = {}) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	if (!appPath || typeof appPath !== 'string') {
+		throw new TypeError('Expected app path to be a non-empty string');
+	}
+
+	appPath = resolveAppPath(appPath);
+	const recordDir = resolveRecordDir(opts);
+	return binding.install(udid, appPath, !!opts.skipIfUnchanged, recordDir);
+};
+
+/**
+ * Installs several iOS apps on the specified device over a single session. Each app is copied to
+ * the device's staging directory over AFC and installed from there by the installation proxy, and
+ * the next app is copied while the current app is being installed.
+ *
+ * @param {String} udid - The device udid to install the apps to.
+ * @param {Array<String>} appPaths - The paths to the iOS .app directories to install, in the order
+ * they should be installed.
+ * @param {Object} [opts] - Various options.
+ * @param {Boolean} [opts.skipIfUnchanged=false] - When `true`, an app is skipped if the identical
+ * build was previously installed and is still installed.
+ * @param {String} [opts.recordDir] - The directory to store the per-device install records in.
+ * Defaults to `~/.node-ios-device/installs`.
+ * @returns {Array<Object>} The result for each app with the `appPath`, a `skipped` flag, and the
+ * `error` if the app failed to install.
+ */
+api.installAll = function installAll(udid, appPaths, opts = {}) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	if (!Array.isArray(appPaths) || !appPaths.length || appPaths.some(p => !p || typeof p !== 'string')) {
+		throw new TypeError('Expected app paths to be a non-empty array of strings');
+	}
+
+	appPaths = appPaths.map(resolveAppPath);
+	const recordDir = resolveRecordDir(opts);
+	return binding.installAll(udid, appPaths, !!opts.skipIfUnchanged, recordDir);
+};
+
+/**
+ * Installs an iOS app on the specified device in the background. Installs on the same device run
+ * one at a time and installs on different devices run in parallel. Requesting the same build for
+ * the same device while a previous request for it is still queued or installing doesn't install it
+ * again. The request shares the pending install's result instead.
+ *
+ * @param {String} udid - The device udid to install the app to.
+ * @param {String} appPath - The path to iOS .app directory to install.
+ * @param {Object} [opts] - Various options.
+ * @param {Function} [opts.onProgress] - Called with the progress of the transfer and install
+ * phases. See the README for the event properties.
+ * @param {Number} [opts.progressInterval=250] - The minimum number of milliseconds between progress
+ * events within a phase. Phase changes and status changes are always reported.
+ * @param {AbortSignal} [opts.signal] - Aborts the request. The install itself is only aborted once
+ * every request for it has been aborted, and a running transfer or install is abandoned.
+ * @param {Boolean} [opts.skipIfUnchanged=false] - When `true`, the install is skipped if the
+ * identical build was previously installed and is still installed.
+ * @param {String} [opts.recordDir] - The directory to store the per-device install records in.
+ * Defaults to `~/.node-ios-device/installs`.
+ * @returns {Promise<Object>} Resolves an object with a `skipped` flag and a `deduped` flag that is
+ * `true` if the request was merged into a pending install.
  */
-api.install = function install(udid, appPath) {
+api.queueInstall = function queueInstall(udid, appPath, opts = {}) {
 	if (!udid || typeof udid !== 'string') {
 		throw new TypeError('Expected udid to be a non-empty string');
 	}
@@ -62,6 +442,53 @@ api.install = function install(udid, appPath) {
 		throw new TypeError('Expected app path to be a non-empty string');
 	}
 
+	const { onProgress, progressInterval, signal } = opts || {};
+	if (signal !== undefined && (!signal || typeof signal.addEventListener !== 'function')) {
+		throw new TypeError('Expected signal to be an AbortSignal');
+	}
+
+	if (onProgress !== undefined && typeof onProgress !== 'function') {
+		throw new TypeError('Expected progress callback to be a function');
+	}
+
+	if (progressInterval !== undefined && (!Number.isInteger(progressInterval) || progressInterval < 0)) {
+		throw new TypeError('Expected progress interval to be a non-negative integer');
+	}
+
+	appPath = resolveAppPath(appPath);
+	const recordDir = resolveRecordDir(opts);
+
+	if (signal && signal.aborted) {
+		const err = new Error('The install was aborted');
+		err.code = 'ABORT_ERR';
+		err.name = 'AbortError';
+		return Promise.reject(err);
+	}
+
+	const { id, promise } = binding.installQueueAdd(udid, appPath, !!opts.skipIfUnchanged, recordDir, onProgress, progressInterval === undefined ? 250 : progressInterval);
+	if (!signal) {
+		return promise;
+	}
+
+	const onAbort = () => binding.installQueueCancel(id);
+	signal.addEventListener('abort', onAbort, { once: true });
+	const cleanup = () => signal.removeEventListener('abort', onAbort);
+	return promise.then(result => {
+		cleanup();
+		return result;
+	}, err => {
+		cleanup();
+		throw err;
+	});
+};
+
+/**
+ * Resolves an app path and makes sure it's an iOS .app directory.
+ *
+ * @param {String} appPath - The path to the iOS .app directory.
+ * @returns {String}
+ */
+function resolveAppPath(appPath) {
 	appPath = path.resolve(appPath);
 
 	try {
@@ -78,8 +505,26 @@ api.install = function install(udid, appPath) {
 		throw new Error(`Invalid app: ${appPath}`);
 	}
 
-	binding.install(udid, appPath);
-};
+	return appPath;
+}
+
+/**
+ * Validates the install options and resolves the install record directory.
+ *
+ * @param {Object} opts - The install options.
+ * @returns {String}
+ */
+function resolveRecordDir(opts) {
+	if (!opts || typeof opts !== 'object') {
+		throw new TypeError('Expected options to be an object');
+	}
+
+	if (opts.recordDir !== undefined && (!opts.recordDir || typeof opts.recordDir !== 'string')) {
+		throw new TypeError('Expected record directory to be a non-empty string');
+	}
+
+	return path.resolve(opts.recordDir || path.join(os.homedir(), '.node-ios-device', 'installs'));
+}
 
 /**
  * Returns a list of all connected iOS devices.
@@ -88,28 +533,523 @@ api.install = function install(udid, appPath) {
  */
 api.list = binding.list;
 
+/**
+ * Creates a native lockdown client. This talks the lockdown protocol directly instead of going
+ * through MobileDevice. TLS sessions are cached per device and service so that only the first
+ * handshake with each is a full handshake.
+ *
+ * @param {Object} opts - Various options.
+ * @param {String} opts.udid - The device udid.
+ * @param {String|Buffer} [opts.pairRecord] - The path to or contents of the device's pair record.
+ * When omitted, the record is read from `pairRecordDir` and cached until it changes on disk.
+ * @param {String} [opts.pairRecordDir] - The directory containing the pair records. Defaults to
+ * `/var/db/lockdown` on macOS and `/var/lib/lockdown` elsewhere.
+ * @param {String} [opts.host] - The host to connect to over TCP. When omitted, the connection is
+ * made through usbmuxd.
+ * @param {Number} [opts.port=62078] - The lockdown port when connecting over TCP.
+ * @param {Number} [opts.deviceId] - The usbmuxd device id when connecting through usbmuxd.
+ * @param {String} [opts.socketPath='/var/run/usbmuxd'] - The path to the usbmuxd socket.
+ * @returns {Object} The client with `getValue()`, `startService()`, and `close()` methods.
+ */
+api.lockdown = function lockdown(opts = {}) {
+	if (!opts || typeof opts !== 'object') {
+		throw new TypeError('Expected options to be an object');
+	}
+
+	if (!opts.udid || typeof opts.udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	let { pairRecord } = opts;
+	if (typeof pairRecord === 'string' && pairRecord) {
+		pairRecord = fs.readFileSync(pairRecord);
+	}
+	if (pairRecord !== undefined && !Buffer.isBuffer(pairRecord)) {
+		throw new TypeError('Expected pair record to be a path or Buffer');
+	}
+
+	if (opts.pairRecordDir !== undefined && (!opts.pairRecordDir || typeof opts.pairRecordDir !== 'string')) {
+		throw new TypeError('Expected pair record directory to be a non-empty string');
+	}
+
+	if (opts.host !== undefined && (!opts.host || typeof opts.host !== 'string')) {
+		throw new TypeError('Expected host to be a non-empty string');
+	}
+
+	if (opts.host === undefined && (!Number.isInteger(opts.deviceId) || opts.deviceId < 0)) {
+		throw new TypeError('Expected device id to be a non-negative integer');
+	}
+
+	const pairRecordDir = opts.pairRecordDir && path.resolve(opts.pairRecordDir);
+	const handle = binding.lockdownConnect(opts.udid, pairRecord, opts.host, opts.port === undefined ? 62078 : ~~opts.port, opts.deviceId, opts.socketPath, pairRecordDir);
+
+	return {
+		/**
+		 * Retrieves a value from lockdown. Omit the key to get every value in the domain.
+		 *
+		 * @param {String} [domain] - The domain such as `com.apple.disk_usage`.
+		 * @param {String} [key] - The key such as `ProductVersion`.
+		 * @returns {*}
+		 */
+		getValue(domain, key) {
+			return binding.lockdownGetValue(handle, domain, key);
+		},
+
+		/**
+		 * Starts a service and connects to it, starting a session first if needed.
+		 *
+		 * @param {String} name - The service name.
+		 * @returns {Object} The service `port`, whether it uses `ssl`, and whether the TLS
+		 * session was `resumed`.
+		 */
+		startService(name) {
+			if (!name || typeof name !== 'string') {
+				throw new TypeError('Expected service name to be a non-empty string');
+			}
+			return binding.lockdownStartService(handle, name);
+		},
+
+		/**
+		 * Stops the session and disconnects.
+		 */
+		close() {
+			binding.lockdownClose(handle);
+		}
+	};
+};
+
+/**
+ * Mounts the developer disk image on the specified device unless a developer disk image is already
+ * mounted. The image and signature are mapped into memory once and shared by every device.
+ *
+ * @param {String} udid - The device udid.
+ * @param {String} imagePath - The path to the `DeveloperDiskImage.dmg`.
+ * @param {String} [sigPath] - The path to the image's signature. Defaults to the image path with a
+ * `.signature` extension.
+ * @returns {Object} An object with `alreadyMounted`, `differentImage`, and `uploaded` flags.
+ */
+api.mountDeveloperImage = function mountDeveloperImage(udid, imagePath, sigPath) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	if (!imagePath || typeof imagePath !== 'string') {
+		throw new TypeError('Expected image path to be a non-empty string');
+	}
+
+	if (sigPath !== undefined && (!sigPath || typeof sigPath !== 'string')) {
+		throw new TypeError('Expected signature path to be a non-empty string');
+	}
+
+	imagePath = path.resolve(imagePath);
+	sigPath = path.resolve(sigPath || `${imagePath}.signature`);
+
+	return binding.mountDeveloperImage(udid, imagePath, sigPath);
+};
+
+/**
+ * Observes device notifications such as app installs and uninstalls. All observers for a device
+ * share a single notification proxy connection.
+ *
+ * @param {String} udid - The device udid to observe.
+ * @param {Array<String>} names - The notification names to observe (e.g.
+ * `com.apple.mobile.application_installed`).
+ * @returns {EventEmitter} The handle to wire up listeners and stop observing.
+ * @emits {notification} Emits the name of the notification that was posted.
+ * @emits {end} Emits when the device has been disconnected.
+ */
+api.observe = function observe(udid, names) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	if (!Array.isArray(names) || !names.length || names.some(name => !name || typeof name !== 'string')) {
+		throw new TypeError('Expected notification names to be a non-empty array of strings');
+	}
+
+	const handle = new EventEmitter();
+	const wanted = new Set(names);
+	const listener = (evt, msg) => {
+		if (evt === 'data') {
+			if (msg && msg.Command === 'RelayNotification' && wanted.has(msg.Name)) {
+				handle.emit('notification', msg.Name);
+			}
+		} else {
+			handle.emit(evt, msg);
+		}
+	};
+
+	handle.stop = () => binding.stopObserve(udid, listener);
+	binding.startObserve(udid, listener, names);
+
+	return handle;
+};
+
+/**
+ * Native binary and XML property list codec.
+ */
+api.plist = {
+	/**
+	 * Parses a binary or XML plist. Dates are returned as `Date` objects, data as Buffers, and
+	 * keyed archiver UIDs as `{ CF$UID: n }` objects.
+	 *
+	 * @param {Buffer|String} data - The plist to parse.
+	 * @returns {*}
+	 */
+	parse(data) {
+		if (!Buffer.isBuffer(data) && typeof data !== 'string') {
+			throw new TypeError('Expected plist data to be a Buffer or string');
+		}
+		return binding.plistParse(data);
+	},
+
+	/**
+	 * Serializes a value as a plist. `null` and `undefined` values are omitted from objects and
+	 * arrays.
+	 *
+	 * @param {*} value - The value to serialize.
+	 * @param {Object} [opts] - Various options.
+	 * @param {String} [opts.format='binary'] - The plist format, either `binary` or `xml`.
+	 * @returns {Buffer}
+	 */
+	encode(value, opts = {}) {
+		if (value === null || value === undefined) {
+			throw new TypeError('Expected value to not be null or undefined');
+		}
+
+		const format = opts.format || 'binary';
+		if (format !== 'binary' && format !== 'xml') {
+			throw new TypeError('Expected format to be "binary" or "xml"');
+		}
+
+		return binding.plistEncode(value, format === 'xml');
+	}
+};
+
+/**
+ * The traffic classes in the order of the native `QosClass` enum.
+ */
+const qosClasses = [ 'interactive', 'streaming', 'bulk' ];
+
+/**
+ * Shapes the traffic of the device's USB and Wi-Fi links. Interactive traffic such as port
+ * forwarding and Web Inspector messages is never delayed, streaming traffic such as syslog is held
+ * to its own rate, and bulk transfers such as AFC copies, developer disk image uploads, and file
+ * relay archives only get the link bandwidth the other classes leave over.
+ *
+ * @param {String} udid - The device udid.
+ * @param {Object} rates - The rates in bytes per second. A rate of `0` is unlimited.
+ * @param {Number} [rates.linkRate=0] - The total rate of the link shared by all classes.
+ * @param {Number} [rates.streamingRate=0] - The rate of streaming traffic.
+ * @param {Number} [rates.bulkRate=0] - The rate of bulk transfers.
+ */
+api.qos = function qos(udid, rates = {}) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	if (!rates || typeof rates !== 'object') {
+		throw new TypeError('Expected rates to be an object');
+	}
+
+	for (const name of [ 'linkRate', 'streamingRate', 'bulkRate' ]) {
+		const rate = rates[name];
+		if (rate !== undefined && (typeof rate !== 'number' || !Number.isFinite(rate) || rate < 0)) {
+			throw new TypeError(`Expected ${name} to be a non-negative number`);
+		}
+	}
+
+	binding.qos(udid, Math.floor(rates.linkRate || 0), Math.floor(rates.streamingRate || 0), Math.floor(rates.bulkRate || 0));
+};
+
+/**
+ * Sets how long device operations may take before they are abandoned. An operation that runs past
+ * its timeout closes the device's session and fails with an `ETIMEDOUT` error code. The next
+ * operation reconnects to the device, while relays still using the old connection fail with an
+ * `EBUSY` error code if they reconnect. The timeouts apply to every device and don't cover the
+ * usbmux connection of `lockdown()`.
+ *
+ * @param {Object} [timeouts] - The timeouts in milliseconds to change. A timeout of `0` disables it.
+ * @param {Number} [timeouts.connect] - Connecting, pairing, and starting a session.
+ * @param {Number} [timeouts.startService] - Starting a service.
+ * @param {Number} [timeouts.install] - Each transfer and each install of an app.
+ * @returns {Object} The timeouts in effect.
+ */
+api.timeouts = function timeouts(timeouts = {}) {
+	if (!timeouts || typeof timeouts !== 'object') {
+		throw new TypeError('Expected timeouts to be an object');
+	}
+
+	for (const name of [ 'connect', 'startService', 'install' ]) {
+		const timeout = timeouts[name];
+		if (timeout !== undefined && (typeof timeout !== 'number' || !Number.isFinite(timeout) || timeout < 0)) {
+			throw new TypeError(`Expected ${name} to be a non-negative number`);
+		}
+	}
+
+	const ms = timeout => timeout === undefined ? undefined : Math.floor(timeout);
+	return binding.timeouts(ms(timeouts.connect), ms(timeouts.startService), ms(timeouts.install));
+};
+
+/**
+ * Relays messages to and from the Web Inspector service on the device. Messages are encoded and
+ * decoded natively.
+ *
+ * @param {String} udid - The device udid to connect to.
+ * @returns {EventEmitter} The handle to wire up listeners, send messages, and disconnect.
+ * @emits {message} Emits each decoded message object.
+ * @emits {end} Emits when the device has been disconnected.
+ */
+api.webinspector = function webinspector(udid) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	const handle = new EventEmitter();
+	const listener = (evt, msg) => handle.emit(evt === 'data' ? 'message' : evt, msg);
+
+	handle.send = msg => {
+		if (!msg || typeof msg !== 'object' || Array.isArray(msg)) {
+			throw new TypeError('Expected message to be an object');
+		}
+		binding.sendWebInspector(udid, msg);
+	};
+	handle.stop = () => binding.stopWebInspector(udid, listener);
+	binding.startWebInspector(udid, listener);
+
+	return handle;
+};
+
+/**
+ * Streams screenshots from the device using a single screenshot service connection.
+ *
+ * @param {String} udid - The device udid to capture screenshots from.
+ * @param {Object} [opts] - Various options.
+ * @param {Boolean} [opts.dedup=false] - When `true`, frames identical to the previous frame are
+ * skipped.
+ * @param {Number} [opts.fps=1] - The number of frames to capture per second.
+ * @returns {EventEmitter} The handle to wire up listeners and stop capturing.
+ * @emits {data} Emits a buffer containing the image data.
+ * @emits {end} Emits when the device has been disconnected.
+ */
+api.screenshots = function screenshots(udid, opts = {}) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	if (!opts || typeof opts !== 'object') {
+		throw new TypeError('Expected options to be an object');
+	}
+
+	if (opts.fps !== undefined && (typeof opts.fps !== 'number' || opts.fps <= 0 || opts.fps > 60)) {
+		throw new TypeError('Expected fps to be a number greater than 0 and less than or equal to 60');
+	}
+
+	const handle = new EventEmitter();
+	const emit = handle.emit.bind(handle);
+
+	handle.stop = () => binding.stopScreenshots(udid, emit);
+	binding.startScreenshots(udid, emit, opts.fps, !!opts.dedup);
+
+	return handle;
+};
+
+/**
+ * Copies the files that differ between an app's data container (`Documents`, `Library`, and `tmp`)
+ * and a local directory. Only files whose size or modified time differ are transferred, using
+ * several connections in parallel.
+ *
+ * @param {String} udid - The device udid.
+ * @param {String} bundleId - The bundle id of the app.
+ * @param {String} localDir - The local directory to sync with.
+ * @param {Object} [opts] - Various options.
+ * @param {Number} [opts.concurrency=4] - The number of files to copy in parallel.
+ * @param {String} [opts.direction='pull'] - Either `'pull'` to copy from the device or `'push'` to
+ * copy to the device.
+ * @returns {Object} An object containing the `copied` paths and the number of `skipped` files.
+ */
+api.syncContainer = function syncContainer(udid, bundleId, localDir, opts = {}) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	if (!bundleId || typeof bundleId !== 'string') {
+		throw new TypeError('Expected bundle id to be a non-empty string');
+	}
+
+	if (!localDir || typeof localDir !== 'string') {
+		throw new TypeError('Expected local directory to be a non-empty string');
+	}
+
+	if (!opts || typeof opts !== 'object') {
+		throw new TypeError('Expected options to be an object');
+	}
+
+	const direction = opts.direction || 'pull';
+	if (direction !== 'pull' && direction !== 'push') {
+		throw new TypeError('Expected direction to be "pull" or "push"');
+	}
+
+	if (opts.concurrency !== undefined && (!Number.isInteger(opts.concurrency) || opts.concurrency < 1)) {
+		throw new TypeError('Expected concurrency to be a positive integer');
+	}
+
+	return binding.syncContainer(udid, bundleId, path.resolve(localDir), direction === 'push', opts.concurrency || 4);
+};
+
+/**
+ * Copies new and changed crash reports from the device into the specified directory. A manifest of
+ * previously copied crash reports is kept in the destination directory so that subsequent syncs
+ * only transfer what has changed.
+ *
+ * @param {String} udid - The device udid to copy the crash reports from.
+ * @param {String} destDir - The directory to copy the crash reports into.
+ * @param {Object} [opts] - Various options.
+ * @param {Number} [opts.concurrency=4] - The number of files to copy in parallel.
+ * @param {Boolean} [opts.remove=false] - When `true`, crash reports are deleted from the device
+ * after they have been copied.
+ * @returns {Object} An object containing the `copied` and `removed` paths and the number of
+ * `skipped` crash reports.
+ */
+api.syncCrashReports = function syncCrashReports(udid, destDir, opts = {}) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	if (!destDir || typeof destDir !== 'string') {
+		throw new TypeError('Expected destination directory to be a non-empty string');
+	}
+
+	if (!opts || typeof opts !== 'object') {
+		throw new TypeError('Expected options to be an object');
+	}
+
+	if (opts.concurrency !== undefined && (!Number.isInteger(opts.concurrency) || opts.concurrency < 1)) {
+		throw new TypeError('Expected concurrency to be a positive integer');
+	}
+
+	return binding.syncCrashReports(udid, path.resolve(destDir), !!opts.remove, opts.concurrency || 4);
+};
+
 /**
  * Relays syslog messages.
  *
  * @param {String} udid - The device udid to install the app to.
+ * @param {Object} [opts] - Various options.
+ * @param {Boolean} [opts.batch=false] - When `true`, a `batch` event is emitted with all lines that
+ * have arrived along with their sequence numbers and receive times instead of a `data` event per
+ * line.
  * @returns {Promise<EventEmitter>} Resolves a handle to wire up listeners and stop watching.
  * @emits {data} Emits a buffer containing syslog messages.
+ * @emits {batch} Emits an array of lines and an object of `Float64Array`s with each line's `seq`,
+ * `monotonic`, and `time`.
  * @emits {end} Emits when the device has been disconnected.
  */
-api.syslog = function syslog(udid) {
+api.syslog = function syslog(udid, opts = {}) {
 	if (!udid || typeof udid !== 'string') {
 		throw new TypeError('Expected udid to be a non-empty string');
 	}
 
+	if (!opts || typeof opts !== 'object') {
+		throw new TypeError('Expected options to be an object');
+	}
+
 	const handle = new EventEmitter();
 	const emit = handle.emit.bind(handle);
 
 	handle.stop = () => binding.stopSyslog(udid, emit);
-	binding.startSyslog(udid, emit);
+	binding.startSyslog(udid, emit, opts.batch ? relayFlows.batch : relayFlows.push);
 
 	return handle;
 };
 
+/**
+ * The syslog rate limit keys in the order of the native `SyslogLimitKey` enum.
+ */
+const syslogLimitKeys = [ 'process', 'sender' ];
+
+/**
+ * Rate limits the device's syslog relay per process so that a daemon flooding the syslog doesn't
+ * drown out the lines you care about. Lines over the limit are dropped natively and a summary line
+ * is periodically relayed in their place. The limits apply to every syslog listener of the device.
+ *
+ * @param {String} udid - The device udid.
+ * @param {Object} [opts] - Various options.
+ * @param {Number} [opts.rate=0] - The number of lines per second each process may log. A rate of
+ * `0` is unlimited.
+ * @param {Object} [opts.limits] - The rates of specific processes, keyed by name, that override
+ * `rate`.
+ * @param {String} [opts.key='process'] - What lines are limited by, either `'process'` for the
+ * process name or `'sender'` for the process name and the library that logged the line.
+ * @param {Number} [opts.sample=0] - When set, one in every `sample` lines over the limit is relayed
+ * anyway.
+ * @param {Number} [opts.summaryInterval=5000] - The number of milliseconds between summaries of the
+ * suppressed lines.
+ */
+api.syslogLimits = function syslogLimits(udid, opts = {}) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	if (!opts || typeof opts !== 'object') {
+		throw new TypeError('Expected options to be an object');
+	}
+
+	const isRate = value => Number.isInteger(value) && value >= 0;
+
+	if (opts.rate !== undefined && !isRate(opts.rate)) {
+		throw new TypeError('Expected rate to be a non-negative integer');
+	}
+
+	const limits = opts.limits || {};
+	if (typeof limits !== 'object' || Object.values(limits).some(rate => !isRate(rate))) {
+		throw new TypeError('Expected limits to be an object of non-negative integer rates');
+	}
+
+	const key = syslogLimitKeys.indexOf(opts.key || 'process');
+	if (key === -1) {
+		throw new TypeError('Expected key to be "process" or "sender"');
+	}
+
+	if (opts.sample !== undefined && !isRate(opts.sample)) {
+		throw new TypeError('Expected sample to be a non-negative integer');
+	}
+
+	if (opts.summaryInterval !== undefined && (!Number.isInteger(opts.summaryInterval) || opts.summaryInterval < 1)) {
+		throw new TypeError('Expected summaryInterval to be a positive integer');
+	}
+
+	binding.syslogLimits(udid, opts.rate || 0, Object.keys(limits), Object.values(limits), key, opts.sample || 0, opts.summaryInterval || 5000);
+};
+
+/**
+ * Relays the syslog as a `Readable` stream. Lines are only read from the device as fast as the
+ * stream is consumed.
+ *
+ * @param {String} udid - The device udid.
+ * @param {Object} [opts] - Various options.
+ * @param {Number} [opts.highWaterMark] - The number of lines, or bytes when `objectMode` is
+ * `false`, to buffer before the stream stops pulling.
+ * @param {Boolean} [opts.objectMode=true] - When `true`, each chunk is a line. When `false`, the
+ * stream is a byte stream with each line terminated by a newline. Empty lines are dropped and every
+ * line break becomes a single newline.
+ * @returns {Readable}
+ */
+api.syslogStream = function syslogStream(udid, opts = {}) {
+	if (!udid || typeof udid !== 'string') {
+		throw new TypeError('Expected udid to be a non-empty string');
+	}
+
+	validateStreamOptions(opts);
+
+	return createRelayStream(
+		opts,
+		(listener, flow) => binding.startSyslog(udid, listener, flow),
+		(listener, size) => binding.pullSyslog(udid, listener, size),
+		listener => binding.stopSyslog(udid, listener)
+	);
+};
+
 /**
  * Watches a key for changes to subkeys and values.
  *
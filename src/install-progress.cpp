@@ -0,0 +1,168 @@
+#include "install-progress.h"
+#include "service.h"
+#include <algorithm>
+
+namespace node_ios_device {
+
+/**
+ * The reporter of the phase running on the current thread.
+ */
+static thread_local InstallProgress* currentProgress = NULL;
+
+/**
+ * Receives the status dictionaries from `AMDeviceSecureTransferPath()` and
+ * `AMDeviceSecureInstallApplication()`. Returns an error once the phase has been stopped so that
+ * MobileDevice stops it before the next chunk.
+ */
+static mach_error_t progressCallback(CFDictionaryRef status, int arg) {
+	if (!currentProgress) {
+		return MDERR_OK;
+	}
+	if (status && ::CFGetTypeID(status) == ::CFDictionaryGetTypeID()) {
+		currentProgress->update(status);
+	}
+	return currentProgress->isStopped() ? INSTALL_PROGRESS_STOPPED : MDERR_OK;
+}
+
+InstallProgress::InstallProgress(const std::string& appPath, uint64_t totalBytes, const InstallProgressOptions& options) :
+	options(options),
+	lastBytes(0),
+	shapedBytes(0) {
+	event.appPath = appPath;
+	event.totalBytes = totalBytes;
+}
+
+/**
+ * Returns the callback to pass to MobileDevice.
+ */
+void* InstallProgress::callback() {
+	return (void*)&progressCallback;
+}
+
+/**
+ * Resets the progress for a new phase and emits its first event.
+ */
+void InstallProgress::begin(const char* phase) {
+	std::lock_guard<std::mutex> guard(lock);
+	start = std::chrono::steady_clock::now();
+	event.phase = phase;
+	event.status.clear();
+	event.percent = 0;
+	event.bytes = 0;
+	lastBytes = 0;
+	shapedBytes = 0;
+	lastEmit = start;
+	emit(start);
+}
+
+/**
+ * Emits the final event of a phase that succeeded.
+ */
+void InstallProgress::complete() {
+	std::lock_guard<std::mutex> guard(lock);
+	event.percent = 100;
+	if (event.phase == "transfer") {
+		event.bytes = event.totalBytes;
+	}
+	emit(std::chrono::steady_clock::now());
+}
+
+/**
+ * Adds bytes written by a transfer that copies the files itself and updates the percentage from
+ * the bundle's size. Unlike `update()`, nothing is shaped since the writer already was.
+ */
+void InstallProgress::transferred(uint64_t bytes) {
+	std::lock_guard<std::mutex> guard(lock);
+	event.bytes = std::min(event.bytes + bytes, event.totalBytes);
+	shapedBytes = event.bytes;
+	if (event.totalBytes) {
+		event.percent = 100.0 * (double)event.bytes / (double)event.totalBytes;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	if (now - lastEmit >= options.interval) {
+		emit(now);
+	}
+}
+
+/**
+ * Updates the progress from a MobileDevice or installation proxy status dictionary. It contains
+ * the current step in "Status" and the phase's progress in "PercentComplete". During the transfer
+ * phase, waits until the shaper lets the newly transferred bytes through or the phase is stopped.
+ */
+void InstallProgress::update(CFDictionaryRef status) {
+	uint64_t shape = 0;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		shape = updateLocked(status);
+	}
+
+	if (shape && qos) {
+		qos->acquire(QosBulk, (size_t)shape, &stopped);
+	}
+}
+
+/**
+ * Applies a status dictionary and returns how many transferred bytes have yet to be shaped. Must
+ * be called with the lock held.
+ */
+uint64_t InstallProgress::updateLocked(CFDictionaryRef status) {
+	auto now = std::chrono::steady_clock::now();
+	bool changed = false;
+
+	CFStringRef value = (CFStringRef)::CFDictionaryGetValue(status, CFSTR("Status"));
+	if (value && ::CFGetTypeID(value) == ::CFStringGetTypeID()) {
+		std::string str = cfStringToStdString(value);
+		changed = str != event.status;
+		event.status = str;
+	}
+
+	CFNumberRef percent = (CFNumberRef)::CFDictionaryGetValue(status, CFSTR("PercentComplete"));
+	if (percent && ::CFGetTypeID(percent) == ::CFNumberGetTypeID()) {
+		double pct = 0;
+		::CFNumberGetValue(percent, kCFNumberDoubleType, &pct);
+		event.percent = std::min<double>(std::max<double>(pct, event.percent), 100);
+		if (event.phase == "transfer") {
+			event.bytes = (uint64_t)((double)event.totalBytes * event.percent / 100);
+		}
+	}
+
+	if (changed || now - lastEmit >= options.interval) {
+		emit(now);
+	}
+
+	uint64_t shape = event.bytes > shapedBytes ? event.bytes - shapedBytes : 0;
+	shapedBytes = std::max(shapedBytes, event.bytes);
+	return shape;
+}
+
+/**
+ * Computes the rates and hands the event to the handler. Must be called with the lock held.
+ */
+void InstallProgress::emit(std::chrono::steady_clock::time_point now) {
+	double sinceLast = std::chrono::duration<double>(now - lastEmit).count();
+	event.elapsed = std::chrono::duration<double>(now - start).count();
+	event.rate = sinceLast > 0 ? (double)(event.bytes - lastBytes) / sinceLast : 0;
+	event.averageRate = event.elapsed > 0 ? (double)event.bytes / event.elapsed : 0;
+	lastEmit = now;
+	lastBytes = event.bytes;
+
+	if (options.handler) {
+		options.handler(event);
+	}
+}
+
+InstallProgressScope::InstallProgressScope(InstallProgress* progress, const char* phase) :
+	previous(currentProgress) {
+	if (progress) {
+		progress->begin(phase);
+	}
+	currentProgress = progress;
+}
+
+InstallProgressScope::~InstallProgressScope() {
+	currentProgress = previous;
+}
+
+}
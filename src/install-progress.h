@@ -0,0 +1,123 @@
+#ifndef __INSTALL_PROGRESS_H__
+#define __INSTALL_PROGRESS_H__
+
+#include "node-ios-device.h"
+#include "cancel-token.h"
+#include "mobiledevice.h"
+#include "qos.h"
+#include <CoreFoundation/CoreFoundation.h>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * The default minimum time between progress events of an install phase.
+ */
+#define INSTALL_PROGRESS_INTERVAL std::chrono::milliseconds(250)
+
+/**
+ * What the MobileDevice callback returns once a phase has been stopped. Any error makes
+ * MobileDevice stop the transfer or install and return it.
+ */
+#define INSTALL_PROGRESS_STOPPED ((mach_error_t)-1)
+
+/**
+ * A snapshot of an install's progress. `phase` is either "transfer" or "install" and `status` is
+ * the step reported last, such as "CopyingApplication" or "InstallingEmbeddedProfile". Bytes and
+ * rates are only known for the transfer phase, where `bytes` is what has been copied so far or,
+ * when MobileDevice only reports a percentage, estimated from the bundle's size. Rates are in bytes
+ * per second, `rate` since the previous event and `averageRate` since the phase began.
+ */
+struct InstallProgressEvent {
+	InstallProgressEvent() : percent(0), bytes(0), totalBytes(0), rate(0), averageRate(0), elapsed(0) {}
+	std::string appPath;
+	std::string phase;
+	std::string status;
+	double      percent;
+	uint64_t    bytes;
+	uint64_t    totalBytes;
+	double      rate;
+	double      averageRate;
+	double      elapsed;
+};
+
+/**
+ * Where install progress events go and how often. Handlers are called on the thread running the
+ * phase, so they must be thread safe.
+ */
+struct InstallProgressOptions {
+	InstallProgressOptions() : interval(INSTALL_PROGRESS_INTERVAL) {}
+	std::function<void(const InstallProgressEvent&)> handler;
+	std::chrono::milliseconds                        interval;
+};
+
+/**
+ * Turns the status dictionaries MobileDevice passes to the transfer and install callbacks, or the
+ * installation proxy sends during an install, into rate limited progress events for one app. A
+ * transfer that copies the files itself reports the bytes it wrote instead. An event is emitted
+ * when a phase begins and completes, when the status changes, and otherwise at most once per
+ * interval.
+ *
+ * MobileDevice calls the callback synchronously on the calling thread and the callback argument is
+ * only an int, so the reporter for the phase running on a thread is found through a thread local.
+ * A phase abandoned after its deadline keeps reporting until MobileDevice returns, so reporters are
+ * shared and own a copy of the options.
+ *
+ * Since the callback blocks the transfer, it's also where transfers are shaped. When a shaper is
+ * set, the bytes transferred since the previous callback are acquired as bulk traffic before the
+ * callback returns.
+ *
+ * It's also where a cancelled phase stops between chunks. Once `stop()` is called, waiting on the
+ * shaper gives up and the callback returns `INSTALL_PROGRESS_STOPPED`.
+ */
+class InstallProgress {
+public:
+	InstallProgress(const std::string& appPath, uint64_t totalBytes, const InstallProgressOptions& options);
+
+	void begin(const char* phase);
+	void complete();
+	bool isStopped() const { return stopped.isCancelled(); }
+	void setQos(std::shared_ptr<QosShaper> qos) { this->qos = qos; }
+	void stop() { stopped.cancel(); }
+	void transferred(uint64_t bytes);
+	void update(CFDictionaryRef status);
+
+	static void* callback();
+
+private:
+	void emit(std::chrono::steady_clock::time_point now);
+	uint64_t updateLocked(CFDictionaryRef status);
+
+	std::mutex                            lock;
+	InstallProgressOptions                options;
+	InstallProgressEvent                  event;
+	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::time_point lastEmit;
+	uint64_t                              lastBytes;
+	std::shared_ptr<QosShaper>            qos;
+	uint64_t                              shapedBytes;
+	CancelToken                           stopped;
+};
+
+/**
+ * Makes a reporter the target of the MobileDevice callbacks on the current thread for the lifetime
+ * of the object and begins the phase. A null reporter is allowed.
+ */
+class InstallProgressScope {
+public:
+	InstallProgressScope(InstallProgress* progress, const char* phase);
+	~InstallProgressScope();
+
+private:
+	InstallProgress* previous;
+};
+
+}
+
+#endif
@@ -0,0 +1,468 @@
+#include "install-queue.h"
+#include "deadline.h"
+#include "fingerprint.h"
+#include <thread>
+#include <vector>
+
+namespace node_ios_device {
+
+InstallQueue::InstallQueue(napi_env env, FingerprintFn fingerprint, InstallFn install) :
+	env(env),
+	fingerprint(fingerprint),
+	install(install),
+	closed(false),
+	nextId(0) {
+	if (!this->fingerprint) {
+		this->fingerprint = [](const std::string& appPath) { return fingerprintDir(appPath); };
+	}
+	if (!this->install) {
+		this->install = [](InstallJob& job) {
+			return job.device->installAll({ job.appPath }, job.skipIfUnchanged, job.recordDir, &job.cancel, &job.progress)[0];
+		};
+	}
+}
+
+/**
+ * Creates a shared pointer to an instance of the install queue. The fingerprint and install
+ * functions can be swapped out so the queue can be exercised without a device.
+ */
+std::shared_ptr<InstallQueue> InstallQueue::create(napi_env env, FingerprintFn fingerprint, InstallFn install) {
+	auto queue = std::make_shared<InstallQueue>(env, fingerprint, install);
+	queue->init();
+	return queue;
+}
+
+/**
+ * Wires up the completion handler into Node's event loop. The handle is only ref'd while requests
+ * are pending so that an idle queue doesn't keep Node from exiting.
+ */
+void InstallQueue::init() {
+	self = shared_from_this();
+
+	uv_loop_t* loop;
+	::napi_get_uv_event_loop(env, &loop);
+	completionNotify.data = &self;
+	::uv_async_init(loop, &completionNotify, [](uv_async_t* handle) {
+		std::shared_ptr<InstallQueue>* queue = static_cast<std::shared_ptr<InstallQueue>*>(handle->data);
+		if (*queue) {
+			(*queue)->dispatch();
+		}
+	});
+	::uv_unref((uv_handle_t*)&completionNotify);
+}
+
+/**
+ * Queues an install request and returns its id. The app is fingerprinted on a background thread
+ * so that the main thread isn't blocked hashing the bundle. Must be called on the main thread.
+ */
+uint32_t InstallQueue::add(std::shared_ptr<Device> device, const std::string& udid, const std::string& appPath, bool skipIfUnchanged, const std::string& recordDir, napi_deferred deferred, napi_value onProgress, uint32_t progressInterval) {
+	napi_ref ref = NULL;
+	napi_valuetype type;
+	if (onProgress && ::napi_typeof(env, onProgress, &type) == napi_ok && type == napi_function) {
+		NAPI_THROW_RETURN("InstallQueue::add", "ERR_NAPI_CREATE_REFERENCE", ::napi_create_reference(env, onProgress, 1, &ref), 0)
+	}
+
+	uint32_t id;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		id = ++nextId;
+		requests[id].deferred = deferred;
+		requests[id].onProgress = ref;
+	}
+	updateRef();
+
+	std::shared_ptr<InstallQueue> queue = shared_from_this();
+	std::weak_ptr<InstallQueue> weakQueue = queue;
+
+	auto job = std::make_shared<InstallJob>();
+	std::weak_ptr<InstallJob> weakJob = job;
+	job->udid = udid;
+	job->device = device;
+	job->appPath = appPath;
+	job->skipIfUnchanged = skipIfUnchanged;
+	job->recordDir = recordDir;
+	job->progress.interval = std::chrono::milliseconds(progressInterval);
+	job->progress.handler = [weakQueue, weakJob](const InstallProgressEvent& event) {
+		auto queue = weakQueue.lock();
+		auto job = weakJob.lock();
+		if (queue && job) {
+			queue->progress(job, event);
+		}
+	};
+
+	std::thread([queue, id, job]() {
+		try {
+			// requests only merge when they'd install the same way, so a forced reinstall or one
+			// recorded elsewhere doesn't get another request's result; the record dir is last
+			// since it may contain colons
+			job->key = job->udid + ":" + queue->fingerprint(job->appPath) + ":" + (job->skipIfUnchanged ? "1" : "0") + ":" + job->recordDir;
+		} catch (std::exception& e) {
+			InstallCompletion failed;
+			failed.id = id;
+			failed.error = e.what();
+			queue->complete(failed);
+			return;
+		}
+		queue->attach(id, job);
+	}).detach();
+
+	return id;
+}
+
+/**
+ * Merges a fingerprinted request into the unfinished job for the same build on the same device,
+ * or queues its job and starts the device's worker if it isn't running.
+ */
+void InstallQueue::attach(uint32_t id, std::shared_ptr<InstallJob> job) {
+	bool start = false;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto req = requests.find(id);
+		if (req == requests.end()) {
+			// cancelled while fingerprinting
+			return;
+		}
+
+		auto it = jobs.find(job->key);
+		if (it != jobs.end()) {
+			LOG_DEBUG_2("InstallQueue::attach", "Merging request %u into the pending install of %s", id, job->appPath.c_str())
+			it->second->waiters.insert(id);
+			req->second.job = it->second;
+			req->second.deduped = true;
+			return;
+		}
+
+		job->waiters.insert(id);
+		req->second.job = job;
+		jobs[job->key] = job;
+		queues[job->udid].push_back(job);
+		start = workers.insert(job->udid).second;
+	}
+
+	if (start) {
+		std::shared_ptr<InstallQueue> queue = shared_from_this();
+		std::string udid = job->udid;
+		std::thread([queue, udid]() { queue->run(udid); }).detach();
+	}
+}
+
+/**
+ * Cancels a request and rejects its promise with an `AbortError`. A job that has no requests left
+ * is cancelled as well. Returns false if the request has already completed. Must be called on the
+ * main thread.
+ */
+bool InstallQueue::cancel(uint32_t id) {
+	napi_deferred deferred;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto req = requests.find(id);
+		if (req == requests.end()) {
+			return false;
+		}
+
+		deferred = req->second.deferred;
+		std::shared_ptr<InstallJob> job = req->second.job;
+		release(req->second);
+		requests.erase(req);
+
+		if (job) {
+			job->waiters.erase(id);
+			if (job->waiters.empty()) {
+				LOG_DEBUG_1("InstallQueue::cancel", "Cancelling install of %s", job->appPath.c_str())
+				job->cancel.cancel();
+				auto it = jobs.find(job->key);
+				if (it != jobs.end() && it->second == job) {
+					jobs.erase(it);
+				}
+			}
+		}
+	}
+	updateRef();
+
+	napi_value code, msg, err, name;
+	NAPI_THROW_RETURN("InstallQueue::cancel", "ERR_NAPI_CREATE_STRING", ::napi_create_string_utf8(env, "ABORT_ERR", NAPI_AUTO_LENGTH, &code), true)
+	NAPI_THROW_RETURN("InstallQueue::cancel", "ERR_NAPI_CREATE_STRING", ::napi_create_string_utf8(env, "The install was aborted", NAPI_AUTO_LENGTH, &msg), true)
+	NAPI_THROW_RETURN("InstallQueue::cancel", "ERR_NAPI_CREATE_ERROR", ::napi_create_error(env, code, msg, &err), true)
+	NAPI_THROW_RETURN("InstallQueue::cancel", "ERR_NAPI_CREATE_STRING", ::napi_create_string_utf8(env, "AbortError", NAPI_AUTO_LENGTH, &name), true)
+	NAPI_THROW_RETURN("InstallQueue::cancel", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, err, "name", name), true)
+	NAPI_THROW_RETURN("InstallQueue::cancel", "ERR_NAPI_REJECT_DEFERRED", ::napi_reject_deferred(env, deferred, err), true)
+
+	return true;
+}
+
+/**
+ * Queues a completion for the main thread.
+ */
+void InstallQueue::complete(const InstallCompletion& completion) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (closed) {
+			return;
+		}
+		completions.push(completion);
+	}
+	::uv_async_send(&completionNotify);
+}
+
+/**
+ * Calls the progress callbacks, then settles the promises of the completed requests. Progress is
+ * always queued before the completion of the same job, so a request sees all of its progress
+ * before its promise settles. This runs on the main thread.
+ */
+void InstallQueue::dispatch() {
+	napi_handle_scope scope;
+	NAPI_THROW("InstallQueue::dispatch", "ERR_NAPI_OPEN_HANDLE_SCOPE", ::napi_open_handle_scope(env, &scope))
+
+	// drain both queues at once so that no progress queued before a completion is left behind
+	std::vector<std::pair<std::vector<uint32_t>, InstallProgressEvent>> events;
+	std::vector<InstallCompletion> completed;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		while (!progressEvents.empty()) {
+			auto& it = progressEvents.front();
+			std::vector<uint32_t> ids;
+			for (uint32_t id : it.first->waiters) {
+				auto req = requests.find(id);
+				if (req != requests.end() && req->second.onProgress) {
+					ids.push_back(id);
+				}
+			}
+			if (!ids.empty()) {
+				events.emplace_back(ids, it.second);
+			}
+			progressEvents.pop();
+		}
+
+		while (!completions.empty()) {
+			completed.push_back(completions.front());
+			completions.pop();
+		}
+	}
+
+	dispatchProgress(events);
+
+	// a progress callback may have cancelled a request and settled its promise, so the deferreds
+	// are only looked up now and requests that are gone are skipped
+	std::vector<std::pair<napi_deferred, InstallCompletion>> settled;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto const& completion : completed) {
+			auto req = requests.find(completion.id);
+			if (req != requests.end()) {
+				settled.emplace_back(req->second.deferred, completion);
+				release(req->second);
+				requests.erase(req);
+			}
+		}
+	}
+	updateRef();
+
+	for (auto const& it : settled) {
+		const InstallCompletion& completion = it.second;
+		napi_value rval, tmp;
+
+		if (!completion.error.empty()) {
+			napi_value code, msg;
+			NAPI_THROW("InstallQueue::dispatch", "ERR_NAPI_CREATE_STRING", ::napi_create_string_utf8(env, completion.code.empty() ? "ERR_INSTALL" : completion.code.c_str(), NAPI_AUTO_LENGTH, &code))
+			NAPI_THROW("InstallQueue::dispatch", "ERR_NAPI_CREATE_STRING", ::napi_create_string_utf8(env, completion.error.c_str(), completion.error.length(), &msg))
+			NAPI_THROW("InstallQueue::dispatch", "ERR_NAPI_CREATE_ERROR", ::napi_create_error(env, code, msg, &rval))
+			NAPI_THROW("InstallQueue::dispatch", "ERR_NAPI_REJECT_DEFERRED", ::napi_reject_deferred(env, it.first, rval))
+			continue;
+		}
+
+		NAPI_THROW("InstallQueue::dispatch", "ERR_NAPI_CREATE_OBJECT", ::napi_create_object(env, &rval))
+		NAPI_THROW("InstallQueue::dispatch", "ERR_NAPI_GET_BOOLEAN", ::napi_get_boolean(env, completion.skipped, &tmp))
+		NAPI_THROW("InstallQueue::dispatch", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, rval, "skipped", tmp))
+		NAPI_THROW("InstallQueue::dispatch", "ERR_NAPI_GET_BOOLEAN", ::napi_get_boolean(env, completion.deduped, &tmp))
+		NAPI_THROW("InstallQueue::dispatch", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, rval, "deduped", tmp))
+		NAPI_THROW("InstallQueue::dispatch", "ERR_NAPI_RESOLVE_DEFERRED", ::napi_resolve_deferred(env, it.first, rval))
+	}
+
+	NAPI_THROW("InstallQueue::dispatch", "ERR_NAPI_CLOSE_HANDLE_SCOPE", ::napi_close_handle_scope(env, scope))
+}
+
+/**
+ * Calls the progress callbacks with the drained events. The callbacks are looked up by request id
+ * right before each call since a callback may cancel any request. Must be called on the main
+ * thread with a handle scope open.
+ */
+void InstallQueue::dispatchProgress(const std::vector<std::pair<std::vector<uint32_t>, InstallProgressEvent>>& pending) {
+	if (pending.empty()) {
+		return;
+	}
+
+	napi_value global;
+	NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_GET_GLOBAL", ::napi_get_global(env, &global))
+
+	for (auto const& it : pending) {
+		const InstallProgressEvent& event = it.second;
+		napi_value obj, tmp, fn, rval;
+
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_CREATE_OBJECT", ::napi_create_object(env, &obj))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_CREATE_STRING", ::napi_create_string_utf8(env, event.appPath.c_str(), event.appPath.length(), &tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, obj, "appPath", tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_CREATE_STRING", ::napi_create_string_utf8(env, event.phase.c_str(), event.phase.length(), &tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, obj, "phase", tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_CREATE_STRING", ::napi_create_string_utf8(env, event.status.c_str(), event.status.length(), &tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, obj, "status", tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_CREATE_DOUBLE", ::napi_create_double(env, event.percent, &tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, obj, "percent", tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_CREATE_DOUBLE", ::napi_create_double(env, (double)event.bytes, &tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, obj, "bytes", tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_CREATE_DOUBLE", ::napi_create_double(env, (double)event.totalBytes, &tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, obj, "totalBytes", tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_CREATE_DOUBLE", ::napi_create_double(env, event.rate, &tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, obj, "rate", tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_CREATE_DOUBLE", ::napi_create_double(env, event.averageRate, &tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, obj, "averageRate", tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_CREATE_DOUBLE", ::napi_create_double(env, event.elapsed * 1000, &tmp))
+		NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, obj, "elapsedMs", tmp))
+
+		for (uint32_t id : it.first) {
+			napi_ref ref = NULL;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				auto req = requests.find(id);
+				if (req != requests.end()) {
+					ref = req->second.onProgress;
+				}
+			}
+			if (!ref) {
+				continue;
+			}
+
+			NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_GET_REFERENCE_VALUE", ::napi_get_reference_value(env, ref, &fn))
+			if (fn) {
+				NAPI_THROW("InstallQueue::dispatchProgress", "ERR_NAPI_MAKE_CALLBACK", ::napi_make_callback(env, NULL, global, fn, 1, &obj, &rval))
+			}
+		}
+	}
+}
+
+/**
+ * Queues a progress event of a job for the main thread.
+ */
+void InstallQueue::progress(std::shared_ptr<InstallJob> job, const InstallProgressEvent& event) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (closed) {
+			return;
+		}
+		progressEvents.emplace(job, event);
+	}
+	::uv_async_send(&completionNotify);
+}
+
+/**
+ * Deletes a request's progress callback reference. Must be called on the main thread.
+ */
+void InstallQueue::release(Request& req) {
+	if (req.onProgress) {
+		::napi_delete_reference(env, req.onProgress);
+		req.onProgress = NULL;
+	}
+}
+
+/**
+ * Works through a device's jobs until its queue is empty. Jobs that were cancelled while queued
+ * are skipped.
+ */
+void InstallQueue::run(const std::string& udid) {
+	LOG_DEBUG_THREAD_ID("InstallQueue::run", "Starting install worker")
+
+	while (1) {
+		std::shared_ptr<InstallJob> job;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			auto& queue = queues[udid];
+			if (queue.empty() || closed) {
+				queues.erase(udid);
+				workers.erase(udid);
+				return;
+			}
+			job = queue.front();
+			queue.pop_front();
+			if (job->cancel.isCancelled()) {
+				continue;
+			}
+		}
+
+		InstallCompletion result;
+		try {
+			AppInstallResult installed = install(*job);
+			result.skipped = installed.skipped;
+			result.error = installed.error;
+			result.code = installed.code;
+		} catch (std::exception& e) {
+			result.error = e.what();
+			result.code = errorCode(e, "ERR_INSTALL");
+		}
+
+		std::vector<InstallCompletion> done;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			auto it = jobs.find(job->key);
+			if (it != jobs.end() && it->second == job) {
+				jobs.erase(it);
+			}
+			for (uint32_t id : job->waiters) {
+				InstallCompletion completion = result;
+				completion.id = id;
+				auto req = requests.find(id);
+				completion.deduped = req != requests.end() && req->second.deduped;
+				done.push_back(completion);
+			}
+		}
+
+		for (auto const& completion : done) {
+			complete(completion);
+		}
+	}
+}
+
+/**
+ * Closes the completion handle and cancels all jobs. Running jobs abandon their transfer or install and
+ * pending promises are never settled. The queue holds on to itself until the handle is closed since
+ * libuv still uses the handle after `uv_close()` returns. Must be called on the main thread.
+ */
+void InstallQueue::shutdown() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		closed = true;
+		for (auto const& it : jobs) {
+			it.second->cancel.cancel();
+		}
+	}
+	::uv_close((uv_handle_t*)&completionNotify, [](uv_handle_t* handle) {
+		static_cast<std::shared_ptr<InstallQueue>*>(handle->data)->reset();
+	});
+}
+
+/**
+ * Returns the number of requests merged into a request's job, or 0 if the request is still being
+ * fingerprinted or has completed.
+ */
+size_t InstallQueue::waiters(uint32_t id) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto req = requests.find(id);
+	return req != requests.end() && req->second.job ? req->second.job->waiters.size() : 0;
+}
+
+/**
+ * Refs the completion handle while requests are pending so that Node waits for them. Must be
+ * called on the main thread.
+ */
+void InstallQueue::updateRef() {
+	bool pending;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		pending = !requests.empty();
+	}
+	if (pending) {
+		::uv_ref((uv_handle_t*)&completionNotify);
+	} else {
+		::uv_unref((uv_handle_t*)&completionNotify);
+	}
+}
+
+}
@@ -0,0 +1,127 @@
+#ifndef __INSTALL_QUEUE_H__
+#define __INSTALL_QUEUE_H__
+
+#include "node-ios-device.h"
+#include "cancel-token.h"
+#include "device.h"
+#include "install-progress.h"
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <string>
+#include <uv.h>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * An install of one app build on one device. Every request for the same build on the same device
+ * with the same `skipIfUnchanged` and `recordDir` that arrives while the job is queued or running is
+ * merged into the job, so the app is installed once and every request completes with the job's
+ * result.
+ */
+struct InstallJob {
+	InstallJob() : skipIfUnchanged(false) {}
+	std::string             key;
+	std::string             udid;
+	std::shared_ptr<Device> device;
+	std::string             appPath;
+	bool                    skipIfUnchanged;
+	std::string             recordDir;
+	std::set<uint32_t>      waiters;
+	CancelToken             cancel;
+	InstallProgressOptions  progress;
+};
+
+/**
+ * The outcome of a request, created on a worker thread and handed to the main thread to settle the
+ * request's promise.
+ */
+struct InstallCompletion {
+	InstallCompletion() : id(0), skipped(false), deduped(false) {}
+	uint32_t    id;
+	bool        skipped;
+	bool        deduped;
+	std::string error;
+	std::string code;
+};
+
+/**
+ * Installs apps in the background, one job at a time per device with devices running in parallel.
+ *
+ * Each request is fingerprinted on its own thread and keyed by the device, fingerprint, and install
+ * options, then either merged into a matching job that hasn't finished yet or queued as a new job.
+ * A request can be cancelled until it completes. Its promise is rejected right away and once a job
+ * has no requests left it's cancelled too. A queued job is dropped and a running job stops its
+ * transfer before the next chunk or stops waiting on its install.
+ *
+ * Promises are only settled and progress callbacks are only called on the main thread. Workers
+ * queue completions and progress events and notify the main thread through libuv. A job's progress
+ * is delivered to the progress callback of every request merged into it.
+ */
+class InstallQueue : public std::enable_shared_from_this<InstallQueue> {
+public:
+	/**
+	 * Fingerprints an app bundle. Defaults to `fingerprintDir()`.
+	 */
+	typedef std::function<std::string(const std::string& appPath)> FingerprintFn;
+
+	/**
+	 * Installs a job's app and returns the result. Defaults to installing it on the job's device.
+	 */
+	typedef std::function<AppInstallResult(InstallJob& job)> InstallFn;
+
+	InstallQueue(napi_env env, FingerprintFn fingerprint, InstallFn install);
+
+	static std::shared_ptr<InstallQueue> create(napi_env env, FingerprintFn fingerprint = NULL, InstallFn install = NULL);
+
+	uint32_t add(std::shared_ptr<Device> device, const std::string& udid, const std::string& appPath, bool skipIfUnchanged, const std::string& recordDir, napi_deferred deferred, napi_value onProgress, uint32_t progressInterval);
+	bool cancel(uint32_t id);
+	void shutdown();
+	size_t waiters(uint32_t id);
+
+private:
+	struct Request {
+		Request() : deferred(NULL), onProgress(NULL), deduped(false) {}
+		napi_deferred               deferred;
+		napi_ref                    onProgress;
+		std::shared_ptr<InstallJob> job;
+		bool                        deduped;
+	};
+
+	void attach(uint32_t id, std::shared_ptr<InstallJob> job);
+	void complete(const InstallCompletion& completion);
+	void dispatch();
+	void dispatchProgress(const std::vector<std::pair<std::vector<uint32_t>, InstallProgressEvent>>& pending);
+	void init();
+	void progress(std::shared_ptr<InstallJob> job, const InstallProgressEvent& event);
+	void release(Request& req);
+	void run(const std::string& udid);
+	void updateRef();
+
+	std::shared_ptr<InstallQueue> self;
+	napi_env                      env;
+	FingerprintFn                 fingerprint;
+	InstallFn                     install;
+	bool                          closed;
+
+	std::mutex                                          lock;
+	uint32_t                                            nextId;
+	std::map<uint32_t, Request>                         requests;
+	std::map<std::string, std::shared_ptr<InstallJob>>  jobs;
+	std::map<std::string, std::deque<std::shared_ptr<InstallJob>>> queues;
+	std::set<std::string>                               workers;
+
+	std::queue<InstallCompletion> completions;
+	std::queue<std::pair<std::shared_ptr<InstallJob>, InstallProgressEvent>> progressEvents;
+	uv_async_t                    completionNotify;
+};
+
+}
+
+#endif
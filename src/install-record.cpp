@@ -0,0 +1,109 @@
+#include "install-record.h"
+#include "afc.h"
+#include "plist.h"
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+namespace node_ios_device {
+
+#define INSTALL_RECORD_HEADER "# node-ios-device install record v1"
+
+/**
+ * Reads the bundle id and version from the app's `Info.plist`.
+ */
+AppBundleInfo AppBundleInfo::load(const std::string& appPath) {
+	std::string infoPath = appPath + "/Info.plist";
+	std::ifstream in(infoPath, std::ios::binary);
+	if (!in) {
+		throw std::runtime_error("Failed to read \"" + infoPath + "\"");
+	}
+	std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+	plist::Arena arena;
+	plist::Node* root = plist::parse(data.data(), data.size(), arena);
+
+	AppBundleInfo info;
+	info.bundleId = plist::dictGetString(root, "CFBundleIdentifier");
+	info.bundleVersion = plist::dictGetString(root, "CFBundleVersion");
+	if (info.bundleId.empty()) {
+		throw std::runtime_error("App \"" + appPath + "\" does not have a CFBundleIdentifier");
+	}
+	return info;
+}
+
+/**
+ * Loads the device's install record. A missing or unreadable record is treated as empty.
+ */
+InstallRecord::InstallRecord(const std::string& recordDir, const std::string& udid) :
+	path(recordDir + "/" + udid) {
+
+	std::ifstream in(path);
+	std::string line;
+
+	if (!std::getline(in, line) || line != INSTALL_RECORD_HEADER) {
+		return;
+	}
+
+	while (std::getline(in, line)) {
+		size_t a = line.find('\t');
+		size_t b = a == std::string::npos ? a : line.find('\t', a + 1);
+		if (b == std::string::npos) {
+			continue;
+		}
+
+		InstallRecordEntry& entry = entries[line.substr(b + 1)];
+		entry.fingerprint = line.substr(0, a);
+		entry.bundleVersion = line.substr(a + 1, b - a - 1);
+	}
+}
+
+bool InstallRecord::get(const std::string& bundleId, InstallRecordEntry& entry) {
+	auto it = entries.find(bundleId);
+	if (it == entries.end()) {
+		return false;
+	}
+	entry = it->second;
+	return true;
+}
+
+void InstallRecord::put(const std::string& bundleId, const InstallRecordEntry& entry) {
+	entries[bundleId] = entry;
+	save();
+}
+
+void InstallRecord::remove(const std::string& bundleId) {
+	if (entries.erase(bundleId)) {
+		save();
+	}
+}
+
+/**
+ * Writes the record to a temp file and moves it into place.
+ */
+void InstallRecord::save() {
+	size_t slash = path.find_last_of('/');
+	if (slash != std::string::npos) {
+		makeLocalDirs(path.substr(0, slash));
+	}
+
+	std::string tmpPath = path + ".partial";
+
+	{
+		std::ofstream out(tmpPath, std::ios::trunc);
+		out << INSTALL_RECORD_HEADER << '\n';
+		for (auto const& it : entries) {
+			out << it.second.fingerprint << '\t' << it.second.bundleVersion << '\t' << it.first << '\n';
+		}
+		if (!out) {
+			throw std::runtime_error("Failed to write install record \"" + tmpPath + "\"");
+		}
+	}
+
+	if (::rename(tmpPath.c_str(), path.c_str()) != 0) {
+		::unlink(tmpPath.c_str());
+		throw std::runtime_error("Failed to write install record \"" + path + "\"");
+	}
+}
+
+}
@@ -0,0 +1,51 @@
+#ifndef __INSTALL_RECORD_H__
+#define __INSTALL_RECORD_H__
+
+#include "node-ios-device.h"
+#include <map>
+#include <string>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * What was last installed for a bundle id.
+ */
+struct InstallRecordEntry {
+	std::string fingerprint;
+	std::string bundleVersion;
+};
+
+/**
+ * The identity of an app bundle on the host as read from its `Info.plist`.
+ */
+struct AppBundleInfo {
+	std::string bundleId;
+	std::string bundleVersion;
+
+	static AppBundleInfo load(const std::string& appPath);
+};
+
+/**
+ * A host-side record of the fingerprint and `CFBundleVersion` of each app installed on a device.
+ * Each device has its own file in the record directory so that devices don't contend for it.
+ */
+class InstallRecord {
+public:
+	InstallRecord(const std::string& recordDir, const std::string& udid);
+
+	bool get(const std::string& bundleId, InstallRecordEntry& entry);
+	void put(const std::string& bundleId, const InstallRecordEntry& entry);
+	void remove(const std::string& bundleId);
+
+private:
+	void save();
+
+	std::string path;
+	std::map<std::string, InstallRecordEntry> entries;
+};
+
+}
+
+#endif
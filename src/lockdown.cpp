@@ -0,0 +1,626 @@
+#include "lockdown.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fstream>
+#include <iterator>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace node_ios_device {
+
+/**
+ * Lockdown messages are small, anything bigger than this is a protocol error.
+ */
+#define LOCKDOWN_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+
+#define LOCKDOWN_LABEL "node-ios-device"
+
+#ifdef MSG_NOSIGNAL
+	#define SEND_FLAGS MSG_NOSIGNAL
+#else
+	#define SEND_FLAGS 0
+#endif
+
+/**
+ * Returns the most recent OpenSSL error as a string.
+ */
+static std::string sslError() {
+	char buf[256];
+	unsigned long code = ::ERR_get_error();
+	if (!code) {
+		return "unknown error";
+	}
+	::ERR_error_string_n(code, buf, sizeof(buf));
+	::ERR_clear_error();
+	return buf;
+}
+
+/**
+ * Parses a pair record plist.
+ */
+PairRecord PairRecord::parse(const uint8_t* data, size_t len) {
+	plist::Arena arena;
+	plist::Node* root = plist::parse(data, len, arena);
+
+	PairRecord record;
+	record.hostId = plist::dictGetString(root, "HostID");
+	record.systemBUID = plist::dictGetString(root, "SystemBUID");
+
+	const plist::Node* cert = plist::dictGet(root, "HostCertificate");
+	const plist::Node* key = plist::dictGet(root, "HostPrivateKey");
+	if (record.hostId.empty() || !cert || cert->type != plist::PlistData || !key || key->type != plist::PlistData) {
+		throw std::runtime_error("Invalid pair record");
+	}
+	record.hostCertificate.assign(cert->str.ptr, cert->str.len);
+	record.hostPrivateKey.assign(key->str.ptr, key->str.len);
+
+	return record;
+}
+
+/**
+ * Loads a pair record from disk.
+ */
+PairRecord PairRecord::load(const std::string& path) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		throw std::runtime_error("Failed to read pair record \"" + path + "\"");
+	}
+	std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	return parse(data.data(), data.size());
+}
+
+TlsSessionCache::~TlsSessionCache() {
+	for (auto const& it : sessions) {
+		::SSL_SESSION_free(it.second);
+	}
+}
+
+TlsSessionCache& TlsSessionCache::shared() {
+	static TlsSessionCache cache;
+	return cache;
+}
+
+/**
+ * Returns the cached session for the key or NULL. The caller must free the returned session.
+ */
+SSL_SESSION* TlsSessionCache::get(const std::string& key) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = sessions.find(key);
+	if (it == sessions.end()) {
+		return NULL;
+	}
+	::SSL_SESSION_up_ref(it->second);
+	return it->second;
+}
+
+/**
+ * Caches a session, replacing any previous one for the key. The cache takes ownership of the
+ * session.
+ */
+void TlsSessionCache::put(const std::string& key, SSL_SESSION* session) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = sessions.find(key);
+	if (it != sessions.end()) {
+		::SSL_SESSION_free(it->second);
+		it->second = session;
+	} else {
+		sessions[key] = session;
+	}
+}
+
+void TlsSessionCache::remove(const std::string& key) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = sessions.find(key);
+	if (it != sessions.end()) {
+		::SSL_SESSION_free(it->second);
+		sessions.erase(it);
+	}
+}
+
+/**
+ * Called by OpenSSL whenever the server hands us a session ID or ticket. Returning 1 tells OpenSSL
+ * that we have taken ownership of the session.
+ */
+static int onNewSession(SSL* ssl, SSL_SESSION* session) {
+	LockdownConnection* conn = static_cast<LockdownConnection*>(SSL_get_app_data(ssl));
+	if (!conn || conn->sessionKey.empty()) {
+		return 0;
+	}
+	TlsSessionCache::shared().put(conn->sessionKey, session);
+	return 1;
+}
+
+LockdownConnection::LockdownConnection(int fd) : fd(fd), ssl(NULL), resumed(false) {}
+
+LockdownConnection::~LockdownConnection() {
+	stopTls();
+	if (fd >= 0) {
+		::close(fd);
+	}
+}
+
+/**
+ * Performs a TLS handshake on the socket, offering the cached session for `key` if there is one.
+ * If the handshake fails, the cached session is discarded so the next attempt does a full
+ * handshake.
+ */
+void LockdownConnection::startTls(SSL_CTX* ctx, const std::string& key) {
+	sessionKey = key;
+	ssl = ::SSL_new(ctx);
+	if (!ssl) {
+		throw std::runtime_error("Failed to create TLS connection: " + sslError());
+	}
+	::SSL_set_fd(ssl, fd);
+	SSL_set_app_data(ssl, this);
+
+	SSL_SESSION* session = TlsSessionCache::shared().get(key);
+	if (session) {
+		::SSL_set_session(ssl, session);
+		::SSL_SESSION_free(session);
+	}
+
+	if (::SSL_connect(ssl) != 1) {
+		std::string error = sslError();
+		::SSL_free(ssl);
+		ssl = NULL;
+		TlsSessionCache::shared().remove(key);
+		throw std::runtime_error("TLS handshake failed: " + error);
+	}
+
+	resumed = ::SSL_session_reused(ssl) == 1;
+	LOG_DEBUG_2("LockdownConnection::startTls", "TLS handshake for %s %s", key.c_str(), resumed ? "resumed a cached session" : "was a full handshake")
+}
+
+/**
+ * Sends a close notify and goes back to plain text. Lockdown expects this after `StopSession`.
+ */
+void LockdownConnection::stopTls() {
+	if (ssl) {
+		::SSL_shutdown(ssl);
+		::SSL_free(ssl);
+		ssl = NULL;
+	}
+}
+
+bool LockdownConnection::readFully(void* buffer, size_t len) {
+	uint8_t* p = static_cast<uint8_t*>(buffer);
+
+	while (len > 0) {
+		ssize_t n;
+		if (ssl) {
+			n = ::SSL_read(ssl, p, len > INT32_MAX ? INT32_MAX : (int)len);
+		} else {
+			n = ::recv(fd, p, len, 0);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+
+	return true;
+}
+
+bool LockdownConnection::writeFully(const void* buffer, size_t len) {
+	const uint8_t* p = static_cast<const uint8_t*>(buffer);
+
+	while (len > 0) {
+		ssize_t n;
+		if (ssl) {
+			n = ::SSL_write(ssl, p, len > INT32_MAX ? INT32_MAX : (int)len);
+		} else {
+			n = ::send(fd, p, len, SEND_FLAGS);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+
+	return true;
+}
+
+/**
+ * Serializes the plist as XML, which is what lockdown itself sends, and writes it prefixed with its
+ * length in a single write.
+ */
+void LockdownConnection::sendPlist(const plist::Node* node) {
+	std::vector<uint8_t> out(4);
+	plist::writeXml(node, out);
+
+	uint32_t len = htonl((uint32_t)(out.size() - 4));
+	::memcpy(out.data(), &len, 4);
+
+	if (!writeFully(out.data(), out.size())) {
+		throw std::runtime_error("Failed to send plist to device");
+	}
+}
+
+/**
+ * Receives a length prefixed plist. The message is read straight into the arena so the parsed tree
+ * can reference it. Returns NULL if the connection was closed.
+ */
+plist::Node* LockdownConnection::recvPlist(plist::Arena& arena) {
+	uint32_t len;
+	if (!readFully(&len, sizeof(len))) {
+		return NULL;
+	}
+
+	len = ntohl(len);
+	if (len == 0 || len > LOCKDOWN_MAX_MESSAGE_SIZE) {
+		std::stringstream error;
+		error << "Invalid plist message length (" << len << " bytes)";
+		throw std::runtime_error(error.str());
+	}
+
+	char* data = arena.chars(len);
+	if (!readFully(data, len)) {
+		throw std::runtime_error("Connection closed while receiving plist");
+	}
+
+	return plist::parse(reinterpret_cast<const uint8_t*>(data), len, arena);
+}
+
+/**
+ * Connects to a TCP port. This is used for Wi-Fi devices and for testing against a stand-in
+ * lockdownd.
+ */
+int tcpConnect(const std::string& host, uint16_t port) {
+	struct addrinfo hints, *res;
+	::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	std::string portStr = std::to_string(port);
+	int rval = ::getaddrinfo(host.c_str(), portStr.c_str(), &hints, &res);
+	if (rval != 0) {
+		throw std::runtime_error("Failed to resolve \"" + host + "\": " + ::gai_strerror(rval));
+	}
+
+	int fd = -1;
+	for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+		fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		::close(fd);
+		fd = -1;
+	}
+	::freeaddrinfo(res);
+
+	if (fd < 0) {
+		throw std::runtime_error("Failed to connect to " + host + ":" + portStr);
+	}
+
+	int one = 1;
+	::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static void writeLE32(uint8_t* p, uint32_t value) {
+	p[0] = (uint8_t)value;
+	p[1] = (uint8_t)(value >> 8);
+	p[2] = (uint8_t)(value >> 16);
+	p[3] = (uint8_t)(value >> 24);
+}
+
+static uint32_t readLE32(const uint8_t* p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * Asks usbmuxd to connect to a port on a USB device. Once usbmuxd replies, the socket is a raw pipe
+ * to the port on the device.
+ */
+int usbmuxConnect(uint32_t deviceId, uint16_t port, const std::string& socketPath) {
+	struct sockaddr_un addr;
+	::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socketPath.length() >= sizeof(addr.sun_path)) {
+		throw std::runtime_error("usbmuxd socket path is too long");
+	}
+	::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || ::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		if (fd >= 0) {
+			::close(fd);
+		}
+		throw std::runtime_error("Failed to connect to usbmuxd at \"" + socketPath + "\"");
+	}
+
+	LockdownConnection conn(fd);
+
+	plist::Arena arena;
+	plist::Node* req = plist::createDict(arena, {
+		{ "MessageType",         plist::createString(arena, "Connect") },
+		{ "ClientVersionString", plist::createString(arena, LOCKDOWN_LABEL) },
+		{ "ProgName",            plist::createString(arena, LOCKDOWN_LABEL) },
+		{ "kLibUSBMuxVersion",   plist::createInteger(arena, 3) },
+		{ "DeviceID",            plist::createInteger(arena, deviceId) },
+		{ "PortNumber",          plist::createInteger(arena, htons(port)) }
+	});
+
+	// usbmuxd messages have a 16 byte little endian header: length, version, type, and tag
+	std::vector<uint8_t> out(16);
+	plist::writeXml(req, out);
+	writeLE32(out.data(), (uint32_t)out.size());
+	writeLE32(out.data() + 4, 1);
+	writeLE32(out.data() + 8, 8);
+	writeLE32(out.data() + 12, 1);
+
+	uint8_t header[16];
+	if (!conn.writeFully(out.data(), out.size()) || !conn.readFully(header, sizeof(header))) {
+		throw std::runtime_error("Failed to talk to usbmuxd");
+	}
+
+	uint32_t len = readLE32(header);
+	if (len < 16 || len > LOCKDOWN_MAX_MESSAGE_SIZE) {
+		throw std::runtime_error("Invalid usbmuxd response");
+	}
+	char* data = arena.chars(len - 16);
+	if (!conn.readFully(data, len - 16)) {
+		throw std::runtime_error("Failed to talk to usbmuxd");
+	}
+
+	const plist::Node* number = plist::dictGet(plist::parse(reinterpret_cast<const uint8_t*>(data), len - 16, arena), "Number");
+	int64_t result = number && number->type == plist::PlistInteger ? number->i : -1;
+	if (result != 0) {
+		std::stringstream error;
+		error << "usbmuxd failed to connect to port " << port << " on device " << deviceId;
+		if (result == 2) {
+			error << ": device not connected";
+		} else if (result == 3) {
+			error << ": connection refused";
+		} else {
+			error << " (" << result << ")";
+		}
+		throw std::runtime_error(error.str());
+	}
+
+	// hand the socket over to the caller
+	conn.fd = -1;
+	return fd;
+}
+
+/**
+ * Creates the client. The TLS context is set up once with the host certificate from the pair
+ * record and is used for lockdown and every service connection.
+ */
+LockdownClient::LockdownClient(const std::string& udid, const PairRecord& pairRecord, LockdownConnector connector) :
+	udid(udid),
+	pairRecord(pairRecord),
+	connector(connector),
+	ctx(NULL) {
+
+	ctx = ::SSL_CTX_new(::TLS_client_method());
+	if (!ctx) {
+		throw std::runtime_error("Failed to create TLS context: " + sslError());
+	}
+
+	// devices use self signed certificates, and older devices use certificates and ciphers that
+	// OpenSSL's default security level rejects
+	::SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+	::SSL_CTX_set_security_level(ctx, 0);
+
+	// cap at TLS 1.2 so the session ID or ticket arrives during the handshake; TLS 1.3 tickets are
+	// sent afterwards and would be missed by connections that are closed right away
+	SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	::SSL_CTX_sess_set_new_cb(ctx, onNewSession);
+
+	BIO* bio = ::BIO_new_mem_buf(pairRecord.hostCertificate.data(), (int)pairRecord.hostCertificate.length());
+	X509* cert = ::PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	::BIO_free(bio);
+
+	bio = ::BIO_new_mem_buf(pairRecord.hostPrivateKey.data(), (int)pairRecord.hostPrivateKey.length());
+	EVP_PKEY* key = ::PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+	::BIO_free(bio);
+
+	bool success = cert && key && ::SSL_CTX_use_certificate(ctx, cert) == 1 && ::SSL_CTX_use_PrivateKey(ctx, key) == 1;
+	::X509_free(cert);
+	::EVP_PKEY_free(key);
+
+	if (!success) {
+		std::string error = sslError();
+		::SSL_CTX_free(ctx);
+		throw std::runtime_error("Invalid pair record host certificate: " + error);
+	}
+}
+
+LockdownClient::~LockdownClient() {
+	disconnect();
+	::SSL_CTX_free(ctx);
+}
+
+/**
+ * Connects to lockdown and makes sure something that speaks lockdown is listening.
+ */
+void LockdownClient::connect() {
+	if (conn) {
+		return;
+	}
+
+	LOG_DEBUG_1("LockdownClient::connect", "Connecting to lockdown: %s", udid.c_str())
+	conn = std::make_unique<LockdownConnection>(connector(LOCKDOWN_PORT));
+
+	std::string type = queryType();
+	if (type != "com.apple.mobile.lockdown") {
+		conn.reset();
+		throw std::runtime_error("Unexpected lockdown type \"" + type + "\"");
+	}
+}
+
+/**
+ * Stops the session if there is one and closes the connection.
+ */
+void LockdownClient::disconnect() {
+	if (!conn) {
+		return;
+	}
+	if (!sessionId.empty()) {
+		try {
+			stopSession();
+		} catch (std::exception& e) {
+			LOG_DEBUG_2("LockdownClient::disconnect", "Failed to stop session for %s: %s", udid.c_str(), e.what())
+		}
+	}
+	LOG_DEBUG_1("LockdownClient::disconnect", "Disconnecting from lockdown: %s", udid.c_str())
+	conn.reset();
+	sessionId.clear();
+}
+
+/**
+ * Sends a request and waits for the response. Lockdown reports failures in an `Error` key.
+ */
+plist::Node* LockdownClient::request(plist::Node* req, plist::Arena& arena) {
+	connect();
+
+	std::string name = plist::dictGetString(req, "Request");
+	conn->sendPlist(req);
+
+	plist::Node* res = conn->recvPlist(arena);
+	if (!res) {
+		conn.reset();
+		sessionId.clear();
+		throw std::runtime_error("Lockdown closed the connection during \"" + name + "\"");
+	}
+
+	std::string error = plist::dictGetString(res, "Error");
+	if (!error.empty()) {
+		throw std::runtime_error("Lockdown request \"" + name + "\" failed: " + error);
+	}
+
+	return res;
+}
+
+std::string LockdownClient::queryType() {
+	plist::Arena arena;
+	plist::Node* res = request(plist::createDict(arena, {
+		{ "Label",   plist::createString(arena, LOCKDOWN_LABEL) },
+		{ "Request", plist::createString(arena, "QueryType") }
+	}), arena);
+	return plist::dictGetString(res, "Type");
+}
+
+/**
+ * Retrieves a value from lockdown. Omitting the key returns the whole domain. The returned node
+ * lives in `arena`, or NULL if lockdown didn't return a value.
+ */
+plist::Node* LockdownClient::getValue(const char* domain, const char* key, plist::Arena& arena) {
+	plist::Node* res = request(plist::createDict(arena, {
+		{ "Label",   plist::createString(arena, LOCKDOWN_LABEL) },
+		{ "Request", plist::createString(arena, "GetValue") },
+		{ "Domain",  domain ? plist::createString(arena, domain) : NULL },
+		{ "Key",     key ? plist::createString(arena, key) : NULL }
+	}), arena);
+	return const_cast<plist::Node*>(plist::dictGet(res, "Value"));
+}
+
+/**
+ * Starts a session using the pair record and upgrades the lockdown connection to TLS when asked.
+ */
+void LockdownClient::startSession() {
+	if (!sessionId.empty()) {
+		return;
+	}
+
+	LOG_DEBUG_1("LockdownClient::startSession", "Starting session: %s", udid.c_str())
+
+	plist::Arena arena;
+	plist::Node* res = request(plist::createDict(arena, {
+		{ "Label",      plist::createString(arena, LOCKDOWN_LABEL) },
+		{ "Request",    plist::createString(arena, "StartSession") },
+		{ "HostID",     plist::createString(arena, pairRecord.hostId) },
+		{ "SystemBUID", pairRecord.systemBUID.empty() ? NULL : plist::createString(arena, pairRecord.systemBUID) }
+	}), arena);
+
+	sessionId = plist::dictGetString(res, "SessionID");
+	if (sessionId.empty()) {
+		throw std::runtime_error("Lockdown did not return a session ID");
+	}
+
+	const plist::Node* ssl = plist::dictGet(res, "EnableSessionSSL");
+	if (ssl && ssl->type == plist::PlistBool && ssl->b) {
+		try {
+			conn->startTls(ctx, udid + "/lockdown");
+		} catch (...) {
+			conn.reset();
+			sessionId.clear();
+			throw;
+		}
+	}
+}
+
+void LockdownClient::stopSession() {
+	if (sessionId.empty()) {
+		return;
+	}
+
+	LOG_DEBUG_1("LockdownClient::stopSession", "Stopping session: %s", udid.c_str())
+
+	plist::Arena arena;
+	std::string id = sessionId;
+	sessionId.clear();
+	request(plist::createDict(arena, {
+		{ "Label",     plist::createString(arena, LOCKDOWN_LABEL) },
+		{ "Request",   plist::createString(arena, "StopSession") },
+		{ "SessionID", plist::createString(arena, id) }
+	}), arena);
+	conn->stopTls();
+}
+
+/**
+ * Asks lockdown to start a service, then connects to the port it returns and does the TLS
+ * handshake if the service requires one. A session is started first if there isn't one.
+ */
+LockdownService LockdownClient::startService(const std::string& name) {
+	startSession();
+
+	LOG_DEBUG_2("LockdownClient::startService", "Starting \'%s\' service: %s", name.c_str(), udid.c_str())
+
+	plist::Arena arena;
+	plist::Node* res = request(plist::createDict(arena, {
+		{ "Label",   plist::createString(arena, LOCKDOWN_LABEL) },
+		{ "Request", plist::createString(arena, "StartService") },
+		{ "Service", plist::createString(arena, name) }
+	}), arena);
+
+	const plist::Node* port = plist::dictGet(res, "Port");
+	if (!port || port->type != plist::PlistInteger || port->i <= 0 || port->i > 65535) {
+		throw std::runtime_error("Lockdown did not return a port for the \"" + name + "\" service");
+	}
+	const plist::Node* ssl = plist::dictGet(res, "EnableServiceSSL");
+
+	LockdownService service;
+	service.port = (uint16_t)port->i;
+	service.ssl = ssl && ssl->type == plist::PlistBool && ssl->b;
+	service.connection = std::make_unique<LockdownConnection>(connector(service.port));
+
+	if (service.ssl) {
+		service.connection->startTls(ctx, udid + "/" + name);
+	}
+
+	return service;
+}
+
+}
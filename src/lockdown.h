@@ -0,0 +1,134 @@
+#ifndef __LOCKDOWN_H__
+#define __LOCKDOWN_H__
+
+#include "node-ios-device.h"
+#include "plist.h"
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <openssl/ssl.h>
+#include <string>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+#define LOCKDOWN_PORT 62078
+#define USBMUXD_SOCKET_PATH "/var/run/usbmuxd"
+
+/**
+ * The host side of a pairing as stored by usbmuxd in `/var/db/lockdown` (macOS) or
+ * `/var/lib/lockdown` (Linux). The certificate and key are PEM encoded.
+ */
+struct PairRecord {
+	std::string hostId;
+	std::string systemBUID;
+	std::string hostCertificate;
+	std::string hostPrivateKey;
+
+	static PairRecord parse(const uint8_t* data, size_t len);
+	static PairRecord load(const std::string& path);
+};
+
+/**
+ * TLS sessions keyed by device and service. Lockdown and each service terminate TLS in their own
+ * process on the device, so a session is only ever resumed against the endpoint that issued it.
+ * Sessions are shared by every `LockdownClient` in the process.
+ */
+class TlsSessionCache {
+public:
+	~TlsSessionCache();
+
+	static TlsSessionCache& shared();
+
+	SSL_SESSION* get(const std::string& key);
+	void put(const std::string& key, SSL_SESSION* session);
+	void remove(const std::string& key);
+
+private:
+	std::mutex                          lock;
+	std::map<std::string, SSL_SESSION*> sessions;
+};
+
+/**
+ * A socket to lockdown or a service that is optionally upgraded to TLS. Messages are a 32-bit big
+ * endian length followed by a plist.
+ */
+class LockdownConnection {
+public:
+	LockdownConnection(int fd);
+	~LockdownConnection();
+
+	LockdownConnection(const LockdownConnection&) = delete;
+	LockdownConnection& operator=(const LockdownConnection&) = delete;
+
+	void startTls(SSL_CTX* ctx, const std::string& sessionKey);
+	void stopTls();
+
+	bool readFully(void* buffer, size_t len);
+	bool writeFully(const void* buffer, size_t len);
+
+	void sendPlist(const plist::Node* node);
+	plist::Node* recvPlist(plist::Arena& arena);
+
+	int         fd;
+	SSL*        ssl;
+	bool        resumed;
+	std::string sessionKey;
+};
+
+/**
+ * Opens a raw connection to a port on the device and returns the socket.
+ */
+typedef std::function<int(uint16_t port)> LockdownConnector;
+
+int tcpConnect(const std::string& host, uint16_t port);
+int usbmuxConnect(uint32_t deviceId, uint16_t port, const std::string& socketPath = USBMUXD_SOCKET_PATH);
+
+/**
+ * The result of starting a service.
+ */
+struct LockdownService {
+	uint16_t                            port;
+	bool                                ssl;
+	std::unique_ptr<LockdownConnection> connection;
+};
+
+/**
+ * A native implementation of the lockdown protocol for backends that don't have MobileDevice. It
+ * replaces `AMDeviceConnect()`, `AMDeviceStartSession()`, and `AMDeviceStartService()`.
+ *
+ * Every TLS handshake offers the last session for the same device and service, so only the first
+ * connection to each pays for a full handshake.
+ */
+class LockdownClient {
+public:
+	LockdownClient(const std::string& udid, const PairRecord& pairRecord, LockdownConnector connector);
+	~LockdownClient();
+
+	void connect();
+	void disconnect();
+
+	std::string queryType();
+	plist::Node* getValue(const char* domain, const char* key, plist::Arena& arena);
+	void startSession();
+	void stopSession();
+	LockdownService startService(const std::string& name);
+
+	bool sessionResumed() { return conn && conn->resumed; }
+
+private:
+	plist::Node* request(plist::Node* req, plist::Arena& arena);
+
+	std::string                         udid;
+	PairRecord                          pairRecord;
+	LockdownConnector                   connector;
+	SSL_CTX*                            ctx;
+	std::unique_ptr<LockdownConnection> conn;
+	std::string                         sessionId;
+};
+
+}
+
+#endif
@@ -76,7 +76,10 @@ extern "C" {
 #define AMSVC_AFC2                  "com.apple.afc2"
 #define AMSVC_BACKUP                "com.apple.mobilebackup"
 #define AMSVC_CRASH_REPORT_COPY     "com.apple.crashreportcopy"
+#define AMSVC_CRASH_REPORT_COPY_MOBILE "com.apple.crashreportcopymobile"
+#define AMSVC_CRASH_REPORT_MOVER    "com.apple.crashreportmover"
 #define AMSVC_DEBUG_IMAGE_MOUNT     "com.apple.mobile.debug_image_mount"
+#define AMSVC_DIAGNOSTICS_RELAY     "com.apple.mobile.diagnostics_relay"
 #define AMSVC_NOTIFICATION_PROXY    "com.apple.mobile.notification_proxy"
 #define AMSVC_PURPLE_TEST           "com.apple.purpletestr"
 #define AMSVC_SOFTWARE_UPDATE       "com.apple.mobile.software_update"
@@ -85,6 +88,9 @@ extern "C" {
 #define AMSVC_SYSLOG_RELAY          "com.apple.syslog_relay"
 #define AMSVC_SYSTEM_PROFILER       "com.apple.mobile.system_profiler"
 #define AMSVC_FILE_RELAY            "com.apple.mobile.file_relay"
+#define AMSVC_HOUSE_ARREST          "com.apple.mobile.house_arrest"
+#define AMSVC_INSTALLATION_PROXY    "com.apple.mobile.installation_proxy"
+#define AMSVC_MOBILE_IMAGE_MOUNTER  "com.apple.mobile.mobile_image_mounter"
 #define AMSVC_WEB_INSPECTOR         "com.apple.webinspector"
 
 typedef uint32_t afc_error_t;
@@ -260,6 +266,22 @@ afc_error_t AFCDirectoryAccessOpen(
 	uint32_t io_timeout,
     afc_connection *conn);
 
+/* Opens an Apple File Connection on a service socket returned by
+ * AMDeviceStartService(). This is the variant used with service_conn_t
+ * handles. Close with AFCConnectionClose().
+ *
+ * Returns:
+ *      MDERR_OK                if successful
+ */
+
+afc_error_t AFCConnectionOpen(
+	service_conn_t handle,
+	uint32_t io_timeout,
+	afc_connection *conn);
+
+afc_error_t AFCConnectionClose(
+	afc_connection conn);
+
 /* Retrieves an afc_dictionary that describes the connected device.  To
  * extract values from the dictionary, use AFCKeyValueRead() and close
  * it when finished with AFCKeyValueClose()
@@ -429,11 +451,21 @@ uint32_t AMDeviceGetInterfaceType(
 uint32_t AMDeviceGetInterfaceSpeed(
 	am_device device); // { return 0x78000; }
 
+/* Returns the USB location id of the port the device is plugged into,
+ * e.g. 0x14200000 for port 2 on bus 0x14, or 0 for Wi-Fi interfaces.
+ */
+uint32_t AMDeviceUSBLocationID(
+	am_device device);
+
 /* Reads various device settings; returns nil if no value is found for
  * the nominated key
  *
  * Must be balanced by CFRelease()
  *
+ * The domain is NULL for the values below. Other domains, such as
+ * com.apple.disk_usage or com.apple.mobile.battery, return their values
+ * for the key, or all of them as a dictionary when the key is NULL.
+ *
  * Possible values for key:
  * ActivationState
  * ActivationStateAcknowledged
@@ -471,7 +503,7 @@ uint32_t AMDeviceGetInterfaceSpeed(
  */
 void* AMDeviceCopyValue(
 	am_device device,
-	uint32_t mbz,
+	CFStringRef domain,
 	CFStringRef key);
 
 /*
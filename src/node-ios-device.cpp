@@ -1,8 +1,23 @@
 #include "node-ios-device.h"
+#include "deadline.h"
 #include "deviceman.h"
+#include "fingerprint.h"
+#include "install-progress.h"
+#include "install-queue.h"
+#include "lockdown.h"
+#include "pairing-cache.h"
+#include "plist.h"
+#include "service.h"
+#include "usb-scheduler.h"
+#include <condition_variable>
+#include <queue>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
 
 namespace node_ios_device {
 	std::shared_ptr<DeviceMan> deviceman = NULL;
+	std::shared_ptr<InstallQueue> installQueue = NULL;
 	napi_ref logRef = NULL;
 	LOG_DEBUG_VARS
 }
@@ -123,38 +138,1640 @@ std::string napi_string_to_std_string(napi_env env, napi_value str) {
 	return rval;
 }
 
+/**
+ * Helper function that converts a list of std strings into a JavaScript array.
+ */
+napi_value std_strings_to_napi_array(napi_env env, const std::vector<std::string>& strs) {
+	napi_value rval;
+	NAPI_THROW_RETURN("std_strings_to_napi_array", "ERR_NAPI_CREATE_ARRAY", napi_create_array_with_length(env, strs.size(), &rval), NULL)
+	for (size_t i = 0; i < strs.size(); ++i) {
+		napi_value str;
+		NAPI_THROW_RETURN("std_strings_to_napi_array", "ERR_NAPI_CREATE_STRING", napi_create_string_utf8(env, strs[i].c_str(), strs[i].length(), &str), NULL)
+		NAPI_THROW_RETURN("std_strings_to_napi_array", "ERR_NAPI_SET_ELEMENT", napi_set_element(env, rval, (uint32_t)i, str), NULL)
+	}
+	return rval;
+}
+
+/**
+ * afcSnapshot()
+ * Walks a directory tree on the specified iOS device and returns it as a packed snapshot.
+ */
+NAPI_METHOD(afcSnapshot) {
+	NAPI_ARGV(5);
+	napi_value rval;
+
+	try {
+		std::string udid = napi_string_to_std_string(env, argv[0]);
+		std::shared_ptr<Device> device = deviceman->getDevice(udid);
+		std::string service = napi_string_to_std_string(env, argv[1]);
+		std::string bundleId = napi_string_to_std_string(env, argv[2]);
+		std::string root = napi_string_to_std_string(env, argv[3]);
+
+		uint32_t concurrency = 4;
+		napi_get_value_uint32(env, argv[4], &concurrency);
+
+		std::vector<uint8_t> packed = device->afcSnapshot(service, bundleId, root, concurrency).pack();
+
+		void* dest;
+		NAPI_THROW_RETURN("afcSnapshot", "ERR_NAPI_CREATE_BUFFER_COPY", napi_create_buffer_copy(env, packed.size(), packed.data(), &dest, &rval), NULL)
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("afcSnapshot", "%s", msg)
+		NAPI_THROW_ERROR(errorCode(e, "ERR_AFC_SNAPSHOT"), msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * Reads a packed snapshot from a Buffer.
+ */
+static AfcSnapshot napiToAfcSnapshot(napi_env env, napi_value value) {
+	void* data = NULL;
+	size_t len = 0;
+	bool isBuffer = false;
+
+	if (napi_is_buffer(env, value, &isBuffer) != napi_ok || !isBuffer || napi_get_buffer_info(env, value, &data, &len) != napi_ok) {
+		throw std::runtime_error("Expected snapshot to be a Buffer");
+	}
+
+	return AfcSnapshot::unpack(static_cast<const uint8_t*>(data), len);
+}
+
+/**
+ * afcSnapshotDiff()
+ * Compares two packed snapshots and returns the paths that were added, removed, or changed.
+ */
+NAPI_METHOD(afcSnapshotDiff) {
+	NAPI_ARGV(2);
+	napi_value rval;
+
+	try {
+		AfcSnapshotDiff diff = diffAfcSnapshots(napiToAfcSnapshot(env, argv[0]), napiToAfcSnapshot(env, argv[1]));
+
+		NAPI_THROW_RETURN("afcSnapshotDiff", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+		NAPI_THROW_RETURN("afcSnapshotDiff", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "added", std_strings_to_napi_array(env, diff.added)), NULL)
+		NAPI_THROW_RETURN("afcSnapshotDiff", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "removed", std_strings_to_napi_array(env, diff.removed)), NULL)
+		NAPI_THROW_RETURN("afcSnapshotDiff", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "changed", std_strings_to_napi_array(env, diff.changed)), NULL)
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		NAPI_THROW_ERROR(errorCode(e, "ERR_AFC_SNAPSHOT"), msg, ::strlen(msg), NULL)
+	}
+
+	return rval;
+}
+
+/**
+ * afcSnapshotEntries()
+ * Expands a packed snapshot into an array of entries.
+ */
+NAPI_METHOD(afcSnapshotEntries) {
+	NAPI_ARGV(1);
+	napi_value rval;
+
+	try {
+		AfcSnapshot snapshot = napiToAfcSnapshot(env, argv[0]);
+
+		NAPI_THROW_RETURN("afcSnapshotEntries", "ERR_NAPI_CREATE_ARRAY", napi_create_array_with_length(env, snapshot.count(), &rval), NULL)
+		for (size_t i = 0; i < snapshot.count(); ++i) {
+			napi_value obj, tmp;
+			NAPI_THROW_RETURN("afcSnapshotEntries", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &obj), NULL)
+			NAPI_THROW_RETURN("afcSnapshotEntries", "ERR_NAPI_CREATE_STRING", napi_create_string_utf8(env, snapshot.path(i), NAPI_AUTO_LENGTH, &tmp), NULL)
+			NAPI_THROW_RETURN("afcSnapshotEntries", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, obj, "path", tmp), NULL)
+			NAPI_THROW_RETURN("afcSnapshotEntries", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, snapshot.dirs[i] != AFC_ENTRY_FILE, &tmp), NULL)
+			NAPI_THROW_RETURN("afcSnapshotEntries", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, obj, "isDirectory", tmp), NULL)
+			NAPI_THROW_RETURN("afcSnapshotEntries", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, snapshot.dirs[i] == AFC_ENTRY_UNREADABLE_DIR, &tmp), NULL)
+			NAPI_THROW_RETURN("afcSnapshotEntries", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, obj, "unreadable", tmp), NULL)
+			NAPI_THROW_RETURN("afcSnapshotEntries", "ERR_NAPI_CREATE_DOUBLE", napi_create_double(env, (double)snapshot.sizes[i], &tmp), NULL)
+			NAPI_THROW_RETURN("afcSnapshotEntries", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, obj, "size", tmp), NULL)
+			NAPI_THROW_RETURN("afcSnapshotEntries", "ERR_NAPI_CREATE_DOUBLE", napi_create_double(env, (double)(snapshot.mtimes[i] / 1000000), &tmp), NULL)
+			NAPI_THROW_RETURN("afcSnapshotEntries", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, obj, "mtimeMs", tmp), NULL)
+			NAPI_THROW_RETURN("afcSnapshotEntries", "ERR_NAPI_SET_ELEMENT", napi_set_element(env, rval, (uint32_t)i, obj), NULL)
+		}
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		NAPI_THROW_ERROR(errorCode(e, "ERR_AFC_SNAPSHOT"), msg, ::strlen(msg), NULL)
+	}
+
+	return rval;
+}
+
+/**
+ * apps()
+ * Retrieves the apps installed on the specified iOS device, or passes them to a callback a page at
+ * a time.
+ */
+NAPI_METHOD(apps) {
+	NAPI_ARGV(4);
+	napi_value rval;
+
+	try {
+		std::string udid = napi_string_to_std_string(env, argv[0]);
+		std::shared_ptr<Device> device = deviceman->getDevice(udid);
+		rval = device->apps(argv[1], argv[2], argv[3]);
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("apps", "%s", msg)
+
+		// if the page callback threw, let its exception propagate
+		bool pending = false;
+		napi_is_exception_pending(env, &pending);
+		if (pending) {
+			flushLog(env);
+			return NULL;
+		}
+		NAPI_THROW_ERROR(errorCode(e, "ERR_APPS"), msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * Reads the diagnostic keys and the TTL of each key in milliseconds. Throws if the keys aren't an
+ * array of strings or the TTLs aren't an array of numbers of the same length.
+ */
+static void napiToDiagnosticsArgs(napi_env env, napi_value nkeys, napi_value nttls, std::vector<std::string>& keys, std::vector<uint64_t>& ttls) {
+	bool isArray = false;
+	uint32_t count = 0;
+	uint32_t ttlCount = 0;
+
+	if (::napi_is_array(env, nkeys, &isArray) != napi_ok || !isArray) {
+		throw std::runtime_error("Expected keys to be an array of strings");
+	}
+	if (::napi_is_array(env, nttls, &isArray) != napi_ok || !isArray) {
+		throw std::runtime_error("Expected TTLs to be an array of numbers");
+	}
+	::napi_get_array_length(env, nkeys, &count);
+	::napi_get_array_length(env, nttls, &ttlCount);
+	if (count != ttlCount) {
+		throw std::runtime_error("Expected a TTL for every key");
+	}
+
+	for (uint32_t i = 0; i < count; ++i) {
+		napi_value key, ttl;
+		napi_valuetype type;
+		double ms = 0;
+		if (::napi_get_element(env, nkeys, i, &key) != napi_ok || ::napi_typeof(env, key, &type) != napi_ok || type != napi_string) {
+			throw std::runtime_error("Expected keys to be an array of strings");
+		}
+		if (::napi_get_element(env, nttls, i, &ttl) != napi_ok || ::napi_get_value_double(env, ttl, &ms) != napi_ok) {
+			throw std::runtime_error("Expected TTLs to be an array of numbers");
+		}
+		keys.push_back(napi_string_to_std_string(env, key));
+		ttls.push_back(ms > 0 ? (uint64_t)ms : 0);
+	}
+}
+
+/**
+ * Creates an object with a property for every requested key. Keys the device doesn't have are
+ * `null`.
+ */
+static napi_value diagnosticsToJS(napi_env env, const std::vector<std::string>& keys, CFDictionaryRef values) {
+	napi_value rval;
+	NAPI_THROW_RETURN("diagnostics", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+	for (auto const& key : keys) {
+		CFStringRef cfkey = createCFString(key);
+		CFTypeRef value = values ? ::CFDictionaryGetValue(values, cfkey) : NULL;
+		::CFRelease(cfkey);
+		NAPI_THROW_RETURN("diagnostics", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, key.c_str(), cfToJS(env, value)), NULL)
+	}
+	return rval;
+}
+
+/**
+ * diagnostics()
+ * Retrieves diagnostic values such as the battery level and free disk space from the specified
+ * iOS device.
+ */
+NAPI_METHOD(diagnostics) {
+	NAPI_ARGV(3);
+	napi_value rval;
+
+	try {
+		std::string udid = napi_string_to_std_string(env, argv[0]);
+		std::shared_ptr<Device> device = deviceman->getDevice(udid);
+
+		std::vector<std::string> keys;
+		std::vector<uint64_t> ttls;
+		napiToDiagnosticsArgs(env, argv[1], argv[2], keys, ttls);
+
+		CFDictionaryRef values = device->diagnostics(keys, ttls);
+		rval = diagnosticsToJS(env, keys, values);
+		::CFRelease(values);
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("diagnostics", "%s", msg)
+		NAPI_THROW_ERROR(errorCode(e, "ERR_DIAGNOSTICS"), msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * diagnosticsAll()
+ * Retrieves diagnostic values from every connected iOS device in parallel.
+ */
+NAPI_METHOD(diagnosticsAll) {
+	NAPI_ARGV(3);
+	napi_value rval;
+
+	std::vector<std::string> keys;
+	std::vector<uint64_t> ttls;
+	uint32_t concurrency = 4;
+	try {
+		napiToDiagnosticsArgs(env, argv[0], argv[1], keys, ttls);
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		NAPI_THROW_ERROR("ERR_DIAGNOSTICS", msg, ::strlen(msg), NULL)
+	}
+	napi_get_value_uint32(env, argv[2], &concurrency);
+
+	std::vector<DeviceDiagnosticsResult> results = deviceman->diagnosticsAll(keys, ttls, concurrency);
+
+	NAPI_THROW_RETURN("diagnosticsAll", "ERR_NAPI_CREATE_ARRAY", napi_create_array_with_length(env, results.size(), &rval), NULL)
+	for (size_t i = 0; i < results.size(); ++i) {
+		napi_value obj, tmp;
+		NAPI_THROW_RETURN("diagnosticsAll", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &obj), NULL)
+		NAPI_THROW_RETURN("diagnosticsAll", "ERR_NAPI_CREATE_STRING", napi_create_string_utf8(env, results[i].udid.c_str(), results[i].udid.length(), &tmp), NULL)
+		NAPI_THROW_RETURN("diagnosticsAll", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, obj, "udid", tmp), NULL)
+		if (results[i].values) {
+			tmp = diagnosticsToJS(env, keys, results[i].values);
+			::CFRelease(results[i].values);
+			NAPI_THROW_RETURN("diagnosticsAll", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, obj, "values", tmp), NULL)
+		} else {
+			napi_value code, msg;
+			NAPI_THROW_RETURN("diagnosticsAll", "ERR_NAPI_CREATE_STRING", napi_create_string_utf8(env, "ERR_DIAGNOSTICS", NAPI_AUTO_LENGTH, &code), NULL)
+			NAPI_THROW_RETURN("diagnosticsAll", "ERR_NAPI_CREATE_STRING", napi_create_string_utf8(env, results[i].error.c_str(), results[i].error.length(), &msg), NULL)
+			NAPI_THROW_RETURN("diagnosticsAll", "ERR_NAPI_CREATE_ERROR", napi_create_error(env, code, msg, &tmp), NULL)
+			NAPI_THROW_RETURN("diagnosticsAll", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, obj, "error", tmp), NULL)
+		}
+		NAPI_THROW_RETURN("diagnosticsAll", "ERR_NAPI_SET_ELEMENT", napi_set_element(env, rval, (uint32_t)i, obj), NULL)
+	}
+
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * Passes the entries of a file relay archive to a JavaScript function as they're decoded. Each
+ * call gets its own handle scope so that memory doesn't grow with the size of the archive.
+ */
+class CallbackSink : public FileRelaySink {
+public:
+	CallbackSink(napi_env env, napi_value fn) : env(env), fn(fn), entryRef(NULL) {}
+
+	~CallbackSink() {
+		if (entryRef) {
+			::napi_delete_reference(env, entryRef);
+		}
+	}
+
+	void begin(const CpioEntry& entry) {
+		napi_value obj, tmp;
+		const char* type = S_ISREG(entry.mode) ? "file" : S_ISDIR(entry.mode) ? "directory" : S_ISLNK(entry.mode) ? "symlink" : "other";
+
+		Scope scope(*this);
+		check(::napi_create_object(env, &obj));
+		check(::napi_create_string_utf8(env, entry.name.c_str(), entry.name.length(), &tmp));
+		check(::napi_set_named_property(env, obj, "name", tmp));
+		check(::napi_create_string_utf8(env, type, NAPI_AUTO_LENGTH, &tmp));
+		check(::napi_set_named_property(env, obj, "type", tmp));
+		check(::napi_create_uint32(env, entry.mode & 07777, &tmp));
+		check(::napi_set_named_property(env, obj, "mode", tmp));
+		check(::napi_create_double(env, (double)entry.size, &tmp));
+		check(::napi_set_named_property(env, obj, "size", tmp));
+		check(::napi_create_double(env, (double)entry.mtime * 1000, &tmp));
+		check(::napi_set_named_property(env, obj, "mtimeMs", tmp));
+		if (entryRef) {
+			::napi_delete_reference(env, entryRef);
+			entryRef = NULL;
+		}
+		check(::napi_create_reference(env, obj, 1, &entryRef));
+	}
+
+	void data(const uint8_t* data, size_t len) {
+		napi_value chunk;
+		void* dest;
+
+		Scope scope(*this);
+		check(::napi_create_buffer_copy(env, len, data, &dest, &chunk));
+		call(chunk);
+	}
+
+	void end() {
+		{
+			napi_value chunk;
+
+			Scope scope(*this);
+			check(::napi_get_null(env, &chunk));
+			call(chunk);
+		}
+
+		::napi_delete_reference(env, entryRef);
+		entryRef = NULL;
+	}
+
+private:
+	/**
+	 * Opens a handle scope and closes it when it goes out of scope. The callback may throw, and
+	 * the JavaScript exception is left pending for the caller, so the scope has to be closed on
+	 * the way out or Node aborts on the unbalanced scope.
+	 */
+	class Scope {
+	public:
+		Scope(CallbackSink& sink) : env(sink.env), scope(NULL) {
+			sink.check(::napi_open_handle_scope(env, &scope));
+		}
+
+		~Scope() {
+			if (scope) {
+				::napi_close_handle_scope(env, scope);
+			}
+		}
+
+	private:
+		napi_env          env;
+		napi_handle_scope scope;
+	};
+
+	void call(napi_value chunk) {
+		napi_value global, argv[2], rval;
+		check(::napi_get_global(env, &global));
+		check(::napi_get_reference_value(env, entryRef, &argv[0]));
+		argv[1] = chunk;
+		check(::napi_call_function(env, global, fn, 2, argv, &rval));
+	}
+
+	void check(napi_status status) {
+		if (status != napi_ok) {
+			throw std::runtime_error("Failed to pass file relay entry to callback");
+		}
+	}
+
+	napi_env   env;
+	napi_value fn;
+	napi_ref   entryRef;
+};
+
+/**
+ * fileRelay()
+ * Retrieves diagnostic sources from the specified iOS device and writes them to a directory or
+ * passes them to a callback.
+ */
+NAPI_METHOD(fileRelay) {
+	NAPI_ARGV(3);
+	napi_value rval;
+	napi_valuetype type;
+
+	try {
+		std::string udid = napi_string_to_std_string(env, argv[0]);
+		std::shared_ptr<Device> device = deviceman->getDevice(udid);
+
+		std::vector<std::string> sources;
+		uint32_t count = 0;
+		napi_get_array_length(env, argv[1], &count);
+		for (uint32_t i = 0; i < count; ++i) {
+			napi_value source;
+			NAPI_THROW_RETURN("fileRelay", "ERR_NAPI_GET_ELEMENT", napi_get_element(env, argv[1], i, &source), NULL)
+			sources.push_back(napi_string_to_std_string(env, source));
+		}
+
+		FileRelayResult result;
+		NAPI_THROW_RETURN("fileRelay", "ERR_NAPI_TYPEOF", napi_typeof(env, argv[2], &type), NULL)
+		if (type == napi_function) {
+			CallbackSink sink(env, argv[2]);
+			result = device->fileRelay(sources, sink);
+		} else {
+			DirectorySink sink(napi_string_to_std_string(env, argv[2]));
+			result = device->fileRelay(sources, sink);
+		}
+
+		napi_value tmp;
+		NAPI_THROW_RETURN("fileRelay", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+		NAPI_THROW_RETURN("fileRelay", "ERR_NAPI_CREATE_DOUBLE", napi_create_double(env, (double)result.entries, &tmp), NULL)
+		NAPI_THROW_RETURN("fileRelay", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "entries", tmp), NULL)
+		NAPI_THROW_RETURN("fileRelay", "ERR_NAPI_CREATE_DOUBLE", napi_create_double(env, (double)result.bytes, &tmp), NULL)
+		NAPI_THROW_RETURN("fileRelay", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "bytes", tmp), NULL)
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("fileRelay", "%s", msg)
+
+		// if the callback threw, let its exception propagate
+		bool pending = false;
+		napi_is_exception_pending(env, &pending);
+		if (pending) {
+			flushLog(env);
+			return NULL;
+		}
+		NAPI_THROW_ERROR(errorCode(e, "ERR_FILE_RELAY"), msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	return rval;
+}
+
 /**
  * install()
  * Installs an app to the specified iOS device.
  */
-NAPI_METHOD(install) {
+NAPI_METHOD(install) {
+	NAPI_ARGV(4);
+	napi_value rval;
+
+	try {
+		std::string udid = napi_string_to_std_string(env, argv[0]);
+		std::shared_ptr<Device> device = deviceman->getDevice(udid);
+		std::string appPath = napi_string_to_std_string(env, argv[1]);
+
+		bool skipIfUnchanged = false;
+		std::string recordDir;
+		napi_get_value_bool(env, argv[2], &skipIfUnchanged);
+		if (skipIfUnchanged) {
+			recordDir = napi_string_to_std_string(env, argv[3]);
+		}
+
+		bool skipped = device->install(appPath, skipIfUnchanged, recordDir);
+
+		napi_value tmp;
+		NAPI_THROW_RETURN("install", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+		NAPI_THROW_RETURN("install", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, skipped, &tmp), NULL)
+		NAPI_THROW_RETURN("install", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "skipped", tmp), NULL)
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("install", "%s", msg)
+		NAPI_THROW_ERROR(errorCode(e, "ERR_INSTALL"), msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * installQueueAdd()
+ * Queues an install in the background and returns the request id and a promise that settles when
+ * the install completes. The optional progress callback receives rate limited progress events.
+ */
+NAPI_METHOD(installQueueAdd) {
+	NAPI_ARGV(6);
+	napi_value rval;
+
+	try {
+		std::string udid = napi_string_to_std_string(env, argv[0]);
+		std::shared_ptr<Device> device = deviceman->getDevice(udid);
+		std::string appPath = napi_string_to_std_string(env, argv[1]);
+
+		bool skipIfUnchanged = false;
+		std::string recordDir;
+		napi_get_value_bool(env, argv[2], &skipIfUnchanged);
+		if (skipIfUnchanged) {
+			recordDir = napi_string_to_std_string(env, argv[3]);
+		}
+
+		uint32_t progressInterval = 250;
+		napi_get_value_uint32(env, argv[5], &progressInterval);
+
+		napi_deferred deferred;
+		napi_value promise, id;
+		NAPI_THROW_RETURN("installQueueAdd", "ERR_NAPI_CREATE_PROMISE", napi_create_promise(env, &deferred, &promise), NULL)
+		NAPI_THROW_RETURN("installQueueAdd", "ERR_NAPI_CREATE_UINT32", napi_create_uint32(env, installQueue->add(device, udid, appPath, skipIfUnchanged, recordDir, deferred, argv[4], progressInterval), &id), NULL)
+		NAPI_THROW_RETURN("installQueueAdd", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+		NAPI_THROW_RETURN("installQueueAdd", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "id", id), NULL)
+		NAPI_THROW_RETURN("installQueueAdd", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "promise", promise), NULL)
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("installQueueAdd", "%s", msg)
+		NAPI_THROW_ERROR(errorCode(e, "ERR_INSTALL"), msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * installQueueCancel()
+ * Cancels a queued or running install request. Returns false if it has already completed.
+ */
+NAPI_METHOD(installQueueCancel) {
+	NAPI_ARGV(1);
+	uint32_t id = 0;
+	napi_value rval;
+
+	NAPI_THROW_RETURN("installQueueCancel", "ERR_NAPI_GET_VALUE_UINT32", napi_get_value_uint32(env, argv[0], &id), NULL)
+	NAPI_THROW_RETURN("installQueueCancel", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, installQueue->cancel(id), &rval), NULL)
+
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * installAll()
+ * Installs several apps to the specified iOS device. Each app is staged over AFC and installed by
+ * the installation proxy, and the next app is staged while the current app is installing.
+ */
+NAPI_METHOD(installAll) {
+	NAPI_ARGV(4);
+	napi_value rval;
+
+	try {
+		std::string udid = napi_string_to_std_string(env, argv[0]);
+		std::shared_ptr<Device> device = deviceman->getDevice(udid);
+
+		std::vector<std::string> appPaths;
+		uint32_t count = 0;
+		napi_get_array_length(env, argv[1], &count);
+		for (uint32_t i = 0; i < count; ++i) {
+			napi_value appPath;
+			NAPI_THROW_RETURN("installAll", "ERR_NAPI_GET_ELEMENT", napi_get_element(env, argv[1], i, &appPath), NULL)
+			appPaths.push_back(napi_string_to_std_string(env, appPath));
+		}
+
+		bool skipIfUnchanged = false;
+		std::string recordDir;
+		napi_get_value_bool(env, argv[2], &skipIfUnchanged);
+		if (skipIfUnchanged) {
+			recordDir = napi_string_to_std_string(env, argv[3]);
+		}
+
+		std::vector<AppInstallResult> results = device->installAll(appPaths, skipIfUnchanged, recordDir);
+
+		NAPI_THROW_RETURN("installAll", "ERR_NAPI_CREATE_ARRAY", napi_create_array_with_length(env, results.size(), &rval), NULL)
+		for (size_t i = 0; i < results.size(); ++i) {
+			napi_value obj, tmp;
+			NAPI_THROW_RETURN("installAll", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &obj), NULL)
+			NAPI_THROW_RETURN("installAll", "ERR_NAPI_CREATE_STRING", napi_create_string_utf8(env, results[i].appPath.c_str(), results[i].appPath.length(), &tmp), NULL)
+			NAPI_THROW_RETURN("installAll", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, obj, "appPath", tmp), NULL)
+			NAPI_THROW_RETURN("installAll", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, results[i].skipped, &tmp), NULL)
+			NAPI_THROW_RETURN("installAll", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, obj, "skipped", tmp), NULL)
+			if (!results[i].error.empty()) {
+				napi_value code, msg;
+				NAPI_THROW_RETURN("installAll", "ERR_NAPI_CREATE_STRING", napi_create_string_utf8(env, results[i].code.empty() ? "ERR_INSTALL" : results[i].code.c_str(), NAPI_AUTO_LENGTH, &code), NULL)
+				NAPI_THROW_RETURN("installAll", "ERR_NAPI_CREATE_STRING", napi_create_string_utf8(env, results[i].error.c_str(), results[i].error.length(), &msg), NULL)
+				NAPI_THROW_RETURN("installAll", "ERR_NAPI_CREATE_ERROR", napi_create_error(env, code, msg, &tmp), NULL)
+				NAPI_THROW_RETURN("installAll", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, obj, "error", tmp), NULL)
+			}
+			NAPI_THROW_RETURN("installAll", "ERR_NAPI_SET_ELEMENT", napi_set_element(env, rval, (uint32_t)i, obj), NULL)
+		}
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("installAll", "%s", msg)
+		NAPI_THROW_ERROR(errorCode(e, "ERR_INSTALL"), msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * list()
+ * Retrieves a list all connected iOS devices.
+ */
+NAPI_METHOD(list) {
+	napi_value rval = deviceman->list();
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * mountDeveloperImage()
+ * Mounts the developer disk image on the specified iOS device.
+ */
+NAPI_METHOD(mountDeveloperImage) {
+	NAPI_ARGV(3);
+	napi_value rval;
+
+	try {
+		std::string udid = napi_string_to_std_string(env, argv[0]);
+		std::shared_ptr<Device> device = deviceman->getDevice(udid);
+		std::string imagePath = napi_string_to_std_string(env, argv[1]);
+		std::string sigPath = napi_string_to_std_string(env, argv[2]);
+
+		DeveloperImageMountResult result = device->mountDeveloperImage(imagePath, sigPath);
+
+		napi_value tmp;
+		NAPI_THROW_RETURN("mountDeveloperImage", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+		NAPI_THROW_RETURN("mountDeveloperImage", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, result.alreadyMounted, &tmp), NULL)
+		NAPI_THROW_RETURN("mountDeveloperImage", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "alreadyMounted", tmp), NULL)
+		NAPI_THROW_RETURN("mountDeveloperImage", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, result.differentImage, &tmp), NULL)
+		NAPI_THROW_RETURN("mountDeveloperImage", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "differentImage", tmp), NULL)
+		NAPI_THROW_RETURN("mountDeveloperImage", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, result.uploaded, &tmp), NULL)
+		NAPI_THROW_RETURN("mountDeveloperImage", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "uploaded", tmp), NULL)
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("mountDeveloperImage", "%s", msg)
+		NAPI_THROW_ERROR(errorCode(e, "ERR_MOUNT_DEVELOPER_IMAGE"), msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * plistParse()
+ * Parses a binary or XML plist from a Buffer or string.
+ */
+NAPI_METHOD(plistParse) {
+	NAPI_ARGV(1);
+	napi_value rval;
+	napi_valuetype type;
+	bool isBuffer = false;
+	std::string str;
+	void* data = NULL;
+	size_t len = 0;
+
+	NAPI_THROW_RETURN("plistParse", "ERR_NAPI_TYPEOF", napi_typeof(env, argv[0], &type), NULL)
+	if (type == napi_string) {
+		str = napi_string_to_std_string(env, argv[0]);
+		data = &str[0];
+		len = str.length();
+	} else if (napi_is_buffer(env, argv[0], &isBuffer) == napi_ok && isBuffer) {
+		NAPI_THROW_RETURN("plistParse", "ERR_NAPI_GET_BUFFER_INFO", napi_get_buffer_info(env, argv[0], &data, &len), NULL)
+	} else {
+		NAPI_THROW_ERROR("ERR_PLIST_PARSE", "Expected plist to be a Buffer or string", NAPI_AUTO_LENGTH, NULL)
+	}
+
+	try {
+		plist::Arena arena;
+		plist::Node* root = plist::parse(static_cast<const uint8_t*>(data), len, arena);
+		rval = plist::toJS(env, root);
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		NAPI_THROW_ERROR("ERR_PLIST_PARSE", msg, ::strlen(msg), NULL)
+	}
+
+	return rval;
+}
+
+/**
+ * plistEncode()
+ * Serializes a value as a binary or XML plist and returns it as a Buffer.
+ */
+NAPI_METHOD(plistEncode) {
+	NAPI_ARGV(2);
+	napi_value rval;
+	bool xml = false;
+
+	NAPI_THROW_RETURN("plistEncode", "ERR_NAPI_GET_VALUE_BOOL", napi_get_value_bool(env, argv[1], &xml), NULL)
+
+	try {
+		plist::Arena arena;
+		plist::Node* root = plist::fromJS(env, argv[0], arena);
+		if (!root) {
+			throw std::runtime_error("Expected value to not be null or undefined");
+		}
+
+		std::vector<uint8_t> out;
+		if (xml) {
+			plist::writeXml(root, out);
+		} else {
+			plist::writeBinary(root, out);
+		}
+
+		void* dest;
+		NAPI_THROW_RETURN("plistEncode", "ERR_NAPI_CREATE_BUFFER_COPY", napi_create_buffer_copy(env, out.size(), out.data(), &dest, &rval), NULL)
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		NAPI_THROW_ERROR("ERR_PLIST_ENCODE", msg, ::strlen(msg), NULL)
+	}
+
+	return rval;
+}
+
+/**
+ * Holds a native lockdown client for a JavaScript handle. The client is released when the handle
+ * is closed or garbage collected.
+ */
+struct LockdownHandle {
+	std::unique_ptr<LockdownClient> client;
+};
+
+static void finalizeLockdownHandle(napi_env env, void* data, void* hint) {
+	delete static_cast<LockdownHandle*>(data);
+}
+
+static LockdownClient* getLockdownClient(napi_env env, napi_value external) {
+	void* data = NULL;
+	if (napi_get_value_external(env, external, &data) != napi_ok || !data || !static_cast<LockdownHandle*>(data)->client) {
+		throw std::runtime_error("Lockdown client is closed");
+	}
+	return static_cast<LockdownHandle*>(data)->client.get();
+}
+
+/**
+ * lockdownConnect()
+ * Creates a native lockdown client that connects over TCP when a host is given, otherwise through
+ * usbmuxd. The connection is made lazily by the first request. When no pair record is given, the
+ * device's record is taken from the pairing cache for the record directory.
+ */
+NAPI_METHOD(lockdownConnect) {
+	NAPI_ARGV(7);
+	napi_value rval;
+	napi_valuetype type;
+	void* data = NULL;
+	size_t len = 0;
+	uint32_t port = LOCKDOWN_PORT;
+	uint32_t deviceId = 0;
+
+	std::string udid = napi_string_to_std_string(env, argv[0]);
+	NAPI_THROW_RETURN("lockdownConnect", "ERR_NAPI_TYPEOF", napi_typeof(env, argv[1], &type), NULL)
+	bool cachedRecord = type == napi_undefined;
+	if (!cachedRecord) {
+		NAPI_THROW_RETURN("lockdownConnect", "ERR_NAPI_GET_BUFFER_INFO", napi_get_buffer_info(env, argv[1], &data, &len), NULL)
+	}
+	NAPI_THROW_RETURN("lockdownConnect", "ERR_NAPI_TYPEOF", napi_typeof(env, argv[6], &type), NULL)
+	std::string recordDir = type == napi_string ? napi_string_to_std_string(env, argv[6]) : PAIRING_RECORD_DIR;
+	NAPI_THROW_RETURN("lockdownConnect", "ERR_NAPI_TYPEOF", napi_typeof(env, argv[2], &type), NULL)
+	std::string host = type == napi_string ? napi_string_to_std_string(env, argv[2]) : "";
+	napi_get_value_uint32(env, argv[3], &port);
+	napi_get_value_uint32(env, argv[4], &deviceId);
+	NAPI_THROW_RETURN("lockdownConnect", "ERR_NAPI_TYPEOF", napi_typeof(env, argv[5], &type), NULL)
+	std::string socketPath = type == napi_string ? napi_string_to_std_string(env, argv[5]) : USBMUXD_SOCKET_PATH;
+
+	LockdownConnector connector;
+	if (!host.empty()) {
+		connector = [host, port](uint16_t p) { return tcpConnect(host, p == LOCKDOWN_PORT ? (uint16_t)port : p); };
+	} else {
+		connector = [deviceId, socketPath](uint16_t p) { return usbmuxConnect(deviceId, p, socketPath); };
+	}
+
+	LockdownHandle* handle = new LockdownHandle();
+	try {
+		if (cachedRecord) {
+			std::shared_ptr<PairRecord> pairRecord = PairingCache::shared(recordDir).getRecord(udid);
+			handle->client = std::make_unique<LockdownClient>(udid, *pairRecord, connector);
+		} else {
+			PairRecord pairRecord = PairRecord::parse(static_cast<const uint8_t*>(data), len);
+			handle->client = std::make_unique<LockdownClient>(udid, pairRecord, connector);
+		}
+	} catch (std::exception& e) {
+		delete handle;
+		const char* msg = e.what();
+		NAPI_THROW_ERROR("ERR_LOCKDOWN_CONNECT", msg, ::strlen(msg), NULL)
+	}
+
+	if (napi_create_external(env, handle, finalizeLockdownHandle, NULL, &rval) != napi_ok) {
+		delete handle;
+		NAPI_THROW_ERROR("ERR_NAPI_CREATE_EXTERNAL", "Failed to create lockdown handle", NAPI_AUTO_LENGTH, NULL)
+	}
+
+	return rval;
+}
+
+/**
+ * lockdownGetValue()
+ * Retrieves a value from lockdown. The domain and key are optional.
+ */
+NAPI_METHOD(lockdownGetValue) {
+	NAPI_ARGV(3);
+	napi_value rval;
+	napi_valuetype domainType, keyType;
+
+	NAPI_THROW_RETURN("lockdownGetValue", "ERR_NAPI_TYPEOF", napi_typeof(env, argv[1], &domainType), NULL)
+	NAPI_THROW_RETURN("lockdownGetValue", "ERR_NAPI_TYPEOF", napi_typeof(env, argv[2], &keyType), NULL)
+	std::string domain = domainType == napi_string ? napi_string_to_std_string(env, argv[1]) : "";
+	std::string key = keyType == napi_string ? napi_string_to_std_string(env, argv[2]) : "";
+
+	try {
+		plist::Arena arena;
+		plist::Node* value = getLockdownClient(env, argv[0])->getValue(domain.empty() ? NULL : domain.c_str(), key.empty() ? NULL : key.c_str(), arena);
+		if (value) {
+			rval = plist::toJS(env, value);
+		} else {
+			NAPI_THROW_RETURN("lockdownGetValue", "ERR_NAPI_GET_UNDEFINED", napi_get_undefined(env, &rval), NULL)
+		}
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("lockdownGetValue", "%s", msg)
+		NAPI_THROW_ERROR("ERR_LOCKDOWN_GET_VALUE", msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * lockdownStartService()
+ * Starts a service, connects to it, and performs the TLS handshake if the service requires it. The
+ * connection is closed before returning, so this reports how the service was started.
+ */
+NAPI_METHOD(lockdownStartService) {
+	NAPI_ARGV(2);
+	napi_value rval, tmp;
+	std::string name = napi_string_to_std_string(env, argv[1]);
+
+	try {
+		LockdownService service = getLockdownClient(env, argv[0])->startService(name);
+
+		NAPI_THROW_RETURN("lockdownStartService", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+		NAPI_THROW_RETURN("lockdownStartService", "ERR_NAPI_CREATE_UINT32", napi_create_uint32(env, service.port, &tmp), NULL)
+		NAPI_THROW_RETURN("lockdownStartService", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "port", tmp), NULL)
+		NAPI_THROW_RETURN("lockdownStartService", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, service.ssl, &tmp), NULL)
+		NAPI_THROW_RETURN("lockdownStartService", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "ssl", tmp), NULL)
+		NAPI_THROW_RETURN("lockdownStartService", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, service.connection->resumed, &tmp), NULL)
+		NAPI_THROW_RETURN("lockdownStartService", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "resumed", tmp), NULL)
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("lockdownStartService", "%s", msg)
+		NAPI_THROW_ERROR("ERR_LOCKDOWN_START_SERVICE", msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * lockdownClose()
+ * Stops the session and disconnects from lockdown.
+ */
+NAPI_METHOD(lockdownClose) {
+	NAPI_ARGV(1);
+	void* data = NULL;
+
+	if (napi_get_value_external(env, argv[0], &data) == napi_ok && data) {
+		static_cast<LockdownHandle*>(data)->client.reset();
+	}
+
+	flushLog(env);
+	NAPI_RETURN_UNDEFINED("lockdownClose")
+}
+
+/**
+ * qos()
+ * Sets the rates in bytes per second that the device's links are shaped to.
+ */
+NAPI_METHOD(qos) {
+	NAPI_ARGV(4);
+
+	try {
+		std::string udid = napi_string_to_std_string(env, argv[0]);
+		std::shared_ptr<Device> device = deviceman->getDevice(udid);
+
+		int64_t linkRate = 0;
+		int64_t streamingRate = 0;
+		int64_t bulkRate = 0;
+		napi_get_value_int64(env, argv[1], &linkRate);
+		napi_get_value_int64(env, argv[2], &streamingRate);
+		napi_get_value_int64(env, argv[3], &bulkRate);
+
+		QosConfig config;
+		config.linkRate = (uint64_t)std::max<int64_t>(linkRate, 0);
+		config.streamingRate = (uint64_t)std::max<int64_t>(streamingRate, 0);
+		config.bulkRate = (uint64_t)std::max<int64_t>(bulkRate, 0);
+		device->configureQos(config);
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("qos", "%s", msg)
+		NAPI_THROW_ERROR("ERR_QOS", msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	NAPI_RETURN_UNDEFINED("qos")
+}
+
+#ifdef NODE_IOS_DEVICE_TEST
+
+/*
+ * The functions below drive internals directly for the tests and benchmarks. They're only built
+ * into the `node_ios_device_test` addon.
+ */
+
+/**
+ * qosTransfer()
+ * Feeds the progress of a simulated app transfer through an install progress reporter shaped to a
+ * link and bulk rate and returns how many seconds it took. This exists for the shaping tests. A
+ * rate of zero is unlimited. `interactiveBytes` of interactive traffic are sent to the device just
+ * before the transfer starts.
+ */
+NAPI_METHOD(qosTransfer) {
+	NAPI_ARGV(5);
+	napi_value rval;
+	int64_t linkRate = 0;
+	int64_t bulkRate = 0;
+	int64_t totalBytes = 0;
+	uint32_t steps = 1;
+	int64_t interactiveBytes = 0;
+
+	napi_get_value_int64(env, argv[0], &linkRate);
+	napi_get_value_int64(env, argv[1], &bulkRate);
+	napi_get_value_int64(env, argv[2], &totalBytes);
+	napi_get_value_uint32(env, argv[3], &steps);
+	napi_get_value_int64(env, argv[4], &interactiveBytes);
+	steps = std::max<uint32_t>(steps, 1);
+
+	QosConfig config;
+	config.linkRate = (uint64_t)std::max<int64_t>(linkRate, 0);
+	config.bulkRate = (uint64_t)std::max<int64_t>(bulkRate, 0);
+	auto shaper = std::make_shared<QosShaper>();
+	shaper->configure(config);
+
+	auto progress = std::make_shared<InstallProgress>("", (uint64_t)std::max<int64_t>(totalBytes, 0), InstallProgressOptions());
+	progress->setQos(shaper);
+	auto callback = (mach_error_t (*)(CFDictionaryRef, int))InstallProgress::callback();
+
+	auto start = std::chrono::steady_clock::now();
+	if (interactiveBytes > 0) {
+		shaper->acquire(QosInteractive, (size_t)interactiveBytes);
+	}
+	{
+		InstallProgressScope scope(progress.get(), "transfer");
+		for (uint32_t i = 1; i <= steps; ++i) {
+			double pct = 100.0 * i / steps;
+			CFNumberRef percent = ::CFNumberCreate(NULL, kCFNumberDoubleType, &pct);
+			const void* keys[] = { CFSTR("PercentComplete") };
+			const void* values[] = { percent };
+			CFDictionaryRef status = ::CFDictionaryCreate(NULL, keys, values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+			callback(status, 0);
+			::CFRelease(status);
+			::CFRelease(percent);
+		}
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	NAPI_THROW_RETURN("qosTransfer", "ERR_NAPI_CREATE_DOUBLE", napi_create_double(env, elapsed, &rval), NULL)
+	return rval;
+}
+
+/**
+ * fileRelayExtract()
+ * Feeds an array of buffers through the file relay's gzip and cpio decoder as if each were a socket
+ * read and writes the entries into a directory. This exists for the file relay tests so archives
+ * can be checked without a device. Throws if the archive is invalid or ends early.
+ */
+NAPI_METHOD(fileRelayExtract) {
+	NAPI_ARGV(2);
+	napi_value rval, chunk, tmp;
+	uint32_t numChunks = 0;
+
+	try {
+		DirectorySink sink(napi_string_to_std_string(env, argv[1]));
+		GzipCpioExtractor extractor(sink);
+
+		NAPI_THROW_RETURN("fileRelayExtract", "ERR_NAPI_GET_ARRAY_LENGTH", napi_get_array_length(env, argv[0], &numChunks), NULL)
+		for (uint32_t i = 0; i < numChunks; ++i) {
+			void* data = NULL;
+			size_t len = 0;
+			NAPI_THROW_RETURN("fileRelayExtract", "ERR_NAPI_GET_ELEMENT", napi_get_element(env, argv[0], i, &chunk), NULL)
+			NAPI_THROW_RETURN("fileRelayExtract", "ERR_NAPI_GET_BUFFER_INFO", napi_get_buffer_info(env, chunk, &data, &len), NULL)
+			extractor.write((const uint8_t*)data, len);
+		}
+		extractor.finish();
+
+		NAPI_THROW_RETURN("fileRelayExtract", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+		NAPI_THROW_RETURN("fileRelayExtract", "ERR_NAPI_CREATE_DOUBLE", napi_create_double(env, (double)extractor.decoder.numEntries, &tmp), NULL)
+		NAPI_THROW_RETURN("fileRelayExtract", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "entries", tmp), NULL)
+		NAPI_THROW_RETURN("fileRelayExtract", "ERR_NAPI_CREATE_DOUBLE", napi_create_double(env, (double)extractor.decoder.numBytes, &tmp), NULL)
+		NAPI_THROW_RETURN("fileRelayExtract", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "bytes", tmp), NULL)
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		NAPI_THROW_ERROR("ERR_FILE_RELAY", msg, ::strlen(msg), NULL)
+	}
+
+	return rval;
+}
+
+/**
+ * fingerprint()
+ * Returns the fingerprint `installAll()` compares against the install record for a directory. This
+ * exists for the fingerprint tests.
+ */
+NAPI_METHOD(fingerprint) {
+	NAPI_ARGV(1);
+	napi_value rval;
+
+	try {
+		std::string hex = fingerprintDir(napi_string_to_std_string(env, argv[0]));
+		NAPI_THROW_RETURN("fingerprint", "ERR_NAPI_CREATE_STRING_UTF8", napi_create_string_utf8(env, hex.c_str(), hex.length(), &rval), NULL)
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		NAPI_THROW_ERROR("ERR_FINGERPRINT", msg, ::strlen(msg), NULL)
+	}
+
+	return rval;
+}
+
+/**
+ * The state shared by the fake install queue's fingerprint and install functions. Fingerprinting
+ * and installing block while held so the tests can cancel requests at a known point.
+ */
+static struct FakeInstalls {
+	FakeInstalls() : holdFingerprint(false), holdInstall(false), installs(0) {}
+	std::mutex                    lock;
+	std::condition_variable       cond;
+	bool                          holdFingerprint;
+	bool                          holdInstall;
+	uint32_t                      installs;
+	std::shared_ptr<InstallQueue> queue;
+} fakeInstalls;
+
+/**
+ * Releases the held fingerprints and installs of the fake install queue.
+ */
+static void releaseFakeInstalls() {
+	{
+		std::lock_guard<std::mutex> guard(fakeInstalls.lock);
+		fakeInstalls.holdFingerprint = false;
+		fakeInstalls.holdInstall = false;
+	}
+	fakeInstalls.cond.notify_all();
+}
+
+/**
+ * Releases the held work of the fake install queue and shuts it down. Must be called on the main
+ * thread.
+ */
+static void shutdownFakeInstallQueue() {
+	releaseFakeInstalls();
+	if (fakeInstalls.queue) {
+		fakeInstalls.queue->shutdown();
+		fakeInstalls.queue.reset();
+	}
+}
+
+/**
+ * installQueueFake()
+ * Replaces the fake install queue with a new one that uses the app path as the fingerprint and
+ * installs without a device. When `holdFingerprint` or `holdInstall` is set, fingerprinting or
+ * installing blocks until `installQueueFakeRelease()` is called, and a held install that's
+ * cancelled fails with `OperationCancelled`. This exists for the install queue tests.
+ */
+NAPI_METHOD(installQueueFake) {
 	NAPI_ARGV(2);
+	bool holdFingerprint = false;
+	bool holdInstall = false;
+
+	napi_get_value_bool(env, argv[0], &holdFingerprint);
+	napi_get_value_bool(env, argv[1], &holdInstall);
+
+	shutdownFakeInstallQueue();
+	{
+		std::lock_guard<std::mutex> guard(fakeInstalls.lock);
+		fakeInstalls.holdFingerprint = holdFingerprint;
+		fakeInstalls.holdInstall = holdInstall;
+		fakeInstalls.installs = 0;
+	}
+
+	fakeInstalls.queue = InstallQueue::create(
+		env,
+		[](const std::string& appPath) {
+			std::unique_lock<std::mutex> guard(fakeInstalls.lock);
+			fakeInstalls.cond.wait(guard, [] { return !fakeInstalls.holdFingerprint; });
+			return appPath;
+		},
+		[](InstallJob& job) {
+			std::unique_lock<std::mutex> guard(fakeInstalls.lock);
+			++fakeInstalls.installs;
+			while (fakeInstalls.holdInstall) {
+				job.cancel.check();
+				fakeInstalls.cond.wait_for(guard, std::chrono::milliseconds(10));
+			}
+			AppInstallResult result;
+			result.appPath = job.appPath;
+			return result;
+		}
+	);
+
+	NAPI_RETURN_UNDEFINED("installQueueFake")
+}
+
+/**
+ * installQueueFakeAdd()
+ * Queues an install request on the fake install queue with the optional `skipIfUnchanged` and
+ * `recordDir` options and returns its id and promise.
+ */
+NAPI_METHOD(installQueueFakeAdd) {
+	NAPI_ARGV(4);
+	napi_value rval, id, promise;
+	napi_deferred deferred;
+	napi_valuetype type;
+	std::string udid = napi_string_to_std_string(env, argv[0]);
+	std::string appPath = napi_string_to_std_string(env, argv[1]);
+	bool skipIfUnchanged = false;
+	std::string recordDir;
+
+	napi_get_value_bool(env, argv[2], &skipIfUnchanged);
+	if (napi_typeof(env, argv[3], &type) == napi_ok && type == napi_string) {
+		recordDir = napi_string_to_std_string(env, argv[3]);
+	}
+
+	if (!fakeInstalls.queue) {
+		NAPI_THROW_ERROR("ERR_NO_INSTALL_QUEUE", "installQueueFake() must be called first", 39, NULL)
+	}
+
+	NAPI_THROW_RETURN("installQueueFakeAdd", "ERR_NAPI_CREATE_PROMISE", napi_create_promise(env, &deferred, &promise), NULL)
+	NAPI_THROW_RETURN("installQueueFakeAdd", "ERR_NAPI_CREATE_UINT32", napi_create_uint32(env, fakeInstalls.queue->add(NULL, udid, appPath, skipIfUnchanged, recordDir, deferred, NULL, 0), &id), NULL)
+	NAPI_THROW_RETURN("installQueueFakeAdd", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+	NAPI_THROW_RETURN("installQueueFakeAdd", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "id", id), NULL)
+	NAPI_THROW_RETURN("installQueueFakeAdd", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "promise", promise), NULL)
+	return rval;
+}
+
+/**
+ * installQueueFakeCancel()
+ * Cancels a request on the fake install queue. Returns false if it has already completed.
+ */
+NAPI_METHOD(installQueueFakeCancel) {
+	NAPI_ARGV(1);
+	napi_value rval;
+	uint32_t id = 0;
+
+	NAPI_THROW_RETURN("installQueueFakeCancel", "ERR_NAPI_GET_VALUE_UINT32", napi_get_value_uint32(env, argv[0], &id), NULL)
+	NAPI_THROW_RETURN("installQueueFakeCancel", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, fakeInstalls.queue && fakeInstalls.queue->cancel(id), &rval), NULL)
+	return rval;
+}
+
+/**
+ * installQueueFakeRelease()
+ * Lets the held fingerprints and installs of the fake install queue finish.
+ */
+NAPI_METHOD(installQueueFakeRelease) {
+	releaseFakeInstalls();
+	NAPI_RETURN_UNDEFINED("installQueueFakeRelease")
+}
+
+/**
+ * installQueueFakeState()
+ * Returns the number of installs the fake install queue has started, along with the number of
+ * requests merged into the job of the specified request.
+ */
+NAPI_METHOD(installQueueFakeState) {
+	NAPI_ARGV(1);
+	napi_value rval, value;
+	uint32_t id = 0;
+	uint32_t installs;
+
+	napi_get_value_uint32(env, argv[0], &id);
+	{
+		std::lock_guard<std::mutex> guard(fakeInstalls.lock);
+		installs = fakeInstalls.installs;
+	}
+	uint32_t waiters = fakeInstalls.queue ? (uint32_t)fakeInstalls.queue->waiters(id) : 0;
+
+	NAPI_THROW_RETURN("installQueueFakeState", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+	NAPI_THROW_RETURN("installQueueFakeState", "ERR_NAPI_CREATE_UINT32", napi_create_uint32(env, installs, &value), NULL)
+	NAPI_THROW_RETURN("installQueueFakeState", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "installs", value), NULL)
+	NAPI_THROW_RETURN("installQueueFakeState", "ERR_NAPI_CREATE_UINT32", napi_create_uint32(env, waiters, &value), NULL)
+	NAPI_THROW_RETURN("installQueueFakeState", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "waiters", value), NULL)
+	return rval;
+}
+
+/**
+ * relayLines()
+ * Splits a buffer into lines the way the syslog and port relays do and returns the lines as strings.
+ * This exists for the relay benchmark. When `legacy` is set, the lines are split a byte at a time
+ * and decoded by V8 the way the relays did before lines were classified natively. When `syslog` is
+ * set, vis(3) escapes are decoded the way the syslog relay does, except in legacy mode.
+ */
+NAPI_METHOD(relayLines) {
+	NAPI_ARGV(3);
+	napi_value rval, line;
+	void* data = NULL;
+	size_t len = 0;
+	bool legacy = false;
+	bool syslog = false;
+
+	NAPI_THROW_RETURN("relayLines", "ERR_NAPI_GET_BUFFER_INFO", napi_get_buffer_info(env, argv[0], &data, &len), NULL)
+	napi_get_value_bool(env, argv[1], &legacy);
+	napi_get_value_bool(env, argv[2], &syslog);
+	NAPI_THROW_RETURN("relayLines", "ERR_NAPI_CREATE_ARRAY", napi_create_array(env, &rval), NULL)
+
+	uint32_t count = 0;
+	if (legacy) {
+		std::vector<std::string> lines;
+		std::string buffer;
+		for (const char* p = (const char*)data, *end = p + len; p < end; ++p) {
+			if (*p == '\0' || *p == '\r' || *p == '\n') {
+				if (!buffer.empty()) {
+					lines.push_back(buffer);
+					buffer.clear();
+				}
+			} else {
+				buffer += *p;
+			}
+		}
+		if (!buffer.empty()) {
+			lines.push_back(buffer);
+		}
+		for (auto const& str : lines) {
+			NAPI_THROW_RETURN("relayLines", "ERR_NAPI_CREATE_STRING_UTF8", napi_create_string_utf8(env, str.c_str(), NAPI_AUTO_LENGTH, &line), NULL)
+			NAPI_THROW_RETURN("relayLines", "ERR_NAPI_SET_ELEMENT", napi_set_element(env, rval, count++, line), NULL)
+		}
+	} else {
+		std::vector<std::shared_ptr<RelayMessage>> messages;
+		if (syslog) {
+			splitSyslogLines((const char*)data, len, messages);
+		} else {
+			splitLines((const char*)data, len, messages);
+		}
+		for (auto const& msg : messages) {
+			NAPI_THROW_RETURN("relayLines", "ERR_NAPI_SET_ELEMENT", napi_set_element(env, rval, count++, msg->toJS(env)), NULL)
+		}
+	}
+
+	return rval;
+}
+
+/**
+ * relayFrames()
+ * Feeds an array of buffers through a relay framer as if each were a socket read and returns the
+ * messages. This exists for the relay tests so framing can be checked without a device. Throws if
+ * the framer rejects the data the way a relay connection would drop it.
+ *
+ * When `rate` is set, lines are rate limited by process the way the syslog relay does with a
+ * summary after every read.
+ */
+NAPI_METHOD(relayFrames) {
+	NAPI_ARGV(4);
+	napi_value rval, chunk;
+	uint32_t framing = LineFraming;
+	uint32_t numChunks = 0;
+	uint32_t count = 0;
+	SyslogLimitConfig config;
+
+	napi_get_value_uint32(env, argv[1], &framing);
+	napi_get_value_uint32(env, argv[2], &config.rate);
+	napi_get_value_uint32(env, argv[3], &config.sample);
+	NAPI_THROW_RETURN("relayFrames", "ERR_NAPI_GET_ARRAY_LENGTH", napi_get_array_length(env, argv[0], &numChunks), NULL)
+	NAPI_THROW_RETURN("relayFrames", "ERR_NAPI_CREATE_ARRAY", napi_create_array(env, &rval), NULL)
+
+	RelayFramer framer(framing > WebInspectorFraming ? LineFraming : (RelayFraming)framing);
+	std::vector<std::shared_ptr<RelayMessage>> messages;
+
+	if (config.rate) {
+		std::shared_ptr<SyslogLimiter> limiter = std::make_shared<SyslogLimiter>();
+		config.summaryInterval = std::chrono::milliseconds(0);
+		limiter->configure(config);
+		framer.setLimiter(limiter);
+	}
+
+	for (uint32_t i = 0; i < numChunks; ++i) {
+		void* data = NULL;
+		size_t len = 0;
+		NAPI_THROW_RETURN("relayFrames", "ERR_NAPI_GET_ELEMENT", napi_get_element(env, argv[0], i, &chunk), NULL)
+		NAPI_THROW_RETURN("relayFrames", "ERR_NAPI_GET_BUFFER_INFO", napi_get_buffer_info(env, chunk, &data, &len), NULL)
+		if (!framer.feed((const char*)data, len, 0, 0, messages)) {
+			const char* msg = "Relay frame exceeds the maximum size";
+			NAPI_THROW_ERROR("ERR_RELAY_FRAME_TOO_LARGE", msg, ::strlen(msg), NULL)
+		}
+	}
+
+	for (auto const& msg : messages) {
+		NAPI_THROW_RETURN("relayFrames", "ERR_NAPI_SET_ELEMENT", napi_set_element(env, rval, count++, msg->toJS(env)), NULL)
+	}
+
+	return rval;
+}
+
+/**
+ * A relay connection on one end of a socket pair with no run loop, so the tests feed it reads
+ * directly instead of writing to the socket. It's reconnected to a new socket pair whenever its
+ * first listener is added.
+ */
+static struct {
+	int                              fd = -1;
+	int                              peer = -1;
+	std::shared_ptr<RelayConnection> conn;
+} loopbackRelay;
+
+/**
+ * relayLoopbackStart()
+ * Adds a push listener to the loopback relay connection, creating the connection with line framing
+ * the first time. This exists for the relay tests so the message queue can be checked without a
+ * device.
+ */
+NAPI_METHOD(relayLoopbackStart) {
+	NAPI_ARGV(1);
+
+	if (!loopbackRelay.conn) {
+		loopbackRelay.conn = RelayConnection::create(env, std::weak_ptr<CFRunLoopRef>(), &loopbackRelay.fd);
+	}
+
+	if (loopbackRelay.conn->size() == 0) {
+		int fds[2];
+		if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+			const char* msg = "Failed to create socket pair";
+			NAPI_THROW_ERROR("ERR_SOCKETPAIR", msg, ::strlen(msg), NULL)
+		}
+		if (loopbackRelay.fd != -1) {
+			::close(loopbackRelay.fd);
+			::close(loopbackRelay.peer);
+		}
+		loopbackRelay.fd = fds[0];
+		loopbackRelay.peer = fds[1];
+	}
 
 	try {
-		std::string udid = napi_string_to_std_string(env, argv[0]);
-		std::shared_ptr<Device> device = deviceman->getDevice(udid);
-		std::string appPath = napi_string_to_std_string(env, argv[1]);
-		device->install(appPath);
+		loopbackRelay.conn->add(argv[0]);
 	} catch (std::exception& e) {
-		const char* msg = e.what();
-		LOG_DEBUG_1("install", "%s", msg)
-		NAPI_THROW_ERROR("ERR_INSTALL", msg, ::strlen(msg), NULL)
+		NAPI_THROW_ERROR("ERR_RELAY_START", e.what(), ::strlen(e.what()), NULL)
 	}
 
-	flushLog(env);
-	NAPI_RETURN_UNDEFINED("install")
+	NAPI_RETURN_UNDEFINED("relayLoopbackStart")
 }
 
 /**
- * list()
- * Retrieves a list all connected iOS devices.
+ * relayLoopbackFeed()
+ * Feeds a buffer to the loopback relay connection as if it were read from the socket, or closes the
+ * connection the way the device does when there's no buffer.
  */
-NAPI_METHOD(list) {
-	napi_value rval = deviceman->list();
-	flushLog(env);
+NAPI_METHOD(relayLoopbackFeed) {
+	NAPI_ARGV(1);
+	void* data = NULL;
+	size_t len = 0;
+
+	if (loopbackRelay.conn) {
+		if (::napi_get_buffer_info(env, argv[0], &data, &len) == napi_ok) {
+			loopbackRelay.conn->onData((const char*)data, len);
+		} else {
+			loopbackRelay.conn->onClose();
+		}
+	}
+
+	NAPI_RETURN_UNDEFINED("relayLoopbackFeed")
+}
+
+/**
+ * relayLoopbackStop()
+ * Removes a listener from the loopback relay connection.
+ */
+NAPI_METHOD(relayLoopbackStop) {
+	NAPI_ARGV(1);
+	if (loopbackRelay.conn) {
+		loopbackRelay.conn->remove(argv[0]);
+	}
+	NAPI_RETURN_UNDEFINED("relayLoopbackStop")
+}
+
+/**
+ * What the deadline test's operation saw. The worker may outlive the call, so it's reference
+ * counted.
+ */
+struct DeadlineProbe {
+	DeadlineProbe() : finished(false), aborted(false), abandoned(false) {}
+	std::mutex              lock;
+	std::condition_variable cond;
+	bool                    finished;
+	bool                    aborted;
+	bool                    abandoned;
+};
+
+/**
+ * afcSnapshotPack()
+ * Packs an array of `{ path, isDirectory, unreadable, size, mtimeMs }` entries into a snapshot the
+ * way `afcSnapshot()` would after walking them. This exists for the snapshot tests so snapshots
+ * can be built without a device.
+ */
+NAPI_METHOD(afcSnapshotPack) {
+	NAPI_ARGV(1);
+	napi_value rval, entry, tmp;
+	uint32_t count = 0;
+	AfcSnapshot snapshot;
+
+	NAPI_THROW_RETURN("afcSnapshotPack", "ERR_NAPI_GET_ARRAY_LENGTH", napi_get_array_length(env, argv[0], &count), NULL)
+	for (uint32_t i = 0; i < count; ++i) {
+		AfcFileInfo info;
+		bool unreadable = false;
+		double size = 0;
+		double mtimeMs = 0;
+
+		NAPI_THROW_RETURN("afcSnapshotPack", "ERR_NAPI_GET_ELEMENT", napi_get_element(env, argv[0], i, &entry), NULL)
+		NAPI_THROW_RETURN("afcSnapshotPack", "ERR_NAPI_GET_NAMED_PROPERTY", napi_get_named_property(env, entry, "path", &tmp), NULL)
+		std::string path = napi_string_to_std_string(env, tmp);
+		NAPI_THROW_RETURN("afcSnapshotPack", "ERR_NAPI_GET_NAMED_PROPERTY", napi_get_named_property(env, entry, "isDirectory", &tmp), NULL)
+		napi_get_value_bool(env, tmp, &info.isDir);
+		NAPI_THROW_RETURN("afcSnapshotPack", "ERR_NAPI_GET_NAMED_PROPERTY", napi_get_named_property(env, entry, "unreadable", &tmp), NULL)
+		napi_get_value_bool(env, tmp, &unreadable);
+		NAPI_THROW_RETURN("afcSnapshotPack", "ERR_NAPI_GET_NAMED_PROPERTY", napi_get_named_property(env, entry, "size", &tmp), NULL)
+		napi_get_value_double(env, tmp, &size);
+		NAPI_THROW_RETURN("afcSnapshotPack", "ERR_NAPI_GET_NAMED_PROPERTY", napi_get_named_property(env, entry, "mtimeMs", &tmp), NULL)
+		napi_get_value_double(env, tmp, &mtimeMs);
+
+		info.size = (uint64_t)size;
+		info.mtime = (uint64_t)mtimeMs * 1000000;
+		size_t index = snapshot.add(path, info);
+		if (unreadable) {
+			snapshot.dirs[index] = AFC_ENTRY_UNREADABLE_DIR;
+		}
+	}
+	snapshot.sort();
+
+	std::vector<uint8_t> packed = snapshot.pack();
+	void* dest;
+	NAPI_THROW_RETURN("afcSnapshotPack", "ERR_NAPI_CREATE_BUFFER_COPY", napi_create_buffer_copy(env, packed.size(), packed.data(), &dest, &rval), NULL)
+	return rval;
+}
+
+/**
+ * deadlineRun()
+ * Runs an operation that sleeps for `sleep` milliseconds, then fails if `fail` is set, with
+ * `runWithDeadline()` and returns what happened. When `cancelAfter` is set, the operation is
+ * cancelled after that many milliseconds. This exists for the deadline tests, so it waits for an
+ * abandoned operation to finish and clean up before returning.
+ */
+NAPI_METHOD(deadlineRun) {
+	NAPI_ARGV(4);
+	napi_value rval, value;
+	uint32_t sleep = 0;
+	uint32_t timeout = 0;
+	uint32_t cancelAfter = 0;
+	bool fail = false;
+
+	napi_get_value_uint32(env, argv[0], &sleep);
+	napi_get_value_uint32(env, argv[1], &timeout);
+	napi_get_value_uint32(env, argv[2], &cancelAfter);
+	napi_get_value_bool(env, argv[3], &fail);
+
+	auto probe = std::make_shared<DeadlineProbe>();
+	auto cancel = std::make_shared<CancelToken>();
+	std::thread canceller;
+	if (cancelAfter) {
+		canceller = std::thread([cancel, cancelAfter]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(cancelAfter));
+			cancel->cancel();
+		});
+	}
+
+	std::string error;
+	std::string code;
+	bool cancelled = false;
+	bool late = false;
+
+	try {
+		runWithDeadline(
+			"Test operation",
+			std::chrono::milliseconds(timeout),
+			cancelAfter ? cancel.get() : NULL,
+			[probe, sleep, fail]() {
+				std::this_thread::sleep_for(std::chrono::milliseconds(sleep));
+				{
+					std::lock_guard<std::mutex> guard(probe->lock);
+					probe->finished = true;
+				}
+				probe->cond.notify_all();
+				if (fail) {
+					throw std::runtime_error("Test operation failed");
+				}
+			},
+			[probe]() {
+				std::lock_guard<std::mutex> guard(probe->lock);
+				probe->aborted = true;
+			},
+			[probe]() {
+				{
+					std::lock_guard<std::mutex> guard(probe->lock);
+					probe->abandoned = true;
+				}
+				probe->cond.notify_all();
+			}
+		);
+	} catch (std::exception& e) {
+		error = e.what();
+		code = errorCode(e, "ERR_TEST");
+		cancelled = dynamic_cast<OperationCancelled*>(&e) != NULL;
+		late = dynamic_cast<DeadlineExceeded*>(&e) != NULL || cancelled;
+	}
+
+	if (canceller.joinable()) {
+		canceller.join();
+	}
+
+	bool aborted, abandoned;
+	{
+		std::unique_lock<std::mutex> guard(probe->lock);
+		probe->cond.wait(guard, [&probe] { return probe->finished; });
+		if (late && !fail) {
+			probe->cond.wait_for(guard, std::chrono::seconds(5), [&probe] { return probe->abandoned; });
+		}
+		aborted = probe->aborted;
+		abandoned = probe->abandoned;
+	}
+
+	NAPI_THROW_RETURN("deadlineRun", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+	if (!error.empty()) {
+		NAPI_THROW_RETURN("deadlineRun", "ERR_NAPI_CREATE_STRING_UTF8", napi_create_string_utf8(env, error.c_str(), error.length(), &value), NULL)
+		NAPI_THROW_RETURN("deadlineRun", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "error", value), NULL)
+		NAPI_THROW_RETURN("deadlineRun", "ERR_NAPI_CREATE_STRING_UTF8", napi_create_string_utf8(env, code.c_str(), code.length(), &value), NULL)
+		NAPI_THROW_RETURN("deadlineRun", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "code", value), NULL)
+	}
+	NAPI_THROW_RETURN("deadlineRun", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, cancelled, &value), NULL)
+	NAPI_THROW_RETURN("deadlineRun", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "cancelled", value), NULL)
+	NAPI_THROW_RETURN("deadlineRun", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, aborted, &value), NULL)
+	NAPI_THROW_RETURN("deadlineRun", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "aborted", value), NULL)
+	NAPI_THROW_RETURN("deadlineRun", "ERR_NAPI_GET_BOOLEAN", napi_get_boolean(env, abandoned, &value), NULL)
+	NAPI_THROW_RETURN("deadlineRun", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "abandoned", value), NULL)
+
+	return rval;
+}
+
+/**
+ * usbSimulate()
+ * Runs transfers through a USB scheduler on simulated hubs on a virtual clock and returns the cap
+ * each hub held most often over the second half of its transfers. This exists for the scheduler
+ * tests. Each hub's aggregate throughput grows linearly up to its optimal number of concurrent
+ * transfers and falls off by a quarter for each transfer past it. A transfer takes the time the
+ * model gives for the concurrency it started at, and the next transfer to finish is always the one
+ * with the earliest end, so the result doesn't depend on thread scheduling.
+ */
+NAPI_METHOD(usbSimulate) {
+	NAPI_ARGV(3);
+	napi_value rval, value;
+	uint32_t numHubs = 0;
+	uint32_t transfers = 0;
+	uint32_t initialCap = USB_SCHEDULER_INITIAL_CAP;
+
+	NAPI_THROW_RETURN("usbSimulate", "ERR_NAPI_GET_ARRAY_LENGTH", napi_get_array_length(env, argv[0], &numHubs), NULL)
+	napi_get_value_uint32(env, argv[1], &transfers);
+	napi_get_value_uint32(env, argv[2], &initialCap);
+
+	struct Transfer {
+		double   end;
+		double   seconds;
+		uint32_t concurrency;
+		bool operator>(const Transfer& other) const { return end > other.end; }
+	};
+
+	const uint64_t bytes = 64 * 1024 * 1024;
+	const double bandwidth = 40e6;
+	UsbScheduler scheduler;
+
+	NAPI_THROW_RETURN("usbSimulate", "ERR_NAPI_CREATE_ARRAY", napi_create_array(env, &rval), NULL)
+
+	for (uint32_t i = 0; i < numHubs; ++i) {
+		uint32_t optimal = 1;
+		NAPI_THROW_RETURN("usbSimulate", "ERR_NAPI_GET_ELEMENT", napi_get_element(env, argv[0], i, &value), NULL)
+		NAPI_THROW_RETURN("usbSimulate", "ERR_NAPI_GET_VALUE_UINT32", napi_get_value_uint32(env, value, &optimal), NULL)
+		optimal = std::max<uint32_t>(optimal, 1);
+
+		uint32_t hub = (i + 1) << 24;
+		uint32_t left = transfers;
+		double now = 0;
+		std::priority_queue<Transfer, std::vector<Transfer>, std::greater<Transfer>> running;
+		std::vector<uint32_t> caps;
+
+		while (left > 0 || !running.empty()) {
+			while (left > 0) {
+				uint32_t concurrency = scheduler.tryAcquire(hub, initialCap, left - 1);
+				if (!concurrency) {
+					break;
+				}
+				--left;
+				double aggregate = concurrency <= optimal
+					? bandwidth * concurrency / optimal
+					: bandwidth * std::max(1 - 0.25 * (concurrency - optimal), 0.1);
+				double seconds = bytes / (aggregate / concurrency);
+				running.push({ now + seconds, seconds, concurrency });
+			}
+
+			Transfer done = running.top();
+			running.pop();
+			now = done.end;
+			scheduler.release(hub, bytes, done.seconds, done.concurrency);
+			caps.push_back(scheduler.cap(hub));
+		}
+
+		std::vector<uint32_t> counts(USB_SCHEDULER_MAX_CAP + 1);
+		for (size_t n = caps.size() / 2; n < caps.size(); ++n) {
+			++counts[caps[n]];
+		}
+		uint32_t mode = (uint32_t)(std::max_element(counts.begin(), counts.end()) - counts.begin());
+
+		NAPI_THROW_RETURN("usbSimulate", "ERR_NAPI_CREATE_UINT32", napi_create_uint32(env, mode, &value), NULL)
+		NAPI_THROW_RETURN("usbSimulate", "ERR_NAPI_SET_ELEMENT", napi_set_element(env, rval, i, value), NULL)
+	}
+
 	return rval;
 }
 
+#endif
+
+/**
+ * Converts the traffic class index passed in from JavaScript into a `QosClass`.
+ */
+static QosClass napiToQosClass(napi_env env, napi_value value) {
+	uint32_t cls = QosInteractive;
+	napi_get_value_uint32(env, value, &cls);
+	return cls == QosStreaming ? QosStreaming : cls == QosBulk ? QosBulk : QosInteractive;
+}
+
+/**
+ * Converts the flow index passed in from JavaScript into a `RelayFlow`.
+ */
+static RelayFlow napiToRelayFlow(napi_env env, napi_value value) {
+	uint32_t flow = RelayPush;
+	napi_get_value_uint32(env, value, &flow);
+	return flow == RelayPullLines || flow == RelayPullBytes || flow == RelayBatch ? (RelayFlow)flow : RelayPush;
+}
+
+/**
+ * Converts the number of lines or bytes a stream wants to read into relay credit.
+ */
+static uint32_t napiToCredit(napi_env env, napi_value value) {
+	uint32_t credit = 0;
+	napi_get_value_uint32(env, value, &credit);
+	return credit;
+}
+
 /**
  * Helper for generating the forward() and syslog() functions.
  */
@@ -168,21 +1785,180 @@ NAPI_METHOD(list) {
 		} catch (std::exception& e) { \
 			const char* msg = e.what(); \
 			LOG_DEBUG_1(STRINGIFY(name), "Error: %s", msg) \
-			NAPI_THROW_ERROR(errCode, msg, ::strlen(msg), NULL) \
+			NAPI_THROW_ERROR(errorCode(e, errCode), msg, ::strlen(msg), NULL) \
 		} \
 		flushLog(env); \
 		NAPI_RETURN_UNDEFINED(STRINGIFY(name)) \
 	}
 
 /**
- * forward() and syslog()
+ * forward(), syslog(), screenshots(), observe(), and webinspector()
  * All of the logic is performed in the device's relay object.
  */
-CREATE_LOG_METHOD(startForward, 3, "ERR_FORWARD_START", device->forward(RELAY_START, argv[1], argv[2]))
-CREATE_LOG_METHOD(stopForward,  3, "ERR_FORWARD_STOP",  device->forward(RELAY_STOP, argv[1], argv[2]))
+CREATE_LOG_METHOD(startForward, 5, "ERR_FORWARD_START", device->forward(RELAY_START, argv[1], argv[2], napiToQosClass(env, argv[3]), napiToRelayFlow(env, argv[4])))
+CREATE_LOG_METHOD(stopForward,  3, "ERR_FORWARD_STOP",  device->forward(RELAY_STOP, argv[1], argv[2], QosInteractive))
+CREATE_LOG_METHOD(pullForward,  4, "ERR_FORWARD_PULL",  device->pullForward(argv[1], argv[2], napiToCredit(env, argv[3])))
 
-CREATE_LOG_METHOD(startSyslog,  2, "ERR_SYSLOG_START",  device->syslog(RELAY_START, argv[1]))
+CREATE_LOG_METHOD(startSyslog,  3, "ERR_SYSLOG_START",  device->syslog(RELAY_START, argv[1], napiToRelayFlow(env, argv[2])))
 CREATE_LOG_METHOD(stopSyslog,   2, "ERR_SYSLOG_STOP",   device->syslog(RELAY_STOP, argv[1]))
+CREATE_LOG_METHOD(pullSyslog,   3, "ERR_SYSLOG_PULL",   device->pullSyslog(argv[1], napiToCredit(env, argv[2])))
+
+CREATE_LOG_METHOD(startObserve, 3, "ERR_OBSERVE_START", device->observe(RELAY_START, argv[1], argv[2]))
+CREATE_LOG_METHOD(stopObserve,  2, "ERR_OBSERVE_STOP",  device->observe(RELAY_STOP, argv[1], NULL))
+
+CREATE_LOG_METHOD(startWebInspector, 2, "ERR_WEBINSPECTOR_START", device->webinspector(RELAY_START, argv[1]))
+CREATE_LOG_METHOD(stopWebInspector,  2, "ERR_WEBINSPECTOR_STOP",  device->webinspector(RELAY_STOP, argv[1]))
+CREATE_LOG_METHOD(sendWebInspector,  2, "ERR_WEBINSPECTOR_SEND",  device->webinspectorSend(argv[1]))
+
+CREATE_LOG_METHOD(startScreenshots, 4, "ERR_SCREENSHOTS_START", device->screenshots(RELAY_START, argv[1], argv[2], argv[3]))
+CREATE_LOG_METHOD(stopScreenshots,  2, "ERR_SCREENSHOTS_STOP",  device->screenshots(RELAY_STOP, argv[1], NULL, NULL))
+
+/**
+ * syncContainer()
+ * Copies the files that differ between an app's data container and a local directory.
+ */
+NAPI_METHOD(syncContainer) {
+	NAPI_ARGV(5);
+	napi_value rval;
+
+	try {
+		std::string udid = napi_string_to_std_string(env, argv[0]);
+		std::shared_ptr<Device> device = deviceman->getDevice(udid);
+		std::string bundleId = napi_string_to_std_string(env, argv[1]);
+		std::string localDir = napi_string_to_std_string(env, argv[2]);
+
+		bool push = false;
+		uint32_t concurrency = 4;
+		napi_get_value_bool(env, argv[3], &push);
+		napi_get_value_uint32(env, argv[4], &concurrency);
+
+		ContainerSyncResult result = device->syncContainer(bundleId, localDir, push ? Push : Pull, concurrency);
+
+		napi_value tmp;
+		NAPI_THROW_RETURN("syncContainer", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+		NAPI_THROW_RETURN("syncContainer", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "copied", std_strings_to_napi_array(env, result.copied)), NULL)
+		NAPI_THROW_RETURN("syncContainer", "ERR_NAPI_CREATE_UINT32", napi_create_uint32(env, (uint32_t)result.skipped, &tmp), NULL)
+		NAPI_THROW_RETURN("syncContainer", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "skipped", tmp), NULL)
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("syncContainer", "%s", msg)
+		NAPI_THROW_ERROR(errorCode(e, "ERR_SYNC_CONTAINER"), msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * syncCrashReports()
+ * Copies new crash reports from the device to a local directory.
+ */
+NAPI_METHOD(syncCrashReports) {
+	NAPI_ARGV(4);
+	napi_value rval;
+
+	try {
+		std::string udid = napi_string_to_std_string(env, argv[0]);
+		std::shared_ptr<Device> device = deviceman->getDevice(udid);
+		std::string destDir = napi_string_to_std_string(env, argv[1]);
+
+		bool removeFromDevice = false;
+		uint32_t concurrency = 4;
+		napi_get_value_bool(env, argv[2], &removeFromDevice);
+		napi_get_value_uint32(env, argv[3], &concurrency);
+
+		CrashReportSyncResult result = device->syncCrashReports(destDir, removeFromDevice, concurrency);
+
+		napi_value tmp;
+		NAPI_THROW_RETURN("syncCrashReports", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+		NAPI_THROW_RETURN("syncCrashReports", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "copied", std_strings_to_napi_array(env, result.copied)), NULL)
+		NAPI_THROW_RETURN("syncCrashReports", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "removed", std_strings_to_napi_array(env, result.removed)), NULL)
+		NAPI_THROW_RETURN("syncCrashReports", "ERR_NAPI_CREATE_UINT32", napi_create_uint32(env, (uint32_t)result.skipped, &tmp), NULL)
+		NAPI_THROW_RETURN("syncCrashReports", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "skipped", tmp), NULL)
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("syncCrashReports", "%s", msg)
+		NAPI_THROW_ERROR(errorCode(e, "ERR_SYNC_CRASH_REPORTS"), msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	return rval;
+}
+
+/**
+ * syslogLimits()
+ * Sets the per process rate limits of the device's syslog relay. `names` and `rates` are parallel
+ * arrays of rates that override the default rate.
+ */
+NAPI_METHOD(syslogLimits) {
+	NAPI_ARGV(7);
+
+	try {
+		std::string udid = napi_string_to_std_string(env, argv[0]);
+		std::shared_ptr<Device> device = deviceman->getDevice(udid);
+
+		SyslogLimitConfig config;
+		uint32_t key = SyslogLimitByProcess;
+		uint32_t summaryInterval = SYSLOG_LIMIT_SUMMARY_INTERVAL;
+		napi_get_value_uint32(env, argv[1], &config.rate);
+		napi_get_value_uint32(env, argv[4], &key);
+		napi_get_value_uint32(env, argv[5], &config.sample);
+		napi_get_value_uint32(env, argv[6], &summaryInterval);
+		config.key = key == SyslogLimitBySender ? SyslogLimitBySender : SyslogLimitByProcess;
+		config.summaryInterval = std::chrono::milliseconds(summaryInterval);
+
+		uint32_t count = 0;
+		napi_get_array_length(env, argv[2], &count);
+		for (uint32_t i = 0; i < count; ++i) {
+			napi_value name, rate;
+			uint32_t value = 0;
+			NAPI_THROW_RETURN("syslogLimits", "ERR_NAPI_GET_ELEMENT", napi_get_element(env, argv[2], i, &name), NULL)
+			NAPI_THROW_RETURN("syslogLimits", "ERR_NAPI_GET_ELEMENT", napi_get_element(env, argv[3], i, &rate), NULL)
+			napi_get_value_uint32(env, rate, &value);
+			config.rates[napi_string_to_std_string(env, name)] = value;
+		}
+
+		device->configureSyslogLimits(config);
+	} catch (std::exception& e) {
+		const char* msg = e.what();
+		LOG_DEBUG_1("syslogLimits", "%s", msg)
+		NAPI_THROW_ERROR("ERR_SYSLOG_LIMITS", msg, ::strlen(msg), NULL)
+	}
+
+	flushLog(env);
+	NAPI_RETURN_UNDEFINED("syslogLimits")
+}
+
+/**
+ * timeouts()
+ * Sets how long in milliseconds device operations may take and returns the timeouts in effect.
+ * Arguments that aren't numbers leave the timeout unchanged.
+ */
+NAPI_METHOD(timeouts) {
+	NAPI_ARGV(3);
+	napi_value rval, tmp;
+
+	DeviceTimeouts timeouts = DeviceTimeouts::get();
+	std::chrono::milliseconds* fields[] = { &timeouts.connect, &timeouts.startService, &timeouts.install };
+	for (size_t i = 0; i < 3; ++i) {
+		int64_t ms;
+		if (napi_get_value_int64(env, argv[i], &ms) == napi_ok) {
+			*fields[i] = std::chrono::milliseconds(std::max<int64_t>(ms, 0));
+		}
+	}
+	DeviceTimeouts::set(timeouts);
+
+	NAPI_THROW_RETURN("timeouts", "ERR_NAPI_CREATE_OBJECT", napi_create_object(env, &rval), NULL)
+	NAPI_THROW_RETURN("timeouts", "ERR_NAPI_CREATE_DOUBLE", napi_create_double(env, (double)timeouts.connect.count(), &tmp), NULL)
+	NAPI_THROW_RETURN("timeouts", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "connect", tmp), NULL)
+	NAPI_THROW_RETURN("timeouts", "ERR_NAPI_CREATE_DOUBLE", napi_create_double(env, (double)timeouts.startService.count(), &tmp), NULL)
+	NAPI_THROW_RETURN("timeouts", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "startService", tmp), NULL)
+	NAPI_THROW_RETURN("timeouts", "ERR_NAPI_CREATE_DOUBLE", napi_create_double(env, (double)timeouts.install.count(), &tmp), NULL)
+	NAPI_THROW_RETURN("timeouts", "ERR_NAPI_SET_NAMED_PROPERTY", napi_set_named_property(env, rval, "install", tmp), NULL)
+
+	flushLog(env);
+	return rval;
+}
 
 /**
  * watch()
@@ -210,6 +1986,16 @@ NAPI_METHOD(unwatch) {
  * Destroys the Watchman instance and closes open handles.
  */
 static void cleanup(void* arg) {
+	if (installQueue) {
+		LOG_DEBUG("cleanup", "Shutting down install queue")
+		installQueue->shutdown();
+		installQueue.reset();
+	}
+
+#ifdef NODE_IOS_DEVICE_TEST
+	shutdownFakeInstallQueue();
+#endif
+
 	if (deviceman) {
 		LOG_DEBUG("cleanup", "Deleting deviceman")
 		deviceman.reset();
@@ -238,17 +2024,68 @@ NAPI_INIT() {
 	uv_unref((uv_handle_t*)&logNotify);
 #endif
 
+	NAPI_EXPORT_FUNCTION(afcSnapshot);
+	NAPI_EXPORT_FUNCTION(afcSnapshotDiff);
+	NAPI_EXPORT_FUNCTION(afcSnapshotEntries);
+	NAPI_EXPORT_FUNCTION(apps);
+	NAPI_EXPORT_FUNCTION(diagnostics);
+	NAPI_EXPORT_FUNCTION(diagnosticsAll);
+	NAPI_EXPORT_FUNCTION(fileRelay);
 	NAPI_EXPORT_FUNCTION(init);
 	NAPI_EXPORT_FUNCTION(install);
+	NAPI_EXPORT_FUNCTION(installAll);
+	NAPI_EXPORT_FUNCTION(installQueueAdd);
+	NAPI_EXPORT_FUNCTION(installQueueCancel);
 	NAPI_EXPORT_FUNCTION(list);
+	NAPI_EXPORT_FUNCTION(lockdownClose);
+	NAPI_EXPORT_FUNCTION(lockdownConnect);
+	NAPI_EXPORT_FUNCTION(lockdownGetValue);
+	NAPI_EXPORT_FUNCTION(lockdownStartService);
+	NAPI_EXPORT_FUNCTION(mountDeveloperImage);
+	NAPI_EXPORT_FUNCTION(plistEncode);
+	NAPI_EXPORT_FUNCTION(plistParse);
+	NAPI_EXPORT_FUNCTION(pullForward);
+	NAPI_EXPORT_FUNCTION(pullSyslog);
+	NAPI_EXPORT_FUNCTION(qos);
+	NAPI_EXPORT_FUNCTION(sendWebInspector);
 	NAPI_EXPORT_FUNCTION(startForward);
+	NAPI_EXPORT_FUNCTION(startObserve);
+	NAPI_EXPORT_FUNCTION(startScreenshots);
 	NAPI_EXPORT_FUNCTION(startSyslog);
+	NAPI_EXPORT_FUNCTION(startWebInspector);
 	NAPI_EXPORT_FUNCTION(stopForward);
+	NAPI_EXPORT_FUNCTION(stopObserve);
+	NAPI_EXPORT_FUNCTION(stopScreenshots);
 	NAPI_EXPORT_FUNCTION(stopSyslog);
+	NAPI_EXPORT_FUNCTION(stopWebInspector);
+	NAPI_EXPORT_FUNCTION(syncContainer);
+	NAPI_EXPORT_FUNCTION(syncCrashReports);
+	NAPI_EXPORT_FUNCTION(syslogLimits);
+	NAPI_EXPORT_FUNCTION(timeouts);
 	NAPI_EXPORT_FUNCTION(watch);
 	NAPI_EXPORT_FUNCTION(unwatch);
 
+#ifdef NODE_IOS_DEVICE_TEST
+	NAPI_EXPORT_FUNCTION(afcSnapshotPack);
+	NAPI_EXPORT_FUNCTION(deadlineRun);
+	NAPI_EXPORT_FUNCTION(fileRelayExtract);
+	NAPI_EXPORT_FUNCTION(fingerprint);
+	NAPI_EXPORT_FUNCTION(installQueueFake);
+	NAPI_EXPORT_FUNCTION(installQueueFakeAdd);
+	NAPI_EXPORT_FUNCTION(installQueueFakeCancel);
+	NAPI_EXPORT_FUNCTION(installQueueFakeRelease);
+	NAPI_EXPORT_FUNCTION(installQueueFakeState);
+	NAPI_EXPORT_FUNCTION(qosTransfer);
+	NAPI_EXPORT_FUNCTION(relayFrames);
+	NAPI_EXPORT_FUNCTION(relayLines);
+	NAPI_EXPORT_FUNCTION(relayLoopbackFeed);
+	NAPI_EXPORT_FUNCTION(relayLoopbackStart);
+	NAPI_EXPORT_FUNCTION(relayLoopbackStop);
+	NAPI_EXPORT_FUNCTION(usbSimulate);
+#endif
+
 	NAPI_THROW("napi_init", "ERR_NAPI_ADD_ENV_CLEANUP_HOOK", napi_add_env_cleanup_hook(env, cleanup, env))
 
 	deviceman = DeviceMan::create(env);
+	installQueue = InstallQueue::create(env);
 }
@@ -11,6 +11,7 @@
 #include <napi-macros.h>
 #include <node_api.h>
 #include <queue>
+#include <string>
 #include <thread>
 #include <uv.h>
 
@@ -26,6 +27,8 @@ namespace node_ios_device {
 	};
 }
 
+std::string napi_string_to_std_string(napi_env env, napi_value str);
+
 #define RELAY_START 0
 #define RELAY_STOP 1
 
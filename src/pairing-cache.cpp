@@ -0,0 +1,121 @@
+#include "pairing-cache.h"
+#include <sys/stat.h>
+
+namespace node_ios_device {
+
+PairingCache::PairingCache(const std::string& dir) : dir(dir) {}
+
+/**
+ * Returns the cache for a record directory. There's one per directory for the life of the process.
+ */
+PairingCache& PairingCache::shared(const std::string& dir) {
+	static std::mutex cachesLock;
+	static std::map<std::string, std::unique_ptr<PairingCache>> caches;
+
+	std::lock_guard<std::mutex> guard(cachesLock);
+	std::unique_ptr<PairingCache>& cache = caches[dir];
+	if (!cache) {
+		cache = std::make_unique<PairingCache>(dir);
+	}
+	return *cache;
+}
+
+/**
+ * Returns the stamp for the device's pairing record, or an empty stamp if it can't be stat'd.
+ */
+PairingStamp PairingCache::stamp(const std::string& udid) {
+	PairingStamp rval;
+	struct stat st;
+	if (::stat((dir + "/" + udid + ".plist").c_str(), &st) == 0) {
+#ifdef __APPLE__
+		rval.mtime = (uint64_t)st.st_mtimespec.tv_sec * 1000000000ULL + (uint64_t)st.st_mtimespec.tv_nsec;
+#else
+		rval.mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec;
+#endif
+		rval.size = (uint64_t)st.st_size;
+	}
+	return rval;
+}
+
+/**
+ * Checks the cached records for changes. Any record that changed loses its trust and is reloaded
+ * the next time it's needed. Must be called with the lock held.
+ */
+void PairingCache::refresh() {
+	auto now = std::chrono::steady_clock::now();
+	if (now - lastCheck < PAIRING_CACHE_CHECK_INTERVAL) {
+		return;
+	}
+	lastCheck = now;
+
+	for (auto& it : entries) {
+		PairingStamp current = stamp(it.first);
+		if (current != it.second.stamp) {
+			LOG_DEBUG_1("PairingCache::refresh", "Pairing record changed for %s", it.first.c_str())
+			it.second.stamp = current;
+			it.second.trusted = false;
+			it.second.record.reset();
+		}
+	}
+}
+
+/**
+ * Returns the pairing record for the device, loading it the first time it's requested or after it
+ * changed. Throws the load error if the record can't be read or parsed, and nothing is cached.
+ */
+std::shared_ptr<PairRecord> PairingCache::getRecord(const std::string& udid) {
+	std::lock_guard<std::mutex> guard(lock);
+	refresh();
+
+	Entry& entry = entries[udid];
+	if (!entry.record) {
+		PairingStamp current = stamp(udid);
+		try {
+			entry.record = std::make_shared<PairRecord>(PairRecord::load(dir + "/" + udid + ".plist"));
+		} catch (std::exception& e) {
+			LOG_DEBUG_2("PairingCache::getRecord", "Failed to load pairing record for %s: %s", udid.c_str(), e.what())
+			throw;
+		}
+		if (current != entry.stamp) {
+			entry.stamp = current;
+			entry.trusted = false;
+		}
+	}
+
+	return entry.record;
+}
+
+/**
+ * Returns true if the pairing was validated and the record hasn't changed since.
+ */
+bool PairingCache::isTrusted(const std::string& udid) {
+	std::lock_guard<std::mutex> guard(lock);
+	refresh();
+	auto it = entries.find(udid);
+	return it != entries.end() && it->second.trusted;
+}
+
+/**
+ * Marks the pairing as validated against the current version of the record.
+ */
+void PairingCache::setTrusted(const std::string& udid) {
+	std::lock_guard<std::mutex> guard(lock);
+	refresh();
+	Entry& entry = entries[udid];
+	PairingStamp current = stamp(udid);
+	if (current != entry.stamp) {
+		entry.stamp = current;
+		entry.record.reset();
+	}
+	entry.trusted = true;
+}
+
+void PairingCache::invalidate(const std::string& udid) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = entries.find(udid);
+	if (it != entries.end()) {
+		it->second.trusted = false;
+	}
+}
+
+}
@@ -0,0 +1,81 @@
+#ifndef __PAIRING_CACHE_H__
+#define __PAIRING_CACHE_H__
+
+#include "node-ios-device.h"
+#include "lockdown.h"
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+#ifdef __APPLE__
+	#define PAIRING_RECORD_DIR "/var/db/lockdown"
+#else
+	#define PAIRING_RECORD_DIR "/var/lib/lockdown"
+#endif
+
+/**
+ * How long a check is trusted before the cached records are stat'd again.
+ */
+#define PAIRING_CACHE_CHECK_INTERVAL std::chrono::seconds(1)
+
+/**
+ * Identifies a version of a pairing record by its modification time and size. A record that can't
+ * be stat'd, which is the case on macOS where the record directory is only readable by usbmuxd, has
+ * an empty stamp.
+ */
+struct PairingStamp {
+	PairingStamp() : mtime(0), size(0) {}
+	bool operator==(const PairingStamp& other) const { return mtime == other.mtime && size == other.size; }
+	bool operator!=(const PairingStamp& other) const { return !(*this == other); }
+	uint64_t mtime;
+	uint64_t size;
+};
+
+/**
+ * Caches pairing records and whether the pairing has been validated for each device. A device is
+ * trusted once a session has been started after a full pairing validation, and stays trusted until
+ * its pairing record changes on disk or a cached connect fails. Each record is re-stat'd at most
+ * once per `PAIRING_CACHE_CHECK_INTERVAL`. Changes to other files in the record directory don't
+ * affect it. When the record can't be stat'd, only a failed connect drops the trust.
+ *
+ * MobileDevice reads the records itself, so connects through it only use the trust. The native
+ * lockdown client gets its pair record from `getRecord()`, which parses each record once and
+ * reloads it when it changes.
+ */
+class PairingCache {
+public:
+	PairingCache(const std::string& dir = PAIRING_RECORD_DIR);
+
+	static PairingCache& shared(const std::string& dir = PAIRING_RECORD_DIR);
+
+	std::shared_ptr<PairRecord> getRecord(const std::string& udid);
+	bool isTrusted(const std::string& udid);
+	void setTrusted(const std::string& udid);
+	void invalidate(const std::string& udid);
+
+private:
+	struct Entry {
+		Entry() : trusted(false) {}
+		PairingStamp                stamp;
+		bool                        trusted;
+		std::shared_ptr<PairRecord> record;
+	};
+
+	void refresh();
+	PairingStamp stamp(const std::string& udid);
+
+	std::string                           dir;
+	std::mutex                            lock;
+	std::map<std::string, Entry>          entries;
+	std::chrono::steady_clock::time_point lastCheck;
+};
+
+}
+
+#endif
@@ -0,0 +1,1485 @@
+#include "plist.h"
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace node_ios_device {
+namespace plist {
+
+/**
+ * The deepest a plist can be nested. This guards against stack exhaustion on hostile input and
+ * against reference cycles in binary plists and JavaScript objects.
+ */
+#define PLIST_MAX_DEPTH 512
+
+/**
+ * The number of seconds between the Unix epoch and the CoreFoundation epoch (2001-01-01).
+ */
+#define PLIST_EPOCH_OFFSET 978307200.0
+
+static const char* base64Chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * Maps each byte to its base64 value, or -1 if it isn't a base64 character. Used as a function-local
+ * static so it's built once, thread-safely, the first time it's needed.
+ */
+struct Base64Table {
+	Base64Table() {
+		::memset(values, -1, sizeof(values));
+		for (int i = 0; i < 64; ++i) {
+			values[(uint8_t)base64Chars[i]] = (int8_t)i;
+		}
+	}
+	int8_t values[256];
+};
+
+/**
+ * Encodes a code point as UTF-8 and returns the number of bytes written. `out` must have room for
+ * 4 bytes.
+ */
+static size_t encodeUtf8(uint32_t cp, char* out) {
+	if (cp < 0x80) {
+		out[0] = (char)cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = (char)(0xC0 | (cp >> 6));
+		out[1] = (char)(0x80 | (cp & 0x3F));
+		return 2;
+	}
+	if (cp < 0x10000) {
+		out[0] = (char)(0xE0 | (cp >> 12));
+		out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+		out[2] = (char)(0x80 | (cp & 0x3F));
+		return 3;
+	}
+	out[0] = (char)(0xF0 | (cp >> 18));
+	out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+	out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+	out[3] = (char)(0x80 | (cp & 0x3F));
+	return 4;
+}
+
+/**
+ * Decodes the next UTF-8 sequence and advances `p`. Invalid sequences decode as U+FFFD.
+ */
+static uint32_t decodeUtf8(const uint8_t*& p, const uint8_t* end) {
+	uint8_t c = *p++;
+	if (c < 0x80) {
+		return c;
+	}
+
+	size_t n = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+	if (n == 0 || c > 0xF4 || (size_t)(end - p) < n) {
+		return 0xFFFD;
+	}
+
+	uint32_t cp = c & (0x3F >> n);
+	for (size_t i = 0; i < n; ++i) {
+		if ((p[i] & 0xC0) != 0x80) {
+			return 0xFFFD;
+		}
+		cp = (cp << 6) | (p[i] & 0x3F);
+	}
+	p += n;
+
+	static const uint32_t min[] = { 0, 0x80, 0x800, 0x10000 };
+	if (cp < min[n] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+		return 0xFFFD;
+	}
+	return cp;
+}
+
+/**
+ * Converts days since the Unix epoch to a civil date and back. These avoid `timegm()` and
+ * `gmtime_r()` which aren't portable and are much slower than the arithmetic.
+ */
+static void civilFromDays(int64_t z, int64_t& y, unsigned& m, unsigned& d) {
+	z += 719468;
+	int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+	unsigned doe = (unsigned)(z - era * 146097);
+	unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	unsigned mp = (5 * doy + 2) / 153;
+	d = doy - (153 * mp + 2) / 5 + 1;
+	m = mp < 10 ? mp + 3 : mp - 9;
+	y = (int64_t)yoe + era * 400 + (m <= 2);
+}
+
+static int64_t daysFromCivil(int64_t y, unsigned m, unsigned d) {
+	y -= m <= 2;
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	unsigned yoe = (unsigned)(y - era * 400);
+	unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (int64_t)doe - 719468;
+}
+
+/**
+ * Creates a string node that points at `str`. The caller must make sure `str` outlives the node.
+ */
+static Node* createSlice(Arena& arena, NodeType type, const char* str, size_t len) {
+	if (len > UINT32_MAX) {
+		throw std::runtime_error("String or data is too large for a plist");
+	}
+	Node* node = arena.node(type);
+	node->str.ptr = str;
+	node->str.len = (uint32_t)len;
+	return node;
+}
+
+/**
+ * Creates a string node with a copy of `str` in the arena.
+ */
+Node* createString(Arena& arena, const char* str, size_t len) {
+	char* dest = arena.chars(len);
+	::memcpy(dest, str, len);
+	return createSlice(arena, PlistString, dest, len);
+}
+
+Node* createString(Arena& arena, const std::string& str) {
+	return createString(arena, str.data(), str.length());
+}
+
+Node* createInteger(Arena& arena, int64_t value) {
+	Node* node = arena.node(PlistInteger);
+	node->i = value;
+	return node;
+}
+
+Node* createBool(Arena& arena, bool value) {
+	Node* node = arena.node(PlistBool);
+	node->b = value;
+	return node;
+}
+
+/**
+ * Creates a dict node from key/value pairs. Pairs with a NULL value are skipped. Keys are not
+ * copied and must outlive the node, which is the case for string literals.
+ */
+Node* createDict(Arena& arena, std::initializer_list<std::pair<const char*, Node*>> entries) {
+	Node* node = arena.node(PlistDict);
+	node->items = arena.items(entries.size() * 2);
+	for (auto const& entry : entries) {
+		if (entry.second) {
+			node->items[node->count * 2] = createSlice(arena, PlistString, entry.first, ::strlen(entry.first));
+			node->items[node->count * 2 + 1] = entry.second;
+			++node->count;
+		}
+	}
+	return node;
+}
+
+/**
+ * Looks up a key in a dict node. Returns NULL if the node isn't a dict or the key doesn't exist.
+ */
+const Node* dictGet(const Node* dict, const char* key) {
+	if (!dict || dict->type != PlistDict) {
+		return NULL;
+	}
+	size_t len = ::strlen(key);
+	for (uint32_t i = 0; i < dict->count; ++i) {
+		const Node* k = dict->items[i * 2];
+		if (k->str.len == len && ::memcmp(k->str.ptr, key, len) == 0) {
+			return dict->items[i * 2 + 1];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Looks up a string in a dict node. Returns an empty string if the key doesn't exist or isn't a
+ * string.
+ */
+std::string dictGetString(const Node* dict, const char* key) {
+	const Node* value = dictGet(dict, key);
+	return value && value->type == PlistString ? std::string(value->str.ptr, value->str.len) : "";
+}
+
+/**
+ * Detects the format and parses the plist.
+ */
+Node* parse(const uint8_t* data, size_t len, Arena& arena) {
+	if (len >= 8 && ::memcmp(data, "bplist00", 8) == 0) {
+		return parseBinary(data, len, arena);
+	}
+	return parseXml(reinterpret_cast<const char*>(data), len, arena);
+}
+
+/**
+ * Binary plist reader. The trailer at the end of the file describes an offset table that maps
+ * object numbers to their position. Every object is decoded at most once, so objects that are
+ * referenced more than once share the same node.
+ */
+class BinaryReader {
+public:
+	BinaryReader(const uint8_t* data, size_t len, Arena& arena) : data(data), len(len), arena(arena) {}
+
+	Node* parse() {
+		if (len < 8 + 32 + 1 || ::memcmp(data, "bplist00", 8) != 0) {
+			throw std::runtime_error("Invalid binary plist header");
+		}
+
+		const uint8_t* trailer = data + len - 32;
+		offsetSize = trailer[6];
+		refSize = trailer[7];
+		numObjects = readInt(trailer + 8, 8);
+		uint64_t topObject = readInt(trailer + 16, 8);
+		offsetTable = readInt(trailer + 24, 8);
+
+		if (offsetSize < 1 || offsetSize > 8 || refSize < 1 || refSize > 8) {
+			throw std::runtime_error("Invalid binary plist trailer");
+		}
+		if (numObjects == 0 || topObject >= numObjects || offsetTable < 8 || offsetTable > len - 32
+			|| numObjects > (len - 32 - offsetTable) / offsetSize) {
+			throw std::runtime_error("Invalid binary plist offset table");
+		}
+
+		objects = static_cast<Node**>(arena.alloc(sizeof(Node*) * numObjects, alignof(Node*)));
+		state = static_cast<uint8_t*>(arena.alloc(numObjects, 1));
+		::memset(objects, 0, sizeof(Node*) * numObjects);
+		::memset(state, 0, numObjects);
+
+		return parseObject(topObject, 0);
+	}
+
+private:
+	static uint64_t readInt(const uint8_t* p, size_t n) {
+		uint64_t value = 0;
+		for (size_t i = 0; i < n; ++i) {
+			value = (value << 8) | p[i];
+		}
+		return value;
+	}
+
+	static double readReal(const uint8_t* p, size_t n) {
+		if (n == 4) {
+			uint32_t bits = (uint32_t)readInt(p, 4);
+			float f;
+			::memcpy(&f, &bits, 4);
+			return f;
+		}
+		uint64_t bits = readInt(p, 8);
+		double d;
+		::memcpy(&d, &bits, 8);
+		return d;
+	}
+
+	/**
+	 * Makes sure `count` items of `size` bytes starting at `start` are inside the object area.
+	 */
+	void checkRange(uint64_t start, uint64_t count, uint64_t size) {
+		if (start > offsetTable || count > (offsetTable - start) / size) {
+			throw std::runtime_error("Binary plist object extends past the end of the data");
+		}
+	}
+
+	/**
+	 * Reads the length of a string, data, or collection object. Lengths of 15 or more are stored in
+	 * an integer object that follows the marker.
+	 */
+	uint64_t readLength(uint64_t off, uint8_t lo, uint64_t& start) {
+		if (lo != 0x0F) {
+			start = off + 1;
+			return lo;
+		}
+		checkRange(off + 1, 1, 1);
+		uint8_t marker = data[off + 1];
+		if ((marker & 0xF0) != 0x10 || (marker & 0x0F) > 3) {
+			throw std::runtime_error("Invalid binary plist length");
+		}
+		size_t n = (size_t)1 << (marker & 0x0F);
+		checkRange(off + 2, n, 1);
+		start = off + 2 + n;
+		return readInt(data + off + 2, n);
+	}
+
+	Node* parseObject(uint64_t ref, uint32_t depth) {
+		if (ref >= numObjects) {
+			throw std::runtime_error("Invalid binary plist object reference");
+		}
+		if (state[ref] == 2) {
+			return objects[ref];
+		}
+		if (state[ref] == 1 || depth > PLIST_MAX_DEPTH) {
+			throw std::runtime_error("Binary plist contains a reference cycle or is too deeply nested");
+		}
+		state[ref] = 1;
+
+		uint64_t off = readInt(data + offsetTable + ref * offsetSize, offsetSize);
+		checkRange(off, 1, 1);
+
+		uint8_t marker = data[off];
+		uint8_t lo = marker & 0x0F;
+		uint64_t start, count;
+		Node* node;
+
+		switch (marker >> 4) {
+			case 0x0:
+				if (lo != 0x8 && lo != 0x9) {
+					throw std::runtime_error("Unsupported binary plist object");
+				}
+				node = arena.node(PlistBool);
+				node->b = lo == 0x9;
+				break;
+
+			case 0x1:
+			{
+				if (lo > 4) {
+					throw std::runtime_error("Invalid binary plist integer");
+				}
+				size_t n = (size_t)1 << lo;
+				checkRange(off + 1, n, 1);
+				node = arena.node(PlistInteger);
+				// 128-bit integers only carry 64 significant bits in the low half
+				node->i = (int64_t)(n == 16 ? readInt(data + off + 9, 8) : readInt(data + off + 1, n));
+				break;
+			}
+
+			case 0x2:
+			case 0x3:
+			{
+				size_t n = (size_t)1 << lo;
+				if ((n != 4 && n != 8) || ((marker >> 4) == 0x3 && n != 8)) {
+					throw std::runtime_error("Invalid binary plist real");
+				}
+				checkRange(off + 1, n, 1);
+				node = arena.node((marker >> 4) == 0x2 ? PlistReal : PlistDate);
+				node->d = readReal(data + off + 1, n);
+				break;
+			}
+
+			case 0x4:
+				count = readLength(off, lo, start);
+				checkRange(start, count, 1);
+				node = createSlice(arena, PlistData, (const char*)data + start, count);
+				break;
+
+			case 0x5:
+				count = readLength(off, lo, start);
+				checkRange(start, count, 1);
+				node = parseAscii(data + start, (size_t)count);
+				break;
+
+			case 0x6:
+				count = readLength(off, lo, start);
+				checkRange(start, count, 2);
+				node = parseUtf16(data + start, (size_t)count);
+				break;
+
+			case 0x7:
+				count = readLength(off, lo, start);
+				checkRange(start, count, 1);
+				node = createSlice(arena, PlistString, (const char*)data + start, count);
+				break;
+
+			case 0x8:
+				checkRange(off + 1, lo + 1, 1);
+				node = arena.node(PlistUid);
+				node->i = (int64_t)readInt(data + off + 1, lo + 1);
+				break;
+
+			case 0xA:
+			case 0xC:
+				count = readLength(off, lo, start);
+				checkRange(start, count, refSize);
+				node = arena.node(PlistArray);
+				node->count = (uint32_t)count;
+				node->items = arena.items(count);
+				for (uint64_t i = 0; i < count; ++i) {
+					node->items[i] = parseObject(readInt(data + start + i * refSize, refSize), depth + 1);
+				}
+				break;
+
+			case 0xD:
+				count = readLength(off, lo, start);
+				checkRange(start, count, refSize * 2);
+				node = arena.node(PlistDict);
+				node->count = (uint32_t)count;
+				node->items = arena.items(count * 2);
+				for (uint64_t i = 0; i < count; ++i) {
+					Node* key = parseObject(readInt(data + start + i * refSize, refSize), depth + 1);
+					if (key->type != PlistString) {
+						throw std::runtime_error("Binary plist dict key is not a string");
+					}
+					node->items[i * 2] = key;
+					node->items[i * 2 + 1] = parseObject(readInt(data + start + (count + i) * refSize, refSize), depth + 1);
+				}
+				break;
+
+			default:
+				throw std::runtime_error("Unsupported binary plist object");
+		}
+
+		objects[ref] = node;
+		state[ref] = 2;
+		return node;
+	}
+
+	/**
+	 * ASCII strings are sliced straight out of the input. Apple only writes 7-bit characters here,
+	 * but anything above that is treated as Latin-1 and converted.
+	 */
+	Node* parseAscii(const uint8_t* p, size_t count) {
+		size_t extra = 0;
+		for (size_t i = 0; i < count; ++i) {
+			extra += p[i] >> 7;
+		}
+		if (extra == 0) {
+			return createSlice(arena, PlistString, (const char*)p, count);
+		}
+
+		char* dest = arena.chars(count + extra);
+		char* q = dest;
+		for (size_t i = 0; i < count; ++i) {
+			q += encodeUtf8(p[i], q);
+		}
+		return createSlice(arena, PlistString, dest, count + extra);
+	}
+
+	/**
+	 * Converts a big endian UTF-16 string to UTF-8 in the arena. Unpaired surrogates become U+FFFD.
+	 */
+	Node* parseUtf16(const uint8_t* p, size_t count) {
+		char* dest = arena.chars(count * 3);
+		char* q = dest;
+		for (size_t i = 0; i < count; ++i) {
+			uint32_t cp = (uint32_t)(p[i * 2] << 8 | p[i * 2 + 1]);
+			if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < count) {
+				uint32_t lo = (uint32_t)(p[i * 2 + 2] << 8 | p[i * 2 + 3]);
+				if (lo >= 0xDC00 && lo <= 0xDFFF) {
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+					++i;
+				}
+			}
+			if (cp >= 0xD800 && cp <= 0xDFFF) {
+				cp = 0xFFFD;
+			}
+			q += encodeUtf8(cp, q);
+		}
+		return createSlice(arena, PlistString, dest, (size_t)(q - dest));
+	}
+
+	const uint8_t* data;
+	size_t         len;
+	Arena&         arena;
+	uint8_t        offsetSize;
+	uint8_t        refSize;
+	uint64_t       numObjects;
+	uint64_t       offsetTable;
+	Node**         objects;
+	uint8_t*       state;
+};
+
+Node* parseBinary(const uint8_t* data, size_t len, Arena& arena) {
+	return BinaryReader(data, len, arena).parse();
+}
+
+/**
+ * XML plist reader. This is not a general purpose XML parser, it only understands the handful of
+ * elements used by property lists. Text without entities or CDATA sections is sliced straight out
+ * of the input.
+ */
+class XmlReader {
+public:
+	XmlReader(const char* data, size_t len, Arena& arena) : p(data), end(data + len), arena(arena) {}
+
+	Node* parse() {
+		skipMisc();
+		bool wrapped = startsWith("<plist");
+		if (wrapped) {
+			if (readOpenTag() != "plist") {
+				throw std::runtime_error("Invalid XML plist");
+			}
+			skipMisc();
+		}
+
+		Node* root = parseValue(0);
+
+		skipMisc();
+		if (wrapped) {
+			expectCloseTag("plist");
+			skipMisc();
+		}
+		if (p != end) {
+			throw error("Unexpected content after plist value");
+		}
+		return root;
+	}
+
+private:
+	std::runtime_error error(const char* msg) {
+		return std::runtime_error(std::string(msg) + " in XML plist");
+	}
+
+	bool startsWith(const char* s) {
+		size_t n = ::strlen(s);
+		return (size_t)(end - p) >= n && ::memcmp(p, s, n) == 0;
+	}
+
+	void skipWhitespace() {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+			++p;
+		}
+	}
+
+	void skipPast(const char* s) {
+		size_t n = ::strlen(s);
+		while ((size_t)(end - p) >= n) {
+			if (::memcmp(p, s, n) == 0) {
+				p += n;
+				return;
+			}
+			++p;
+		}
+		throw error("Unterminated markup");
+	}
+
+	/**
+	 * Skips whitespace, comments, processing instructions, and the doctype.
+	 */
+	void skipMisc() {
+		for (;;) {
+			skipWhitespace();
+			if (startsWith("<?")) {
+				skipPast("?>");
+			} else if (startsWith("<!--")) {
+				skipPast("-->");
+			} else if (startsWith("<!DOCTYPE")) {
+				skipPast(">");
+			} else {
+				return;
+			}
+		}
+	}
+
+	/**
+	 * Reads an opening tag and returns its name. Attributes are ignored. `selfClosing` is set for
+	 * tags like `<true/>`.
+	 */
+	std::string readOpenTag() {
+		if (p >= end || *p != '<') {
+			throw error("Expected element");
+		}
+		const char* name = ++p;
+		while (p < end && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'))) {
+			++p;
+		}
+		std::string tag(name, (size_t)(p - name));
+		while (p < end && *p != '>') {
+			++p;
+		}
+		if (p >= end) {
+			throw error("Unterminated element");
+		}
+		selfClosing = p[-1] == '/';
+		++p;
+		return tag;
+	}
+
+	void expectCloseTag(const char* tag) {
+		size_t n = ::strlen(tag);
+		if (!startsWith("</") || (size_t)(end - p) < n + 2 || ::memcmp(p + 2, tag, n) != 0) {
+			throw error("Mismatched closing element");
+		}
+		p += n + 2;
+		skipWhitespace();
+		if (p >= end || *p != '>') {
+			throw error("Mismatched closing element");
+		}
+		++p;
+	}
+
+	/**
+	 * Reads the text content of an element up to its closing tag.
+	 */
+	Slice readText(const char* tag) {
+		Slice text = { p, 0 };
+		if (selfClosing) {
+			return text;
+		}
+
+		const char* lt = static_cast<const char*>(::memchr(p, '<', (size_t)(end - p)));
+		if (!lt) {
+			throw error("Unterminated element");
+		}
+
+		if (!::memchr(p, '&', (size_t)(lt - p)) && !startsWithAt(lt, "<![CDATA[")) {
+			text.len = (uint32_t)(lt - p);
+			p = lt;
+		} else {
+			text = decodeText();
+		}
+
+		expectCloseTag(tag);
+		return text;
+	}
+
+	bool startsWithAt(const char* at, const char* s) {
+		size_t n = ::strlen(s);
+		return (size_t)(end - at) >= n && ::memcmp(at, s, n) == 0;
+	}
+
+	/**
+	 * Decodes entities and CDATA sections into the arena. The decoded text is never longer than the
+	 * raw text, so the raw length is a safe upper bound.
+	 */
+	Slice decodeText() {
+		const char* start = p;
+		while (p < end && !(*p == '<' && !startsWith("<![CDATA["))) {
+			if (startsWith("<![CDATA[")) {
+				skipPast("]]>");
+			} else {
+				++p;
+			}
+		}
+		const char* stop = p;
+
+		char* dest = arena.chars((size_t)(stop - start));
+		char* q = dest;
+		for (const char* s = start; s < stop; ) {
+			if (startsWithAt(s, "<![CDATA[")) {
+				s += 9;
+				while (!startsWithAt(s, "]]>")) {
+					*q++ = *s++;
+				}
+				s += 3;
+			} else if (*s == '&') {
+				const char* semi = static_cast<const char*>(::memchr(s, ';', (size_t)(stop - s)));
+				if (!semi) {
+					throw error("Unterminated entity");
+				}
+				q += decodeEntity(s + 1, (size_t)(semi - s - 1), q);
+				s = semi + 1;
+			} else {
+				*q++ = *s++;
+			}
+		}
+
+		Slice text = { dest, (uint32_t)(q - dest) };
+		return text;
+	}
+
+	size_t decodeEntity(const char* name, size_t len, char* out) {
+		if (len == 3 && ::memcmp(name, "amp", 3) == 0) { *out = '&'; return 1; }
+		if (len == 2 && ::memcmp(name, "lt", 2) == 0) { *out = '<'; return 1; }
+		if (len == 2 && ::memcmp(name, "gt", 2) == 0) { *out = '>'; return 1; }
+		if (len == 4 && ::memcmp(name, "quot", 4) == 0) { *out = '"'; return 1; }
+		if (len == 4 && ::memcmp(name, "apos", 4) == 0) { *out = '\''; return 1; }
+
+		if (len >= 2 && name[0] == '#') {
+			bool hex = name[1] == 'x' || name[1] == 'X';
+			uint32_t cp = 0;
+			for (size_t i = hex ? 2 : 1; i < len; ++i) {
+				char c = name[i];
+				uint32_t digit;
+				if (c >= '0' && c <= '9') {
+					digit = (uint32_t)(c - '0');
+				} else if (hex && c >= 'a' && c <= 'f') {
+					digit = (uint32_t)(c - 'a' + 10);
+				} else if (hex && c >= 'A' && c <= 'F') {
+					digit = (uint32_t)(c - 'A' + 10);
+				} else {
+					throw error("Invalid character reference");
+				}
+				cp = cp * (hex ? 16 : 10) + digit;
+				if (cp > 0x10FFFF) {
+					throw error("Invalid character reference");
+				}
+			}
+			if (cp >= 0xD800 && cp <= 0xDFFF) {
+				cp = 0xFFFD;
+			}
+			return encodeUtf8(cp, out);
+		}
+
+		throw error("Unknown entity");
+	}
+
+	/**
+	 * Copies trimmed text into a null terminated buffer for strtoll() and strtod().
+	 */
+	void textToBuffer(Slice text, char* buf, size_t size) {
+		const char* s = text.ptr;
+		const char* e = text.ptr + text.len;
+		while (s < e && ::isspace((unsigned char)*s)) ++s;
+		while (e > s && ::isspace((unsigned char)e[-1])) --e;
+		if (s == e || (size_t)(e - s) >= size) {
+			throw error("Invalid number");
+		}
+		::memcpy(buf, s, (size_t)(e - s));
+		buf[e - s] = '\0';
+	}
+
+	Node* parseValue(uint32_t depth) {
+		if (depth > PLIST_MAX_DEPTH) {
+			throw error("Too deeply nested");
+		}
+
+		std::string tag = readOpenTag();
+		Node* node;
+
+		if (tag == "dict" || tag == "array") {
+			bool isDict = tag == "dict";
+			size_t base = scratch.size();
+
+			if (!selfClosing) {
+				for (;;) {
+					skipMisc();
+					if (startsWith("</")) {
+						expectCloseTag(tag.c_str());
+						break;
+					}
+					if (isDict) {
+						if (readOpenTag() != "key") {
+							throw error("Expected key");
+						}
+						Slice key = readText("key");
+						scratch.push_back(createSlice(arena, PlistString, key.ptr, key.len));
+						skipMisc();
+					}
+					scratch.push_back(parseValue(depth + 1));
+				}
+			}
+
+			size_t n = scratch.size() - base;
+			node = arena.node(isDict ? PlistDict : PlistArray);
+			node->count = (uint32_t)(isDict ? n / 2 : n);
+			node->items = arena.items(n);
+			if (n) {
+				::memcpy(node->items, scratch.data() + base, sizeof(Node*) * n);
+			}
+			scratch.resize(base);
+
+			// NSKeyedArchiver UIDs are written as a dict with a single CF$UID key
+			const Node* uid = isDict && node->count == 1 ? dictGet(node, "CF$UID") : NULL;
+			if (uid && uid->type == PlistInteger) {
+				int64_t value = uid->i;
+				node = arena.node(PlistUid);
+				node->i = value;
+			}
+
+		} else if (tag == "key" || tag == "string") {
+			Slice text = readText(tag.c_str());
+			node = createSlice(arena, PlistString, text.ptr, text.len);
+
+		} else if (tag == "data") {
+			node = decodeBase64(readText("data"));
+
+		} else if (tag == "integer") {
+			char buf[72];
+			textToBuffer(readText("integer"), buf, sizeof(buf));
+			char* stop;
+			node = arena.node(PlistInteger);
+			if (buf[0] == '-') {
+				node->i = ::strtoll(buf, &stop, 10);
+			} else {
+				node->i = (int64_t)::strtoull(buf[0] == '+' ? buf + 1 : buf, &stop, 10);
+			}
+			if (*stop) {
+				throw error("Invalid integer");
+			}
+
+		} else if (tag == "real") {
+			char buf[72];
+			textToBuffer(readText("real"), buf, sizeof(buf));
+			char* stop;
+			node = arena.node(PlistReal);
+			if (::strcmp(buf, "+infinity") == 0 || ::strcmp(buf, "inf") == 0) {
+				node->d = INFINITY;
+			} else if (::strcmp(buf, "-infinity") == 0 || ::strcmp(buf, "-inf") == 0) {
+				node->d = -INFINITY;
+			} else {
+				node->d = ::strtod(buf, &stop);
+				if (*stop) {
+					throw error("Invalid real");
+				}
+			}
+
+		} else if (tag == "date") {
+			node = arena.node(PlistDate);
+			node->d = parseDate(readText("date"));
+
+		} else if (tag == "true" || tag == "false") {
+			if (!selfClosing) {
+				skipWhitespace();
+				expectCloseTag(tag.c_str());
+			}
+			node = arena.node(PlistBool);
+			node->b = tag == "true";
+
+		} else {
+			throw error("Unsupported element");
+		}
+
+		return node;
+	}
+
+	/**
+	 * Parses an ISO 8601 date in the `YYYY-MM-DDTHH:MM:SSZ` form that CoreFoundation writes and
+	 * returns seconds since the CoreFoundation epoch.
+	 */
+	double parseDate(Slice text) {
+		char buf[72];
+		textToBuffer(text, buf, sizeof(buf));
+		int y, mo, d, h = 0, mi = 0, s = 0;
+		if (::sscanf(buf, "%d-%d-%dT%d:%d:%d", &y, &mo, &d, &h, &mi, &s) < 3 || mo < 1 || mo > 12 || d < 1 || d > 31) {
+			throw error("Invalid date");
+		}
+		int64_t days = daysFromCivil(y, (unsigned)mo, (unsigned)d);
+		return (double)(days * 86400 + h * 3600 + mi * 60 + s) - PLIST_EPOCH_OFFSET;
+	}
+
+	/**
+	 * Decodes base64 into the arena, ignoring whitespace.
+	 */
+	Node* decodeBase64(Slice text) {
+		static const Base64Table table;
+
+		char* dest = arena.chars(text.len / 4 * 3 + 3);
+		char* q = dest;
+		uint32_t acc = 0;
+		int bits = 0;
+
+		for (uint32_t i = 0; i < text.len; ++i) {
+			uint8_t c = (uint8_t)text.ptr[i];
+			if (c == '=') {
+				break;
+			}
+			int8_t v = table.values[c];
+			if (v < 0) {
+				if (::isspace(c)) {
+					continue;
+				}
+				throw error("Invalid base64 data");
+			}
+			acc = (acc << 6) | (uint32_t)v;
+			bits += 6;
+			if (bits >= 8) {
+				bits -= 8;
+				*q++ = (char)((acc >> bits) & 0xFF);
+			}
+		}
+
+		return createSlice(arena, PlistData, dest, (size_t)(q - dest));
+	}
+
+	const char*        p;
+	const char*        end;
+	Arena&             arena;
+	bool               selfClosing = false;
+	std::vector<Node*> scratch;
+};
+
+Node* parseXml(const char* data, size_t len, Arena& arena) {
+	return XmlReader(data, len, arena).parse();
+}
+
+/**
+ * Binary plist writer. Objects are numbered breadth first so that the children of every
+ * collection have consecutive object numbers that are known by the time the collection is
+ * written. The tree is counted up front so the reference size is known and nothing needs to be
+ * patched afterwards.
+ */
+class BinaryWriter {
+public:
+	BinaryWriter(std::vector<uint8_t>& out) : out(out) {}
+
+	void write(const Node* root) {
+		size_t total = countNodes(root, 0);
+		refSize = total <= 0xFF ? 1 : total <= 0xFFFF ? 2 : 4;
+
+		objects.reserve(total);
+		offsets.reserve(total);
+		objects.push_back(root);
+
+		size_t base = out.size();
+		out.insert(out.end(), { 'b', 'p', 'l', 'i', 's', 't', '0', '0' });
+
+		for (size_t i = 0; i < objects.size(); ++i) {
+			offsets.push_back(out.size() - base);
+			writeObject(objects[i]);
+		}
+
+		uint64_t offsetTable = out.size() - base;
+		uint8_t offsetSize = offsetTable <= 0xFF ? 1 : offsetTable <= 0xFFFF ? 2 : offsetTable <= 0xFFFFFFFF ? 4 : 8;
+		for (auto offset : offsets) {
+			writeInt(offset, offsetSize);
+		}
+
+		uint8_t trailer[6] = { 0 };
+		out.insert(out.end(), trailer, trailer + 6);
+		out.push_back(offsetSize);
+		out.push_back(refSize);
+		writeInt(objects.size(), 8);
+		writeInt(0, 8);
+		writeInt(offsetTable, 8);
+	}
+
+private:
+	size_t countNodes(const Node* node, uint32_t depth) {
+		if (depth > PLIST_MAX_DEPTH) {
+			throw std::runtime_error("Plist is too deeply nested");
+		}
+		size_t n = 1;
+		if (node->type == PlistArray || node->type == PlistDict) {
+			uint32_t items = node->type == PlistDict ? node->count * 2 : node->count;
+			for (uint32_t i = 0; i < items; ++i) {
+				n += countNodes(node->items[i], depth + 1);
+			}
+		}
+		return n;
+	}
+
+	void writeInt(uint64_t value, size_t n) {
+		for (size_t i = n; i > 0; --i) {
+			out.push_back((uint8_t)(value >> ((i - 1) * 8)));
+		}
+	}
+
+	void writeMarker(uint8_t type, uint64_t count) {
+		if (count < 0x0F) {
+			out.push_back((uint8_t)(type | count));
+		} else {
+			out.push_back((uint8_t)(type | 0x0F));
+			writeInteger((int64_t)count);
+		}
+	}
+
+	void writeInteger(int64_t value) {
+		if (value < 0) {
+			out.push_back(0x13);
+			writeInt((uint64_t)value, 8);
+		} else if (value <= 0xFF) {
+			out.push_back(0x10);
+			writeInt((uint64_t)value, 1);
+		} else if (value <= 0xFFFF) {
+			out.push_back(0x11);
+			writeInt((uint64_t)value, 2);
+		} else if (value <= 0xFFFFFFFFLL) {
+			out.push_back(0x12);
+			writeInt((uint64_t)value, 4);
+		} else {
+			out.push_back(0x13);
+			writeInt((uint64_t)value, 8);
+		}
+	}
+
+	void writeDouble(uint8_t marker, double d) {
+		uint64_t bits;
+		::memcpy(&bits, &d, 8);
+		out.push_back(marker);
+		writeInt(bits, 8);
+	}
+
+	/**
+	 * ASCII strings are written as is, anything else is converted to big endian UTF-16.
+	 */
+	void writeString(const Slice& str) {
+		const uint8_t* s = (const uint8_t*)str.ptr;
+		const uint8_t* e = s + str.len;
+		bool ascii = true;
+		for (const uint8_t* c = s; c < e; ++c) {
+			if (*c & 0x80) {
+				ascii = false;
+				break;
+			}
+		}
+
+		if (ascii) {
+			writeMarker(0x50, str.len);
+			out.insert(out.end(), s, e);
+			return;
+		}
+
+		size_t units = 0;
+		for (const uint8_t* c = s; c < e; ) {
+			units += decodeUtf8(c, e) >= 0x10000 ? 2 : 1;
+		}
+		writeMarker(0x60, units);
+		for (const uint8_t* c = s; c < e; ) {
+			uint32_t cp = decodeUtf8(c, e);
+			if (cp >= 0x10000) {
+				cp -= 0x10000;
+				writeInt(0xD800 + (cp >> 10), 2);
+				writeInt(0xDC00 + (cp & 0x3FF), 2);
+			} else {
+				writeInt(cp, 2);
+			}
+		}
+	}
+
+	void writeRefs(const Node* node, uint32_t items) {
+		for (uint32_t i = 0; i < items; ++i) {
+			writeInt(objects.size(), refSize);
+			objects.push_back(node->items[i]);
+		}
+	}
+
+	void writeObject(const Node* node) {
+		switch (node->type) {
+			case PlistBool:
+				out.push_back(node->b ? 0x09 : 0x08);
+				break;
+
+			case PlistInteger:
+				writeInteger(node->i);
+				break;
+
+			case PlistReal:
+				writeDouble(0x23, node->d);
+				break;
+
+			case PlistDate:
+				writeDouble(0x33, node->d);
+				break;
+
+			case PlistString:
+				writeString(node->str);
+				break;
+
+			case PlistData:
+				writeMarker(0x40, node->str.len);
+				out.insert(out.end(), (const uint8_t*)node->str.ptr, (const uint8_t*)node->str.ptr + node->str.len);
+				break;
+
+			case PlistUid:
+			{
+				uint64_t value = (uint64_t)node->i;
+				size_t n = value <= 0xFF ? 1 : value <= 0xFFFF ? 2 : value <= 0xFFFFFFFF ? 4 : 8;
+				out.push_back((uint8_t)(0x80 | (n - 1)));
+				writeInt(value, n);
+				break;
+			}
+
+			case PlistArray:
+				writeMarker(0xA0, node->count);
+				writeRefs(node, node->count);
+				break;
+
+			case PlistDict:
+			{
+				// keys come first, then values
+				writeMarker(0xD0, node->count);
+				for (uint32_t i = 0; i < node->count; ++i) {
+					writeInt(objects.size(), refSize);
+					objects.push_back(node->items[i * 2]);
+				}
+				for (uint32_t i = 0; i < node->count; ++i) {
+					writeInt(objects.size(), refSize);
+					objects.push_back(node->items[i * 2 + 1]);
+				}
+				break;
+			}
+		}
+	}
+
+	std::vector<uint8_t>&    out;
+	std::vector<const Node*> objects;
+	std::vector<uint64_t>    offsets;
+	uint8_t                  refSize;
+};
+
+void writeBinary(const Node* root, std::vector<uint8_t>& out) {
+	BinaryWriter(out).write(root);
+}
+
+/**
+ * XML plist writer. The output matches what CoreFoundation produces, indented with tabs.
+ */
+class XmlWriter {
+public:
+	XmlWriter(std::vector<uint8_t>& out) : out(out) {}
+
+	void write(const Node* root) {
+		append("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+			"<plist version=\"1.0\">\n");
+		writeNode(root, 0);
+		append("</plist>\n");
+	}
+
+private:
+	void append(const char* s, size_t len) {
+		out.insert(out.end(), (const uint8_t*)s, (const uint8_t*)s + len);
+	}
+
+	void append(const char* s) {
+		append(s, ::strlen(s));
+	}
+
+	void indent(uint32_t depth) {
+		out.insert(out.end(), depth, '\t');
+	}
+
+	void appendEscaped(const Slice& str) {
+		const char* run = str.ptr;
+		const char* e = str.ptr + str.len;
+		for (const char* c = run; c < e; ++c) {
+			const char* entity = *c == '&' ? "&amp;" : *c == '<' ? "&lt;" : *c == '>' ? "&gt;" : NULL;
+			if (entity) {
+				append(run, (size_t)(c - run));
+				append(entity);
+				run = c + 1;
+			}
+		}
+		append(run, (size_t)(e - run));
+	}
+
+	void appendBase64(const Slice& data) {
+		const uint8_t* s = (const uint8_t*)data.ptr;
+		uint32_t len = data.len;
+		uint32_t i = 0;
+		for (; i + 3 <= len; i += 3) {
+			uint32_t v = (uint32_t)(s[i] << 16 | s[i + 1] << 8 | s[i + 2]);
+			out.push_back((uint8_t)base64Chars[(v >> 18) & 0x3F]);
+			out.push_back((uint8_t)base64Chars[(v >> 12) & 0x3F]);
+			out.push_back((uint8_t)base64Chars[(v >> 6) & 0x3F]);
+			out.push_back((uint8_t)base64Chars[v & 0x3F]);
+		}
+		if (i < len) {
+			uint32_t v = (uint32_t)(s[i] << 16 | (i + 1 < len ? s[i + 1] << 8 : 0));
+			out.push_back((uint8_t)base64Chars[(v >> 18) & 0x3F]);
+			out.push_back((uint8_t)base64Chars[(v >> 12) & 0x3F]);
+			out.push_back(i + 1 < len ? (uint8_t)base64Chars[(v >> 6) & 0x3F] : '=');
+			out.push_back('=');
+		}
+	}
+
+	void appendElement(const char* tag, const char* text, size_t len) {
+		append("<");
+		append(tag);
+		append(">");
+		append(text, len);
+		append("</");
+		append(tag);
+		append(">\n");
+	}
+
+	void writeNode(const Node* node, uint32_t depth) {
+		char buf[64];
+		int n;
+
+		if (depth > PLIST_MAX_DEPTH) {
+			throw std::runtime_error("Plist is too deeply nested");
+		}
+
+		indent(depth);
+
+		switch (node->type) {
+			case PlistBool:
+				append(node->b ? "<true/>\n" : "<false/>\n");
+				break;
+
+			case PlistInteger:
+				n = ::snprintf(buf, sizeof(buf), "%lld", (long long)node->i);
+				appendElement("integer", buf, (size_t)n);
+				break;
+
+			case PlistReal:
+				if (std::isnan(node->d)) {
+					n = ::snprintf(buf, sizeof(buf), "nan");
+				} else if (std::isinf(node->d)) {
+					n = ::snprintf(buf, sizeof(buf), "%s", node->d > 0 ? "+infinity" : "-infinity");
+				} else {
+					// use the shortest representation that survives a round trip
+					n = ::snprintf(buf, sizeof(buf), "%.15g", node->d);
+					if (::strtod(buf, NULL) != node->d) {
+						n = ::snprintf(buf, sizeof(buf), "%.17g", node->d);
+					}
+				}
+				appendElement("real", buf, (size_t)n);
+				break;
+
+			case PlistDate:
+			{
+				if (!(std::fabs(node->d) < 1e14)) {
+					throw std::runtime_error("Date is out of range");
+				}
+				int64_t secs = (int64_t)std::floor(node->d + PLIST_EPOCH_OFFSET);
+				int64_t days = (secs >= 0 ? secs : secs - 86399) / 86400;
+				int64_t rem = secs - days * 86400;
+				int64_t y;
+				unsigned m, d;
+				civilFromDays(days, y, m, d);
+				n = ::snprintf(buf, sizeof(buf), "%04lld-%02u-%02uT%02d:%02d:%02dZ", (long long)y, m, d, (int)(rem / 3600), (int)(rem / 60 % 60), (int)(rem % 60));
+				appendElement("date", buf, (size_t)n);
+				break;
+			}
+
+			case PlistString:
+				append("<string>");
+				appendEscaped(node->str);
+				append("</string>\n");
+				break;
+
+			case PlistData:
+				append("<data>");
+				appendBase64(node->str);
+				append("</data>\n");
+				break;
+
+			case PlistUid:
+				append("<dict>\n");
+				indent(depth + 1);
+				append("<key>CF$UID</key>\n");
+				indent(depth + 1);
+				n = ::snprintf(buf, sizeof(buf), "%lld", (long long)node->i);
+				appendElement("integer", buf, (size_t)n);
+				indent(depth);
+				append("</dict>\n");
+				break;
+
+			case PlistArray:
+				if (node->count == 0) {
+					append("<array/>\n");
+					break;
+				}
+				append("<array>\n");
+				for (uint32_t i = 0; i < node->count; ++i) {
+					writeNode(node->items[i], depth + 1);
+				}
+				indent(depth);
+				append("</array>\n");
+				break;
+
+			case PlistDict:
+				if (node->count == 0) {
+					append("<dict/>\n");
+					break;
+				}
+				append("<dict>\n");
+				for (uint32_t i = 0; i < node->count; ++i) {
+					indent(depth + 1);
+					append("<key>");
+					appendEscaped(node->items[i * 2]->str);
+					append("</key>\n");
+					writeNode(node->items[i * 2 + 1], depth + 1);
+				}
+				indent(depth);
+				append("</dict>\n");
+				break;
+		}
+	}
+
+	std::vector<uint8_t>& out;
+};
+
+void writeXml(const Node* root, std::vector<uint8_t>& out) {
+	XmlWriter(out).write(root);
+}
+
+/**
+ * Converts a tree into JavaScript values. Dates become `Date` objects, data is copied into a
+ * Buffer, and UIDs become `{ CF$UID: n }` objects. Integers outside of the safe integer range lose
+ * precision.
+ */
+static napi_value toJS(napi_env env, const Node* node, napi_value& dateCtor) {
+	napi_value rval;
+
+	switch (node->type) {
+		case PlistBool:
+			NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_GET_BOOLEAN", ::napi_get_boolean(env, node->b, &rval), NULL)
+			break;
+
+		case PlistInteger:
+			NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_CREATE_INT64", ::napi_create_int64(env, node->i, &rval), NULL)
+			break;
+
+		case PlistReal:
+			NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_CREATE_DOUBLE", ::napi_create_double(env, node->d, &rval), NULL)
+			break;
+
+		case PlistDate:
+		{
+			// napi_create_date() requires N-API 5, so construct the Date ourselves
+			if (!dateCtor) {
+				napi_value global;
+				NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_GET_GLOBAL", ::napi_get_global(env, &global), NULL)
+				NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_GET_NAMED_PROPERTY", ::napi_get_named_property(env, global, "Date", &dateCtor), NULL)
+			}
+			napi_value ms;
+			NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_CREATE_DOUBLE", ::napi_create_double(env, (node->d + PLIST_EPOCH_OFFSET) * 1000.0, &ms), NULL)
+			NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_NEW_INSTANCE", ::napi_new_instance(env, dateCtor, 1, &ms, &rval), NULL)
+			break;
+		}
+
+		case PlistString:
+			NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_CREATE_STRING", ::napi_create_string_utf8(env, node->str.ptr, node->str.len, &rval), NULL)
+			break;
+
+		case PlistData:
+		{
+			void* dest;
+			NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_CREATE_BUFFER_COPY", ::napi_create_buffer_copy(env, node->str.len, node->str.ptr, &dest, &rval), NULL)
+			break;
+		}
+
+		case PlistUid:
+		{
+			napi_value uid;
+			NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_CREATE_OBJECT", ::napi_create_object(env, &rval), NULL)
+			NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_CREATE_INT64", ::napi_create_int64(env, node->i, &uid), NULL)
+			NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, rval, "CF$UID", uid), NULL)
+			break;
+		}
+
+		case PlistArray:
+			NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_CREATE_ARRAY", ::napi_create_array_with_length(env, node->count, &rval), NULL)
+			for (uint32_t i = 0; i < node->count; ++i) {
+				napi_value item = toJS(env, node->items[i], dateCtor);
+				if (!item) {
+					return NULL;
+				}
+				NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_SET_ELEMENT", ::napi_set_element(env, rval, i, item), NULL)
+			}
+			break;
+
+		case PlistDict:
+			NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_CREATE_OBJECT", ::napi_create_object(env, &rval), NULL)
+			for (uint32_t i = 0; i < node->count; ++i) {
+				const Node* key = node->items[i * 2];
+				napi_value name, item = toJS(env, node->items[i * 2 + 1], dateCtor);
+				if (!item) {
+					return NULL;
+				}
+				NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_CREATE_STRING", ::napi_create_string_utf8(env, key->str.ptr, key->str.len, &name), NULL)
+				NAPI_THROW_RETURN("plist::toJS", "ERR_NAPI_SET_PROPERTY", ::napi_set_property(env, rval, name, item), NULL)
+			}
+			break;
+	}
+
+	return rval;
+}
+
+napi_value toJS(napi_env env, const Node* node) {
+	napi_value dateCtor = NULL;
+	return toJS(env, node, dateCtor);
+}
+
+/**
+ * Converts a JavaScript value into a tree. Buffers are referenced rather than copied, so the value
+ * must stay alive until the tree has been serialized. Returns NULL for `null`, `undefined`, and
+ * functions, which are omitted from objects and arrays.
+ */
+static Node* fromJS(napi_env env, napi_value value, Arena& arena, napi_value& dateCtor, uint32_t depth) {
+	if (depth > PLIST_MAX_DEPTH) {
+		throw std::runtime_error("Value is too deeply nested or contains a cycle");
+	}
+
+	napi_valuetype type;
+	if (::napi_typeof(env, value, &type) != napi_ok) {
+		return NULL;
+	}
+
+	if (type == napi_string) {
+		size_t len = 0;
+		::napi_get_value_string_utf8(env, value, NULL, 0, &len);
+		char* dest = arena.chars(len + 1);
+		::napi_get_value_string_utf8(env, value, dest, len + 1, &len);
+		return createSlice(arena, PlistString, dest, len);
+	}
+
+	if (type == napi_boolean) {
+		Node* node = arena.node(PlistBool);
+		::napi_get_value_bool(env, value, &node->b);
+		return node;
+	}
+
+	if (type == napi_number) {
+		double num = 0;
+		::napi_get_value_double(env, value, &num);
+		Node* node;
+		if (std::fabs(num) < 9.2e18 && num == (double)(int64_t)num) {
+			node = arena.node(PlistInteger);
+			node->i = (int64_t)num;
+		} else {
+			node = arena.node(PlistReal);
+			node->d = num;
+		}
+		return node;
+	}
+
+	if (type != napi_object) {
+		return NULL;
+	}
+
+	bool is = false;
+
+	if (::napi_is_buffer(env, value, &is) == napi_ok && is) {
+		void* data;
+		size_t len;
+		::napi_get_buffer_info(env, value, &data, &len);
+		return createSlice(arena, PlistData, (const char*)data, len);
+	}
+
+	if (::napi_is_array(env, value, &is) == napi_ok && is) {
+		uint32_t count = 0;
+		::napi_get_array_length(env, value, &count);
+		Node* node = arena.node(PlistArray);
+		node->items = arena.items(count);
+		for (uint32_t i = 0; i < count; ++i) {
+			napi_value item;
+			::napi_get_element(env, value, i, &item);
+			Node* child = fromJS(env, item, arena, dateCtor, depth + 1);
+			if (child) {
+				node->items[node->count++] = child;
+			}
+		}
+		return node;
+	}
+
+	if (!dateCtor) {
+		napi_value global;
+		::napi_get_global(env, &global);
+		::napi_get_named_property(env, global, "Date", &dateCtor);
+	}
+	if (::napi_instanceof(env, value, dateCtor, &is) == napi_ok && is) {
+		napi_value getTime, ms;
+		double num = 0;
+		::napi_get_named_property(env, value, "getTime", &getTime);
+		::napi_call_function(env, value, getTime, 0, NULL, &ms);
+		::napi_get_value_double(env, ms, &num);
+		Node* node = arena.node(PlistDate);
+		node->d = num / 1000.0 - PLIST_EPOCH_OFFSET;
+		return node;
+	}
+
+	napi_value names;
+	uint32_t count = 0;
+	::napi_get_property_names(env, value, &names);
+	::napi_get_array_length(env, names, &count);
+
+	Node* node = arena.node(PlistDict);
+	node->items = arena.items(count * 2);
+	for (uint32_t i = 0; i < count; ++i) {
+		napi_value name, item;
+		::napi_get_element(env, names, i, &name);
+		::napi_get_property(env, value, name, &item);
+		Node* child = fromJS(env, item, arena, dateCtor, depth + 1);
+		if (child) {
+			node->items[node->count * 2] = fromJS(env, name, arena, dateCtor, depth + 1);
+			node->items[node->count * 2 + 1] = child;
+			++node->count;
+		}
+	}
+
+	// round trip `{ CF$UID: n }` back into a UID
+	const Node* uid = node->count == 1 ? dictGet(node, "CF$UID") : NULL;
+	if (uid && uid->type == PlistInteger) {
+		int64_t n = uid->i;
+		node = arena.node(PlistUid);
+		node->i = n;
+	}
+
+	return node;
+}
+
+Node* fromJS(napi_env env, napi_value value, Arena& arena) {
+	napi_value dateCtor = NULL;
+	return fromJS(env, value, arena, dateCtor, 0);
+}
+
+}
+}
@@ -0,0 +1,153 @@
+#ifndef __PLIST_H__
+#define __PLIST_H__
+
+#include "node-ios-device.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <initializer_list>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace node_ios_device {
+namespace plist {
+
+/**
+ * The types of values a property list can contain. `Uid` only appears in NSKeyedArchiver plists.
+ */
+enum NodeType : uint8_t { PlistBool, PlistInteger, PlistReal, PlistDate, PlistString, PlistData, PlistArray, PlistDict, PlistUid };
+
+/**
+ * A pointer and length into either the input buffer or the arena. Strings are always UTF-8 and not
+ * null terminated.
+ */
+struct Slice {
+	const char* ptr;
+	uint32_t    len;
+};
+
+struct Node;
+
+/**
+ * A property list value. Nodes are allocated in an `Arena` and are never freed individually.
+ *
+ * Arrays store `count` child pointers in `items`. Dicts store `count` key/value pairs in `items` as
+ * alternating key and value nodes, so `items` has `count * 2` entries. Dates are seconds since
+ * 2001-01-01 00:00:00 UTC, the same as CoreFoundation.
+ */
+struct Node {
+	NodeType type;
+	uint32_t count;
+	union {
+		bool     b;
+		int64_t  i;
+		double   d;
+		Slice    str;
+		Node**   items;
+	};
+};
+
+/**
+ * A bump allocator. Memory is handed out from large blocks and released all at once when the arena
+ * is destroyed or reset, so building a tree costs one heap allocation per block instead of one per
+ * node.
+ */
+class Arena {
+public:
+	Arena(size_t blockSize = 64 * 1024) : blockSize(blockSize), ptr(NULL), remaining(0) {}
+	~Arena() { reset(); }
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* alloc(size_t size, size_t align = alignof(std::max_align_t)) {
+		size_t pad = (align - (reinterpret_cast<uintptr_t>(ptr) & (align - 1))) & (align - 1);
+		if (pad + size > remaining) {
+			size_t len = size + align > blockSize ? size + align : blockSize;
+			char* block = static_cast<char*>(::malloc(len));
+			if (!block) {
+				throw std::bad_alloc();
+			}
+			blocks.push_back(block);
+			ptr = block;
+			remaining = len;
+			pad = (align - (reinterpret_cast<uintptr_t>(ptr) & (align - 1))) & (align - 1);
+		}
+		char* rval = ptr + pad;
+		ptr += pad + size;
+		remaining -= pad + size;
+		return rval;
+	}
+
+	Node* node(NodeType type) {
+		Node* n = static_cast<Node*>(alloc(sizeof(Node), alignof(Node)));
+		n->type = type;
+		n->count = 0;
+		n->i = 0;
+		return n;
+	}
+
+	Node** items(size_t count) {
+		return count ? static_cast<Node**>(alloc(sizeof(Node*) * count, alignof(Node*))) : NULL;
+	}
+
+	char* chars(size_t len) {
+		return static_cast<char*>(alloc(len ? len : 1, 1));
+	}
+
+	void reset() {
+		for (auto block : blocks) {
+			::free(block);
+		}
+		blocks.clear();
+		ptr = NULL;
+		remaining = 0;
+	}
+
+private:
+	size_t             blockSize;
+	char*              ptr;
+	size_t             remaining;
+	std::vector<char*> blocks;
+};
+
+enum Format { BinaryFormat, XmlFormat };
+
+/**
+ * Parses a binary or XML plist. Strings and data that don't need decoding point directly into
+ * `data`, so the input must outlive the returned tree. Throws `std::runtime_error` if the plist is
+ * malformed.
+ */
+Node* parse(const uint8_t* data, size_t len, Arena& arena);
+Node* parseBinary(const uint8_t* data, size_t len, Arena& arena);
+Node* parseXml(const char* data, size_t len, Arena& arena);
+
+/**
+ * Serializes a tree as a binary or XML plist, appending to `out`.
+ */
+void writeBinary(const Node* root, std::vector<uint8_t>& out);
+void writeXml(const Node* root, std::vector<uint8_t>& out);
+
+/**
+ * Helpers for building trees.
+ */
+Node* createString(Arena& arena, const char* str, size_t len);
+Node* createString(Arena& arena, const std::string& str);
+Node* createInteger(Arena& arena, int64_t value);
+Node* createBool(Arena& arena, bool value);
+Node* createDict(Arena& arena, std::initializer_list<std::pair<const char*, Node*>> entries);
+const Node* dictGet(const Node* dict, const char* key);
+std::string dictGetString(const Node* dict, const char* key);
+
+/**
+ * Conversion between trees and JavaScript values.
+ */
+napi_value toJS(napi_env env, const Node* node);
+Node* fromJS(napi_env env, napi_value value, Arena& arena);
+
+}
+}
+
+#endif
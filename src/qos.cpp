@@ -0,0 +1,131 @@
+#include "qos.h"
+#include <algorithm>
+#include <thread>
+
+namespace node_ios_device {
+
+/**
+ * The longest a bulk or streaming transfer sleeps before checking the buckets again, so that a
+ * config change takes effect promptly.
+ */
+#define QOS_MAX_WAIT std::chrono::milliseconds(100)
+
+void TokenBucket::configure(uint64_t rate) {
+	this->rate = rate;
+	tokens = rate ? std::min<double>(tokens, (double)rate) : 0;
+}
+
+/**
+ * Adds the tokens that accrued since the last refill.
+ */
+void TokenBucket::refill(std::chrono::steady_clock::time_point now) {
+	if (rate) {
+		double elapsed = std::chrono::duration<double>(now - last).count();
+		tokens = std::min<double>(tokens + elapsed * (double)rate, (double)rate);
+	}
+	last = now;
+}
+
+/**
+ * Returns how long until the bucket is out of debt.
+ */
+std::chrono::microseconds TokenBucket::waitTime() const {
+	if (!rate || tokens >= 0) {
+		return std::chrono::microseconds(0);
+	}
+	return std::chrono::microseconds((int64_t)(-tokens / (double)rate * 1000000.0) + 1);
+}
+
+/**
+ * Waits until the class may send `bytes` more bytes and takes them from its buckets. Returns false
+ * without taking them if `cancel` is tripped while waiting.
+ */
+bool QosShaper::acquire(QosClass cls, size_t bytes, const CancelToken* cancel) {
+	if (cls == QosInteractive) {
+		record(cls, bytes);
+		return true;
+	}
+
+	while (1) {
+		if (cancel && cancel->isCancelled()) {
+			return false;
+		}
+
+
+		std::chrono::microseconds wait;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			auto now = std::chrono::steady_clock::now();
+			link.refill(now);
+
+			if (cls == QosStreaming) {
+				streaming.refill(now);
+				wait = streaming.waitTime();
+			} else {
+				bulk.refill(now);
+				wait = std::max(link.waitTime(), bulk.waitTime());
+			}
+
+			if (wait.count() == 0) {
+				if (link.rate) {
+					link.tokens -= (double)bytes;
+				}
+				TokenBucket& own = cls == QosStreaming ? streaming : bulk;
+				if (own.rate) {
+					own.tokens -= (double)bytes;
+				}
+				return true;
+			}
+		}
+
+		std::this_thread::sleep_for(std::min<std::chrono::microseconds>(wait, QOS_MAX_WAIT));
+	}
+}
+
+/**
+ * Sets the link and class rates. Pending transfers pick up the new rates the next time they check
+ * the buckets.
+ */
+void QosShaper::configure(const QosConfig& config) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto now = std::chrono::steady_clock::now();
+	link.refill(now);
+	streaming.refill(now);
+	bulk.refill(now);
+	link.configure(config.linkRate);
+	streaming.configure(config.streamingRate);
+	bulk.configure(config.bulkRate);
+	LOG_DEBUG_3("QosShaper::configure", "Link %llu B/s, streaming %llu B/s, bulk %llu B/s",
+		(unsigned long long)config.linkRate, (unsigned long long)config.streamingRate, (unsigned long long)config.bulkRate)
+}
+
+/**
+ * Returns true if `acquire()` may delay the class.
+ */
+bool QosShaper::isLimited(QosClass cls) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (cls == QosStreaming) {
+		return streaming.rate > 0;
+	}
+	return cls == QosBulk && (link.rate > 0 || bulk.rate > 0);
+}
+
+/**
+ * Takes bytes that have already been sent or received from the buckets without waiting. The debt
+ * is capped at one second so that a burst of relayed traffic doesn't stall bulk transfers for
+ * longer than that.
+ */
+void QosShaper::record(QosClass cls, size_t bytes) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto now = std::chrono::steady_clock::now();
+	link.refill(now);
+	if (link.rate) {
+		link.tokens = std::max<double>(link.tokens - (double)bytes, -(double)link.rate);
+	}
+	if (cls == QosStreaming && streaming.rate) {
+		streaming.refill(now);
+		streaming.tokens = std::max<double>(streaming.tokens - (double)bytes, -(double)streaming.rate);
+	}
+}
+
+}
@@ -0,0 +1,73 @@
+#ifndef __QOS_H__
+#define __QOS_H__
+
+#include "node-ios-device.h"
+#include "cancel-token.h"
+#include <chrono>
+#include <mutex>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * The traffic classes that share a device link, from highest to lowest priority.
+ */
+enum QosClass { QosInteractive, QosStreaming, QosBulk };
+
+/**
+ * The rates in bytes per second that a link is shaped to. A rate of zero is unlimited.
+ */
+struct QosConfig {
+	QosConfig() : linkRate(0), streamingRate(0), bulkRate(0) {}
+	uint64_t linkRate;
+	uint64_t streamingRate;
+	uint64_t bulkRate;
+};
+
+/**
+ * A token bucket that refills at a fixed rate up to one second's worth of tokens. Tokens may go
+ * negative so that a request larger than the bucket is let through once the bucket is full and the
+ * debt is paid off before the next one.
+ */
+class TokenBucket {
+public:
+	TokenBucket() : rate(0), tokens(0), last(std::chrono::steady_clock::now()) {}
+
+	void configure(uint64_t rate);
+	void refill(std::chrono::steady_clock::time_point now);
+	std::chrono::microseconds waitTime() const;
+
+	uint64_t rate;
+	double   tokens;
+
+private:
+	std::chrono::steady_clock::time_point last;
+};
+
+/**
+ * Shapes the traffic of one device link so that latency sensitive traffic isn't stuck behind bulk
+ * transfers.
+ *
+ * Every class draws from the link's bucket. Interactive traffic is never delayed, streaming
+ * traffic is only held to its own rate, and bulk traffic waits until the link's bucket and its own
+ * bucket have tokens, so it only gets the bandwidth the other classes leave over. Relayed traffic
+ * that arrives from the device can't be delayed and is only recorded.
+ */
+class QosShaper {
+public:
+	bool acquire(QosClass cls, size_t bytes, const CancelToken* cancel = NULL);
+	void configure(const QosConfig& config);
+	bool isLimited(QosClass cls);
+	void record(QosClass cls, size_t bytes);
+
+private:
+	std::mutex  lock;
+	TokenBucket link;
+	TokenBucket streaming;
+	TokenBucket bulk;
+};
+
+}
+
+#endif
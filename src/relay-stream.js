@@ -0,0 +1,147 @@
+const { Readable } = require('stream');
+
+/**
+ * The relay flows in the order of the native `RelayFlow` enum.
+ */
+const relayFlows = { push: 0, lines: 1, bytes: 2, batch: 3 };
+
+/**
+ * Whether the relay streams need their own async iterator. `Readable` is async iterable on Node 10
+ * and newer. Node 8 only has `Symbol.asyncIterator` when async iteration is enabled with a flag,
+ * and its `Readable` has no iterator then.
+ */
+const needsIterator = typeof Symbol.asyncIterator === 'symbol' && typeof Readable.prototype[Symbol.asyncIterator] !== 'function';
+
+/**
+ * Creates an async iterator that reads a stream one chunk at a time, for runtimes where `Readable`
+ * isn't async iterable. Returning early destroys the stream, which stops the relay.
+ *
+ * @param {Readable} stream - The stream to read.
+ * @returns {Object}
+ */
+function iterate(stream) {
+	const waiting = [];
+	let error = null;
+	let done = false;
+
+	const settle = () => {
+		while (waiting.length) {
+			const { resolve, reject } = waiting[0];
+			if (error) {
+				waiting.shift();
+				reject(error);
+				error = null;
+				done = true;
+				continue;
+			}
+
+			const chunk = done ? null : stream.read();
+			if (chunk !== null) {
+				waiting.shift();
+				resolve({ value: chunk, done: false });
+			} else if (done) {
+				waiting.shift();
+				resolve({ value: undefined, done: true });
+			} else {
+				break;
+			}
+		}
+	};
+
+	const finish = () => {
+		done = true;
+		settle();
+	};
+
+	stream.on('readable', settle);
+	stream.once('end', finish);
+	stream.once('close', finish);
+	stream.once('error', err => {
+		error = err;
+		settle();
+	});
+
+	return {
+		next() {
+			return new Promise((resolve, reject) => {
+				waiting.push({ resolve, reject });
+				settle();
+			});
+		},
+		return() {
+			stream.destroy();
+			finish();
+			return Promise.resolve({ value: undefined, done: true });
+		},
+		[Symbol.asyncIterator]() {
+			return this;
+		}
+	};
+}
+
+/**
+ * Wraps a relay in a `Readable` that pulls lines from the native queue as it's read. The relay is
+ * stopped once the stream ends or is destroyed. When the device goes away, the relay has already
+ * removed the listener and may no longer exist, so it isn't stopped again.
+ *
+ * In byte mode, the relay has already split the data into lines and dropped the line breaks and
+ * empty lines, so each line is written with a `\n` after it. The bytes are the device's output
+ * with every line break normalized to a single `\n`, not an exact copy.
+ *
+ * The stream is async iterable wherever `Symbol.asyncIterator` exists. Readable's own iterator is
+ * used when it has one.
+ *
+ * @param {Object} opts - The stream options.
+ * @param {Function} start - Starts the relay with the listener and flow.
+ * @param {Function} pull - Lets the listener receive up to the specified number of lines or bytes.
+ * @param {Function} stop - Stops the relay for the listener.
+ * @returns {Readable}
+ */
+function createRelayStream(opts, start, pull, stop) {
+	const objectMode = opts.objectMode !== false;
+	let stopped = false;
+
+	const halt = () => {
+		if (!stopped) {
+			stopped = true;
+			stop(listener);
+		}
+	};
+
+	const stream = new Readable({
+		objectMode,
+		highWaterMark: opts.highWaterMark,
+		read(size) {
+			if (!stopped) {
+				pull(listener, size);
+			}
+		},
+		destroy(err, callback) {
+			halt();
+			callback(err);
+		}
+	});
+
+	const listener = (evt, line) => {
+		if (evt === 'data') {
+			stream.push(objectMode ? line : `${line}\n`);
+		} else if (evt === 'end') {
+			stopped = true;
+			stream.push(null);
+		}
+	};
+
+	if (needsIterator) {
+		stream[Symbol.asyncIterator] = () => iterate(stream);
+	}
+	stream.once('end', halt);
+	start(listener, objectMode ? relayFlows.lines : relayFlows.bytes);
+
+	return stream;
+}
+
+module.exports = {
+	createRelayStream,
+	iterate,
+	relayFlows
+};
@@ -1,18 +1,326 @@
 #include "relay.h"
+#include "service.h"
+#include "utf8.h"
+#include "vis.h"
+#include <algorithm>
+#include <chrono>
 #include <sstream>
 
 namespace node_ios_device {
 
+/**
+ * Converts the message's data to a JavaScript value. All ASCII lines are created as Latin-1 so V8
+ * copies them as is instead of decoding them again.
+ */
+napi_value RelayMessage::toJS(napi_env env) const {
+	if (plist) {
+		return cfToJS(env, plist);
+	}
+
+	napi_value rval;
+	if (ascii) {
+		NAPI_THROW_RETURN("RelayMessage::toJS", "ERR_NAPI_CREATE_STRING_LATIN1", ::napi_create_string_latin1(env, message.data(), message.length(), &rval), NULL)
+	} else {
+		NAPI_THROW_RETURN("RelayMessage::toJS", "ERR_NAPI_CREATE_STRING_UTF8", ::napi_create_string_utf8(env, message.data(), message.length(), &rval), NULL)
+	}
+	return rval;
+}
+
+/**
+ * Creates a "data" message for a non-empty line. Lines that aren't ASCII are copied as UTF-8 with
+ * invalid bytes replaced by U+FFFD.
+ */
+static void addLine(const char* data, size_t len, bool ascii, std::vector<std::shared_ptr<RelayMessage>>& messages) {
+	if (len == 0) {
+		return;
+	}
+
+	std::shared_ptr<RelayMessage> msg = std::make_shared<RelayMessage>("data");
+	if (ascii) {
+		msg->message.assign(data, len);
+		msg->ascii = true;
+	} else {
+		decodeUtf8(data, len, msg->message);
+	}
+	messages.push_back(msg);
+}
+
+/**
+ * Splits data into lines at nulls, carriage returns, and newlines and creates a "data" message for
+ * each non-empty line. Finding the line breaks also tells whether a line is ASCII.
+ */
+void splitLines(const char* data, size_t len, std::vector<std::shared_ptr<RelayMessage>>& messages) {
+	size_t offset = 0;
+
+	while (offset < len) {
+		bool ascii;
+		size_t n = scanLine(data + offset, len - offset, &ascii);
+		addLine(data + offset, n, ascii, messages);
+		offset += n + 1;
+	}
+}
+
+/**
+ * Splits syslog relay data into lines like `splitLines()` and decodes the vis(3) escapes in them.
+ * Finding the line breaks also tells whether a line has any escapes, so lines without a backslash
+ * are copied as is. The bytes that escapes decode to are checked as UTF-8 along with the rest of the
+ * line.
+ *
+ * An escape or a character cut off by the end of the data is left for the next read. Returns the
+ * number of bytes used.
+ */
+size_t splitSyslogLines(const char* data, size_t len, std::vector<std::shared_ptr<RelayMessage>>& messages) {
+	size_t offset = 0;
+
+	while (offset < len) {
+		bool ascii, escaped;
+		size_t n = scanLine(data + offset, len - offset, &ascii, &escaped);
+		bool last = offset + n == len;
+
+		if (!escaped) {
+			if (last && !ascii) {
+				n -= incompleteUtf8Tail(data + offset, n);
+			}
+			addLine(data + offset, n, ascii, messages);
+		} else {
+			std::string bytes;
+			bool high = !ascii;
+			size_t used = unvis(data + offset, n, bytes, &high);
+
+			if (!last) {
+				// an escape cut off by the line break is kept as is
+				bytes.append(data + offset + used, n - used);
+				used = n;
+			} else if (high) {
+				size_t tail = incompleteUtf8Tail(bytes.data(), bytes.size());
+				if (tail) {
+					bytes.resize(bytes.size() - tail);
+					used = unvisOffset(data + offset, used, bytes.size());
+				}
+			}
+
+			addLine(bytes.data(), bytes.size(), !high, messages);
+			n = used;
+		}
+
+		if (last) {
+			return offset + n;
+		}
+		offset += n + 1;
+	}
+
+	return len;
+}
+
+/**
+ * Splits the incoming data into messages based on the framing and appends them to `messages`. Every
+ * message from this read is stamped with the next sequence number and the read's receive times.
+ *
+ * Returns `false` if the data can't be framed, in which case nothing more should be fed until the
+ * framer is reset. Messages framed before the bad data are still appended.
+ */
+bool RelayFramer::feed(const char* data, size_t len, double monotonic, double time, std::vector<std::shared_ptr<RelayMessage>>& messages) {
+	size_t first = messages.size();
+	bool ok = true;
+
+	if (isPlistFraming(framing)) {
+		ok = feedPlists(data, len, messages);
+	} else {
+		feedLines(data, len, messages);
+	}
+
+	for (size_t i = first; i < messages.size(); ++i) {
+		messages[i]->seq = seq++;
+		messages[i]->monotonic = monotonic;
+		messages[i]->time = time;
+	}
+
+	summarize(false, monotonic, time, messages);
+
+	return ok;
+}
+
+/**
+ * Creates a "data" message for each line. A character or escape cut off by the end of the read is
+ * held until the rest of it arrives so that it isn't mistaken for invalid bytes.
+ */
+void RelayFramer::feedLines(const char* data, size_t len, std::vector<std::shared_ptr<RelayMessage>>& messages) {
+	std::vector<char> joined;
+	if (!pending.empty()) {
+		joined.swap(pending);
+		joined.insert(joined.end(), data, data + len);
+		data = joined.data();
+		len = joined.size();
+	}
+
+	std::vector<std::shared_ptr<RelayMessage>> lines;
+
+	if (framing == SyslogFraming) {
+		size_t used = splitSyslogLines(data, len, lines);
+		pending.assign(data + used, data + len);
+	} else {
+		size_t tail = incompleteUtf8Tail(data, len);
+		if (tail) {
+			pending.assign(data + len - tail, data + len);
+			len -= tail;
+		}
+		splitLines(data, len, lines);
+	}
+
+	if (limiter && limiter->isEnabled()) {
+		auto now = std::chrono::steady_clock::now();
+		lines.erase(std::remove_if(lines.begin(), lines.end(), [&](const std::shared_ptr<RelayMessage>& msg) {
+			return !limiter->admit(msg->message, now);
+		}), lines.end());
+	}
+
+	messages.insert(messages.end(), lines.begin(), lines.end());
+}
+
+/**
+ * Reassembles length prefixed plists and creates a "data" message for each complete plist. A plist
+ * may span several socket reads, so incomplete data is held until the rest arrives.
+ *
+ * Returns `false` if a frame or reassembled Web Inspector message is larger than
+ * `RELAY_MAX_PLIST_SIZE`.
+ */
+bool RelayFramer::feedPlists(const char* data, size_t len, std::vector<std::shared_ptr<RelayMessage>>& messages) {
+	pending.insert(pending.end(), data, data + len);
+
+	size_t offset = 0;
+	while (pending.size() - offset >= 4) {
+		uint32_t size;
+		::memcpy(&size, pending.data() + offset, sizeof(size));
+		size = ntohl(size);
+		if (size > RELAY_MAX_PLIST_SIZE) {
+			LOG_DEBUG_2("RelayFramer::feedPlists", "Rejecting %u byte frame, the maximum is %u bytes", size, (uint32_t)RELAY_MAX_PLIST_SIZE)
+			pending.clear();
+			partial.clear();
+			return false;
+		}
+		if (pending.size() - offset - 4 < size) {
+			break;
+		}
+
+		try {
+			CFPropertyListRef plist = parsePlist(pending.data() + offset + 4, size);
+			if (framing == WebInspectorFraming) {
+				plist = reassemble(plist);
+			}
+			if (plist) {
+				messages.push_back(std::make_shared<RelayMessage>("data", plist));
+			}
+		} catch (std::exception& e) {
+			LOG_DEBUG_1("RelayFramer::feedPlists", "%s", e.what())
+		}
+
+		offset += 4 + size;
+
+		if (partial.size() > RELAY_MAX_PLIST_SIZE) {
+			LOG_DEBUG_2("RelayFramer::feedPlists", "Rejecting partial message over %u bytes, the maximum is %u bytes", (uint32_t)partial.size(), (uint32_t)RELAY_MAX_PLIST_SIZE)
+			pending.clear();
+			partial.clear();
+			return false;
+		}
+	}
+
+	if (offset > 0) {
+		pending.erase(pending.begin(), pending.begin() + offset);
+	}
+
+	return true;
+}
+
+/**
+ * Web Inspector messages that are too large are split by the device into a series of
+ * `WIRPartialMessageKey` messages followed by a `WIRFinalMessageKey` message. Each contains a
+ * chunk of the real message which is itself a binary plist. Partial chunks are buffered and NULL is
+ * returned until the final chunk arrives, then the reassembled message is parsed and returned.
+ *
+ * This takes ownership of `plist`.
+ */
+CFPropertyListRef RelayFramer::reassemble(CFPropertyListRef plist) {
+	if (::CFGetTypeID(plist) != ::CFDictionaryGetTypeID()) {
+		return plist;
+	}
+
+	CFDataRef chunk = (CFDataRef)::CFDictionaryGetValue((CFDictionaryRef)plist, CFSTR("WIRPartialMessageKey"));
+	bool isFinal = false;
+	if (!chunk) {
+		chunk = (CFDataRef)::CFDictionaryGetValue((CFDictionaryRef)plist, CFSTR("WIRFinalMessageKey"));
+		isFinal = chunk != NULL;
+	}
+
+	if (!chunk || ::CFGetTypeID(chunk) != ::CFDataGetTypeID()) {
+		return plist;
+	}
+
+	const uint8_t* bytes = ::CFDataGetBytePtr(chunk);
+	partial.insert(partial.end(), bytes, bytes + ::CFDataGetLength(chunk));
+	::CFRelease(plist);
+
+	if (!isFinal) {
+		return NULL;
+	}
+
+	CFPropertyListRef message = NULL;
+	try {
+		message = parsePlist(partial.data(), partial.size());
+	} catch (std::exception& e) {
+		partial.clear();
+		throw;
+	}
+	partial.clear();
+	return message;
+}
+
+/**
+ * Creates a "data" message for each summary of the lines the limiter suppressed, once the summary
+ * interval has passed or right away when `force` is set.
+ */
+void RelayFramer::summarize(bool force, double monotonic, double time, std::vector<std::shared_ptr<RelayMessage>>& messages) {
+	if (!limiter || !limiter->isEnabled()) {
+		return;
+	}
+
+	std::vector<std::string> summaries;
+	limiter->summarize(std::chrono::steady_clock::now(), summaries, force);
+
+	for (auto& summary : summaries) {
+		auto msg = std::make_shared<RelayMessage>("data", summary);
+		msg->seq = seq++;
+		msg->monotonic = monotonic;
+		msg->time = time;
+		messages.push_back(msg);
+	}
+}
+
+/**
+ * Drops whatever was held from the previous connection and restarts the sequence numbers.
+ */
+void RelayFramer::reset() {
+	pending.clear();
+	partial.clear();
+	seq = 0;
+}
+
 /**
  * Initializes the relay connection and wires up the relay message async handler into Node's libuv
  * runloop.
  */
-RelayConnection::RelayConnection(napi_env env, std::weak_ptr<CFRunLoopRef> runloop, int* fd) :
+RelayConnection::RelayConnection(napi_env env, std::weak_ptr<CFRunLoopRef> runloop, int* fd, RelayFraming framing) :
 	fd(fd),
+	framer(framing),
+	qosClass(QosInteractive),
 	env(env),
+	pullListeners(0),
 	runloop(runloop),
 	socket(NULL),
-	source(NULL) {}
+	source(NULL),
+	summaryTimer(NULL),
+	msgQueueBase(0),
+	paused(false),
+	failed(false) {}
 
 /**
  * Shuts down a relay connection.
@@ -24,16 +332,25 @@ RelayConnection::~RelayConnection() {
 
 /**
  * Adds a listener. If this is the first listener, it increments/refs the libuv async handle so
- * prevent Node from exiting.
+ * prevent Node from exiting. The first listener receives everything read since it connected and
+ * later listeners start with the next message.
  */
-void RelayConnection::add(napi_value listener) {
+void RelayConnection::add(napi_value listener, RelayFlow flow) {
 	napi_ref ref;
 	NAPI_THROW_RETURN("RelayConnection::add", "ERROR_NAPI_CREATE_REFERENCE", ::napi_create_reference(env, listener, 1, &ref), )
 
 	size_t count = 0;
 	{
 		std::lock_guard<std::mutex> lock(listenersLock);
-		listeners.push_back(ref);
+		uint64_t cursor;
+		{
+			std::lock_guard<std::mutex> queueLock(msgQueueLock);
+			cursor = listeners.empty() ? msgQueueBase : msgQueueBase + msgQueue.size();
+		}
+		listeners.push_back(std::make_shared<RelayListener>(ref, flow, cursor));
+		if (isPullFlow(flow)) {
+			++pullListeners;
+		}
 		count = listeners.size();
 	}
 
@@ -53,7 +370,7 @@ static void relaySocketCallback(CFSocketRef s, CFSocketCallBackType type, CFData
 
 		std::shared_ptr<RelayConnection>* conn = static_cast<std::shared_ptr<RelayConnection>*>(connData);
 		if (size > 0) {
-			(*conn)->onData((const char*)::CFDataGetBytePtr(cfdata));
+			(*conn)->onData((const char*)::CFDataGetBytePtr(cfdata), (size_t)size);
 		} else {
 			(*conn)->onClose();
 		}
@@ -65,6 +382,15 @@ static void relaySocketCallback(CFSocketRef s, CFSocketCallBackType type, CFData
  */
 void RelayConnection::connect() {
 	CFSocketContext socketCtx = { 0, &self, NULL, NULL, NULL };
+	framer.reset();
+
+	dropQueue();
+
+	{
+		std::lock_guard<std::mutex> lock(msgQueueLock);
+		paused = false;
+		failed = false;
+	}
 
 	LOG_DEBUG_1("RelayConnection::connect", "Creating socket using specified file descriptor %d", *fd)
 	socket = ::CFSocketCreateWithNative(
@@ -89,21 +415,52 @@ void RelayConnection::connect() {
 	if (auto rl = runloop.lock()) {
 		::CFRunLoopAddSource(*rl, source, kCFRunLoopCommonModes);
 	}
+
+	if (framer.hasLimiter()) {
+		CFRunLoopTimerContext timerCtx = { 0, &self, NULL, NULL, NULL };
+		summaryTimer = ::CFRunLoopTimerCreate(
+			kCFAllocatorDefault,
+			::CFAbsoluteTimeGetCurrent() + RELAY_SUMMARY_TIMER_INTERVAL,
+			RELAY_SUMMARY_TIMER_INTERVAL,
+			0, // flags
+			0, // order
+			[](CFRunLoopTimerRef timer, void* info) {
+				std::weak_ptr<RelayConnection>* ptr = static_cast<std::weak_ptr<RelayConnection>*>(info);
+				if (auto conn = (*ptr).lock()) {
+					conn->onSummaryTimer();
+				}
+			},
+			&timerCtx
+		);
+
+		LOG_DEBUG("RelayConnection::connect", "Adding summary timer to run loop")
+		if (auto rl = runloop.lock()) {
+			::CFRunLoopAddTimer(*rl, summaryTimer, kCFRunLoopCommonModes);
+		}
+	}
 }
 
 /**
  * Creates an shared pointer to an instance of the device.
  */
-std::shared_ptr<RelayConnection> RelayConnection::create(napi_env env, std::weak_ptr<CFRunLoopRef> runloop, int* fd) {
-	std::shared_ptr<RelayConnection> conn = std::make_shared<RelayConnection>(env, runloop, fd);
+std::shared_ptr<RelayConnection> RelayConnection::create(napi_env env, std::weak_ptr<CFRunLoopRef> runloop, int* fd, RelayFraming framing) {
+	std::shared_ptr<RelayConnection> conn = std::make_shared<RelayConnection>(env, runloop, fd, framing);
 	conn->init();
 	return conn;
 }
 
 /**
- * Disconnects the socket and stops listening for incoming data.
+ * Disconnects the socket and stops listening for incoming data. Called on the main thread. The
+ * socket is cleared under the queue lock since the run loop thread pauses it under that lock.
  */
 void RelayConnection::disconnect() {
+	if (summaryTimer) {
+		LOG_DEBUG("RelayConnection::disconnect", "Removing summary timer from run loop")
+		::CFRunLoopTimerInvalidate(summaryTimer);
+		::CFRelease(summaryTimer);
+		summaryTimer = NULL;
+	}
+
 	if (source) {
 		LOG_DEBUG("RelayConnection::disconnect", "Removing socket source from run loop")
 		if (auto rl = runloop.lock()) {
@@ -113,83 +470,191 @@ void RelayConnection::disconnect() {
 		source = NULL;
 	}
 
-	if (socket) {
-		LOG_DEBUG("RelayConnection::disconnect", "Releasing socket")
-		::CFSocketInvalidate(socket);
-		::CFRelease(socket);
+	CFSocketRef sock;
+	{
+		std::lock_guard<std::mutex> lock(msgQueueLock);
+		sock = socket;
 		socket = NULL;
 	}
+
+	if (sock) {
+		LOG_DEBUG("RelayConnection::disconnect", "Releasing socket")
+		::CFSocketInvalidate(sock);
+		::CFRelease(sock);
+	}
 }
 
 /**
- * Notifies all relay connection listeners of new data or the connection ending.
+ * Drops every queued message, including a queued "end". Called when the last listener is removed
+ * and when connecting, so that the next listener doesn't get the previous connection's messages.
+ * Listeners skip past the dropped messages.
+ */
+void RelayConnection::dropQueue() {
+	std::lock_guard<std::mutex> lock(listenersLock);
+	std::lock_guard<std::mutex> queueLock(msgQueueLock);
+	msgQueueBase += msgQueue.size();
+	msgQueue.clear();
+	for (auto const& listener : listeners) {
+		listener->cursor = std::max<uint64_t>(listener->cursor, msgQueueBase);
+	}
+}
+
+/**
+ * Notifies all relay connection listeners of new data or the connection ending. Push listeners
+ * receive everything they haven't read yet and pull listeners receive as much as their credit
+ * allows.
  */
 void RelayConnection::dispatch() {
 	napi_handle_scope scope;
-	napi_value global, listener, argv[2], rval;
+	napi_value global, argv[2], rval;
 	int argc;
 
 	NAPI_THROW("RelayConnection::dispatch", "ERR_NAPI_OPEN_HANDLE_SCOPE", ::napi_open_handle_scope(env, &scope))
 	NAPI_THROW("RelayConnection::dispatch", "ERR_NAPI_GET_GLOBAL", ::napi_get_global(env, &global))
 
-	std::list<napi_value> callbacks;
+	std::vector<std::pair<std::shared_ptr<RelayListener>, napi_value>> targets;
 
 	// resolves the listener N-API references and caches the JS callback functions in the
-	// `callbacks` list allowing the listener list to be quickly unlocked
+	// `targets` list allowing the listener list to be quickly unlocked
 	{
 		std::lock_guard<std::mutex> lock(listenersLock);
-		for (auto const& ref : listeners) {
-			NAPI_THROW("RelayConnection::dispatch", "ERR_NAPI_GET_REFERENCE_VALUE", ::napi_get_reference_value(env, ref, &listener))
-			if (listener != NULL) {
-				callbacks.push_back(listener);
+		for (auto const& listener : listeners) {
+			napi_value callback;
+			NAPI_THROW("RelayConnection::dispatch", "ERR_NAPI_GET_REFERENCE_VALUE", ::napi_get_reference_value(env, listener->ref, &callback))
+			if (callback != NULL) {
+				targets.push_back(std::make_pair(listener, callback));
 			}
 		}
 	}
 
-	if (callbacks.empty()) {
-		return;
-	}
+	bool ended = false;
 
-	while (1) {
-		std::shared_ptr<RelayMessage> relayMsg;
+	for (auto const& target : targets) {
+		RelayListener& listener = *target.first;
 
-		{
-			std::lock_guard<std::mutex> lock(msgQueueLock);
+		if (listener.flow == RelayBatch) {
+			if (!listener.removed && dispatchBatch(listener, global, target.second)) {
+				ended = true;
+			}
+			continue;
+		}
 
-			// flush the relay connection data to the listeners
-			if (msgQueue.empty()) {
-				break;
+		while (!listener.removed) {
+			std::shared_ptr<RelayMessage> relayMsg;
+
+			{
+				std::lock_guard<std::mutex> lock(msgQueueLock);
+
+				// flush the relay connection data to the listener
+				if (listener.cursor >= msgQueueBase + msgQueue.size() || (isPullFlow(listener.flow) && listener.credit <= 0)) {
+					break;
+				}
+
+				relayMsg = msgQueue[listener.cursor - msgQueueBase];
+				++listener.cursor;
+
+				// the credit is spent under the queue lock since the run loop thread reads it to
+				// decide whether to pause
+				if (listener.flow == RelayPullLines) {
+					--listener.credit;
+				} else if (listener.flow == RelayPullBytes) {
+					listener.credit -= (int64_t)relayMsg->message.length() + 1;
+				}
 			}
 
-			relayMsg = msgQueue.front();
-			msgQueue.pop();
-		}
+			bool isEnd = strncmp(relayMsg->event, "end", 3) == 0;
 
-		bool isEnd = strncmp(relayMsg->event, "end", 3) == 0;
+			argc = 1;
+			NAPI_THROW("RelayConnection::dispatch", "ERR_NAPI_CREATE_STRING_UTF8", ::napi_create_string_utf8(env, relayMsg->event, NAPI_AUTO_LENGTH, &argv[0]))
 
-		argc = 1;
-		NAPI_THROW("RelayConnection::dispatch", "ERR_NAPI_CREATE_STRING_UTF8", ::napi_create_string_utf8(env, relayMsg->event, NAPI_AUTO_LENGTH, &argv[0]))
+			if (isEnd) {
+				LOG_DEBUG_1("RelayConnection::dispatch", "Emitting \"%s\" event", relayMsg->event);
+			} else {
+				argc = 2;
+				argv[1] = relayMsg->toJS(env);
+			}
 
-		if (isEnd) {
-			LOG_DEBUG_1("RelayConnection::dispatch", "Emitting \"%s\" event", relayMsg->event);
-		} else {
-			argc = 2;
-			NAPI_THROW("RelayConnection::dispatch", "ERR_NAPI_CREATE_STRING_UTF8", ::napi_create_string_utf8(env, relayMsg->message.c_str(), NAPI_AUTO_LENGTH, &argv[1]))
+			NAPI_THROW("RelayConnection::dispatch", "ERR_NAPI_MAKE_CALLBACK", ::napi_make_callback(env, NULL, global, target.second, argc, argv, &rval))
+
+			if (isEnd) {
+				remove(target.second);
+				ended = true;
+			}
 		}
+	}
 
-		for (auto const& callback : callbacks) {
-			NAPI_THROW("RelayConnection::dispatch", "ERR_NAPI_MAKE_CALLBACK", ::napi_make_callback(env, NULL, global, callback, argc, argv, &rval))
+	trim();
 
-			if (isEnd) {
-				remove(callback);
+	if (ended) {
+		disconnect();
+	}
+
+	NAPI_THROW("RelayConnection::dispatch", "ERR_NAPI_CLOSE_HANDLE_SCOPE", ::napi_close_handle_scope(env, scope))
+}
+
+/**
+ * Calls a batch listener once with every message it hasn't read yet. The listener receives a
+ * "batch" event with an array of the messages and an object with parallel `seq`, `monotonic`, and
+ * `time` `Float64Array`s of each message's sequence number and receive times. If the connection
+ * ended, an "end" event follows and the listener is removed. Returns whether it ended.
+ */
+bool RelayConnection::dispatchBatch(RelayListener& listener, napi_value global, napi_value callback) {
+	std::vector<std::shared_ptr<RelayMessage>> batch;
+	bool isEnd = false;
+
+	{
+		std::lock_guard<std::mutex> lock(msgQueueLock);
+		while (listener.cursor < msgQueueBase + msgQueue.size()) {
+			std::shared_ptr<RelayMessage> relayMsg = msgQueue[listener.cursor - msgQueueBase];
+			++listener.cursor;
+			if (strncmp(relayMsg->event, "end", 3) == 0) {
+				isEnd = true;
+				break;
 			}
+			batch.push_back(relayMsg);
 		}
+	}
+
+	napi_value argv[3], rval;
+
+	if (!batch.empty()) {
+		napi_value timing, arrays[3];
+		double* values[3];
+		size_t count = batch.size();
 
-		if (isEnd) {
-			disconnect();
-			return;
+		NAPI_THROW_RETURN("RelayConnection::dispatchBatch", "ERR_NAPI_CREATE_STRING_UTF8", ::napi_create_string_utf8(env, "batch", NAPI_AUTO_LENGTH, &argv[0]), false)
+		NAPI_THROW_RETURN("RelayConnection::dispatchBatch", "ERR_NAPI_CREATE_ARRAY", ::napi_create_array_with_length(env, count, &argv[1]), false)
+		NAPI_THROW_RETURN("RelayConnection::dispatchBatch", "ERR_NAPI_CREATE_OBJECT", ::napi_create_object(env, &timing), false)
+
+		for (size_t i = 0; i < 3; ++i) {
+			napi_value buffer;
+			NAPI_THROW_RETURN("RelayConnection::dispatchBatch", "ERR_NAPI_CREATE_ARRAYBUFFER", ::napi_create_arraybuffer(env, count * sizeof(double), (void**)&values[i], &buffer), false)
+			NAPI_THROW_RETURN("RelayConnection::dispatchBatch", "ERR_NAPI_CREATE_TYPEDARRAY", ::napi_create_typedarray(env, napi_float64_array, count, buffer, 0, &arrays[i]), false)
+		}
+
+		for (size_t i = 0; i < count; ++i) {
+			NAPI_THROW_RETURN("RelayConnection::dispatchBatch", "ERR_NAPI_SET_ELEMENT", ::napi_set_element(env, argv[1], (uint32_t)i, batch[i]->toJS(env)), false)
+			values[0][i] = (double)batch[i]->seq;
+			values[1][i] = batch[i]->monotonic;
+			values[2][i] = batch[i]->time;
 		}
+
+		NAPI_THROW_RETURN("RelayConnection::dispatchBatch", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, timing, "seq", arrays[0]), false)
+		NAPI_THROW_RETURN("RelayConnection::dispatchBatch", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, timing, "monotonic", arrays[1]), false)
+		NAPI_THROW_RETURN("RelayConnection::dispatchBatch", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, timing, "time", arrays[2]), false)
+		argv[2] = timing;
+
+		NAPI_THROW_RETURN("RelayConnection::dispatchBatch", "ERR_NAPI_MAKE_CALLBACK", ::napi_make_callback(env, NULL, global, callback, 3, argv, &rval), false)
 	}
+
+	if (isEnd) {
+		LOG_DEBUG("RelayConnection::dispatchBatch", "Emitting \"end\" event")
+		NAPI_THROW_RETURN("RelayConnection::dispatchBatch", "ERR_NAPI_CREATE_STRING_UTF8", ::napi_create_string_utf8(env, "end", NAPI_AUTO_LENGTH, &argv[0]), false)
+		NAPI_THROW_RETURN("RelayConnection::dispatchBatch", "ERR_NAPI_MAKE_CALLBACK", ::napi_make_callback(env, NULL, global, callback, 1, argv, &rval), false)
+		remove(callback);
+	}
+
+	return isEnd;
 }
 
 /**
@@ -212,74 +677,254 @@ void RelayConnection::init() {
 }
 
 /**
- * Creates an "end" message and queues it.
+ * Queues messages created on the run loop thread and notifies the main thread.
+ */
+void RelayConnection::enqueue(std::vector<std::shared_ptr<RelayMessage>>& messages) {
+	if (!messages.empty()) {
+		std::lock_guard<std::mutex> lock(msgQueueLock);
+		msgQueue.insert(msgQueue.end(), messages.begin(), messages.end());
+	}
+
+	queued(!messages.empty());
+}
+
+/**
+ * Creates an "end" message and queues it. Lines the limiter suppressed since the last summary are
+ * summarized first so that they aren't silently lost.
  */
 void RelayConnection::onClose() {
+	std::vector<std::shared_ptr<RelayMessage>> messages;
+	double monotonic = ::uv_hrtime() / 1e6;
+	double time = std::chrono::duration<double, std::milli>(std::chrono::system_clock::now().time_since_epoch()).count();
+	framer.summarize(true, monotonic, time, messages);
+
 	{
 		std::lock_guard<std::mutex> lock(msgQueueLock);
-		msgQueue.push(std::make_shared<RelayMessage>("end"));
+		msgQueue.insert(msgQueue.end(), messages.begin(), messages.end());
+		msgQueue.push_back(std::make_shared<RelayMessage>("end"));
 	}
 	::uv_async_send(&msgQueueUpdate);
 }
 
 /**
- * Creates an "data" message for each line and queues it.
+ * Frames the incoming data and queues the messages. The read is timestamped on both the monotonic
+ * clock `process.hrtime()` uses and the wall clock before anything else runs.
+ *
+ * After a framing error, the socket stops reading and an "end" is queued. The main thread
+ * disconnects once it dispatches the "end", since it may be using the socket at the same time.
  */
-void RelayConnection::onData(const char* data) {
-	std::string buffer;
-	bool changed = false;
+void RelayConnection::onData(const char* data, size_t len) {
+	double monotonic = ::uv_hrtime() / 1e6;
+	double time = std::chrono::duration<double, std::milli>(std::chrono::system_clock::now().time_since_epoch()).count();
 
-	{
-		std::lock_guard<std::mutex> lock(msgQueueLock);
+	if (qos) {
+		qos->record(qosClass, len);
+	}
 
-		for (; *data; ++data) {
-			if (*data == '\0' || *data == '\r' || *data == '\n') {
-				if (!buffer.empty()) {
-					msgQueue.push(std::make_shared<RelayMessage>("data", buffer));
-					changed = true;
-					buffer.clear();
-				}
-			} else {
-				buffer += *data;
+	std::vector<std::shared_ptr<RelayMessage>> messages;
+	bool ok = framer.feed(data, len, monotonic, time, messages);
+	enqueue(messages);
+
+	if (!ok) {
+		LOG_DEBUG("RelayConnection::onData", "Dropping connection after a framing error")
+		{
+			std::lock_guard<std::mutex> lock(msgQueueLock);
+			failed = true;
+			if (socket) {
+				::CFSocketDisableCallBacks(socket, kCFSocketDataCallBack);
 			}
 		}
+		onClose();
+	}
+}
+
+/**
+ * Sets how much a pull listener may receive before it has to pull again, then delivers whatever is
+ * queued for it. The credit is a number of messages or bytes depending on the listener's flow.
+ */
+void RelayConnection::pull(napi_value listener, uint32_t credit) {
+	bool found = false;
 
-		if (!buffer.empty()) {
-			msgQueue.push(std::make_shared<RelayMessage>("data", buffer));
-			changed = true;
+	{
+		std::lock_guard<std::mutex> lock(listenersLock);
+		for (auto const& it : listeners) {
+			napi_value callback;
+			NAPI_THROW("RelayConnection::pull", "ERR_NAPI_GET_REFERENCE_VALUE", ::napi_get_reference_value(env, it->ref, &callback))
+
+			bool same;
+			NAPI_THROW("RelayConnection::pull", "ERR_NAPI_STRICT_EQUALS", ::napi_strict_equals(env, callback, listener, &same))
+
+			if (same && isPullFlow(it->flow)) {
+				it->credit = credit;
+				found = true;
+			}
 		}
 	}
 
-	if (changed) {
+	if (found) {
 		::uv_async_send(&msgQueueUpdate);
 	}
 }
 
+/**
+ * Queues a summary of the suppressed lines once one is due, even if the device has gone quiet.
+ * Called on the run loop thread.
+ */
+void RelayConnection::onSummaryTimer() {
+	std::vector<std::shared_ptr<RelayMessage>> messages;
+	double monotonic = ::uv_hrtime() / 1e6;
+	double time = std::chrono::duration<double, std::milli>(std::chrono::system_clock::now().time_since_epoch()).count();
+	framer.summarize(false, monotonic, time, messages);
+	enqueue(messages);
+}
+
+/**
+ * Returns true if a pull listener has at least as much queued as its credit allows, counting what
+ * it hasn't been sent yet, so reading more would only grow the queue. Must be called with the
+ * listeners lock and the queue lock held.
+ */
+bool RelayConnection::isBackedUp() {
+	uint64_t end = msgQueueBase + msgQueue.size();
+	for (auto const& listener : listeners) {
+		if (!isPullFlow(listener->flow)) {
+			continue;
+		}
+
+		int64_t unsent = 0;
+		for (uint64_t i = listener->cursor; i < end && unsent < listener->credit; ++i) {
+			unsent += listener->flow == RelayPullLines ? 1 : (int64_t)msgQueue[i - msgQueueBase]->message.length() + 1;
+		}
+		if (unsent >= listener->credit) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Notifies the main thread of newly queued messages. Once a pull listener has as much queued as it
+ * has pulled, the socket stops reading until it pulls again, so the queue never holds much more
+ * than the listeners asked for. Called on the run loop thread.
+ */
+void RelayConnection::queued(bool changed) {
+	if (!changed) {
+		return;
+	}
+
+	if (pullListeners > 0) {
+		std::lock_guard<std::mutex> lock(listenersLock);
+		std::lock_guard<std::mutex> queueLock(msgQueueLock);
+		if (!paused && !failed && socket && isBackedUp()) {
+			LOG_DEBUG_1("RelayConnection::queued", "Pull listeners are out of credit with %ld messages queued, pausing socket", msgQueue.size())
+			paused = true;
+			::CFSocketDisableCallBacks(socket, kCFSocketDataCallBack);
+		}
+	}
+
+	::uv_async_send(&msgQueueUpdate);
+}
+
 /**
  * Removes a callback from the relay connection. Once there are no more listeners, it
  * decrements/unrefs the libuv async handle to all Node to exit.
  */
 void RelayConnection::remove(napi_value listener) {
-	std::lock_guard<std::mutex> lock(listenersLock);
+	size_t count = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(listenersLock);
 
-	for (auto it = listeners.begin(); it != listeners.end(); ) {
-		napi_value callback;
-		NAPI_THROW("RelayConnection::remove", "ERR_NAPI_GET_REFERENCE_VALUE", ::napi_get_reference_value(env, *it, &callback))
+		for (auto it = listeners.begin(); it != listeners.end(); ) {
+			napi_value callback;
+			NAPI_THROW("RelayConnection::remove", "ERR_NAPI_GET_REFERENCE_VALUE", ::napi_get_reference_value(env, (*it)->ref, &callback))
 
-		bool same;
-		NAPI_THROW("RelayConnection::remove", "ERR_NAPI_STRICT_EQUALS", ::napi_strict_equals(env, callback, listener, &same))
+			bool same;
+			NAPI_THROW("RelayConnection::remove", "ERR_NAPI_STRICT_EQUALS", ::napi_strict_equals(env, callback, listener, &same))
 
-		if (same) {
-			LOG_DEBUG("RelayConnection::remove", "Removing listener")
-			it = listeners.erase(it);
-		} else {
-			++it;
+			if (same) {
+				LOG_DEBUG("RelayConnection::remove", "Removing listener")
+				(*it)->removed = true;
+				if (isPullFlow((*it)->flow)) {
+					--pullListeners;
+				}
+				it = listeners.erase(it);
+			} else {
+				++it;
+			}
 		}
+
+		count = listeners.size();
 	}
 
-	if (listeners.size() == 0) {
+	// the removed listener may have been holding messages back
+	trim();
+
+	if (count == 0) {
 		::uv_unref((uv_handle_t*)&msgQueueUpdate);
 		disconnect();
+		dropQueue();
+	}
+}
+
+/**
+ * Sets the rate limiter that incoming lines are checked against before they're queued. The limiter
+ * is configured separately and does nothing until it has a limit.
+ */
+void RelayConnection::setLimiter(std::shared_ptr<SyslogLimiter> limiter) {
+	framer.setLimiter(limiter);
+}
+
+/**
+ * Sets the link shaper and traffic class that incoming data is recorded against and outgoing data
+ * is shaped to. This must be called before the first listener is added since the data is recorded
+ * on the run loop thread.
+ */
+void RelayConnection::setQos(std::shared_ptr<QosShaper> qos, QosClass cls) {
+	this->qos = qos;
+	qosClass = cls;
+}
+
+/**
+ * Writes data to the device. The data counts against the link in the connection's traffic class
+ * before it's written, so bulk transfers make room for interactive traffic going to the device
+ * and not only for traffic coming back. Returns false if the write failed.
+ */
+bool RelayConnection::write(const uint8_t* data, size_t len) {
+	if (qos) {
+		qos->acquire(qosClass, len);
+	}
+	return writeFully(*fd, data, len);
+}
+
+/**
+ * Drops the messages every listener has read and resumes a paused socket once every pull listener
+ * has pulled more than it has queued. Without listeners the queue is left alone. Called on the main
+ * thread.
+ */
+void RelayConnection::trim() {
+	std::lock_guard<std::mutex> lock(listenersLock);
+	if (listeners.empty()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> queueLock(msgQueueLock);
+	uint64_t cursor = msgQueueBase + msgQueue.size();
+	for (auto const& listener : listeners) {
+		cursor = std::min<uint64_t>(cursor, listener->cursor);
+	}
+
+	while (msgQueueBase < cursor) {
+		msgQueue.pop_front();
+		++msgQueueBase;
+	}
+
+	// the socket of a connection that failed stays off until it's disconnected
+	if (paused && !failed && !isBackedUp()) {
+		LOG_DEBUG("RelayConnection::trim", "Pull listeners want more, resuming socket")
+		paused = false;
+		if (socket) {
+			::CFSocketEnableCallBacks(socket, kCFSocketDataCallBack);
+		}
 	}
 }
 
@@ -307,7 +952,7 @@ PortRelay::PortRelay(napi_env env, std::weak_ptr<CFRunLoopRef> runloop) :
 /**
  * Adds or removes a listener to the specified port's relay connection.
  */
-void PortRelay::config(uint8_t action, napi_value nport, napi_value listener, std::shared_ptr<DeviceInterface> iface) {
+void PortRelay::config(uint8_t action, napi_value nport, napi_value listener, std::shared_ptr<DeviceInterface> iface, QosClass cls, RelayFlow flow) {
 	uint32_t port = 0;
 	napi_status status = ::napi_get_value_uint32(env, nport, &port);
 	if (status == napi_number_expected || status != napi_ok || port < 1 || port > 65535) {
@@ -333,13 +978,14 @@ void PortRelay::config(uint8_t action, napi_value nport, napi_value listener, st
 			LOG_DEBUG("PortRelay::config", "Connected");
 
 			conn = RelayConnection::create(env, runloop, &fd);
+			conn->setQos(iface->qos, cls);
 			connections.insert(std::make_pair(port, conn));
 		} else {
 			conn = it->second;
 		}
 
 		LOG_DEBUG("PortRelay::config", "Adding listener to port relay connection")
-		conn->add(listener);
+		conn->add(listener, flow);
 
 	} else if (it != connections.end()) {
 		LOG_DEBUG("PortRelay::config", "Removing listener from port relay connection")
@@ -352,13 +998,27 @@ void PortRelay::config(uint8_t action, napi_value nport, napi_value listener, st
 	}
 }
 
+/**
+ * Gives a pull listener of the specified port's relay connection more credit.
+ */
+void PortRelay::pull(napi_value nport, napi_value listener, uint32_t credit) {
+	uint32_t port = 0;
+	::napi_get_value_uint32(env, nport, &port);
+	auto it = connections.find(port);
+	if (it != connections.end()) {
+		it->second->pull(listener, credit);
+	}
+}
+
 /**
  * Intializes a syslog relay instance along with its base class.
  */
 SyslogRelay::SyslogRelay(napi_env env, std::weak_ptr<CFRunLoopRef> runloop) :
-	Relay(env, runloop) {
+	Relay(env, runloop),
+	limiter(std::make_shared<SyslogLimiter>()) {
 
-	relayConn = RelayConnection::create(env, runloop, (int*)&connection);
+	relayConn = RelayConnection::create(env, runloop, (int*)&connection, SyslogFraming);
+	relayConn->setLimiter(limiter);
 }
 
 /**
@@ -371,12 +1031,15 @@ SyslogRelay::~SyslogRelay() {
 /**
  * Adds or removes a listener to the syslog relay connection.
  */
-void SyslogRelay::config(uint8_t action, napi_value listener, std::shared_ptr<DeviceInterface> iface) {
+void SyslogRelay::config(uint8_t action, napi_value listener, std::shared_ptr<DeviceInterface> iface, RelayFlow flow) {
 	if (action == RELAY_START) {
 		iface->startService(AMSVC_SYSLOG_RELAY, &connection);
+		if (relayConn->size() == 0) {
+			relayConn->setQos(iface->qos, QosStreaming);
+		}
 
 		LOG_DEBUG("SyslogRelay::config", "Adding listener to syslog relay connection")
-		relayConn->add(listener);
+		relayConn->add(listener, flow);
 
 	} else {
 		LOG_DEBUG("SyslogRelay::config", "Removing listener from syslog relay connection")
@@ -384,4 +1047,201 @@ void SyslogRelay::config(uint8_t action, napi_value listener, std::shared_ptr<De
 	}
 }
 
+/**
+ * Sets the rate limits of the syslog relay. They apply to every listener and stay in effect across
+ * reconnects.
+ */
+void SyslogRelay::configureLimits(const SyslogLimitConfig& config) {
+	limiter->configure(config);
+}
+
+/**
+ * Gives a pull listener of the syslog relay connection more credit.
+ */
+void SyslogRelay::pull(napi_value listener, uint32_t credit) {
+	relayConn->pull(listener, credit);
+}
+
+/**
+ * Intializes a notification relay instance along with its base class.
+ */
+NotificationRelay::NotificationRelay(napi_env env, std::weak_ptr<CFRunLoopRef> runloop) :
+	Relay(env, runloop) {
+
+	relayConn = RelayConnection::create(env, runloop, (int*)&connection, PlistFraming);
+}
+
+/**
+ * Adds or removes a listener to the notification relay connection. The service is started when the
+ * first listener is added and any names that haven't already been registered with the device are
+ * registered in a single batch.
+ */
+void NotificationRelay::config(uint8_t action, napi_value listener, napi_value names, std::shared_ptr<DeviceInterface> iface) {
+	if (action == RELAY_START) {
+		std::vector<std::string> toObserve;
+		uint32_t count = 0;
+		bool isArray = false;
+
+		if (!names || ::napi_is_array(env, names, &isArray) != napi_ok || !isArray) {
+			throw std::runtime_error("Expected notification names to be an array of strings");
+		}
+
+		::napi_get_array_length(env, names, &count);
+		for (uint32_t i = 0; i < count; ++i) {
+			napi_value name;
+			napi_valuetype type;
+			::napi_get_element(env, names, i, &name);
+			if (::napi_typeof(env, name, &type) != napi_ok || type != napi_string) {
+				throw std::runtime_error("Expected notification names to be an array of strings");
+			}
+			toObserve.push_back(napi_string_to_std_string(env, name));
+		}
+
+		if (relayConn->size() == 0) {
+			iface->startService(AMSVC_NOTIFICATION_PROXY, &connection);
+			observed.clear();
+
+			try {
+				observe(toObserve);
+			} catch (std::exception& e) {
+				// nothing is relaying the connection yet, so nothing else will close it
+				::close(connection);
+				throw;
+			}
+		} else {
+			observe(toObserve);
+		}
+
+		LOG_DEBUG("NotificationRelay::config", "Adding listener to notification relay connection")
+		relayConn->add(listener);
+
+	} else {
+		LOG_DEBUG("NotificationRelay::config", "Removing listener from notification relay connection")
+		relayConn->remove(listener);
+	}
+}
+
+/**
+ * Registers the notification names that haven't been registered yet. All of the observe commands
+ * are sent with a single write, and the names are only recorded as observed once it succeeds so a
+ * failed registration is retried by the next listener.
+ */
+void NotificationRelay::observe(std::vector<std::string>& names) {
+	std::vector<uint8_t> batch;
+	std::set<std::string> pending;
+	const void* keys[] = { CFSTR("Command"), CFSTR("Name") };
+
+	for (auto const& name : names) {
+		if (observed.count(name) || !pending.insert(name).second) {
+			continue;
+		}
+
+		LOG_DEBUG_1("NotificationRelay::observe", "Observing \"%s\"", name.c_str())
+		CFStringRef cfname = createCFString(name);
+		const void* values[] = { CFSTR("ObserveNotification"), cfname };
+		CFDictionaryRef msg = ::CFDictionaryCreate(kCFAllocatorDefault, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+		::CFRelease(cfname);
+		appendPlist(batch, msg, kCFPropertyListXMLFormat_v1_0);
+		::CFRelease(msg);
+	}
+
+	if (!batch.empty() && !writeFully(connection, batch.data(), batch.size())) {
+		throw std::runtime_error("Failed to register notifications with the device");
+	}
+
+	observed.insert(pending.begin(), pending.end());
+}
+
+/**
+ * The largest chunk iOS 10 and older will accept in a single Web Inspector message.
+ */
+#define WIR_MAX_CHUNK_SIZE 8096
+
+/**
+ * Intializes a Web Inspector relay instance along with its base class.
+ */
+WebInspectorRelay::WebInspectorRelay(napi_env env, std::weak_ptr<CFRunLoopRef> runloop) :
+	Relay(env, runloop),
+	splitMessages(false) {
+
+	relayConn = RelayConnection::create(env, runloop, (int*)&connection, WebInspectorFraming);
+}
+
+/**
+ * Adds or removes a listener to the Web Inspector relay connection. The service is started when the
+ * first listener is added.
+ */
+void WebInspectorRelay::config(uint8_t action, napi_value listener, std::shared_ptr<DeviceInterface> iface, bool splitMessages) {
+	if (action == RELAY_START) {
+		if (relayConn->size() == 0) {
+			iface->startService(AMSVC_WEB_INSPECTOR, &connection);
+			relayConn->setQos(iface->qos, QosInteractive);
+			this->splitMessages = splitMessages;
+		}
+
+		LOG_DEBUG("WebInspectorRelay::config", "Adding listener to Web Inspector relay connection")
+		relayConn->add(listener);
+
+	} else {
+		LOG_DEBUG("WebInspectorRelay::config", "Removing listener from Web Inspector relay connection")
+		relayConn->remove(listener);
+	}
+}
+
+/**
+ * Encodes a message as a binary plist and sends it to the device. If the device requires it, the
+ * message is split into partial messages. All frames are sent with a single write.
+ */
+void WebInspectorRelay::send(napi_value message) {
+	if (relayConn->size() == 0) {
+		throw std::runtime_error("Web Inspector relay is not connected");
+	}
+
+	CFPropertyListRef plist = jsToCF(env, message);
+	if (!plist || ::CFGetTypeID(plist) != ::CFDictionaryGetTypeID()) {
+		if (plist) {
+			::CFRelease(plist);
+		}
+		throw std::runtime_error("Expected message to be an object");
+	}
+
+	std::vector<uint8_t> out;
+
+	try {
+		if (!splitMessages) {
+			appendPlist(out, plist);
+		} else {
+			CFDataRef data = ::CFPropertyListCreateData(kCFAllocatorDefault, plist, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+			if (!data) {
+				throw std::runtime_error("Failed to serialize plist");
+			}
+
+			const uint8_t* bytes = ::CFDataGetBytePtr(data);
+			CFIndex size = ::CFDataGetLength(data);
+
+			for (CFIndex offset = 0; offset < size; offset += WIR_MAX_CHUNK_SIZE) {
+				CFIndex len = std::min<CFIndex>(WIR_MAX_CHUNK_SIZE, size - offset);
+				CFDataRef chunk = ::CFDataCreate(kCFAllocatorDefault, bytes + offset, len);
+				const void* keys[] = { offset + len < size ? CFSTR("WIRPartialMessageKey") : CFSTR("WIRFinalMessageKey") };
+				const void* values[] = { chunk };
+				CFDictionaryRef wrapper = ::CFDictionaryCreate(kCFAllocatorDefault, keys, values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+				::CFRelease(chunk);
+				appendPlist(out, wrapper);
+				::CFRelease(wrapper);
+			}
+
+			::CFRelease(data);
+		}
+	} catch (std::exception& e) {
+		::CFRelease(plist);
+		throw;
+	}
+
+	::CFRelease(plist);
+
+	if (!relayConn->write(out.data(), out.size())) {
+		throw std::runtime_error("Failed to send message to Web Inspector");
+	}
+}
+
 }
@@ -4,12 +4,17 @@
 #include "node-ios-device.h"
 #include "device-interface.h"
 #include "mobiledevice.h"
+#include "syslog-limiter.h"
 #include <CoreFoundation/CoreFoundation.h>
+#include <atomic>
+#include <deque>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <set>
 #include <uv.h>
+#include <vector>
 
 namespace node_ios_device {
 
@@ -21,10 +26,104 @@ class DeviceInterface;
  * messages.
  */
 struct RelayMessage {
-	RelayMessage(const char* event) : event(event) {}
-	RelayMessage(const char* event, std::string& message) : event(event), message(message) {}
+	RelayMessage(const char* event) : event(event), ascii(false), plist(NULL), seq(0), monotonic(0), time(0) {}
+	RelayMessage(const char* event, std::string& message) : event(event), message(message), ascii(false), plist(NULL), seq(0), monotonic(0), time(0) {}
+	RelayMessage(const char* event, CFPropertyListRef plist) : event(event), ascii(false), plist(plist), seq(0), monotonic(0), time(0) {}
+	~RelayMessage() { if (plist) ::CFRelease(plist); }
+	napi_value toJS(napi_env env) const;
 	const char* event;
 	std::string message;
+	bool        ascii;
+	CFPropertyListRef plist;
+	uint64_t    seq;       // the message's position in the messages received since connecting
+	double      monotonic; // when the read containing the message arrived, in `process.hrtime()` milliseconds
+	double      time;      // when the read containing the message arrived, in milliseconds since the epoch
+};
+
+void splitLines(const char* data, size_t len, std::vector<std::shared_ptr<RelayMessage>>& messages);
+size_t splitSyslogLines(const char* data, size_t len, std::vector<std::shared_ptr<RelayMessage>>& messages);
+
+/**
+ * How incoming relay data is split into messages. `LineFraming` emits each line as a string.
+ * `SyslogFraming` is `LineFraming` plus decoding of the vis(3) escapes the syslog relay uses for
+ * control characters and non-ASCII bytes. `PlistFraming` reassembles length prefixed property lists
+ * and emits each one as an object. `WebInspectorFraming` is `PlistFraming` plus reassembly of Web
+ * Inspector messages that the device split into partial messages. Use `isPlistFraming()` to tell
+ * the two families apart so a new plist framing can't fall through to line splitting.
+ */
+enum RelayFraming { LineFraming, SyslogFraming, PlistFraming, WebInspectorFraming };
+
+inline bool isPlistFraming(RelayFraming framing) {
+	return framing == PlistFraming || framing == WebInspectorFraming;
+}
+
+/**
+ * How messages reach a listener. `RelayPush` listeners are called with every message as soon as it
+ * arrives. Pull listeners are only called while they have credit, which they replenish by pulling.
+ * Each message costs a `RelayPullLines` listener one credit and a `RelayPullBytes` listener its
+ * length plus a line terminator. `RelayBatch` listeners are called once with every message that has
+ * arrived, along with each message's sequence number and receive times.
+ */
+enum RelayFlow { RelayPush, RelayPullLines, RelayPullBytes, RelayBatch };
+
+inline bool isPullFlow(RelayFlow flow) {
+	return flow == RelayPullLines || flow == RelayPullBytes;
+}
+
+/**
+ * The largest plist frame, or reassembled Web Inspector message, a relay accepts. A length prefix
+ * above this means the stream is corrupt or hostile, so the connection is dropped instead of
+ * buffering until the claimed length arrives.
+ */
+#define RELAY_MAX_PLIST_SIZE (16 * 1024 * 1024)
+
+/**
+ * How often in seconds a rate limited connection checks for a due summary of suppressed lines, so
+ * that summaries still arrive while the device is quiet.
+ */
+#define RELAY_SUMMARY_TIMER_INTERVAL 1.0
+
+/**
+ * A relay listener and how far it has read into the connection's message queue.
+ */
+struct RelayListener {
+	RelayListener(napi_ref ref, RelayFlow flow, uint64_t cursor) : ref(ref), flow(flow), cursor(cursor), credit(0), removed(false) {}
+	napi_ref  ref;
+	RelayFlow flow;
+	uint64_t  cursor;
+	int64_t   credit;
+	bool      removed;
+};
+
+/**
+ * Turns the data read from a relay socket into messages based on the connection's framing. Lines,
+ * escapes, characters, and plists cut off by the end of a read are held until the rest arrives.
+ * Every message is stamped with a sequence number and the time the read arrived.
+ *
+ * A framer is only fed from one thread at a time and doesn't need a socket, so it can be fed
+ * directly.
+ */
+class RelayFramer {
+public:
+	RelayFramer(RelayFraming framing) : framing(framing), seq(0) {}
+
+	bool feed(const char* data, size_t len, double monotonic, double time, std::vector<std::shared_ptr<RelayMessage>>& messages);
+	bool hasLimiter() const { return limiter != nullptr; }
+	void reset();
+	void setLimiter(std::shared_ptr<SyslogLimiter> limiter) { this->limiter = limiter; }
+	void summarize(bool force, double monotonic, double time, std::vector<std::shared_ptr<RelayMessage>>& messages);
+
+	const RelayFraming framing;
+
+protected:
+	void feedLines(const char* data, size_t len, std::vector<std::shared_ptr<RelayMessage>>& messages);
+	bool feedPlists(const char* data, size_t len, std::vector<std::shared_ptr<RelayMessage>>& messages);
+	CFPropertyListRef reassemble(CFPropertyListRef plist);
+
+	std::vector<char>              pending;
+	std::vector<uint8_t>           partial;
+	std::shared_ptr<SyslogLimiter> limiter;
+	uint64_t                       seq;
 };
 
 /**
@@ -33,37 +132,63 @@ struct RelayMessage {
  *
  * This class contains the list of relay listeners and handles notifying them when new relay
  * messages come in.
+ *
+ * Messages stay queued until every listener has read them, so a pull listener that isn't pulling
+ * holds them back. Once a pull listener has as much queued as its credit allows, the socket is
+ * paused until every pull listener wants more, and unread data backs up on the device.
+ *
+ * The socket is only torn down on the main thread. When the run loop thread drops the connection,
+ * it stops reading and queues an "end" that the main thread disconnects on.
  */
 class RelayConnection : public std::enable_shared_from_this<RelayConnection> {
 public:
-	RelayConnection(napi_env env, std::weak_ptr<CFRunLoopRef> runloop, int* fd);
+	RelayConnection(napi_env env, std::weak_ptr<CFRunLoopRef> runloop, int* fd, RelayFraming framing = LineFraming);
 	virtual ~RelayConnection();
 
-	static std::shared_ptr<RelayConnection> create(napi_env env, std::weak_ptr<CFRunLoopRef> runloop, int* fd);
+	static std::shared_ptr<RelayConnection> create(napi_env env, std::weak_ptr<CFRunLoopRef> runloop, int* fd, RelayFraming framing = LineFraming);
 
-	void add(napi_value listener);
+	void add(napi_value listener, RelayFlow flow = RelayPush);
 	void disconnect();
 	void dispatch();
 	void init();
 	void onClose();
-	void onData(const char* data);
+	void onData(const char* data, size_t len);
+	void pull(napi_value listener, uint32_t credit);
 	void remove(napi_value listener);
+	void setLimiter(std::shared_ptr<SyslogLimiter> limiter);
+	void setQos(std::shared_ptr<QosShaper> qos, QosClass cls);
 	uint32_t size();
+	bool write(const uint8_t* data, size_t len);
 
 protected:
 	void connect();
+	bool dispatchBatch(RelayListener& listener, napi_value global, napi_value callback);
+	void dropQueue();
+	void enqueue(std::vector<std::shared_ptr<RelayMessage>>& messages);
+	bool isBackedUp();
+	void onSummaryTimer();
+	void queued(bool changed);
+	void trim();
 
 	std::weak_ptr<RelayConnection> self;
 	int*                           fd;
+	RelayFramer                    framer;
+	std::shared_ptr<QosShaper>     qos;
+	QosClass                       qosClass;
 	napi_env                       env;
 	std::mutex                     listenersLock;
-	std::list<napi_ref>            listeners;
+	std::list<std::shared_ptr<RelayListener>> listeners;
+	std::atomic<uint32_t>          pullListeners;
 	std::weak_ptr<CFRunLoopRef>    runloop;
 	CFSocketRef                    socket;
 	CFRunLoopSourceRef             source;
+	CFRunLoopTimerRef              summaryTimer;
 	std::mutex                     msgQueueLock;
 	uv_async_t                     msgQueueUpdate;
-	std::queue<std::shared_ptr<RelayMessage>> msgQueue;
+	std::deque<std::shared_ptr<RelayMessage>> msgQueue;
+	uint64_t                       msgQueueBase;
+	bool                           paused;
+	bool                           failed;
 };
 
 /**
@@ -88,7 +213,8 @@ protected:
 class PortRelay : public Relay {
 public:
 	PortRelay(napi_env env, std::weak_ptr<CFRunLoopRef> runloop);
-	void config(uint8_t action, napi_value nport, napi_value listener, std::shared_ptr<DeviceInterface> iface);
+	void config(uint8_t action, napi_value nport, napi_value listener, std::shared_ptr<DeviceInterface> iface, QosClass cls, RelayFlow flow = RelayPush);
+	void pull(napi_value nport, napi_value listener, uint32_t credit);
 
 protected:
 	std::map<uint32_t, std::shared_ptr<RelayConnection>> connections;
@@ -101,11 +227,54 @@ class SyslogRelay : public Relay {
 public:
 	SyslogRelay(napi_env env, std::weak_ptr<CFRunLoopRef> runloop);
 	virtual ~SyslogRelay();
-	void config(uint8_t action, napi_value listener, std::shared_ptr<DeviceInterface> iface);
+	void config(uint8_t action, napi_value listener, std::shared_ptr<DeviceInterface> iface, RelayFlow flow = RelayPush);
+	void configureLimits(const SyslogLimitConfig& config);
+	void pull(napi_value listener, uint32_t credit);
+
+	service_conn_t connection;
+
+protected:
+	std::shared_ptr<SyslogLimiter>   limiter;
+	std::shared_ptr<RelayConnection> relayConn;
+};
+
+/**
+ * Implementation for relaying notifications from the notification proxy service on the device.
+ *
+ * All observers share a single service connection. Each notification name is only registered with
+ * the device once and observers filter the relayed notifications down to the names they asked for.
+ */
+class NotificationRelay : public Relay {
+public:
+	NotificationRelay(napi_env env, std::weak_ptr<CFRunLoopRef> runloop);
+	void config(uint8_t action, napi_value listener, napi_value names, std::shared_ptr<DeviceInterface> iface);
+
+	service_conn_t connection;
+
+protected:
+	void observe(std::vector<std::string>& names);
+
+	std::set<std::string> observed;
+	std::shared_ptr<RelayConnection> relayConn;
+};
+
+/**
+ * Implementation for relaying messages to and from the Web Inspector service on the device.
+ *
+ * Messages are binary plists. Incoming messages are decoded natively and emitted as objects and
+ * outgoing messages are encoded natively. Devices running iOS 10 and older require large messages
+ * to be split into partial messages, which is handled in both directions.
+ */
+class WebInspectorRelay : public Relay {
+public:
+	WebInspectorRelay(napi_env env, std::weak_ptr<CFRunLoopRef> runloop);
+	void config(uint8_t action, napi_value listener, std::shared_ptr<DeviceInterface> iface, bool splitMessages);
+	void send(napi_value message);
 
 	service_conn_t connection;
 
 protected:
+	bool splitMessages;
 	std::shared_ptr<RelayConnection> relayConn;
 };
 
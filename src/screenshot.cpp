@@ -0,0 +1,532 @@
+#include "screenshot.h"
+#include "hash.h"
+#include "service.h"
+#include <chrono>
+#include <sstream>
+#include <sys/socket.h>
+
+namespace node_ios_device {
+
+/**
+ * The number of released frames kept around for reuse.
+ */
+#define SCREENSHOT_POOL_SIZE 4
+
+/**
+ * The maximum number of frames waiting to be emitted. If JavaScript can't keep up, the oldest
+ * frames are dropped so that memory stays bounded.
+ */
+#define SCREENSHOT_MAX_QUEUED 4
+
+/**
+ * Frees any frames that are sitting in the pool. Frames still referenced by JavaScript buffers
+ * are freed by the buffer finalizer once the pool is gone.
+ */
+ScreenshotFramePool::~ScreenshotFramePool() {
+	for (auto frame : available) {
+		delete frame;
+	}
+}
+
+/**
+ * Returns a frame from the pool or allocates a new one if the pool is empty.
+ */
+ScreenshotFrame* ScreenshotFramePool::acquire() {
+	{
+		std::lock_guard<std::mutex> lock(poolLock);
+		if (!available.empty()) {
+			ScreenshotFrame* frame = available.back();
+			available.pop_back();
+			return frame;
+		}
+	}
+
+	ScreenshotFrame* frame = new ScreenshotFrame();
+	frame->pool = shared_from_this();
+	return frame;
+}
+
+/**
+ * Returns a frame to the pool. The frame's buffer keeps its capacity so the next frame of the same
+ * resolution is copied without reallocating.
+ */
+void ScreenshotFramePool::release(ScreenshotFrame* frame) {
+	{
+		std::lock_guard<std::mutex> lock(poolLock);
+		if (available.size() < capacity) {
+			available.push_back(frame);
+			return;
+		}
+	}
+	delete frame;
+}
+
+/**
+ * Called by N-API when a frame buffer is garbage collected.
+ */
+static void finalizeFrame(napi_env env, void* data, void* hint) {
+	ScreenshotFrame* frame = static_cast<ScreenshotFrame*>(hint);
+	if (auto pool = frame->pool.lock()) {
+		pool->release(frame);
+	} else {
+		delete frame;
+	}
+}
+
+/**
+ * Returns the name of a DeviceLink message which is the first element of the message array.
+ */
+static std::string dlMessageName(CFPropertyListRef msg) {
+	if (!msg || ::CFGetTypeID(msg) != ::CFArrayGetTypeID() || ::CFArrayGetCount((CFArrayRef)msg) == 0) {
+		return "";
+	}
+	return cfStringToStdString((CFStringRef)::CFArrayGetValueAtIndex((CFArrayRef)msg, 0));
+}
+
+/**
+ * Initializes the stream. The stream isn't started until the first listener is added.
+ */
+ScreenshotStream::ScreenshotStream(napi_env env) :
+	env(env),
+	connection(0),
+	connected(false),
+	running(false),
+	fps(1),
+	dedup(false),
+	lastHash(0),
+	hasLastHash(false),
+	pool(std::make_shared<ScreenshotFramePool>(SCREENSHOT_POOL_SIZE)) {}
+
+/**
+ * Stops the capture thread and releases any frames that were never emitted.
+ */
+ScreenshotStream::~ScreenshotStream() {
+	::uv_close((uv_handle_t*)&frameQueueUpdate, NULL);
+	stop();
+
+	std::lock_guard<std::mutex> lock(frameQueueLock);
+	while (!frameQueue.empty()) {
+		if (frameQueue.front()) {
+			pool->release(frameQueue.front());
+		}
+		frameQueue.pop();
+	}
+}
+
+/**
+ * Adds a listener. If this is the first listener, it refs the libuv async handle to prevent Node
+ * from exiting.
+ */
+void ScreenshotStream::add(napi_value listener) {
+	napi_ref ref;
+	NAPI_THROW_RETURN("ScreenshotStream::add", "ERROR_NAPI_CREATE_REFERENCE", ::napi_create_reference(env, listener, 1, &ref), )
+
+	size_t count = 0;
+	{
+		std::lock_guard<std::mutex> lock(listenersLock);
+		listeners.push_back(ref);
+		count = listeners.size();
+	}
+
+	if (count == 1) {
+		::uv_ref((uv_handle_t*)&frameQueueUpdate);
+	}
+}
+
+/**
+ * Sets the capture rate and whether identical consecutive frames should be skipped. This can be
+ * called while the stream is running.
+ */
+void ScreenshotStream::configure(double fps, bool dedup) {
+	this->fps = fps;
+	this->dedup = dedup;
+}
+
+/**
+ * Creates an shared pointer to an instance of the screenshot stream.
+ */
+std::shared_ptr<ScreenshotStream> ScreenshotStream::create(napi_env env) {
+	std::shared_ptr<ScreenshotStream> stream = std::make_shared<ScreenshotStream>(env);
+	stream->init();
+	return stream;
+}
+
+/**
+ * Emits queued frames to the listeners. Frames are wrapped in external buffers so the frame
+ * memory is not copied again.
+ */
+void ScreenshotStream::dispatch() {
+	napi_handle_scope scope;
+	napi_value global, listener, argv[2], rval;
+
+	NAPI_THROW("ScreenshotStream::dispatch", "ERR_NAPI_OPEN_HANDLE_SCOPE", ::napi_open_handle_scope(env, &scope))
+	NAPI_THROW("ScreenshotStream::dispatch", "ERR_NAPI_GET_GLOBAL", ::napi_get_global(env, &global))
+
+	std::list<napi_value> callbacks;
+	{
+		std::lock_guard<std::mutex> lock(listenersLock);
+		for (auto const& ref : listeners) {
+			NAPI_THROW("ScreenshotStream::dispatch", "ERR_NAPI_GET_REFERENCE_VALUE", ::napi_get_reference_value(env, ref, &listener))
+			if (listener != NULL) {
+				callbacks.push_back(listener);
+			}
+		}
+	}
+
+	while (1) {
+		ScreenshotFrame* frame;
+		{
+			std::lock_guard<std::mutex> lock(frameQueueLock);
+			if (frameQueue.empty()) {
+				break;
+			}
+			frame = frameQueue.front();
+			frameQueue.pop();
+		}
+
+		if (!frame) {
+			LOG_DEBUG("ScreenshotStream::dispatch", "Emitting \"end\" event")
+			NAPI_THROW("ScreenshotStream::dispatch", "ERR_NAPI_CREATE_STRING_UTF8", ::napi_create_string_utf8(env, "end", NAPI_AUTO_LENGTH, &argv[0]))
+			for (auto const& callback : callbacks) {
+				NAPI_THROW("ScreenshotStream::dispatch", "ERR_NAPI_MAKE_CALLBACK", ::napi_make_callback(env, NULL, global, callback, 1, argv, &rval))
+				remove(callback);
+			}
+			// the capture thread has already exited, but with no listeners nothing above stopped the
+			// stream and the next start() would think it's still running
+			stop();
+			break;
+		}
+
+		if (callbacks.empty()) {
+			pool->release(frame);
+			continue;
+		}
+
+		NAPI_THROW("ScreenshotStream::dispatch", "ERR_NAPI_CREATE_STRING_UTF8", ::napi_create_string_utf8(env, "data", NAPI_AUTO_LENGTH, &argv[0]))
+		if (::napi_create_external_buffer(env, frame->data.size(), frame->data.data(), finalizeFrame, frame, &argv[1]) != napi_ok) {
+			pool->release(frame);
+			NAPI_THROW("ScreenshotStream::dispatch", "ERR_NAPI_CREATE_EXTERNAL_BUFFER", napi_generic_failure)
+		}
+
+		for (auto const& callback : callbacks) {
+			NAPI_THROW("ScreenshotStream::dispatch", "ERR_NAPI_MAKE_CALLBACK", ::napi_make_callback(env, NULL, global, callback, 2, argv, &rval))
+		}
+	}
+
+	NAPI_THROW("ScreenshotStream::dispatch", "ERR_NAPI_CLOSE_HANDLE_SCOPE", ::napi_close_handle_scope(env, scope))
+}
+
+/**
+ * Performs the DeviceLink version exchange with the screenshot service.
+ */
+void ScreenshotStream::handshake() {
+	std::vector<uint8_t> buffer;
+
+	CFPropertyListRef msg = recvPlist(connection, buffer);
+	if (dlMessageName(msg) != "DLMessageVersionExchange" || ::CFArrayGetCount((CFArrayRef)msg) < 2) {
+		if (msg) {
+			::CFRelease(msg);
+		}
+		throw std::runtime_error("Screenshot service did not send a version exchange");
+	}
+
+	const void* values[] = {
+		CFSTR("DLMessageVersionExchange"),
+		CFSTR("DLVersionsOk"),
+		::CFArrayGetValueAtIndex((CFArrayRef)msg, 1)
+	};
+	CFArrayRef reply = ::CFArrayCreate(kCFAllocatorDefault, values, 3, &kCFTypeArrayCallBacks);
+	::CFRelease(msg);
+
+	try {
+		sendPlist(connection, reply);
+	} catch (std::exception& e) {
+		::CFRelease(reply);
+		throw;
+	}
+	::CFRelease(reply);
+
+	msg = recvPlist(connection, buffer);
+	std::string name = dlMessageName(msg);
+	if (msg) {
+		::CFRelease(msg);
+	}
+	if (name != "DLMessageDeviceReady") {
+		throw std::runtime_error("Screenshot service is not ready");
+	}
+}
+
+/**
+ * Explicit initialization so that we can get a weak pointer based on the shared pointer that
+ * created this instance and wire up the libuv callback.
+ */
+void ScreenshotStream::init() {
+	self = shared_from_this();
+
+	uv_loop_t* loop;
+	::napi_get_uv_event_loop(env, &loop);
+	frameQueueUpdate.data = &self;
+	::uv_async_init(loop, &frameQueueUpdate, [](uv_async_t* handle) {
+		std::weak_ptr<ScreenshotStream>* ptr = static_cast<std::weak_ptr<ScreenshotStream>*>(handle->data);
+		if (auto stream = (*ptr).lock()) {
+			stream->dispatch();
+		}
+	});
+	::uv_unref((uv_handle_t*)&frameQueueUpdate);
+}
+
+/**
+ * Queues the "end" marker. Called from the capture thread when the device closes the connection.
+ */
+void ScreenshotStream::onClose() {
+	{
+		std::lock_guard<std::mutex> lock(frameQueueLock);
+		frameQueue.push(NULL);
+	}
+	::uv_async_send(&frameQueueUpdate);
+}
+
+/**
+ * Copies a captured frame into a pooled buffer and queues it. When dedup is enabled, frames that
+ * hash the same as the previous frame are skipped before any copy is made.
+ */
+void ScreenshotStream::onFrame(const uint8_t* data, size_t len) {
+	if (dedup) {
+		uint64_t hash = Hash64::compute(data, len);
+		if (hasLastHash && hash == lastHash) {
+			return;
+		}
+		lastHash = hash;
+		hasLastHash = true;
+	}
+
+	ScreenshotFrame* frame = pool->acquire();
+	frame->data.assign(data, data + len);
+
+	{
+		std::lock_guard<std::mutex> lock(frameQueueLock);
+		if (frameQueue.size() >= SCREENSHOT_MAX_QUEUED) {
+			LOG_DEBUG("ScreenshotStream::onFrame", "Frame queue full, dropping oldest frame")
+			pool->release(frameQueue.front());
+			frameQueue.pop();
+		}
+		frameQueue.push(frame);
+	}
+
+	::uv_async_send(&frameQueueUpdate);
+}
+
+/**
+ * Removes a listener. Once there are no more listeners, the capture thread is stopped and the
+ * libuv async handle is unref'd to allow Node to exit.
+ */
+void ScreenshotStream::remove(napi_value listener) {
+	size_t count;
+	{
+		std::lock_guard<std::mutex> lock(listenersLock);
+
+		for (auto it = listeners.begin(); it != listeners.end(); ) {
+			napi_value callback;
+			NAPI_THROW("ScreenshotStream::remove", "ERR_NAPI_GET_REFERENCE_VALUE", ::napi_get_reference_value(env, *it, &callback))
+
+			bool same;
+			NAPI_THROW("ScreenshotStream::remove", "ERR_NAPI_STRICT_EQUALS", ::napi_strict_equals(env, callback, listener, &same))
+
+			if (same) {
+				LOG_DEBUG("ScreenshotStream::remove", "Removing listener")
+				::napi_delete_reference(env, *it);
+				it = listeners.erase(it);
+			} else {
+				++it;
+			}
+		}
+
+		count = listeners.size();
+	}
+
+	if (count == 0) {
+		::uv_unref((uv_handle_t*)&frameQueueUpdate);
+		stop();
+	}
+}
+
+/**
+ * The capture loop. Requests a frame, waits for the reply, then sleeps until the next frame is due.
+ * If a frame takes longer than the frame interval, the next frame is requested immediately instead
+ * of trying to catch up.
+ */
+void ScreenshotStream::run() {
+	LOG_DEBUG_THREAD_ID("ScreenshotStream::run", "Starting screenshot capture")
+
+	std::vector<uint8_t> buffer;
+
+	const void* keys[] = { CFSTR("MessageType") };
+	const void* values[] = { CFSTR("ScreenShotRequest") };
+	CFDictionaryRef options = ::CFDictionaryCreate(kCFAllocatorDefault, keys, values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	const void* items[] = { CFSTR("DLMessageProcessMessage"), options };
+	CFArrayRef request = ::CFArrayCreate(kCFAllocatorDefault, items, 2, &kCFTypeArrayCallBacks);
+	::CFRelease(options);
+
+	auto next = std::chrono::steady_clock::now();
+
+	while (running) {
+		{
+			std::unique_lock<std::mutex> lock(stateLock);
+			if (stateChange.wait_until(lock, next, [this] { return !running; })) {
+				break;
+			}
+		}
+
+		next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / fps));
+
+		CFPropertyListRef reply = NULL;
+		try {
+			sendPlist(connection, request);
+			reply = recvPlist(connection, buffer);
+		} catch (std::exception& e) {
+			LOG_DEBUG_1("ScreenshotStream::run", "%s", e.what())
+		}
+
+		if (!reply) {
+			if (running) {
+				onClose();
+			}
+			break;
+		}
+
+		CFDataRef data = NULL;
+		if (dlMessageName(reply) == "DLMessageProcessMessage" && ::CFArrayGetCount((CFArrayRef)reply) > 1) {
+			CFDictionaryRef dict = (CFDictionaryRef)::CFArrayGetValueAtIndex((CFArrayRef)reply, 1);
+			if (dict && ::CFGetTypeID(dict) == ::CFDictionaryGetTypeID()) {
+				data = (CFDataRef)::CFDictionaryGetValue(dict, CFSTR("ScreenShotData"));
+			}
+		}
+
+		if (data && ::CFGetTypeID(data) == ::CFDataGetTypeID()) {
+			onFrame(::CFDataGetBytePtr(data), (size_t)::CFDataGetLength(data));
+		} else {
+			LOG_DEBUG("ScreenshotStream::run", "Unexpected reply from screenshot service")
+		}
+
+		::CFRelease(reply);
+
+		auto now = std::chrono::steady_clock::now();
+		if (next < now) {
+			next = now;
+		}
+	}
+
+	::CFRelease(request);
+	LOG_DEBUG_THREAD_ID("ScreenshotStream::run", "Screenshot capture stopped")
+}
+
+/**
+ * Returns the number of listeners for this stream.
+ */
+uint32_t ScreenshotStream::size() {
+	std::lock_guard<std::mutex> lock(listenersLock);
+	return listeners.size();
+}
+
+/**
+ * Starts the screenshot service, performs the handshake, and spawns the capture thread. If the
+ * stream is already running, this is a no-op.
+ */
+void ScreenshotStream::start(std::shared_ptr<DeviceInterface> iface) {
+	if (running) {
+		return;
+	}
+
+	iface->startService(AMSVC_SCREENSHOT, &connection);
+	connected = true;
+
+	try {
+		handshake();
+	} catch (std::exception& e) {
+		::close(connection);
+		connected = false;
+		throw;
+	}
+
+	hasLastHash = false;
+	running = true;
+	thread = std::thread(&ScreenshotStream::run, this);
+}
+
+/**
+ * Stops the capture thread, tells the service we're done, and closes the connection. The read side
+ * of the connection is shut down first so a capture thread blocked waiting for a frame returns
+ * instead of holding up the join.
+ */
+void ScreenshotStream::stop() {
+	{
+		std::lock_guard<std::mutex> lock(stateLock);
+		running = false;
+	}
+	stateChange.notify_all();
+
+	if (connected) {
+		::shutdown(connection, SHUT_RD);
+	}
+
+	if (thread.joinable()) {
+		thread.join();
+	}
+
+	if (connected) {
+		const void* values[] = { CFSTR("DLMessageDisconnect"), CFSTR("___EmptyParameterString___") };
+		CFArrayRef msg = ::CFArrayCreate(kCFAllocatorDefault, values, 2, &kCFTypeArrayCallBacks);
+		try {
+			sendPlist(connection, msg);
+		} catch (std::exception& e) {
+			// the device may already be gone
+		}
+		::CFRelease(msg);
+		::close(connection);
+		connected = false;
+	}
+}
+
+/**
+ * Intializes a screenshot relay instance along with its base class.
+ */
+ScreenshotRelay::ScreenshotRelay(napi_env env, std::weak_ptr<CFRunLoopRef> runloop) :
+	Relay(env, runloop) {
+
+	stream = ScreenshotStream::create(env);
+}
+
+/**
+ * Adds or removes a listener to the screenshot stream. The capture rate and dedup options apply to
+ * the shared stream, so the most recent call wins.
+ */
+void ScreenshotRelay::config(uint8_t action, napi_value listener, napi_value nfps, napi_value ndedup, std::shared_ptr<DeviceInterface> iface) {
+	if (action == RELAY_START) {
+		double fps = 1;
+		bool dedup = false;
+		napi_valuetype type;
+
+		if (nfps && ::napi_typeof(env, nfps, &type) == napi_ok && type != napi_undefined) {
+			if (type != napi_number || ::napi_get_value_double(env, nfps, &fps) != napi_ok || !(fps > 0 && fps <= 60)) {
+				throw std::runtime_error("Expected fps to be a number greater than 0 and less than or equal to 60");
+			}
+		}
+
+		if (ndedup && ::napi_typeof(env, ndedup, &type) == napi_ok && type == napi_boolean) {
+			::napi_get_value_bool(env, ndedup, &dedup);
+		}
+
+		LOG_DEBUG_2("ScreenshotRelay::config", "Capturing at %g fps (dedup %s)", fps, dedup ? "on" : "off")
+		stream->configure(fps, dedup);
+		stream->start(iface);
+
+		LOG_DEBUG("ScreenshotRelay::config", "Adding listener to screenshot stream")
+		stream->add(listener);
+
+	} else {
+		LOG_DEBUG("ScreenshotRelay::config", "Removing listener from screenshot stream")
+		stream->remove(listener);
+	}
+}
+
+}
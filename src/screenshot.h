@@ -0,0 +1,114 @@
+#ifndef __SCREENSHOT_H__
+#define __SCREENSHOT_H__
+
+#include "node-ios-device.h"
+#include "device-interface.h"
+#include "mobiledevice.h"
+#include "relay.h"
+#include <atomic>
+#include <condition_variable>
+#include <CoreFoundation/CoreFoundation.h>
+#include <list>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <uv.h>
+#include <vector>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+class ScreenshotFramePool;
+
+/**
+ * A captured frame. The frame's memory is handed to JavaScript as an external buffer and when the
+ * buffer is garbage collected, the frame is returned to the pool so the next capture can reuse the
+ * allocation.
+ */
+struct ScreenshotFrame {
+	std::vector<uint8_t> data;
+	std::weak_ptr<ScreenshotFramePool> pool;
+};
+
+/**
+ * A pool of reusable frame buffers. Frames are allocated on demand, but released frames are kept
+ * around (up to `capacity`) so that steady state capture doesn't allocate.
+ */
+class ScreenshotFramePool : public std::enable_shared_from_this<ScreenshotFramePool> {
+public:
+	ScreenshotFramePool(size_t capacity) : capacity(capacity) {}
+	~ScreenshotFramePool();
+
+	ScreenshotFrame* acquire();
+	void release(ScreenshotFrame* frame);
+
+private:
+	size_t                        capacity;
+	std::mutex                    poolLock;
+	std::vector<ScreenshotFrame*> available;
+};
+
+/**
+ * Keeps a single `com.apple.screenshotr` service connection open and requests frames on a
+ * background thread at the configured rate. Frames are queued and emitted to the listeners on the
+ * main thread.
+ */
+class ScreenshotStream : public std::enable_shared_from_this<ScreenshotStream> {
+public:
+	ScreenshotStream(napi_env env);
+	virtual ~ScreenshotStream();
+
+	static std::shared_ptr<ScreenshotStream> create(napi_env env);
+
+	void add(napi_value listener);
+	void configure(double fps, bool dedup);
+	void dispatch();
+	void init();
+	void remove(napi_value listener);
+	uint32_t size();
+	void start(std::shared_ptr<DeviceInterface> iface);
+	void stop();
+
+protected:
+	void handshake();
+	void onClose();
+	void onFrame(const uint8_t* data, size_t len);
+	void run();
+
+	std::weak_ptr<ScreenshotStream> self;
+	napi_env                        env;
+	service_conn_t                  connection;
+	bool                            connected;
+	std::thread                     thread;
+	std::atomic<bool>               running;
+	std::mutex                      stateLock;
+	std::condition_variable         stateChange;
+	std::atomic<double>             fps;
+	std::atomic<bool>               dedup;
+	uint64_t                        lastHash;
+	bool                            hasLastHash;
+	std::shared_ptr<ScreenshotFramePool> pool;
+	std::mutex                      listenersLock;
+	std::list<napi_ref>             listeners;
+	std::mutex                      frameQueueLock;
+	uv_async_t                      frameQueueUpdate;
+	std::queue<ScreenshotFrame*>    frameQueue;
+};
+
+/**
+ * Manages the screenshot stream for a device. Like the syslog relay, all listeners share the same
+ * device-side connection.
+ */
+class ScreenshotRelay : public Relay {
+public:
+	ScreenshotRelay(napi_env env, std::weak_ptr<CFRunLoopRef> runloop);
+	void config(uint8_t action, napi_value listener, napi_value nfps, napi_value ndedup, std::shared_ptr<DeviceInterface> iface);
+
+protected:
+	std::shared_ptr<ScreenshotStream> stream;
+};
+
+}
+
+#endif
@@ -0,0 +1,380 @@
+#include "service.h"
+#include <cmath>
+#include <errno.h>
+#include <sstream>
+#include <sys/socket.h>
+
+namespace node_ios_device {
+
+/**
+ * The largest plist message we are willing to receive. Screenshots are the biggest messages we
+ * deal with and even a full resolution iPad Pro PNG is well under this.
+ */
+#define MAX_PLIST_MESSAGE_SIZE (256 * 1024 * 1024)
+
+/**
+ * Reads exactly `len` bytes from the service connection. Returns false if the connection was
+ * closed before all of the bytes were received.
+ */
+bool readFully(service_conn_t connection, void* buffer, size_t len) {
+	uint8_t* p = static_cast<uint8_t*>(buffer);
+
+	while (len > 0) {
+		ssize_t n = ::recv((int)connection, p, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+
+	return true;
+}
+
+/**
+ * Writes all `len` bytes to the service connection. Returns false if the connection was closed.
+ */
+bool writeFully(service_conn_t connection, const void* buffer, size_t len) {
+	const uint8_t* p = static_cast<const uint8_t*>(buffer);
+
+	while (len > 0) {
+		ssize_t n = ::send((int)connection, p, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+
+	return true;
+}
+
+/**
+ * Serializes the plist and appends it to `out` prefixed with its length. This allows several
+ * messages to be sent with a single write.
+ */
+void appendPlist(std::vector<uint8_t>& out, CFPropertyListRef plist, CFPropertyListFormat format) {
+	CFDataRef data = ::CFPropertyListCreateData(kCFAllocatorDefault, plist, format, 0, NULL);
+	if (!data) {
+		throw std::runtime_error("Failed to serialize plist");
+	}
+
+	CFIndex size = ::CFDataGetLength(data);
+	uint32_t len = htonl((uint32_t)size);
+	const uint8_t* bytes = ::CFDataGetBytePtr(data);
+	out.insert(out.end(), (const uint8_t*)&len, (const uint8_t*)&len + sizeof(len));
+	out.insert(out.end(), bytes, bytes + size);
+	::CFRelease(data);
+}
+
+/**
+ * Serializes the plist and writes it to the service connection prefixed with its length.
+ */
+void sendPlist(service_conn_t connection, CFPropertyListRef plist, CFPropertyListFormat format) {
+	std::vector<uint8_t> out;
+	appendPlist(out, plist, format);
+
+	if (!writeFully(connection, out.data(), out.size())) {
+		throw std::runtime_error("Failed to send plist to device");
+	}
+}
+
+/**
+ * Receives a length prefixed plist from the service connection and parses it. The caller owns the
+ * returned plist and must release it. Returns NULL if the connection was closed.
+ *
+ * The raw message is read into `buffer` so that callers that receive in a loop can reuse the same
+ * allocation for every message.
+ */
+CFPropertyListRef recvPlist(service_conn_t connection, std::vector<uint8_t>& buffer) {
+	uint32_t len;
+	if (!readFully(connection, &len, sizeof(len))) {
+		return NULL;
+	}
+
+	len = ntohl(len);
+	if (len == 0 || len > MAX_PLIST_MESSAGE_SIZE) {
+		std::stringstream error;
+		error << "Invalid plist message length (" << len << " bytes)";
+		throw std::runtime_error(error.str());
+	}
+
+	buffer.resize(len);
+	if (!readFully(connection, buffer.data(), len)) {
+		throw std::runtime_error("Connection closed while receiving plist");
+	}
+
+	return parsePlist(buffer.data(), len);
+}
+
+/**
+ * Parses an XML or binary plist. The caller owns the returned plist and must release it.
+ */
+CFPropertyListRef parsePlist(const void* bytes, size_t len) {
+	CFDataRef data = ::CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, (const uint8_t*)bytes, (CFIndex)len, kCFAllocatorNull);
+	CFPropertyListRef plist = ::CFPropertyListCreateWithData(kCFAllocatorDefault, data, kCFPropertyListImmutable, NULL, NULL);
+	::CFRelease(data);
+
+	if (!plist) {
+		throw std::runtime_error("Failed to parse plist received from device");
+	}
+
+	return plist;
+}
+
+/**
+ * Creates a CoreFoundation string from a std string. The caller must release it.
+ */
+CFStringRef createCFString(const std::string& str) {
+	return ::CFStringCreateWithCString(kCFAllocatorDefault, str.c_str(), kCFStringEncodingUTF8);
+}
+
+/**
+ * Copies a CoreFoundation string into a std string. Unlike `CFStringGetCStringPtr()`, this works
+ * for strings that aren't internally stored as UTF-8.
+ */
+std::string cfStringToStdString(CFStringRef str) {
+	if (!str || ::CFGetTypeID(str) != ::CFStringGetTypeID()) {
+		return "";
+	}
+
+	const char* ptr = ::CFStringGetCStringPtr(str, kCFStringEncodingUTF8);
+	if (ptr) {
+		return std::string(ptr);
+	}
+
+	CFIndex size = ::CFStringGetMaximumSizeForEncoding(::CFStringGetLength(str), kCFStringEncodingUTF8) + 1;
+	std::string rval;
+	rval.resize(size);
+	if (!::CFStringGetCString(str, &rval[0], size, kCFStringEncodingUTF8)) {
+		return "";
+	}
+	rval.resize(::strlen(rval.c_str()));
+	return rval;
+}
+
+/**
+ * Converts a CoreFoundation property list value into a JavaScript value. Dates are converted to
+ * milliseconds since the epoch and data is copied into a Buffer.
+ */
+napi_value cfToJS(napi_env env, CFTypeRef value) {
+	napi_value rval;
+
+	if (!value) {
+		NAPI_THROW_RETURN("cfToJS", "ERR_NAPI_GET_NULL", ::napi_get_null(env, &rval), NULL)
+		return rval;
+	}
+
+	CFTypeID type = ::CFGetTypeID(value);
+
+	if (type == ::CFStringGetTypeID()) {
+		std::string str = cfStringToStdString((CFStringRef)value);
+		NAPI_THROW_RETURN("cfToJS", "ERR_NAPI_CREATE_STRING", ::napi_create_string_utf8(env, str.c_str(), str.length(), &rval), NULL)
+
+	} else if (type == ::CFBooleanGetTypeID()) {
+		NAPI_THROW_RETURN("cfToJS", "ERR_NAPI_GET_BOOLEAN", ::napi_get_boolean(env, ::CFBooleanGetValue((CFBooleanRef)value), &rval), NULL)
+
+	} else if (type == ::CFNumberGetTypeID()) {
+		double num = 0;
+		if (::CFNumberIsFloatType((CFNumberRef)value)) {
+			::CFNumberGetValue((CFNumberRef)value, kCFNumberDoubleType, &num);
+		} else {
+			int64_t i = 0;
+			::CFNumberGetValue((CFNumberRef)value, kCFNumberSInt64Type, &i);
+			num = (double)i;
+		}
+		NAPI_THROW_RETURN("cfToJS", "ERR_NAPI_CREATE_DOUBLE", ::napi_create_double(env, num, &rval), NULL)
+
+	} else if (type == ::CFDateGetTypeID()) {
+		double ms = (::CFDateGetAbsoluteTime((CFDateRef)value) + kCFAbsoluteTimeIntervalSince1970) * 1000.0;
+		NAPI_THROW_RETURN("cfToJS", "ERR_NAPI_CREATE_DOUBLE", ::napi_create_double(env, ms, &rval), NULL)
+
+	} else if (type == ::CFDataGetTypeID()) {
+		void* dest;
+		NAPI_THROW_RETURN("cfToJS", "ERR_NAPI_CREATE_BUFFER_COPY", ::napi_create_buffer_copy(env, (size_t)::CFDataGetLength((CFDataRef)value), ::CFDataGetBytePtr((CFDataRef)value), &dest, &rval), NULL)
+
+	} else if (type == ::CFArrayGetTypeID()) {
+		CFIndex count = ::CFArrayGetCount((CFArrayRef)value);
+		NAPI_THROW_RETURN("cfToJS", "ERR_NAPI_CREATE_ARRAY", ::napi_create_array_with_length(env, (size_t)count, &rval), NULL)
+		for (CFIndex i = 0; i < count; ++i) {
+			NAPI_THROW_RETURN("cfToJS", "ERR_NAPI_SET_ELEMENT", ::napi_set_element(env, rval, (uint32_t)i, cfToJS(env, ::CFArrayGetValueAtIndex((CFArrayRef)value, i))), NULL)
+		}
+
+	} else if (type == ::CFDictionaryGetTypeID()) {
+		CFIndex count = ::CFDictionaryGetCount((CFDictionaryRef)value);
+		std::vector<const void*> keys(count);
+		std::vector<const void*> values(count);
+		::CFDictionaryGetKeysAndValues((CFDictionaryRef)value, keys.data(), values.data());
+
+		NAPI_THROW_RETURN("cfToJS", "ERR_NAPI_CREATE_OBJECT", ::napi_create_object(env, &rval), NULL)
+		for (CFIndex i = 0; i < count; ++i) {
+			std::string key = cfStringToStdString((CFStringRef)keys[i]);
+			NAPI_THROW_RETURN("cfToJS", "ERR_NAPI_SET_NAMED_PROPERTY", ::napi_set_named_property(env, rval, key.c_str(), cfToJS(env, values[i])), NULL)
+		}
+
+	} else {
+		NAPI_THROW_RETURN("cfToJS", "ERR_NAPI_GET_UNDEFINED", ::napi_get_undefined(env, &rval), NULL)
+	}
+
+	return rval;
+}
+
+/**
+ * Converts a JavaScript value into a CoreFoundation property list value. The caller owns the
+ * returned value and must release it. Returns NULL for `null`, `undefined`, and functions, which
+ * are omitted from objects and arrays.
+ */
+CFPropertyListRef jsToCF(napi_env env, napi_value value) {
+	napi_valuetype type;
+	if (::napi_typeof(env, value, &type) != napi_ok) {
+		return NULL;
+	}
+
+	if (type == napi_string) {
+		return createCFString(napi_string_to_std_string(env, value));
+	}
+
+	if (type == napi_boolean) {
+		bool b = false;
+		::napi_get_value_bool(env, value, &b);
+		return ::CFRetain(b ? kCFBooleanTrue : kCFBooleanFalse);
+	}
+
+	if (type == napi_number) {
+		double num = 0;
+		::napi_get_value_double(env, value, &num);
+		// NaN, infinities, and values outside the int64 range can't be cast
+		if (std::isfinite(num) && std::fabs(num) < 9.2e18 && num == (double)(int64_t)num) {
+			int64_t i = (int64_t)num;
+			return ::CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &i);
+		}
+		return ::CFNumberCreate(kCFAllocatorDefault, kCFNumberDoubleType, &num);
+	}
+
+	if (type != napi_object) {
+		return NULL;
+	}
+
+	bool is = false;
+
+	if (::napi_is_buffer(env, value, &is) == napi_ok && is) {
+		void* data;
+		size_t len;
+		::napi_get_buffer_info(env, value, &data, &len);
+		return ::CFDataCreate(kCFAllocatorDefault, (const uint8_t*)data, (CFIndex)len);
+	}
+
+	if (::napi_is_array(env, value, &is) == napi_ok && is) {
+		uint32_t count = 0;
+		::napi_get_array_length(env, value, &count);
+		CFMutableArrayRef arr = ::CFArrayCreateMutable(kCFAllocatorDefault, count, &kCFTypeArrayCallBacks);
+		for (uint32_t i = 0; i < count; ++i) {
+			napi_value item;
+			::napi_get_element(env, value, i, &item);
+			CFPropertyListRef cfitem = jsToCF(env, item);
+			if (cfitem) {
+				::CFArrayAppendValue(arr, cfitem);
+				::CFRelease(cfitem);
+			}
+		}
+		return arr;
+	}
+
+	napi_value names;
+	uint32_t count = 0;
+	::napi_get_property_names(env, value, &names);
+	::napi_get_array_length(env, names, &count);
+
+	CFMutableDictionaryRef dict = ::CFDictionaryCreateMutable(kCFAllocatorDefault, count, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	for (uint32_t i = 0; i < count; ++i) {
+		napi_value name, item;
+		::napi_get_element(env, names, i, &name);
+		::napi_get_property(env, value, name, &item);
+		CFPropertyListRef cfitem = jsToCF(env, item);
+		if (cfitem) {
+			CFStringRef key = createCFString(napi_string_to_std_string(env, name));
+			::CFDictionarySetValue(dict, key, cfitem);
+			::CFRelease(key);
+			::CFRelease(cfitem);
+		}
+	}
+	return dict;
+}
+
+/**
+ * Throws if an installation proxy response is an error.
+ */
+static void checkInstallationProxyResponse(CFPropertyListRef msg) {
+	if (!msg || ::CFGetTypeID(msg) != ::CFDictionaryGetTypeID()) {
+		throw std::runtime_error("Unexpected response from installation proxy");
+	}
+
+	CFStringRef error = (CFStringRef)::CFDictionaryGetValue((CFDictionaryRef)msg, CFSTR("Error"));
+	if (error && ::CFGetTypeID(error) == ::CFStringGetTypeID()) {
+		std::stringstream ss;
+		ss << "Installation proxy error: " << cfStringToStdString(error);
+		CFStringRef desc = (CFStringRef)::CFDictionaryGetValue((CFDictionaryRef)msg, CFSTR("ErrorDescription"));
+		if (desc && ::CFGetTypeID(desc) == ::CFStringGetTypeID()) {
+			ss << " (" << cfStringToStdString(desc) << ")";
+		}
+		throw std::runtime_error(ss.str());
+	}
+}
+
+/**
+ * Returns true if the response's status is "Complete".
+ */
+static bool isComplete(CFDictionaryRef msg) {
+	CFStringRef status = (CFStringRef)::CFDictionaryGetValue(msg, CFSTR("Status"));
+	return status && ::CFGetTypeID(status) == ::CFStringGetTypeID() && ::CFStringCompare(status, CFSTR("Complete"), 0) == kCFCompareEqualTo;
+}
+
+/**
+ * Sends a command to the installation proxy and calls `onResponse` with each response until the
+ * command is complete. Browse and Lookup responses carry a page of apps, while Install responses
+ * carry the "Status" and "PercentComplete" of the install. `packagePath` is only sent when given,
+ * relative to the AFC root. The caller owns the connection and must close it.
+ */
+void installationProxyRequest(service_conn_t connection, CFStringRef command, CFDictionaryRef options, std::function<void(CFDictionaryRef)> onResponse, CFStringRef packagePath) {
+	const void* keys[] = { CFSTR("Command"), CFSTR("ClientOptions"), CFSTR("PackagePath") };
+	const void* values[] = { command, options, packagePath };
+	CFDictionaryRef request = ::CFDictionaryCreate(kCFAllocatorDefault, keys, values, packagePath ? 3 : 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	std::vector<uint8_t> buffer;
+
+	try {
+		sendPlist(connection, request, kCFPropertyListXMLFormat_v1_0);
+	} catch (std::exception& e) {
+		::CFRelease(request);
+		throw;
+	}
+	::CFRelease(request);
+
+	while (1) {
+		CFPropertyListRef msg = recvPlist(connection, buffer);
+		if (!msg) {
+			throw std::runtime_error("Installation proxy closed the connection before the command completed");
+		}
+
+		try {
+			checkInstallationProxyResponse(msg);
+			onResponse((CFDictionaryRef)msg);
+		} catch (std::exception& e) {
+			::CFRelease(msg);
+			throw;
+		}
+
+		bool done = isComplete((CFDictionaryRef)msg);
+		::CFRelease(msg);
+		if (done) {
+			break;
+		}
+	}
+}
+
+}
@@ -0,0 +1,36 @@
+#ifndef __SERVICE_H__
+#define __SERVICE_H__
+
+#include "node-ios-device.h"
+#include "mobiledevice.h"
+#include <CoreFoundation/CoreFoundation.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * Helpers for talking to lockdown services that exchange property lists over the service socket.
+ * Each message is a 32-bit big endian length followed by an XML or binary plist.
+ */
+bool readFully(service_conn_t connection, void* buffer, size_t len);
+bool writeFully(service_conn_t connection, const void* buffer, size_t len);
+
+void appendPlist(std::vector<uint8_t>& out, CFPropertyListRef plist, CFPropertyListFormat format = kCFPropertyListBinaryFormat_v1_0);
+void sendPlist(service_conn_t connection, CFPropertyListRef plist, CFPropertyListFormat format = kCFPropertyListBinaryFormat_v1_0);
+CFPropertyListRef recvPlist(service_conn_t connection, std::vector<uint8_t>& buffer);
+CFPropertyListRef parsePlist(const void* data, size_t len);
+
+void installationProxyRequest(service_conn_t connection, CFStringRef command, CFDictionaryRef options, std::function<void(CFDictionaryRef)> onResponse, CFStringRef packagePath = NULL);
+
+CFStringRef createCFString(const std::string& str);
+std::string cfStringToStdString(CFStringRef str);
+napi_value cfToJS(napi_env env, CFTypeRef value);
+CFPropertyListRef jsToCF(napi_env env, napi_value value);
+
+}
+
+#endif
@@ -0,0 +1,149 @@
+#include "syslog-limiter.h"
+#include <algorithm>
+#include <cctype>
+
+namespace node_ios_device {
+
+/**
+ * How far into a line to look for the process name.
+ */
+#define SYSLOG_KEY_SEARCH_LENGTH 256
+
+/**
+ * Finds the sender of a syslog line such as `Jan 12 10:23:00 iPhone SpringBoard(FrontBoard)[58]
+ * <Notice>: ...`, which is the word before the first `[pid]`. Returns false if the line doesn't
+ * have one.
+ */
+bool syslogKey(const std::string& line, SyslogLimitKey by, std::string& key) {
+	size_t limit = std::min<size_t>(line.size(), SYSLOG_KEY_SEARCH_LENGTH);
+
+	for (size_t i = 1; i < limit; ++i) {
+		if (line[i] != '[' || line[i - 1] == ' ') {
+			continue;
+		}
+
+		size_t j = i + 1;
+		while (j < limit && ::isdigit((unsigned char)line[j])) {
+			++j;
+		}
+		if (j == i + 1 || j >= limit || line[j] != ']') {
+			continue;
+		}
+
+		size_t start = line.rfind(' ', i - 1);
+		start = start == std::string::npos ? 0 : start + 1;
+
+		size_t end = i;
+		if (by == SyslogLimitByProcess) {
+			end = std::min(end, line.find('(', start));
+		}
+
+		key.assign(line, start, end - start);
+		return !key.empty();
+	}
+
+	return false;
+}
+
+/**
+ * Formats a count with thousands separators.
+ */
+static std::string formatCount(uint64_t count) {
+	std::string digits = std::to_string(count);
+	for (size_t i = digits.size(); i > 3; i -= 3) {
+		digits.insert(i - 3, ",");
+	}
+	return digits;
+}
+
+/**
+ * Takes a token from the bucket of the line's key. Returns false if the key is over its limit and
+ * the line isn't one of the sampled lines.
+ */
+bool SyslogLimiter::admit(const std::string& line, std::chrono::steady_clock::time_point now) {
+	if (!enabled) {
+		return true;
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	std::string key;
+	if (!syslogKey(line, config.key, key)) {
+		return true;
+	}
+
+	auto rate = config.rates.find(key);
+	uint32_t limit = rate == config.rates.end() ? config.rate : rate->second;
+	if (!limit) {
+		return true;
+	}
+
+	auto it = keys.find(key);
+	if (it == keys.end()) {
+		it = keys.emplace(key, SyslogLimitState()).first;
+		it->second.bucket.configure(limit);
+		it->second.bucket.refill(now);
+		it->second.bucket.tokens = (double)limit;
+	} else if (it->second.bucket.rate != limit) {
+		it->second.bucket.configure(limit);
+	}
+
+	SyslogLimitState& state = it->second;
+	state.bucket.refill(now);
+	if (state.bucket.tokens >= 1) {
+		state.bucket.tokens -= 1;
+		return true;
+	}
+
+	if (config.sample && ++state.overLimit % config.sample == 0) {
+		++state.sampled;
+		return true;
+	}
+
+	++state.suppressed;
+	return false;
+}
+
+/**
+ * Sets the rate limits. Every key starts over with a full bucket.
+ */
+void SyslogLimiter::configure(const SyslogLimitConfig& config) {
+	std::lock_guard<std::mutex> guard(lock);
+	this->config = config;
+	keys.clear();
+	lastSummary = std::chrono::steady_clock::now();
+	enabled = config.rate > 0 || !config.rates.empty();
+	LOG_DEBUG_2("SyslogLimiter::configure", "Limiting syslog to %u lines/s with %ld overrides", config.rate, (long)config.rates.size())
+}
+
+/**
+ * Once the summary interval has passed, adds a line for each key that had lines suppressed since
+ * the last summary, such as "suppressed 12,340 lines from wifid". When `force` is set, the summary
+ * is added right away, such as when the syslog ends.
+ */
+void SyslogLimiter::summarize(std::chrono::steady_clock::time_point now, std::vector<std::string>& summaries, bool force) {
+	if (!enabled) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (!force && now - lastSummary < config.summaryInterval) {
+		return;
+	}
+	lastSummary = now;
+
+	for (auto& it : keys) {
+		SyslogLimitState& state = it.second;
+		if (state.suppressed) {
+			std::string summary = "node-ios-device: suppressed " + formatCount(state.suppressed) + " line" + (state.suppressed == 1 ? "" : "s") + " from " + it.first;
+			if (state.sampled) {
+				summary += " (" + formatCount(state.sampled) + " sampled)";
+			}
+			summaries.push_back(summary);
+		}
+		state.suppressed = 0;
+		state.sampled = 0;
+	}
+}
+
+}
@@ -0,0 +1,84 @@
+#ifndef __SYSLOG_LIMITER_H__
+#define __SYSLOG_LIMITER_H__
+
+#include "node-ios-device.h"
+#include "qos.h"
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * The default time in milliseconds between summaries of the suppressed lines.
+ */
+#define SYSLOG_LIMIT_SUMMARY_INTERVAL 5000
+
+/**
+ * What syslog lines are rate limited by. `SyslogLimitByProcess` uses the process name, such as
+ * `SpringBoard`. `SyslogLimitBySender` also includes the library that logged the line, such as
+ * `SpringBoard(FrontBoard)`.
+ */
+enum SyslogLimitKey { SyslogLimitByProcess, SyslogLimitBySender };
+
+/**
+ * The syslog rate limits in lines per second for each key. A rate of zero is unlimited. When
+ * `sample` is set, every `sample`th line over the limit is let through anyway.
+ */
+struct SyslogLimitConfig {
+	SyslogLimitConfig() :
+		rate(0),
+		key(SyslogLimitByProcess),
+		sample(0),
+		summaryInterval(SYSLOG_LIMIT_SUMMARY_INTERVAL) {}
+	uint32_t                        rate;
+	std::map<std::string, uint32_t> rates;
+	SyslogLimitKey                  key;
+	uint32_t                        sample;
+	std::chrono::milliseconds       summaryInterval;
+};
+
+/**
+ * The bucket of one key and how many of its lines went over the limit since the last summary.
+ */
+struct SyslogLimitState {
+	SyslogLimitState() : overLimit(0), suppressed(0), sampled(0) {}
+	TokenBucket bucket;
+	uint64_t    overLimit;
+	uint64_t    suppressed;
+	uint64_t    sampled;
+};
+
+/**
+ * Rate limits syslog lines with a token bucket per process name or sender so that a daemon
+ * flooding the syslog doesn't drown out everything else. Lines are admitted on the run loop thread
+ * before they're queued, so suppressed lines never reach JavaScript. Lines that don't look like
+ * syslog lines are always admitted.
+ */
+class SyslogLimiter {
+public:
+	SyslogLimiter() : enabled(false), lastSummary(std::chrono::steady_clock::now()) {}
+
+	bool admit(const std::string& line, std::chrono::steady_clock::time_point now);
+	void configure(const SyslogLimitConfig& config);
+	bool isEnabled() const { return enabled; }
+	void summarize(std::chrono::steady_clock::time_point now, std::vector<std::string>& summaries, bool force = false);
+
+private:
+	std::mutex                              lock;
+	SyslogLimitConfig                       config;
+	std::atomic<bool>                       enabled;
+	std::map<std::string, SyslogLimitState> keys;
+	std::chrono::steady_clock::time_point   lastSummary;
+};
+
+bool syslogKey(const std::string& line, SyslogLimitKey by, std::string& key);
+
+}
+
+#endif
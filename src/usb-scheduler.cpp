@@ -0,0 +1,195 @@
+#include "usb-scheduler.h"
+#include <algorithm>
+
+namespace node_ios_device {
+
+/**
+ * How much better a neighboring cap's throughput has to be before the cap moves to it, so that
+ * noise doesn't move the cap.
+ */
+#define USB_SCHEDULER_IMPROVEMENT 1.05
+
+/**
+ * How many adjustments the cap stays put for before its neighbors are probed again.
+ */
+#define USB_SCHEDULER_PROBE_WINDOWS 8
+
+/**
+ * How often a transfer waiting for a slot checks whether it has been cancelled.
+ */
+#define USB_SCHEDULER_CANCEL_POLL std::chrono::milliseconds(100)
+
+UsbScheduler::UsbScheduler(uint32_t maxCap) : maxCap(std::max<uint32_t>(maxCap, 1)) {}
+
+UsbScheduler& UsbScheduler::shared() {
+	static UsbScheduler scheduler;
+	return scheduler;
+}
+
+/**
+ * Returns the location id of the hub a device is plugged into. The top byte of a USB location id is
+ * the bus and each following nibble is the port on the next tier, so clearing the device's own port
+ * yields its parent. Devices plugged into the same root port of a controller share the bus.
+ */
+uint32_t UsbScheduler::hubOf(uint32_t locationId) {
+	for (uint32_t shift = 0; shift < 24; shift += 4) {
+		if (locationId & (0xfu << shift)) {
+			return locationId & ~(0xfu << shift);
+		}
+	}
+	return locationId;
+}
+
+/**
+ * Waits for a free transfer slot on the hub and returns the number of transfers running on the hub
+ * including this one. Throws `OperationCancelled` if `cancel` is tripped while waiting.
+ */
+uint32_t UsbScheduler::acquire(uint32_t hub, uint32_t initialCap, const CancelToken* cancel) {
+	std::unique_lock<std::mutex> guard(lock);
+	Hub& state = hubState(hub, initialCap);
+
+	if (state.active >= state.cap) {
+		++state.waiting;
+		while (state.active >= state.cap) {
+			if (cancel && cancel->isCancelled()) {
+				--state.waiting;
+				throw OperationCancelled();
+			}
+			released.wait_for(guard, USB_SCHEDULER_CANCEL_POLL);
+		}
+		--state.waiting;
+	}
+
+	return ++state.active;
+}
+
+/**
+ * Returns the hub's state, starting it at the initial cap the first time the hub is seen. Must be
+ * called with the lock held.
+ */
+UsbScheduler::Hub& UsbScheduler::hubState(uint32_t hub, uint32_t initialCap) {
+	Hub& state = hubs[hub];
+	if (state.cap == 0) {
+		state.cap = std::min<uint32_t>(std::max<uint32_t>(initialCap, 1), maxCap);
+		LOG_DEBUG_2("UsbScheduler::hubState", "Hub 0x%08x starts with %u concurrent transfers", hub, state.cap)
+	}
+	return state;
+}
+
+/**
+ * Takes a transfer slot without waiting and returns the number of transfers running on the hub
+ * including this one, or 0 if the hub is full. `backlog` is how many transfers the caller has
+ * waiting behind this one, which counts as waiting transfers until the next call.
+ */
+uint32_t UsbScheduler::tryAcquire(uint32_t hub, uint32_t initialCap, uint32_t backlog) {
+	std::lock_guard<std::mutex> guard(lock);
+	Hub& state = hubState(hub, initialCap);
+	if (state.active >= state.cap) {
+		state.backlog = backlog + 1;
+		return 0;
+	}
+	state.backlog = backlog;
+	return ++state.active;
+}
+
+/**
+ * Returns the hub's current cap.
+ */
+uint32_t UsbScheduler::cap(uint32_t hub) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = hubs.find(hub);
+	return it == hubs.end() ? 0 : it->second.cap;
+}
+
+/**
+ * Frees a transfer slot. `concurrency` is the value `acquire()` returned. Transfers that failed are
+ * released with 0 bytes and don't count towards the throughput.
+ */
+void UsbScheduler::release(uint32_t hub, uint64_t bytes, double seconds, uint32_t concurrency) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		Hub& state = hubs[hub];
+		--state.active;
+
+		// only transfers that started with the hub at its cap tell how the cap performs, which
+		// leaves out the ramp up and transfers started under a previous cap
+		if (bytes > 0 && seconds > 0 && concurrency == state.cap) {
+			state.bytes += bytes;
+			state.seconds += seconds;
+			state.concurrency += concurrency;
+			if (++state.completed >= state.cap) {
+				adapt(hub, state);
+			}
+		}
+	}
+
+	released.notify_all();
+}
+
+/**
+ * Adjusts the hub's cap from the transfers completed since the last adjustment. The aggregate
+ * throughput is the average rate of a transfer times the average number of transfers that ran
+ * alongside it. Must be called with the lock held.
+ *
+ * A lower cap that did better wins first, since contention is what the cap guards against. Then an
+ * unmeasured higher cap is probed while transfers are waiting, then a higher cap that did better is
+ * taken, and finally an unmeasured lower cap is probed.
+ */
+void UsbScheduler::adapt(uint32_t hub, Hub& state) {
+	double estimate = (double)state.bytes / state.seconds * ((double)state.concurrency / state.completed);
+	uint32_t cap = state.cap;
+	state.throughput[cap] = estimate;
+
+	if (++state.windows >= USB_SCHEDULER_PROBE_WINDOWS) {
+		state.throughput.erase(cap - 1);
+		state.throughput.erase(cap + 1);
+		state.windows = 0;
+	}
+
+	// -1 means the neighbor hasn't been measured and 0 that it's out of reach
+	auto measured = [&state](uint32_t n) {
+		auto it = state.throughput.find(n);
+		return it == state.throughput.end() ? -1.0 : it->second;
+	};
+	double below = cap > 1 ? measured(cap - 1) : 0;
+	double above = cap < maxCap && (state.waiting > 0 || state.backlog > 0) ? measured(cap + 1) : 0;
+
+	if (below > estimate * USB_SCHEDULER_IMPROVEMENT) {
+		--cap;
+	} else if (above < 0 || above > estimate * USB_SCHEDULER_IMPROVEMENT) {
+		++cap;
+	} else if (below < 0) {
+		--cap;
+	}
+
+	if (cap != state.cap) {
+		LOG_DEBUG_4("UsbScheduler::adapt", "Hub 0x%08x at %.1f MB/s, cap %u -> %u", hub, estimate / 1e6, state.cap, cap)
+		state.cap = cap;
+		state.windows = 0;
+	}
+
+	state.bytes = 0;
+	state.seconds = 0;
+	state.concurrency = 0;
+	state.completed = 0;
+}
+
+UsbSlot::UsbSlot(uint32_t hub, uint32_t initialCap, const CancelToken* cancel, UsbScheduler& scheduler) :
+	scheduler(scheduler),
+	hub(hub),
+	concurrency(hub ? scheduler.acquire(hub, initialCap, cancel) : 0),
+	bytes(0),
+	start(std::chrono::steady_clock::now()) {}
+
+UsbSlot::~UsbSlot() {
+	if (hub) {
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		scheduler.release(hub, bytes, seconds, concurrency);
+	}
+}
+
+void UsbSlot::finish(uint64_t bytes) {
+	this->bytes = bytes;
+}
+
+}
@@ -0,0 +1,102 @@
+#ifndef __USB_SCHEDULER_H__
+#define __USB_SCHEDULER_H__
+
+#include "node-ios-device.h"
+#include "cancel-token.h"
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+
+namespace node_ios_device {
+
+LOG_DEBUG_EXTERN_VARS
+
+/**
+ * The number of concurrent transfers a hub starts with. Devices on a USB 2 hub start with
+ * `USB_SCHEDULER_INITIAL_CAP` and devices on a faster bus with twice that.
+ */
+#define USB_SCHEDULER_INITIAL_CAP 3
+#define USB_SCHEDULER_MAX_CAP     16
+
+/**
+ * The interface speed in Kbit/s reported by MobileDevice for a USB 2 high speed link.
+ */
+#define USB_HIGH_SPEED 491520
+
+/**
+ * Caps the number of concurrent bulk transfers to devices that share a USB hub, since past a point
+ * more transfers only add contention and the batch as a whole gets slower.
+ *
+ * Each hub's cap climbs towards the concurrency with the highest observed throughput. Once as many
+ * transfers as the cap have completed since the last adjustment, the hub's aggregate throughput is
+ * estimated from their average rate and concurrency and remembered for the cap. The cap then moves
+ * to a neighboring cap that did noticeably better, or probes a neighbor that hasn't been measured
+ * yet. A higher cap is only probed while transfers are waiting. After the cap has stayed put for a
+ * while, the neighbors are forgotten and probed again, so the cap follows the hub as devices come
+ * and go.
+ *
+ * Throughput is supplied by the caller, so a topology can be simulated by reporting modeled
+ * transfer times. An event driven simulation can't block, so it uses `tryAcquire()` and reports
+ * its backlog instead.
+ */
+class UsbScheduler {
+public:
+	UsbScheduler(uint32_t maxCap = USB_SCHEDULER_MAX_CAP);
+
+	static UsbScheduler& shared();
+	static uint32_t hubOf(uint32_t locationId);
+
+	uint32_t acquire(uint32_t hub, uint32_t initialCap = USB_SCHEDULER_INITIAL_CAP, const CancelToken* cancel = NULL);
+	uint32_t cap(uint32_t hub);
+	void release(uint32_t hub, uint64_t bytes, double seconds, uint32_t concurrency);
+	uint32_t tryAcquire(uint32_t hub, uint32_t initialCap, uint32_t backlog);
+
+private:
+	struct Hub {
+		Hub() : cap(0), active(0), waiting(0), backlog(0), bytes(0), seconds(0), concurrency(0), completed(0), windows(0) {}
+		uint32_t cap;
+		uint32_t active;
+		uint32_t waiting;
+		uint32_t backlog;
+		uint64_t bytes;
+		double   seconds;
+		uint64_t concurrency;
+		uint32_t completed;
+		uint32_t windows;
+		std::map<uint32_t, double> throughput;
+	};
+
+	void adapt(uint32_t hub, Hub& state);
+	Hub& hubState(uint32_t hub, uint32_t initialCap);
+
+	uint32_t                maxCap;
+	std::mutex              lock;
+	std::condition_variable released;
+	std::map<uint32_t, Hub> hubs;
+};
+
+/**
+ * Holds one of a hub's transfer slots for the lifetime of the object. Transfers over Wi-Fi, where
+ * the hub is 0, aren't limited. Call `finish()` with the number of bytes transferred once the
+ * transfer succeeds so the throughput is counted towards the hub's cap. Waiting for a slot throws
+ * `OperationCancelled` once `cancel` is tripped.
+ */
+class UsbSlot {
+public:
+	UsbSlot(uint32_t hub, uint32_t initialCap, const CancelToken* cancel = NULL, UsbScheduler& scheduler = UsbScheduler::shared());
+	~UsbSlot();
+
+	void finish(uint64_t bytes);
+
+private:
+	UsbScheduler&                         scheduler;
+	uint32_t                              hub;
+	uint32_t                              concurrency;
+	uint64_t                              bytes;
+	std::chrono::steady_clock::time_point start;
+};
+
+}
+
+#endif
@@ -0,0 +1,190 @@
+#include "utf8.h"
+
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	#include <arm_neon.h>
+#endif
+
+namespace node_ios_device {
+
+/**
+ * Returns the number of leading bytes that are ASCII. Sixteen bytes are checked at a time.
+ */
+size_t asciiPrefix(const char* data, size_t len) {
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		int high = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(data + i)));
+		if (high) {
+			return i + __builtin_ctz(high);
+		}
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 16 <= len; i += 16) {
+		if (vmaxvq_u8(vld1q_u8((const uint8_t*)data + i)) >= 0x80) {
+			break;
+		}
+	}
+#endif
+
+	while (i < len && (unsigned char)data[i] < 0x80) {
+		++i;
+	}
+	return i;
+}
+
+/**
+ * Checks the multibyte sequence starting at `p`. Returns its length if it's valid, otherwise 0 and
+ * sets `invalid` to the length of the maximal subpart to replace, which is `avail` if the sequence
+ * is only cut short.
+ */
+static size_t checkSequence(const unsigned char* p, size_t avail, size_t* invalid) {
+	unsigned char c = p[0];
+	if (c < 0xC2 || c > 0xF4) {
+		*invalid = 1;
+		return 0;
+	}
+
+	size_t n = c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+	unsigned char lower = c == 0xE0 ? 0xA0 : c == 0xF0 ? 0x90 : 0x80;
+	unsigned char upper = c == 0xED ? 0x9F : c == 0xF4 ? 0x8F : 0xBF;
+
+	for (size_t k = 1; k < n; ++k) {
+		if (k >= avail || p[k] < lower || p[k] > upper) {
+			*invalid = k;
+			return 0;
+		}
+		lower = 0x80;
+		upper = 0xBF;
+	}
+
+	return n;
+}
+
+/**
+ * Appends `data` to `out`, replacing each invalid UTF-8 sequence with U+FFFD the way the WHATWG
+ * decoder does. ASCII runs are skipped in blocks and everything is copied once. Returns false if
+ * anything was replaced.
+ */
+bool decodeUtf8(const char* data, size_t len, std::string& out) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	size_t start = 0;
+	size_t i = 0;
+	bool valid = true;
+
+	out.reserve(out.size() + len);
+
+	while (true) {
+		i += asciiPrefix(data + i, len - i);
+		if (i >= len) {
+			break;
+		}
+
+		size_t invalid = 0;
+		size_t n = checkSequence(bytes + i, len - i, &invalid);
+		if (n) {
+			i += n;
+		} else {
+			out.append(data + start, i - start);
+			out.append(UTF8_REPLACEMENT);
+			i += invalid;
+			start = i;
+			valid = false;
+		}
+	}
+
+	out.append(data + start, len - start);
+	return valid;
+}
+
+/**
+ * Returns the number of bytes at the end of `data` that begin a valid UTF-8 sequence but are cut
+ * off before it ends, which is at most 3.
+ */
+size_t incompleteUtf8Tail(const char* data, size_t len) {
+	const unsigned char* bytes = (const unsigned char*)data;
+
+	for (size_t back = 1; back <= 3 && back <= len; ++back) {
+		unsigned char c = bytes[len - back];
+		if ((c & 0xC0) == 0x80) {
+			continue;
+		}
+		size_t invalid = 0;
+		if (c >= 0xC2 && c <= 0xF4 && !checkSequence(bytes + len - back, back, &invalid) && invalid == back) {
+			return back;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+/**
+ * Returns the length of the line at the start of `data`, which ends at a null, carriage return, or
+ * newline, or the end of the data. Sets `ascii` to whether the line is all ASCII and `escaped`, if
+ * given, to whether it contains a backslash. Sixteen bytes are checked at a time.
+ */
+size_t scanLine(const char* data, size_t len, bool* ascii, bool* escaped) {
+	size_t i = 0;
+	bool high = false;
+	bool backslash = false;
+
+#if defined(__SSE2__)
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i carriageReturn = _mm_set1_epi8('\r');
+	const __m128i null = _mm_setzero_si128();
+	const __m128i escape = _mm_set1_epi8('\\');
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+		int breaks = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, carriageReturn)), _mm_cmpeq_epi8(v, null)));
+		int highBits = _mm_movemask_epi8(v);
+		int escapes = _mm_movemask_epi8(_mm_cmpeq_epi8(v, escape));
+		if (breaks) {
+			int pos = __builtin_ctz(breaks);
+			int before = (1 << pos) - 1;
+			*ascii = !high && (highBits & before) == 0;
+			if (escaped) {
+				*escaped = backslash || (escapes & before) != 0;
+			}
+			return i + pos;
+		}
+		high = high || highBits;
+		backslash = backslash || escapes;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const uint8x16_t newline = vdupq_n_u8('\n');
+	const uint8x16_t carriageReturn = vdupq_n_u8('\r');
+	const uint8x16_t escape = vdupq_n_u8('\\');
+
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t*)data + i);
+		uint8x16_t breaks = vorrq_u8(vorrq_u8(vceqq_u8(v, newline), vceqq_u8(v, carriageReturn)), vceqzq_u8(v));
+		if (vmaxvq_u8(breaks)) {
+			// the scalar loop finds the break within this block
+			break;
+		}
+		high = high || vmaxvq_u8(v) >= 0x80;
+		backslash = backslash || vmaxvq_u8(vceqq_u8(v, escape));
+	}
+#endif
+
+	for (; i < len; ++i) {
+		unsigned char c = (unsigned char)data[i];
+		if (c == '\n' || c == '\r' || c == '\0') {
+			break;
+		}
+		high = high || c >= 0x80;
+		backslash = backslash || c == '\\';
+	}
+
+	*ascii = !high;
+	if (escaped) {
+		*escaped = backslash;
+	}
+	return i;
+}
+
+}
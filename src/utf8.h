@@ -0,0 +1,21 @@
+#ifndef __UTF8_H__
+#define __UTF8_H__
+
+#include <cstddef>
+#include <string>
+
+namespace node_ios_device {
+
+/**
+ * The replacement character U+FFFD encoded as UTF-8.
+ */
+#define UTF8_REPLACEMENT "\xEF\xBF\xBD"
+
+size_t asciiPrefix(const char* data, size_t len);
+bool decodeUtf8(const char* data, size_t len, std::string& out);
+size_t incompleteUtf8Tail(const char* data, size_t len);
+size_t scanLine(const char* data, size_t len, bool* ascii, bool* escaped = NULL);
+
+}
+
+#endif
@@ -0,0 +1,128 @@
+#include "vis.h"
+#include <cstring>
+
+namespace node_ios_device {
+
+/**
+ * Returns the byte a vis(3) control character such as the `[` in `\^[` stands for, or -1 if it
+ * isn't one.
+ */
+static int unvisControl(unsigned char c) {
+	if (c == '?') {
+		return 0x7F;
+	}
+	return c >= '@' && c <= '_' ? c - '@' : -1;
+}
+
+/**
+ * Decodes the byte at the start of `p`, which is either a literal byte or one of the vis(3) escapes
+ * the syslog relay uses: `\\`, `\^X` for control characters, and `\M-x`, `\M-^X`, or `\M^X` for
+ * bytes with the high bit set. Returns the number of bytes it took, or 0 if `avail` ends partway
+ * into an escape. A backslash that doesn't start an escape is taken literally.
+ */
+static size_t unvisOne(const unsigned char* p, size_t avail, unsigned char* byte) {
+	*byte = p[0];
+	if (p[0] != '\\') {
+		return 1;
+	}
+
+	if (avail < 2) {
+		return 0;
+	}
+
+	size_t i = 1;
+	unsigned char meta = 0;
+
+	if (p[i] == '\\') {
+		return 2;
+	}
+
+	if (p[i] == 'M') {
+		if (++i >= avail) {
+			return 0;
+		}
+		meta = 0x80;
+		if (p[i] == '-') {
+			if (++i >= avail) {
+				return 0;
+			}
+			if (p[i] != '^') {
+				if (p[i] < 0x20 || p[i] > 0x7E) {
+					return 1;
+				}
+				*byte = meta | p[i];
+				return i + 1;
+			}
+		} else if (p[i] != '^') {
+			return 1;
+		}
+	} else if (p[i] != '^') {
+		return 1;
+	}
+
+	// `p[i]` is the `^` of a control character
+	if (++i >= avail) {
+		return 0;
+	}
+	int c = unvisControl(p[i]);
+	if (c < 0) {
+		return 1;
+	}
+	*byte = meta | (unsigned char)c;
+	return i + 1;
+}
+
+/**
+ * Appends `data` to `out` with its vis(3) escapes decoded. Runs without a backslash are copied as
+ * is. Sets `high` if an escape decoded to a byte with the high bit set; literal bytes aren't
+ * checked. Stops before an escape cut off by the end of the data and returns the number of bytes
+ * decoded.
+ */
+size_t unvis(const char* data, size_t len, std::string& out, bool* high) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	size_t i = 0;
+
+	out.reserve(out.size() + len);
+
+	while (i < len) {
+		const char* backslash = (const char*)::memchr(data + i, '\\', len - i);
+		size_t run = backslash ? backslash - (data + i) : len - i;
+		out.append(data + i, run);
+		i += run;
+		if (i >= len) {
+			break;
+		}
+
+		unsigned char byte;
+		size_t n = unvisOne(bytes + i, len - i, &byte);
+		if (n == 0) {
+			break;
+		}
+		out += (char)byte;
+		*high = *high || byte >= 0x80;
+		i += n;
+	}
+
+	return i;
+}
+
+/**
+ * Returns the offset in `data` at which the vis(3) decoded byte at index `count` begins.
+ */
+size_t unvisOffset(const char* data, size_t len, size_t count) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	size_t i = 0;
+
+	for (; count > 0 && i < len; --count) {
+		unsigned char byte;
+		size_t n = unvisOne(bytes + i, len - i, &byte);
+		if (n == 0) {
+			break;
+		}
+		i += n;
+	}
+
+	return i;
+}
+
+}
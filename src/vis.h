@@ -0,0 +1,14 @@
+#ifndef __VIS_H__
+#define __VIS_H__
+
+#include <cstddef>
+#include <string>
+
+namespace node_ios_device {
+
+size_t unvis(const char* data, size_t len, std::string& out, bool* high);
+size_t unvisOffset(const char* data, size_t len, size_t count);
+
+}
+
+#endif
@@ -0,0 +1,91 @@
+/**
+ * A stand-in lockdownd for testing the native lockdown client. It implements just enough of the
+ * protocol to start a TLS session and start a TLS service. It runs in a child process because the
+ * client is synchronous and would block this server if they shared an event loop.
+ */
+
+const fs = require('fs');
+const iosDevice = require('../../../src/index');
+const net = require('net');
+const path = require('path');
+const tls = require('tls');
+
+const credentials = {
+	cert: fs.readFileSync(path.join(__dirname, 'device.crt')),
+	key: fs.readFileSync(path.join(__dirname, 'device.key'))
+};
+const secureContext = tls.createSecureContext(credentials);
+
+/**
+ * Calls `onMessage` for each length prefixed plist received on the socket.
+ */
+function readPlists(socket, onMessage) {
+	let pending = Buffer.alloc(0);
+	socket.on('data', chunk => {
+		pending = Buffer.concat([ pending, chunk ]);
+		while (pending.length >= 4 && pending.length >= 4 + pending.readUInt32BE(0)) {
+			const len = pending.readUInt32BE(0);
+			const msg = iosDevice.plist.parse(pending.slice(4, 4 + len));
+			pending = pending.slice(4 + len);
+			onMessage(msg);
+		}
+	});
+	socket.on('error', () => {});
+}
+
+function writePlist(socket, obj) {
+	const body = iosDevice.plist.encode(obj, { format: 'xml' });
+	const header = Buffer.alloc(4);
+	header.writeUInt32BE(body.length, 0);
+	socket.write(Buffer.concat([ header, body ]));
+}
+
+const service = tls.createServer({ ...credentials, requestCert: true, rejectUnauthorized: false }, socket => {
+	socket.on('error', () => {});
+	socket.end();
+});
+
+const lockdownd = net.createServer(socket => {
+	let conn = socket;
+
+	const onMessage = msg => {
+		switch (msg.Request) {
+			case 'QueryType':
+				return writePlist(conn, { Request: msg.Request, Type: 'com.apple.mobile.lockdown' });
+
+			case 'GetValue':
+				return writePlist(conn, { Request: msg.Request, Value: msg.Key === 'ProductVersion' ? '13.2' : { ProductVersion: '13.2' } });
+
+			case 'StartSession':
+				if (msg.HostID !== 'HOST-ID') {
+					return writePlist(conn, { Request: msg.Request, Error: 'InvalidHostID' });
+				}
+				writePlist(conn, { Request: msg.Request, SessionID: 'SESSION-ID', EnableSessionSSL: true });
+				conn = new tls.TLSSocket(socket, { isServer: true, secureContext, requestCert: true, rejectUnauthorized: false });
+				return readPlists(conn, onMessage);
+
+			case 'StopSession':
+				return writePlist(conn, { Request: msg.Request });
+
+			case 'StartService':
+				if (msg.Service !== 'com.example.service') {
+					return writePlist(conn, { Request: msg.Request, Error: 'InvalidService' });
+				}
+				return writePlist(conn, { Request: msg.Request, Port: service.address().port, EnableServiceSSL: true });
+		}
+	};
+
+	readPlists(socket, msg => {
+		if (conn === socket) {
+			onMessage(msg);
+		}
+	});
+});
+
+service.listen(0, '127.0.0.1', () => {
+	lockdownd.listen(0, '127.0.0.1', () => {
+		process.send({ port: lockdownd.address().port });
+	});
+});
+
+process.on('disconnect', () => process.exit(0));
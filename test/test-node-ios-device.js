@@ -1,8 +1,13 @@
 const fs = require('fs');
 const iosDevice = require('../src/index');
+const os = require('os');
 const path = require('path');
+const zlib = require('zlib');
 const { expect } = require('chai');
-const { spawnSync } = require('child_process');
+const { EventEmitter } = require('events');
+const { fork, spawnSync } = require('child_process');
+// the test hooks are only in the test addon
+const binding = require(path.resolve(__dirname, '..', 'build', 'Release', 'test', 'node_ios_device_test.node'));
 const appPath = path.resolve(__dirname, 'TestApp', 'build', 'Release-iphoneos', 'TestApp.app');
 
 let udid = null;
@@ -62,6 +67,28 @@ if (usbUDID) {
 	usbAppIt.skip = it.skip;
 }
 
+/**
+ * A minimal stand-in for `AbortController`, which Node only provides as a global starting with 15.
+ */
+function createAbortController() {
+	const emitter = new EventEmitter();
+	const signal = {
+		aborted: false,
+		addEventListener: (name, listener) => emitter.once(name, listener),
+		removeEventListener: (name, listener) => emitter.removeListener(name, listener)
+	};
+
+	return {
+		signal,
+		abort() {
+			if (!signal.aborted) {
+				signal.aborted = true;
+				emitter.emit('abort');
+			}
+		}
+	};
+}
+
 describe('devices()', () => {
 	it('should get all connected devices', () => {
 		const devices = iosDevice.list();
@@ -181,6 +208,275 @@ describe('install()', () => {
 
 		iosDevice.install(udid, appPath);
 	});
+
+	appit('should skip installing the test app if unchanged', function () {
+		this.timeout(30000);
+		this.slow(15000);
+
+		const recordDir = fs.mkdtempSync(path.join(os.tmpdir(), 'node-ios-device-installs-'));
+		expect(iosDevice.install(udid, appPath, { recordDir, skipIfUnchanged: true }).skipped).to.equal(false);
+		expect(iosDevice.install(udid, appPath, { recordDir, skipIfUnchanged: true }).skipped).to.equal(true);
+	});
+});
+
+describe('installAll()', () => {
+	it('should error if udid is invalid', () => {
+		expect(() => {
+			iosDevice.installAll();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should error if app paths are invalid', () => {
+		expect(() => {
+			iosDevice.installAll('foo', []);
+		}).to.throw(TypeError, 'Expected app paths to be a non-empty array of strings');
+
+		expect(() => {
+			iosDevice.installAll('foo', [ 123 ]);
+		}).to.throw(TypeError, 'Expected app paths to be a non-empty array of strings');
+
+		expect(() => {
+			iosDevice.installAll('foo', [ __dirname ]);
+		}).to.throw(Error, `Invalid app: ${__dirname}`);
+	});
+
+	it('should fingerprint empty directories', () => {
+		const dir = fs.mkdtempSync(path.join(os.tmpdir(), 'node-ios-device-fingerprint-'));
+		fs.writeFileSync(path.join(dir, 'Info.plist'), 'foo');
+		const before = binding.fingerprint(dir);
+		expect(before).to.match(/^[0-9a-f]{16}$/);
+
+		fs.mkdirSync(path.join(dir, 'empty'));
+		const after = binding.fingerprint(dir);
+		expect(after).to.not.equal(before);
+
+		fs.rmdirSync(path.join(dir, 'empty'));
+		expect(binding.fingerprint(dir)).to.equal(before);
+
+		expect(() => {
+			binding.fingerprint(path.join(dir, 'missing'));
+		}).to.throw(Error, 'Failed to read directory');
+	});
+
+	appit('should install the test app twice', function () {
+		this.timeout(30000);
+		this.slow(30000);
+
+		const results = iosDevice.installAll(udid, [ appPath, appPath ]);
+		expect(results).to.have.lengthOf(2);
+		for (const result of results) {
+			expect(result.appPath).to.equal(appPath);
+			expect(result.error).to.be.undefined;
+		}
+	});
+});
+
+describe('queueInstall()', () => {
+	it('should error if udid is invalid', () => {
+		expect(() => {
+			iosDevice.queueInstall();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should error if app path is invalid', () => {
+		expect(() => {
+			iosDevice.queueInstall('foo');
+		}).to.throw(TypeError, 'Expected app path to be a non-empty string');
+
+		expect(() => {
+			iosDevice.queueInstall('foo', __dirname);
+		}).to.throw(Error, `Invalid app: ${__dirname}`);
+	});
+
+	it('should error if signal is invalid', () => {
+		expect(() => {
+			iosDevice.queueInstall('foo', __dirname, { signal: 'bar' });
+		}).to.throw(TypeError, 'Expected signal to be an AbortSignal');
+	});
+
+	it('should error if progress options are invalid', () => {
+		expect(() => {
+			iosDevice.queueInstall('foo', __dirname, { onProgress: 'bar' });
+		}).to.throw(TypeError, 'Expected progress callback to be a function');
+
+		expect(() => {
+			iosDevice.queueInstall('foo', __dirname, { progressInterval: -1 });
+		}).to.throw(TypeError, 'Expected progress interval to be a non-negative integer');
+	});
+
+	appit('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.queueInstall('foo', appPath);
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+
+	appit('should report transfer and install progress', async function () {
+		this.timeout(30000);
+		this.slow(15000);
+
+		const events = [];
+		await iosDevice.queueInstall(udid, appPath, { onProgress: evt => events.push(evt), progressInterval: 0 });
+
+		const phases = events.map(evt => evt.phase).filter((phase, i, arr) => arr.indexOf(phase) === i);
+		expect(phases).to.deep.equal([ 'transfer', 'install' ]);
+		expect(events[events.length - 1].percent).to.equal(100);
+	});
+
+	appit('should merge duplicate requests into one install', async function () {
+		this.timeout(30000);
+		this.slow(15000);
+
+		const results = await Promise.all([
+			iosDevice.queueInstall(udid, appPath),
+			iosDevice.queueInstall(udid, appPath)
+		]);
+		expect(results.filter(r => r.deduped)).to.have.lengthOf(1);
+	});
+
+	appit('should reject an aborted request', async function () {
+		this.timeout(30000);
+		this.slow(15000);
+
+		const controller = createAbortController();
+		const promise = iosDevice.queueInstall(udid, appPath, { signal: controller.signal });
+		controller.abort();
+
+		try {
+			await promise;
+		} catch (err) {
+			expect(err.name).to.equal('AbortError');
+			return;
+		}
+		throw new Error('Expected install to be aborted');
+	});
+
+	appit('should reject a request aborted from its progress callback once', async function () {
+		this.timeout(30000);
+		this.slow(15000);
+
+		const controller = createAbortController();
+		let rejections = 0;
+		const promise = iosDevice.queueInstall(udid, appPath, {
+			onProgress: () => controller.abort(),
+			progressInterval: 0,
+			signal: controller.signal
+		}).catch(err => {
+			rejections++;
+			expect(err.name).to.equal('AbortError');
+		});
+
+		await promise;
+		await new Promise(resolve => setTimeout(resolve, 1000));
+		expect(rejections).to.equal(1);
+	});
+
+	describe('install queue', () => {
+		/**
+		 * Polls until `fn` returns a truthy value.
+		 */
+		async function until(fn) {
+			const start = Date.now();
+			while (!fn()) {
+				if (Date.now() - start > 2000) {
+					throw new Error('Timed out waiting for the install queue');
+				}
+				await new Promise(resolve => setTimeout(resolve, 5));
+			}
+		}
+
+		async function expectAborted(promise) {
+			try {
+				await promise;
+			} catch (err) {
+				expect(err.name).to.equal('AbortError');
+				expect(err.code).to.equal('ABORT_ERR');
+				return;
+			}
+			throw new Error('Expected install to be aborted');
+		}
+
+		afterEach(() => binding.installQueueFakeRelease());
+
+		it('should merge duplicate requests into one install', async () => {
+			binding.installQueueFake(false, true);
+			const a = binding.installQueueFakeAdd('foo', '/a.app');
+			const b = binding.installQueueFakeAdd('foo', '/a.app');
+			const c = binding.installQueueFakeAdd('bar', '/a.app');
+
+			await until(() => binding.installQueueFakeState(a.id).waiters === 2 && binding.installQueueFakeState(c.id).waiters === 1);
+			binding.installQueueFakeRelease();
+
+			const results = await Promise.all([ a.promise, b.promise, c.promise ]);
+			expect(results.slice(0, 2).map(r => r.deduped).sort()).to.deep.equal([ false, true ]);
+			expect(results[2]).to.deep.equal({ skipped: false, deduped: false });
+			expect(binding.installQueueFakeState(0).installs).to.equal(2);
+		});
+
+		it('should not merge requests with different install options', async () => {
+			binding.installQueueFake(false, true);
+			const a = binding.installQueueFakeAdd('foo', '/a.app', true, '/records');
+			const b = binding.installQueueFakeAdd('foo', '/a.app', false, '/records');
+			const c = binding.installQueueFakeAdd('foo', '/a.app', true, '/other');
+			const d = binding.installQueueFakeAdd('foo', '/a.app', true, '/records');
+
+			await until(() => binding.installQueueFakeState(a.id).waiters === 2
+				&& binding.installQueueFakeState(b.id).waiters === 1
+				&& binding.installQueueFakeState(c.id).waiters === 1);
+			binding.installQueueFakeRelease();
+
+			const results = await Promise.all([ a.promise, b.promise, c.promise, d.promise ]);
+			expect([ results[0].deduped, results[3].deduped ].sort()).to.deep.equal([ false, true ]);
+			expect(results[1].deduped).to.equal(false);
+			expect(results[2].deduped).to.equal(false);
+			expect(binding.installQueueFakeState(0).installs).to.equal(3);
+		});
+
+		it('should keep installing when one of two requests is cancelled', async () => {
+			binding.installQueueFake(false, true);
+			const a = binding.installQueueFakeAdd('foo', '/a.app');
+			const b = binding.installQueueFakeAdd('foo', '/a.app');
+
+			await until(() => binding.installQueueFakeState(b.id).waiters === 2 && binding.installQueueFakeState(b.id).installs === 1);
+			expect(binding.installQueueFakeCancel(a.id)).to.equal(true);
+			await expectAborted(a.promise);
+			expect(binding.installQueueFakeState(b.id).waiters).to.equal(1);
+
+			binding.installQueueFakeRelease();
+			expect((await b.promise).skipped).to.equal(false);
+			expect(binding.installQueueFakeState(0).installs).to.equal(1);
+			expect(binding.installQueueFakeCancel(b.id)).to.equal(false);
+		});
+
+		it('should abandon the install once every request is cancelled', async () => {
+			binding.installQueueFake(false, true);
+			const a = binding.installQueueFakeAdd('foo', '/a.app');
+			await until(() => binding.installQueueFakeState(a.id).installs === 1);
+			const b = binding.installQueueFakeAdd('foo', '/b.app');
+			await until(() => binding.installQueueFakeState(b.id).waiters === 1);
+
+			expect(binding.installQueueFakeCancel(a.id)).to.equal(true);
+			await expectAborted(a.promise);
+
+			// the cancelled install fails and the worker moves on to the next job, which is still held
+			await until(() => binding.installQueueFakeState(b.id).installs === 2);
+			binding.installQueueFakeRelease();
+			expect((await b.promise).deduped).to.equal(false);
+		});
+
+		it('should cancel a request while it is fingerprinted', async () => {
+			binding.installQueueFake(true, false);
+			const a = binding.installQueueFakeAdd('foo', '/a.app');
+
+			expect(binding.installQueueFakeCancel(a.id)).to.equal(true);
+			await expectAborted(a.promise);
+			expect(binding.installQueueFakeCancel(a.id)).to.equal(false);
+
+			binding.installQueueFakeRelease();
+			const b = binding.installQueueFakeAdd('foo', '/b.app');
+			await b.promise;
+			expect(binding.installQueueFakeState(0).installs).to.equal(1);
+		});
+	});
 });
 
 describe('forward()', () => {
@@ -200,6 +496,12 @@ describe('forward()', () => {
 		}).to.throw(Error, 'Device "foo" not found');
 	});
 
+	it('should fail if qos class is invalid', () => {
+		expect(() => {
+			iosDevice.forward('foo', 1337, { qos: 'urgent' });
+		}).to.throw(TypeError, 'Expected qos to be "interactive", "streaming", or "bulk"');
+	});
+
 	usbAppIt('should fail if port is invalid', () => {
 		expect(() => {
 			iosDevice.forward(udid);
@@ -268,6 +570,111 @@ describe('forward()', () => {
 	});
 });
 
+describe('forwardStream()', () => {
+	it('should error if udid is invalid', () => {
+		expect(() => {
+			iosDevice.forwardStream();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should fail if highWaterMark is invalid', () => {
+		expect(() => {
+			iosDevice.forwardStream('foo', 1337, { highWaterMark: 0 });
+		}).to.throw(TypeError, 'Expected highWaterMark to be a positive integer');
+	});
+
+	it('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.forwardStream('foo', 1337);
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+});
+
+describe('relay streams', () => {
+	const { createRelayStream, iterate } = require('../src/relay-stream');
+
+	function createFakeRelay(opts = {}) {
+		const relay = { listener: null, pulled: 0, stopped: 0 };
+		relay.stream = createRelayStream(
+			opts,
+			listener => relay.listener = listener,
+			(listener, size) => relay.pulled += size,
+			() => relay.stopped++
+		);
+		return relay;
+	}
+
+	// the stream's own iterator and the fallback for runtimes where Readable has none, neither of
+	// which exists on Node 8
+	const iterators = {
+		'the stream iterator': stream => stream[Symbol.asyncIterator](),
+		'the fallback iterator': stream => iterate(stream)
+	};
+
+	for (const [ name, createIterator ] of Object.entries(iterators)) {
+		const itIterable = typeof Symbol.asyncIterator === 'symbol' ? it : it.skip;
+
+		itIterable(`should iterate lines with next() using ${name}`, async () => {
+			const relay = createFakeRelay();
+			const iter = createIterator(relay.stream);
+			expect(iter[Symbol.asyncIterator]()).to.equal(iter);
+
+			const first = iter.next();
+			relay.listener('data', 'first');
+			relay.listener('data', 'second');
+			expect(await first).to.deep.equal({ value: 'first', done: false });
+			expect(await iter.next()).to.deep.equal({ value: 'second', done: false });
+
+			const last = iter.next();
+			relay.listener('end');
+			expect(await last).to.deep.equal({ value: undefined, done: true });
+			expect(await iter.next()).to.deep.equal({ value: undefined, done: true });
+			expect(relay.stopped).to.equal(0);
+		});
+
+		itIterable(`should stop the relay when iteration returns early using ${name}`, async () => {
+			const relay = createFakeRelay();
+			const iter = createIterator(relay.stream);
+
+			const first = iter.next();
+			relay.listener('data', 'first');
+			expect(await first).to.deep.equal({ value: 'first', done: false });
+			expect(await iter.return()).to.deep.equal({ value: undefined, done: true });
+			expect(relay.stopped).to.equal(1);
+			expect(await iter.next()).to.deep.equal({ value: undefined, done: true });
+		});
+
+		itIterable(`should reject the pending next() when the stream errors using ${name}`, async () => {
+			const relay = createFakeRelay();
+			const iter = createIterator(relay.stream);
+
+			const pending = iter.next();
+			relay.stream.destroy(new Error('boom'));
+			let err;
+			try {
+				await pending;
+			} catch (e) {
+				err = e;
+			}
+			expect(err).to.be.an('error');
+			expect(err.message).to.equal('boom');
+		});
+	}
+
+	it('should terminate each line with a newline in byte mode', async () => {
+		const relay = createFakeRelay({ objectMode: false });
+		const chunks = [];
+		relay.stream.on('data', chunk => chunks.push(chunk));
+		const ended = new Promise(resolve => relay.stream.on('end', resolve));
+
+		relay.listener('data', 'first');
+		relay.listener('data', 'second');
+		relay.listener('end');
+		await ended;
+		expect(Buffer.concat(chunks).toString()).to.equal('first\nsecond\n');
+	});
+});
+
 describe('syslog()', () => {
 	it('should fail if udid is invalid', () => {
 		expect(() => {
@@ -279,6 +686,12 @@ describe('syslog()', () => {
 		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
 	});
 
+	it('should fail if options is invalid', () => {
+		expect(() => {
+			iosDevice.syslog('foo', 'bar');
+		}).to.throw(TypeError, 'Expected options to be an object');
+	});
+
 	it('should error if udid device is not connected', () => {
 		expect(() => {
 			iosDevice.syslog('foo');
@@ -307,4 +720,1256 @@ describe('syslog()', () => {
 		await new Promise(resolve => setTimeout(resolve, 2000));
 		expect(counter).to.equal(count);
 	});
+
+	usbAppIt('should relay syslog messages in batches with receive times', async function () {
+		this.timeout(15000);
+		this.slow(15000);
+
+		const batches = [];
+		const syslogHandle = iosDevice.syslog(usbUDID, { batch: true });
+		syslogHandle.on('batch', (lines, timing) => batches.push({ lines, timing }));
+
+		await new Promise(resolve => setTimeout(resolve, 2000));
+		syslogHandle.stop();
+
+		const [ sec, ns ] = process.hrtime();
+		const now = sec * 1e3 + ns / 1e6;
+		let next = 0;
+		for (const { lines, timing } of batches) {
+			expect(lines).to.be.an('array');
+			for (const name of [ 'seq', 'monotonic', 'time' ]) {
+				expect(timing[name]).to.be.an.instanceof(Float64Array);
+				expect(timing[name].length).to.equal(lines.length);
+			}
+			for (let i = 0; i < lines.length; i++) {
+				expect(timing.seq[i]).to.equal(next++);
+				expect(timing.monotonic[i]).to.be.at.most(now);
+				expect(timing.time[i]).to.be.at.most(Date.now());
+			}
+		}
+	});
+});
+
+describe('syslogLimits()', () => {
+	it('should fail if udid is invalid', () => {
+		expect(() => {
+			iosDevice.syslogLimits();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should fail if options is invalid', () => {
+		expect(() => {
+			iosDevice.syslogLimits('foo', 'bar');
+		}).to.throw(TypeError, 'Expected options to be an object');
+	});
+
+	it('should fail if a rate is invalid', () => {
+		expect(() => {
+			iosDevice.syslogLimits('foo', { rate: -1 });
+		}).to.throw(TypeError, 'Expected rate to be a non-negative integer');
+
+		expect(() => {
+			iosDevice.syslogLimits('foo', { limits: { wifid: 'fast' } });
+		}).to.throw(TypeError, 'Expected limits to be an object of non-negative integer rates');
+	});
+
+	it('should fail if key is invalid', () => {
+		expect(() => {
+			iosDevice.syslogLimits('foo', { key: 'pid' });
+		}).to.throw(TypeError, 'Expected key to be "process" or "sender"');
+	});
+
+	it('should fail if sample or summary interval is invalid', () => {
+		expect(() => {
+			iosDevice.syslogLimits('foo', { sample: 1.5 });
+		}).to.throw(TypeError, 'Expected sample to be a non-negative integer');
+
+		expect(() => {
+			iosDevice.syslogLimits('foo', { summaryInterval: 0 });
+		}).to.throw(TypeError, 'Expected summaryInterval to be a positive integer');
+	});
+
+	it('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.syslogLimits('foo', { rate: 100 });
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+
+	it('should relay every sampled line over the limit', () => {
+		const SyslogFraming = 1;
+		let data = 'Jan 12 10:23:00 iPhone locationd[61] <Notice>: unlimited\n';
+		for (let i = 0; i < 10; i++) {
+			data += `Jan 12 10:23:00 iPhone wifid[58] <Notice>: line ${i}\n`;
+		}
+
+		const lines = binding.relayFrames([ Buffer.from(data) ], SyslogFraming, 1, 3);
+		expect(lines.filter(line => line.includes('wifid[58]')).map(line => line.split(': ')[1])).to.deep.equal([
+			'line 0', // the bucket's token
+			'line 3',
+			'line 6',
+			'line 9'
+		]);
+		expect(lines).to.include('Jan 12 10:23:00 iPhone locationd[61] <Notice>: unlimited');
+		expect(lines[lines.length - 1]).to.equal('node-ios-device: suppressed 6 lines from wifid (3 sampled)');
+	});
+
+	usbAppIt('should limit syslog messages', async function () {
+		this.timeout(15000);
+		this.slow(15000);
+
+		iosDevice.syslogLimits(usbUDID, { rate: 1, summaryInterval: 1000 });
+
+		const lines = [];
+		const syslogHandle = iosDevice.syslog(usbUDID);
+		syslogHandle.on('data', msg => lines.push(msg));
+
+		try {
+			await new Promise(resolve => setTimeout(resolve, 3000));
+		} finally {
+			syslogHandle.stop();
+			iosDevice.syslogLimits(usbUDID);
+		}
+
+		const counts = {};
+		for (const line of lines) {
+			const m = line.match(/ ([^ (]+)(?:\([^)]*\))?\[\d+\]/);
+			if (m) {
+				counts[m[1]] = (counts[m[1]] || 0) + 1;
+			}
+		}
+		for (const count of Object.values(counts)) {
+			expect(count).to.be.at.most(4);
+		}
+	});
+});
+
+describe('syslogStream()', () => {
+	it('should fail if udid is invalid', () => {
+		expect(() => {
+			iosDevice.syslogStream();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should fail if options is invalid', () => {
+		expect(() => {
+			iosDevice.syslogStream('foo', 'bar');
+		}).to.throw(TypeError, 'Expected options to be an object');
+
+		expect(() => {
+			iosDevice.syslogStream('foo', { highWaterMark: 1.5 });
+		}).to.throw(TypeError, 'Expected highWaterMark to be a positive integer');
+	});
+
+	it('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.syslogStream('foo');
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+
+	usbAppIt('should read syslog lines as they are pulled', async function () {
+		this.timeout(15000);
+		this.slow(15000);
+
+		const lines = [];
+		await new Promise((resolve, reject) => {
+			const stream = iosDevice.syslogStream(usbUDID, { highWaterMark: 4 });
+			stream.on('error', reject);
+			stream.on('data', line => {
+				try {
+					expect(line).to.be.a('string');
+					if (lines.push(line) === 10) {
+						stream.destroy();
+						resolve();
+					}
+				} catch (e) {
+					stream.destroy();
+					reject(e);
+				}
+			});
+		});
+		expect(lines).to.have.lengthOf(10);
+	});
+});
+
+describe('observe()', () => {
+	it('should fail if udid is invalid', () => {
+		expect(() => {
+			iosDevice.observe();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should fail if notification names are invalid', () => {
+		expect(() => {
+			iosDevice.observe('foo');
+		}).to.throw(TypeError, 'Expected notification names to be a non-empty array of strings');
+
+		expect(() => {
+			iosDevice.observe('foo', [ 123 ]);
+		}).to.throw(TypeError, 'Expected notification names to be a non-empty array of strings');
+	});
+
+	it('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.observe('foo', [ 'com.apple.mobile.application_installed' ]);
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+
+	appit('should receive a notification when an app is installed', async function () {
+		this.timeout(30000);
+		this.slow(30000);
+
+		const handle = iosDevice.observe(udid, [ 'com.apple.mobile.application_installed' ]);
+		const received = new Promise(resolve => handle.once('notification', resolve));
+
+		iosDevice.install(udid, appPath);
+
+		expect(await received).to.equal('com.apple.mobile.application_installed');
+		handle.stop();
+	});
+});
+
+describe('screenshots()', () => {
+	it('should fail if udid is invalid', () => {
+		expect(() => {
+			iosDevice.screenshots();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+
+		expect(() => {
+			iosDevice.screenshots(1234);
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should fail if fps is invalid', () => {
+		expect(() => {
+			iosDevice.screenshots('foo', { fps: 0 });
+		}).to.throw(TypeError, 'Expected fps to be a number greater than 0 and less than or equal to 60');
+
+		expect(() => {
+			iosDevice.screenshots('foo', { fps: 'fast' });
+		}).to.throw(TypeError, 'Expected fps to be a number greater than 0 and less than or equal to 60');
+	});
+
+	it('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.screenshots('foo');
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+
+	usbAppIt('should stream screenshots', async function () {
+		this.timeout(15000);
+		this.slow(15000);
+
+		const frames = [];
+		const handle = iosDevice.screenshots(usbUDID, { fps: 4 });
+		handle.on('data', frame => frames.push(frame));
+
+		await new Promise(resolve => setTimeout(resolve, 3000));
+		handle.stop();
+
+		expect(frames.length).to.be.above(0);
+		for (const frame of frames) {
+			expect(frame).to.be.an.instanceof(Buffer);
+			expect(frame.length).to.be.above(0);
+		}
+	});
+});
+
+describe('syncCrashReports()', () => {
+	it('should fail if udid is invalid', () => {
+		expect(() => {
+			iosDevice.syncCrashReports();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should fail if destination directory is invalid', () => {
+		expect(() => {
+			iosDevice.syncCrashReports('foo');
+		}).to.throw(TypeError, 'Expected destination directory to be a non-empty string');
+	});
+
+	it('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.syncCrashReports('foo', path.join(__dirname, 'crashes'));
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+
+	devit('should only copy new crash reports on the second sync', function () {
+		this.timeout(60000);
+		this.slow(30000);
+
+		const destDir = path.join(os.tmpdir(), `node-ios-device-crashes-${udid}`);
+		const first = iosDevice.syncCrashReports(udid, destDir);
+		expect(first.copied).to.be.an('array');
+
+		const second = iosDevice.syncCrashReports(udid, destDir);
+		expect(second.skipped).to.be.at.least(first.copied.length);
+	});
+});
+
+describe('webinspector()', () => {
+	it('should fail if udid is invalid', () => {
+		expect(() => {
+			iosDevice.webinspector();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.webinspector('foo');
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+
+	devit('should report the connected applications', async function () {
+		this.timeout(15000);
+		this.slow(15000);
+
+		const handle = iosDevice.webinspector(udid);
+		const reply = new Promise(resolve => handle.on('message', msg => {
+			if (msg.__selector === '_rpc_reportConnectedApplicationList:') {
+				resolve(msg);
+			}
+		}));
+
+		handle.send({
+			__selector: '_rpc_reportIdentifier:',
+			__argument: { WIRConnectionIdentifierKey: 'c5a8d4c8-3e3b-4b0c-9b6b-2a8f3b4f9e10' }
+		});
+
+		const msg = await reply;
+		expect(msg.__argument).to.be.an('object');
+		handle.stop();
+	});
+});
+
+describe('relay framing', () => {
+	const LineFraming = 0;
+	const SyslogFraming = 1;
+	const PlistFraming = 2;
+	const WebInspectorFraming = 3;
+
+	function frame(obj) {
+		const body = iosDevice.plist.encode(obj);
+		const header = Buffer.alloc(4);
+		header.writeUInt32BE(body.length, 0);
+		return Buffer.concat([ header, body ]);
+	}
+
+	function split(buf, sizes) {
+		const chunks = [];
+		let offset = 0;
+		for (const size of sizes) {
+			chunks.push(buf.slice(offset, offset + size));
+			offset += size;
+		}
+		chunks.push(buf.slice(offset));
+		return chunks;
+	}
+
+	it('should split lines across reads', () => {
+		const data = Buffer.from('first line\nsecond line\r\nthird');
+		expect(binding.relayFrames(split(data, [ 11, 13 ]), LineFraming)).to.deep.equal([ 'first line', 'second line', 'third' ]);
+	});
+
+	it('should emit the part of a line each read delivers', () => {
+		// like the relay always has, lines aren't held until their line break arrives
+		const data = Buffer.from('first line\nsecond line\r\nthird');
+		expect(binding.relayFrames(split(data, [ 3, 9, 7 ]), LineFraming)).to.deep.equal([ 'fir', 'st line', 's', 'econd l', 'ine', 'third' ]);
+	});
+
+	it('should reassemble plists split across reads', () => {
+		const data = Buffer.concat([ frame({ a: 1 }), frame({ b: [ 'two' ] }) ]);
+		expect(binding.relayFrames(split(data, [ 2, 5, 11 ]), PlistFraming)).to.deep.equal([ { a: 1 }, { b: [ 'two' ] } ]);
+	});
+
+	it('should reassemble Web Inspector partial messages', () => {
+		const message = {
+			__selector: '_rpc_applicationSentData:',
+			__argument: { WIRMessageDataKey: Buffer.alloc(300, 'x') }
+		};
+		const inner = iosDevice.plist.encode(message);
+		const data = Buffer.concat([
+			frame({ WIRPartialMessageKey: inner.slice(0, 100) }),
+			frame({ WIRPartialMessageKey: inner.slice(100, 200) }),
+			frame({ WIRFinalMessageKey: inner.slice(200) })
+		]);
+
+		expect(binding.relayFrames(split(data, [ 1, 60, 140, 3 ]), WebInspectorFraming)).to.deep.equal([ message ]);
+		expect(binding.relayFrames([ data ], PlistFraming)).to.have.lengthOf(3);
+	});
+
+	it('should replace each maximal subpart of invalid UTF-8 with U+FFFD', () => {
+		const decode = bytes => binding.relayFrames([ Buffer.from([ 0x61, ...bytes, 0x62, 0x0A ]) ], LineFraming);
+
+		// overlong encodings of "/"
+		expect(decode([ 0xC0, 0xAF ])).to.deep.equal([ 'a\uFFFD\uFFFDb' ]);
+		expect(decode([ 0xE0, 0x80, 0xAF ])).to.deep.equal([ 'a\uFFFD\uFFFD\uFFFDb' ]);
+		expect(decode([ 0xF0, 0x80, 0x80, 0xAF ])).to.deep.equal([ 'a\uFFFD\uFFFD\uFFFD\uFFFDb' ]);
+
+		// U+D800, a surrogate
+		expect(decode([ 0xED, 0xA0, 0x80 ])).to.deep.equal([ 'a\uFFFD\uFFFD\uFFFDb' ]);
+
+		// "€" and "😀" missing their last byte
+		expect(decode([ 0xE2, 0x82 ])).to.deep.equal([ 'a\uFFFDb' ]);
+		expect(decode([ 0xF0, 0x9F, 0x98 ])).to.deep.equal([ 'a\uFFFDb' ]);
+	});
+
+	it('should hold a character split across reads until it completes', () => {
+		const data = Buffer.from('first\n😀 smile\n');
+		for (const at of [ 7, 8, 9 ]) {
+			expect(binding.relayFrames(split(data, [ at ]), LineFraming)).to.deep.equal([ 'first', '😀 smile' ]);
+		}
+		expect(binding.relayFrames(split(data, [ 7, 1, 1 ]), LineFraming)).to.deep.equal([ 'first', '😀 smile' ]);
+	});
+
+	it('should find line breaks at the edges of a scanned block', () => {
+		for (const at of [ 0, 15, 16 ]) {
+			const data = Buffer.alloc(40, 'a');
+			data[at] = 0x0A;
+			data.write('é', 30);
+			expect(binding.relayFrames([ data ], LineFraming)).to.deep.equal(data.toString().split('\n').filter(Boolean));
+		}
+	});
+
+	it('should decode the vis(3) escapes in syslog lines', () => {
+		const syslog = (...chunks) => binding.relayFrames(chunks.map(s => Buffer.from(s)), SyslogFraming);
+
+		// "😀" with its bytes escaped as `\M-^X` and as `\M^X`
+		expect(syslog(String.raw`smile \M-p\M-^_\M-^X\M-^@` + '\n')).to.deep.equal([ 'smile 😀' ]);
+		expect(syslog(String.raw`smile \M-p\M^_\M^X\M^@` + '\n')).to.deep.equal([ 'smile 😀' ]);
+
+		expect(syslog(String.raw`esc \^[ backslash \\ del \^?` + '\n')).to.deep.equal([ 'esc \x1b backslash \\ del \x7f' ]);
+	});
+
+	it('should hold a syslog escape cut off by the end of a read', () => {
+		const data = String.raw`caf\M-C\M-) ok` + '\n';
+		for (const at of [ 4, 8, 9, 10 ]) {
+			const chunks = [ data.slice(0, at), data.slice(at) ].map(s => Buffer.from(s));
+			expect(binding.relayFrames(chunks, SyslogFraming)).to.deep.equal([ 'caf', 'é ok' ]);
+		}
+	});
+
+	it('should keep a syslog escape cut off by a line break as is', () => {
+		const data = Buffer.from(String.raw`cut \M` + '\n' + String.raw`cut \M-` + '\n' + String.raw`cut \^` + '\nnext\n');
+		expect(binding.relayFrames([ data ], SyslogFraming)).to.deep.equal([ 'cut \\M', 'cut \\M-', 'cut \\^', 'next' ]);
+	});
+
+	it('should take a backslash that doesn\'t start an escape literally', () => {
+		const data = Buffer.from(String.raw`C:\path\to \q` + '\n');
+		expect(binding.relayFrames([ data ], SyslogFraming)).to.deep.equal([ String.raw`C:\path\to \q` ]);
+	});
+
+	it('should replace escaped bytes that aren\'t valid UTF-8', () => {
+		const data = Buffer.from(String.raw`bad \M-C( \M-^X caf\M-C\M-)` + '\n');
+		expect(binding.relayFrames([ data ], SyslogFraming)).to.deep.equal([ 'bad \uFFFD( \uFFFD café' ]);
+	});
+
+	it('should reject a frame larger than the maximum', () => {
+		const header = Buffer.alloc(4);
+		header.writeUInt32BE(0x7fffffff, 0);
+		expect(() => {
+			binding.relayFrames([ frame({ a: 1 }), header, Buffer.alloc(16) ], PlistFraming);
+		}).to.throw(Error, 'Relay frame exceeds the maximum size');
+	});
+});
+
+describe('relay connection', () => {
+	/**
+	 * Polls until `fn` returns a truthy value.
+	 */
+	async function until(fn) {
+		const start = Date.now();
+		while (!fn()) {
+			if (Date.now() - start > 2000) {
+				throw new Error('Timed out waiting for the relay');
+			}
+			await new Promise(resolve => setTimeout(resolve, 5));
+		}
+	}
+
+	function collect() {
+		const events = [];
+		return { events, listener: (evt, line) => events.push(evt === 'data' ? line : evt) };
+	}
+
+	it('should only deliver new messages after restarting an ended relay', async () => {
+		const first = collect();
+		binding.relayLoopbackStart(first.listener);
+		binding.relayLoopbackFeed(Buffer.from('one\ntwo\n'));
+		binding.relayLoopbackFeed();
+		await until(() => first.events.includes('end'));
+		expect(first.events).to.deep.equal([ 'one', 'two', 'end' ]);
+
+		const second = collect();
+		binding.relayLoopbackStart(second.listener);
+		binding.relayLoopbackFeed(Buffer.from('three\n'));
+		await until(() => second.events.length);
+		await new Promise(resolve => setTimeout(resolve, 50));
+		binding.relayLoopbackStop(second.listener);
+		expect(second.events).to.deep.equal([ 'three' ]);
+	});
+});
+
+describe('plist', () => {
+	const value = {
+		str: 'hello <&> world',
+		unicode: 'héllo 😀',
+		int: 42,
+		neg: -7,
+		big: 2 ** 40,
+		real: 1.5,
+		yes: true,
+		no: false,
+		date: new Date('2020-05-17T12:34:56Z'),
+		data: Buffer.from([ 0, 1, 2, 255 ]),
+		arr: [ 1, 'two', [ 3 ], {} ],
+		obj: { nested: { deep: [] } }
+	};
+
+	it('should fail if data is invalid', () => {
+		expect(() => {
+			iosDevice.plist.parse(123);
+		}).to.throw(TypeError, 'Expected plist data to be a Buffer or string');
+	});
+
+	it('should fail if the plist is malformed', () => {
+		expect(() => {
+			iosDevice.plist.parse(Buffer.from('bplist00garbage'));
+		}).to.throw(Error, 'Invalid binary plist');
+
+		expect(() => {
+			iosDevice.plist.parse('<plist><dict><key>a</key></plist>');
+		}).to.throw(Error);
+	});
+
+	it('should fail if the format is invalid', () => {
+		expect(() => {
+			iosDevice.plist.encode({}, { format: 'json' });
+		}).to.throw(TypeError, 'Expected format to be "binary" or "xml"');
+	});
+
+	it('should round trip a binary plist', () => {
+		const buf = iosDevice.plist.encode(value);
+		expect(buf.slice(0, 8).toString()).to.equal('bplist00');
+		expect(iosDevice.plist.parse(buf)).to.deep.equal(value);
+	});
+
+	it('should round trip an XML plist', () => {
+		const buf = iosDevice.plist.encode(value, { format: 'xml' });
+		expect(buf.toString()).to.include('<string>hello &lt;&amp;&gt; world</string>');
+		expect(iosDevice.plist.parse(buf)).to.deep.equal(value);
+		expect(iosDevice.plist.parse(buf.toString())).to.deep.equal(value);
+	});
+
+	it('should parse XML integers as decimal', () => {
+		const xml = '<plist><array><integer>010</integer><integer>-010</integer><integer>+7</integer></array></plist>';
+		expect(iosDevice.plist.parse(xml)).to.deep.equal([ 10, -10, 7 ]);
+
+		expect(() => {
+			iosDevice.plist.parse('<plist><integer>0x10</integer></plist>');
+		}).to.throw(Error, 'Invalid integer');
+	});
+
+	it('should omit null and undefined values', () => {
+		const buf = iosDevice.plist.encode({ a: 1, b: null, c: undefined, d: [ null, 2 ] });
+		expect(iosDevice.plist.parse(buf)).to.deep.equal({ a: 1, d: [ 2 ] });
+	});
+
+	it('should round trip keyed archiver UIDs', () => {
+		const buf = iosDevice.plist.encode({ root: { CF$UID: 3 } });
+		expect(iosDevice.plist.parse(buf)).to.deep.equal({ root: { CF$UID: 3 } });
+	});
+});
+
+describe('lockdown()', () => {
+	const fixturesDir = path.join(__dirname, 'fixtures', 'lockdown');
+	const pairRecord = iosDevice.plist.encode({
+		HostID: 'HOST-ID',
+		SystemBUID: 'SYSTEM-BUID',
+		HostCertificate: fs.readFileSync(path.join(fixturesDir, 'host.crt')),
+		HostPrivateKey: fs.readFileSync(path.join(fixturesDir, 'host.key'))
+	});
+	let child = null;
+	let port = null;
+
+	before(function (done) {
+		this.timeout(10000);
+		child = fork(path.join(fixturesDir, 'lockdownd.js'));
+		child.once('message', msg => {
+			port = msg.port;
+			done();
+		});
+	});
+
+	after(() => {
+		if (child) {
+			child.kill();
+		}
+	});
+
+	it('should fail if udid is invalid', () => {
+		expect(() => {
+			iosDevice.lockdown({ pairRecord });
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should fail if pair record is invalid', () => {
+		expect(() => {
+			iosDevice.lockdown({ udid: 'foo', host: '127.0.0.1', pairRecord: 123 });
+		}).to.throw(TypeError, 'Expected pair record to be a path or Buffer');
+
+		expect(() => {
+			iosDevice.lockdown({ udid: 'foo', host: '127.0.0.1', pairRecordDir: '' });
+		}).to.throw(TypeError, 'Expected pair record directory to be a non-empty string');
+
+		expect(() => {
+			iosDevice.lockdown({ udid: 'foo', host: '127.0.0.1', pairRecordDir: os.tmpdir() });
+		}).to.throw(Error, 'No pair record for device foo');
+
+		expect(() => {
+			iosDevice.lockdown({ udid: 'foo', host: '127.0.0.1', pairRecord: iosDevice.plist.encode({ HostID: 'foo' }) });
+		}).to.throw(Error, 'Invalid pair record');
+	});
+
+	it('should get values from the stand-in lockdownd', () => {
+		const client = iosDevice.lockdown({ udid: 'test-get-value', host: '127.0.0.1', port, pairRecord });
+		try {
+			expect(client.getValue(null, 'ProductVersion')).to.equal('13.2');
+			expect(client.getValue()).to.deep.equal({ ProductVersion: '13.2' });
+		} finally {
+			client.close();
+		}
+	});
+
+	it('should resume TLS sessions when starting services', () => {
+		const client = iosDevice.lockdown({ udid: 'test-resume', host: '127.0.0.1', port, pairRecord });
+		try {
+			const first = client.startService('com.example.service');
+			expect(first.ssl).to.equal(true);
+			expect(first.resumed).to.equal(false);
+
+			const second = client.startService('com.example.service');
+			expect(second.port).to.equal(first.port);
+			expect(second.resumed).to.equal(true);
+
+			expect(() => client.startService('com.example.unknown')).to.throw(Error, 'InvalidService');
+		} finally {
+			client.close();
+		}
+	});
+
+	it('should read the pair record from the record directory', async function () {
+		this.timeout(5000);
+		this.slow(3000);
+
+		const pairRecordDir = fs.mkdtempSync(path.join(os.tmpdir(), 'node-ios-device-lockdown-'));
+		const recordFile = path.join(pairRecordDir, 'test-cached-record.plist');
+		fs.writeFileSync(recordFile, pairRecord);
+
+		const client = iosDevice.lockdown({ udid: 'test-cached-record', host: '127.0.0.1', port, pairRecordDir });
+		try {
+			expect(client.getValue(null, 'ProductVersion')).to.equal('13.2');
+		} finally {
+			client.close();
+		}
+
+		// a re-paired device gets a new record, which is picked up once the directory is checked again
+		fs.writeFileSync(recordFile, iosDevice.plist.encode({ HostID: 'foo' }));
+		await new Promise(resolve => setTimeout(resolve, 1100));
+		expect(() => {
+			iosDevice.lockdown({ udid: 'test-cached-record', host: '127.0.0.1', port, pairRecordDir });
+		}).to.throw(Error, 'No pair record for device test-cached-record');
+	});
+});
+
+describe('apps()', () => {
+	it('should fail if udid is invalid', () => {
+		expect(() => {
+			iosDevice.apps();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should fail if attributes are invalid', () => {
+		expect(() => {
+			iosDevice.apps('foo', { attributes: 'CFBundleVersion' });
+		}).to.throw(TypeError, 'Expected attributes to be an array of strings');
+	});
+
+	it('should fail if bundle ids are invalid', () => {
+		expect(() => {
+			iosDevice.apps('foo', { bundleIds: [ 123 ] });
+		}).to.throw(TypeError, 'Expected bundleIds to be an array of strings');
+	});
+
+	it('should fail if onPage is not a function', () => {
+		expect(() => {
+			iosDevice.apps('foo', { onPage: 'bar' });
+		}).to.throw(TypeError, 'Expected onPage to be a function');
+	});
+
+	it('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.apps('foo');
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+
+	devit('should only return the requested attributes', function () {
+		this.timeout(30000);
+		this.slow(10000);
+
+		const apps = iosDevice.apps(udid, { attributes: [ 'CFBundleIdentifier', 'CFBundleVersion' ] });
+		expect(apps).to.be.an('array');
+		expect(apps.length).to.be.above(0);
+		for (const app of apps) {
+			expect(Object.keys(app)).to.satisfy(keys => keys.every(key => key === 'CFBundleIdentifier' || key === 'CFBundleVersion'));
+		}
+
+		const [ first ] = iosDevice.apps(udid, { attributes: [ 'CFBundleVersion' ], bundleIds: [ apps[0].CFBundleIdentifier ] });
+		expect(first).to.deep.equal({ CFBundleVersion: apps[0].CFBundleVersion });
+	});
+
+	devit('should pass the apps a page at a time', function () {
+		this.timeout(30000);
+		this.slow(10000);
+
+		const all = iosDevice.apps(udid, { attributes: [ 'CFBundleIdentifier' ] });
+		const pages = [];
+		expect(iosDevice.apps(udid, { attributes: [ 'CFBundleIdentifier' ], onPage: page => pages.push(page) })).to.be.undefined;
+		expect(pages.length).to.be.above(0);
+		expect([].concat(...pages).map(app => app.CFBundleIdentifier).sort()).to.deep.equal(all.map(app => app.CFBundleIdentifier).sort());
+
+		expect(() => {
+			iosDevice.apps(udid, {
+				attributes: [ 'CFBundleIdentifier' ],
+				onPage() {
+					throw new Error('stop');
+				}
+			});
+		}).to.throw(Error, 'stop');
+	});
+});
+
+describe('mountDeveloperImage()', () => {
+	it('should fail if udid is invalid', () => {
+		expect(() => {
+			iosDevice.mountDeveloperImage();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should fail if image path is invalid', () => {
+		expect(() => {
+			iosDevice.mountDeveloperImage('foo');
+		}).to.throw(TypeError, 'Expected image path to be a non-empty string');
+	});
+
+	it('should fail if signature path is invalid', () => {
+		expect(() => {
+			iosDevice.mountDeveloperImage('foo', 'DeveloperDiskImage.dmg', 123);
+		}).to.throw(TypeError, 'Expected signature path to be a non-empty string');
+	});
+
+	it('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.mountDeveloperImage('foo', 'DeveloperDiskImage.dmg');
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+});
+
+describe('fileRelay()', () => {
+	it('should fail if udid is invalid', () => {
+		expect(() => {
+			iosDevice.fileRelay();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should fail if sources is invalid', () => {
+		expect(() => {
+			iosDevice.fileRelay('foo', []);
+		}).to.throw(TypeError, 'Expected sources to be a non-empty array of strings');
+	});
+
+	it('should fail if destination is invalid', () => {
+		expect(() => {
+			iosDevice.fileRelay('foo', [ 'CrashReporter' ], 123);
+		}).to.throw(TypeError, 'Expected destination to be a directory or a function');
+	});
+
+	it('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.fileRelay('foo', [ 'CrashReporter' ], () => {});
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+
+	const S_IFDIR = 0o040000;
+	const S_IFREG = 0o100000;
+	const S_IFLNK = 0o120000;
+
+	/**
+	 * Builds a "newc" cpio archive. Each entry's `size` defaults to the length of its data.
+	 */
+	function cpio(entries) {
+		const hex = n => n.toString(16).padStart(8, '0');
+		const pad = len => Buffer.alloc((4 - len % 4) % 4);
+		const parts = [];
+		for (const entry of [ ...entries, { name: 'TRAILER!!!', mode: 0 } ]) {
+			const data = Buffer.from(entry.data || '');
+			const name = Buffer.from(`${entry.name}\0`);
+			const fields = [ 0, entry.mode, 0, 0, 1, 0, entry.size === undefined ? data.length : entry.size, 0, 0, 0, 0, entry.nameSize || name.length, 0 ];
+			const header = Buffer.from(`070701${fields.map(hex).join('')}`);
+			parts.push(header, name, pad(header.length + name.length), data, pad(data.length));
+		}
+		return Buffer.concat(parts);
+	}
+
+	/**
+	 * Compresses an archive and splits it into small reads so entries span several of them.
+	 */
+	function reads(archive) {
+		const gz = zlib.gzipSync(archive);
+		const chunks = [];
+		for (let i = 0; i < gz.length; i += 7) {
+			chunks.push(gz.slice(i, i + 7));
+		}
+		return chunks;
+	}
+
+	it('should keep every extracted entry inside the destination', () => {
+		const parent = fs.mkdtempSync(path.join(os.tmpdir(), 'node-ios-device-file-relay-'));
+		const outside = fs.mkdtempSync(path.join(os.tmpdir(), 'node-ios-device-file-relay-outside-'));
+		const dest = path.join(parent, 'dest');
+
+		const result = binding.fileRelayExtract(reads(cpio([
+			{ name: 'safe', mode: S_IFDIR | 0o755 },
+			{ name: 'safe/a.txt', mode: S_IFREG | 0o644, data: 'a' },
+			{ name: '../escape.txt', mode: S_IFREG | 0o644, data: 'escaped' },
+			{ name: './safe/../../escape.txt', mode: S_IFREG | 0o644, data: 'escaped' },
+			{ name: '/abs/b.txt', mode: S_IFREG | 0o644, data: 'b' },
+			{ name: 'link', mode: S_IFLNK | 0o777, data: outside },
+			{ name: 'link/c.txt', mode: S_IFREG | 0o644, data: 'c' }
+		])), dest);
+
+		expect(result).to.deep.equal({ entries: 7, bytes: 17 + outside.length });
+		expect(fs.readdirSync(parent)).to.deep.equal([ 'dest' ]);
+		expect(fs.readdirSync(outside)).to.deep.equal([]);
+		expect(fs.readFileSync(path.join(dest, 'safe', 'a.txt'), 'utf8')).to.equal('a');
+		expect(fs.readFileSync(path.join(dest, 'abs', 'b.txt'), 'utf8')).to.equal('b');
+		expect(fs.lstatSync(path.join(dest, 'link')).isDirectory()).to.equal(true);
+		expect(fs.readFileSync(path.join(dest, 'link', 'c.txt'), 'utf8')).to.equal('c');
+	});
+
+	it('should fail on a truncated or invalid header', () => {
+		const dest = fs.mkdtempSync(path.join(os.tmpdir(), 'node-ios-device-file-relay-'));
+		const archive = cpio([ { name: 'a.txt', mode: S_IFREG | 0o644, data: 'a' } ]);
+
+		for (const len of [ 3, 50, 112 ]) {
+			expect(() => {
+				binding.fileRelayExtract(reads(archive.slice(0, len)), dest);
+			}).to.throw(Error, 'File relay archive ended unexpectedly');
+		}
+
+		expect(() => {
+			binding.fileRelayExtract(reads(Buffer.concat([ Buffer.from('070708'), archive.slice(6) ])), dest);
+		}).to.throw(Error, 'Invalid cpio header');
+
+		const badField = Buffer.from(archive);
+		badField.write('zz', 20);
+		expect(() => {
+			binding.fileRelayExtract(reads(badField), dest);
+		}).to.throw(Error, 'Invalid cpio header');
+	});
+
+	it('should fail on an oversized name or file', () => {
+		const dest = fs.mkdtempSync(path.join(os.tmpdir(), 'node-ios-device-file-relay-'));
+
+		expect(() => {
+			binding.fileRelayExtract(reads(cpio([ { name: 'a.txt', mode: S_IFREG | 0o644, nameSize: 0x10000 } ])), dest);
+		}).to.throw(Error, 'Invalid cpio entry name length');
+
+		// the size claims more data than the archive has, so nothing is left behind
+		expect(() => {
+			binding.fileRelayExtract(reads(cpio([ { name: 'big.bin', mode: S_IFREG | 0o644, data: 'not 4 GB', size: 0xffffffff } ])), dest);
+		}).to.throw(Error, 'File relay archive ended unexpectedly');
+		expect(fs.readdirSync(dest)).to.deep.equal([]);
+	});
+
+	devit('should pass each entry to the callback', function () {
+		this.timeout(60000);
+		this.slow(30000);
+
+		const sizes = {};
+		const result = iosDevice.fileRelay(udid, [ 'SystemConfiguration' ], (entry, chunk) => {
+			if (entry.type === 'file') {
+				sizes[entry.name] = (sizes[entry.name] || 0) + (chunk ? chunk.length : 0);
+				if (!chunk) {
+					expect(sizes[entry.name]).to.equal(entry.size);
+				}
+			}
+		});
+		expect(result.entries).to.be.above(0);
+	});
+
+	devit('should rethrow an error thrown by the callback', function () {
+		this.timeout(60000);
+		this.slow(30000);
+
+		expect(() => {
+			iosDevice.fileRelay(udid, [ 'SystemConfiguration' ], () => {
+				throw new Error('callback failed');
+			});
+		}).to.throw(Error, 'callback failed');
+	});
+});
+
+describe('diagnostics()', () => {
+	it('should fail if udid is invalid', () => {
+		expect(() => {
+			iosDevice.diagnostics();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should fail if keys is invalid', () => {
+		expect(() => {
+			iosDevice.diagnostics('foo', [ 'DeviceName', 123 ]);
+		}).to.throw(TypeError, 'Expected keys to be a non-empty array of strings');
+	});
+
+	it('should fail if ttl is invalid', () => {
+		expect(() => {
+			iosDevice.diagnostics('foo', [ 'DeviceName' ], { ttl: 'bar' });
+		}).to.throw(TypeError, 'Expected ttl to be a number or an object');
+	});
+
+	it('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.diagnostics('foo', [ 'DeviceName' ]);
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+
+	it('should fail if concurrency is invalid', () => {
+		expect(() => {
+			iosDevice.diagnosticsAll([ 'DeviceName' ], { concurrency: 0 });
+		}).to.throw(TypeError, 'Expected concurrency to be a positive integer');
+	});
+
+	it('should validate the keys in the binding before querying any device', () => {
+		expect(() => {
+			binding.diagnosticsAll([ 'DeviceName', 123 ], [ 0, 0 ], 4);
+		}).to.throw(Error, 'Expected keys to be an array of strings');
+
+		expect(() => {
+			binding.diagnosticsAll([ 'DeviceName' ], [], 4);
+		}).to.throw(Error, 'Expected a TTL for every key');
+	});
+
+	it('should return a result for every connected device', () => {
+		const results = iosDevice.diagnosticsAll([ 'DeviceName' ]);
+		expect(results).to.be.an('array');
+		expect(results).to.have.lengthOf(iosDevice.list().length);
+	});
+
+	devit('should return the requested keys', function () {
+		this.timeout(30000);
+		this.slow(10000);
+
+		const keys = [ 'DeviceName', 'com.apple.disk_usage:TotalDiskCapacity', 'com.apple.mobile.battery:' ];
+		const values = iosDevice.diagnostics(udid, keys, { ttl: 60000 });
+		expect(values).to.have.all.keys(keys);
+		expect(values.DeviceName).to.be.a('string');
+		expect(iosDevice.diagnostics(udid, keys, { ttl: 60000 })).to.deep.equal(values);
+	});
+});
+
+describe('syncContainer()', () => {
+	it('should fail if udid is invalid', () => {
+		expect(() => {
+			iosDevice.syncContainer();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should fail if bundle id is invalid', () => {
+		expect(() => {
+			iosDevice.syncContainer('foo');
+		}).to.throw(TypeError, 'Expected bundle id to be a non-empty string');
+	});
+
+	it('should fail if local directory is invalid', () => {
+		expect(() => {
+			iosDevice.syncContainer('foo', 'com.appcelerator.TestApp');
+		}).to.throw(TypeError, 'Expected local directory to be a non-empty string');
+	});
+
+	it('should fail if direction is invalid', () => {
+		expect(() => {
+			iosDevice.syncContainer('foo', 'com.appcelerator.TestApp', os.tmpdir(), { direction: 'sideways' });
+		}).to.throw(TypeError, 'Expected direction to be "pull" or "push"');
+	});
+
+	it('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.syncContainer('foo', 'com.appcelerator.TestApp', os.tmpdir());
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+
+	appit('should only copy changed files on the second pull', function () {
+		this.timeout(60000);
+		this.slow(30000);
+
+		iosDevice.install(udid, appPath);
+
+		const localDir = fs.mkdtempSync(path.join(os.tmpdir(), 'node-ios-device-container-'));
+		const first = iosDevice.syncContainer(udid, 'com.appcelerator.TestApp', localDir);
+		expect(first.copied).to.be.an('array');
+
+		const second = iosDevice.syncContainer(udid, 'com.appcelerator.TestApp', localDir);
+		expect(second.copied).to.have.lengthOf(0);
+		expect(second.skipped).to.equal(first.copied.length + first.skipped);
+	});
+});
+
+describe('afc', () => {
+	describe('snapshot()', () => {
+		it('should fail if udid is invalid', () => {
+			expect(() => {
+				iosDevice.afc.snapshot();
+			}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+		});
+
+		it('should fail if service is invalid', () => {
+			expect(() => {
+				iosDevice.afc.snapshot('foo', { service: 'bar' });
+			}).to.throw(TypeError, 'Expected service to be one of: crashreports, media');
+		});
+
+		it('should error if udid device is not connected', () => {
+			expect(() => {
+				iosDevice.afc.snapshot('foo');
+			}).to.throw(Error, 'Device "foo" not found');
+		});
+
+		devit('should snapshot the media directory', function () {
+			this.timeout(60000);
+			this.slow(30000);
+
+			const snapshot = iosDevice.afc.snapshot(udid, { concurrency: 8 });
+			expect(snapshot).to.be.instanceof(Buffer);
+
+			const entries = iosDevice.afc.entries(snapshot);
+			expect(entries).to.be.an('array');
+			expect(entries.map(e => e.path)).to.deep.equal(entries.map(e => e.path).sort());
+
+			expect(iosDevice.afc.diff(snapshot, snapshot)).to.deep.equal({ added: [], removed: [], changed: [] });
+		});
+	});
+
+	describe('diff()', () => {
+		it('should fail if snapshots are not Buffers', () => {
+			expect(() => {
+				iosDevice.afc.diff('foo', 'bar');
+			}).to.throw(TypeError, 'Expected snapshots to be Buffers');
+		});
+
+		it('should fail if snapshot is invalid', () => {
+			expect(() => {
+				iosDevice.afc.diff(Buffer.from('foo'), Buffer.from('bar'));
+			}).to.throw(Error, 'Invalid AFC snapshot');
+		});
+
+		const file = (path, size, mtimeMs = 1000) => ({ path, isDirectory: false, unreadable: false, size, mtimeMs });
+		const dir = (path, unreadable = false) => ({ path, isDirectory: true, unreadable, size: 0, mtimeMs: 1000 });
+
+		it('should find added, removed, and changed paths', () => {
+			const from = binding.afcSnapshotPack([
+				dir('DCIM'),
+				file('DCIM/a.jpg', 10),
+				file('DCIM/b.jpg', 20),
+				file('DCIM/c.jpg', 30),
+				file('DCIM-notes.txt', 5),
+				file('d', 1)
+			]);
+			const to = binding.afcSnapshotPack([
+				file('DCIM-notes.txt', 5),
+				dir('DCIM'),
+				file('DCIM/a.jpg', 10),
+				file('DCIM/b.jpg', 21),
+				file('DCIM/c.jpg', 30, 2000),
+				file('DCIM/e.jpg', 40),
+				dir('d')
+			]);
+
+			expect(iosDevice.afc.diff(from, to)).to.deep.equal({
+				added: [ 'DCIM/e.jpg' ],
+				removed: [],
+				changed: [ 'DCIM/b.jpg', 'DCIM/c.jpg', 'd' ]
+			});
+			expect(iosDevice.afc.diff(to, from)).to.deep.equal({
+				added: [],
+				removed: [ 'DCIM/e.jpg' ],
+				changed: [ 'DCIM/b.jpg', 'DCIM/c.jpg', 'd' ]
+			});
+			expect(iosDevice.afc.entries(to).map(e => e.path)).to.deep.equal([ 'DCIM', 'DCIM-notes.txt', 'DCIM/a.jpg', 'DCIM/b.jpg', 'DCIM/c.jpg', 'DCIM/e.jpg', 'd' ]);
+		});
+
+		it('should not report the contents of an unreadable directory as removed', () => {
+			const from = binding.afcSnapshotPack([
+				dir('Private'),
+				file('Private/a', 1),
+				dir('Private/sub'),
+				file('Private/sub/b', 2),
+				file('Privateer', 3)
+			]);
+			const to = binding.afcSnapshotPack([
+				dir('Private', true),
+				file('Privateer', 3)
+			]);
+
+			expect(iosDevice.afc.diff(from, to)).to.deep.equal({ added: [], removed: [], changed: [ 'Private' ] });
+			expect(iosDevice.afc.diff(to, from)).to.deep.equal({ added: [], removed: [], changed: [ 'Private' ] });
+			expect(iosDevice.afc.entries(to)[0]).to.deep.equal({ path: 'Private', isDirectory: true, unreadable: true, size: 0, mtimeMs: 1000 });
+		});
+	});
+});
+
+describe('qos()', () => {
+	it('should fail if udid is invalid', () => {
+		expect(() => {
+			iosDevice.qos();
+		}).to.throw(TypeError, 'Expected udid to be a non-empty string');
+	});
+
+	it('should fail if rates is not an object', () => {
+		expect(() => {
+			iosDevice.qos('foo', 'bar');
+		}).to.throw(TypeError, 'Expected rates to be an object');
+	});
+
+	it('should fail if a rate is invalid', () => {
+		expect(() => {
+			iosDevice.qos('foo', { linkRate: -1 });
+		}).to.throw(TypeError, 'Expected linkRate to be a non-negative number');
+
+		expect(() => {
+			iosDevice.qos('foo', { bulkRate: 'fast' });
+		}).to.throw(TypeError, 'Expected bulkRate to be a non-negative number');
+	});
+
+	it('should error if udid device is not connected', () => {
+		expect(() => {
+			iosDevice.qos('foo', { bulkRate: 1e6 });
+		}).to.throw(Error, 'Device "foo" not found');
+	});
+
+	it('should shape app transfers to the bulk rate', function () {
+		this.timeout(5000);
+		this.slow(1000);
+
+		// 3 MB at 10 MB/s, reported in 30 steps, is held to about 0.3 seconds, or 10 MB/s
+		const elapsed = binding.qosTransfer(0, 10e6, 3e6, 30, 0);
+		expect(elapsed).to.be.within(0.2, 1);
+		expect(3e6 / elapsed).to.be.within(3e6, 15e6);
+		expect(binding.qosTransfer(0, 0, 3e6, 30, 0)).to.be.below(0.1);
+	});
+
+	it('should hold bulk transfers behind interactive traffic sent to the device', function () {
+		this.timeout(5000);
+		this.slow(1000);
+
+		// on a 10 MB/s link, 3 MB of interactive traffic costs the transfer about 0.3 seconds
+		const alone = binding.qosTransfer(10e6, 0, 1e6, 10, 0);
+		const behind = binding.qosTransfer(10e6, 0, 1e6, 10, 3e6);
+		expect(alone).to.be.below(0.2);
+		expect(behind - alone).to.be.within(0.2, 0.8);
+	});
+});
+
+describe('usb scheduler', () => {
+	it('should converge on the optimal cap of each hub', () => {
+		// hubs peaking at 1, 2, 5, and 12 concurrent transfers, all starting at a cap of 3
+		expect(binding.usbSimulate([ 1, 2, 5, 12 ], 400, 3)).to.deep.equal([ 1, 2, 5, 12 ]);
+	});
+
+	it('should back off from a cap that is too high', () => {
+		expect(binding.usbSimulate([ 2, 5, 12 ], 400, 16)).to.deep.equal([ 2, 5, 12 ]);
+	});
+
+	it('should climb to the maximum cap', () => {
+		expect(binding.usbSimulate([ 16 ], 400, 1)).to.deep.equal([ 16 ]);
+	});
+});
+
+describe('timeouts()', () => {
+	it('should fail if timeouts is not an object', () => {
+		expect(() => {
+			iosDevice.timeouts('foo');
+		}).to.throw(TypeError, 'Expected timeouts to be an object');
+	});
+
+	it('should fail if a timeout is invalid', () => {
+		expect(() => {
+			iosDevice.timeouts({ connect: -1 });
+		}).to.throw(TypeError, 'Expected connect to be a non-negative number');
+
+		expect(() => {
+			iosDevice.timeouts({ install: 'forever' });
+		}).to.throw(TypeError, 'Expected install to be a non-negative number');
+	});
+
+	it('should set and return the timeouts', () => {
+		const defaults = iosDevice.timeouts();
+		expect(defaults).to.deep.equal({ connect: 30000, startService: 30000, install: 600000 });
+
+		expect(iosDevice.timeouts({ connect: 5000.5 })).to.deep.equal({ connect: 5000, startService: 30000, install: 600000 });
+		expect(iosDevice.timeouts(defaults)).to.deep.equal(defaults);
+	});
+
+	describe('deadline', () => {
+		it('should return the result of an operation that finishes in time', () => {
+			expect(binding.deadlineRun(10, 1000, 0, false)).to.deep.equal({ cancelled: false, aborted: false, abandoned: false });
+		});
+
+		it('should rethrow the error of an operation that fails in time', () => {
+			expect(binding.deadlineRun(10, 1000, 0, true)).to.deep.equal({
+				error: 'Test operation failed',
+				code: 'ERR_TEST',
+				cancelled: false,
+				aborted: false,
+				abandoned: false
+			});
+		});
+
+		it('should run the operation inline without a timeout or cancel token', () => {
+			expect(binding.deadlineRun(10, 0, 0, false)).to.deep.equal({ cancelled: false, aborted: false, abandoned: false });
+		});
+
+		it('should abort and time out an operation that runs too long', function () {
+			this.slow(1000);
+			expect(binding.deadlineRun(300, 50, 0, false)).to.deep.equal({
+				error: 'Test operation timed out after 50ms',
+				code: 'ETIMEDOUT',
+				cancelled: false,
+				aborted: true,
+				abandoned: true
+			});
+		});
+
+		it('should not clean up an abandoned operation that fails', function () {
+			this.slow(1000);
+			expect(binding.deadlineRun(300, 50, 0, true)).to.deep.equal({
+				error: 'Test operation timed out after 50ms',
+				code: 'ETIMEDOUT',
+				cancelled: false,
+				aborted: true,
+				abandoned: false
+			});
+		});
+
+		it('should abort a cancelled operation', function () {
+			this.slow(1000);
+			expect(binding.deadlineRun(300, 0, 50, false)).to.deep.equal({
+				error: 'Operation cancelled',
+				code: 'ERR_TEST',
+				cancelled: true,
+				aborted: true,
+				abandoned: true
+			});
+		});
+	});
 });